@@ -19,275 +19,72 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <mfxvideo.h>
-#include <stdint.h>
-#include <stdio.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <va/va.h>
-#include <va/va_drm.h>
-#include <va/va_drmcommon.h>
 
-#include "frame.h"
+#include "decodeimpl.h"
 #include "toolbox/utils.h"
-#include "window.h"
 
-struct Surface {
-  mfxFrameInfo mfx_frame_info;
-  VASurfaceID va_surface_id;
-  int dmabuf_fds[4];
-  bool locked;
-};
+// mburakov: Streamer might never send another keyframe, so the benchmark
+// covers a fixed number of frames rather than the first GOP.
+#define DECODE_BENCHMARK_FRAMES 60
 
 struct DecodeContext {
   struct Window* window;
-  mfxFrameAllocator allocator;
   int dump_fd;
-
-  int drm_fd;
-  VADisplay va_display;
-  mfxSession mfx_session;
-  struct Surface** surfaces;
+  const struct DecodeImpl* backend;
+  struct DecodeImplContext* impl;
+  uint64_t cpu_time;
+
+  // mburakov: Candidate decodes the same frames without showing them, until
+  // it either takes over the window or gets dropped.
+  const struct DecodeImpl* candidate_backend;
+  struct DecodeImplContext* candidate;
+  size_t benchmark_frames;
+  uint64_t backend_time;
+  uint64_t candidate_time;
+  uint64_t backend_cpu_time;
+  uint64_t candidate_cpu_time;
 };
 
-static const char* VaStatusString(VAStatus status) {
-  static const char* va_status_strings[] = {
-      "VA_STATUS_SUCCESS",
-      "VA_STATUS_ERROR_OPERATION_FAILED",
-      "VA_STATUS_ERROR_ALLOCATION_FAILED",
-      "VA_STATUS_ERROR_INVALID_DISPLAY",
-      "VA_STATUS_ERROR_INVALID_CONFIG",
-      "VA_STATUS_ERROR_INVALID_CONTEXT",
-      "VA_STATUS_ERROR_INVALID_SURFACE",
-      "VA_STATUS_ERROR_INVALID_BUFFER",
-      "VA_STATUS_ERROR_INVALID_IMAGE",
-      "VA_STATUS_ERROR_INVALID_SUBPICTURE",
-      "VA_STATUS_ERROR_ATTR_NOT_SUPPORTED",
-      "VA_STATUS_ERROR_MAX_NUM_EXCEEDED",
-      "VA_STATUS_ERROR_UNSUPPORTED_PROFILE",
-      "VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT",
-      "VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT",
-      "VA_STATUS_ERROR_UNSUPPORTED_BUFFERTYPE",
-      "VA_STATUS_ERROR_SURFACE_BUSY",
-      "VA_STATUS_ERROR_FLAG_NOT_SUPPORTED",
-      "VA_STATUS_ERROR_INVALID_PARAMETER",
-      "VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED",
-      "VA_STATUS_ERROR_UNIMPLEMENTED",
-      "VA_STATUS_ERROR_SURFACE_IN_DISPLAYING",
-      "VA_STATUS_ERROR_INVALID_IMAGE_FORMAT",
-      "VA_STATUS_ERROR_DECODING_ERROR",
-      "VA_STATUS_ERROR_ENCODING_ERROR",
-      "VA_STATUS_ERROR_INVALID_VALUE",
-      "???",
-      "???",
-      "???",
-      "???",
-      "???",
-      "???",
-      "VA_STATUS_ERROR_UNSUPPORTED_FILTER",
-      "VA_STATUS_ERROR_INVALID_FILTER_CHAIN",
-      "VA_STATUS_ERROR_HW_BUSY",
-      "???",
-      "VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE",
-      "VA_STATUS_ERROR_NOT_ENOUGH_BUFFER",
-      "VA_STATUS_ERROR_TIMEDOUT",
-  };
-  return (VA_STATUS_SUCCESS <= status && status <= VA_STATUS_ERROR_TIMEDOUT)
-             ? va_status_strings[status - VA_STATUS_SUCCESS]
-             : "???";
-}
-
-static struct Surface* SurfaceCreate(const mfxFrameInfo* mfx_frame_info,
-                                     VADisplay va_display,
-                                     struct Frame* out_frame) {
-  struct Surface* surface = malloc(sizeof(struct Surface));
-  if (!surface) {
-    LOG("Failed to allocate surface (%s)", strerror(errno));
-    return NULL;
-  }
-  *surface = (struct Surface){
-      .mfx_frame_info = *mfx_frame_info,
-      .dmabuf_fds = {-1, -1, -1, -1},
-  };
-
-  VASurfaceAttrib attrib_list[] = {
-      {.type = VASurfaceAttribPixelFormat,
-       .value.type = VAGenericValueTypeInteger,
-       .value.value.i = VA_FOURCC_NV12},
-      {.type = VASurfaceAttribUsageHint,
-       .value.type = VAGenericValueTypeInteger,
-       .value.value.i = VA_SURFACE_ATTRIB_USAGE_HINT_DECODER |
-                        VA_SURFACE_ATTRIB_USAGE_HINT_EXPORT},
-  };
-  VAStatus va_status =
-      vaCreateSurfaces(va_display, VA_RT_FORMAT_YUV420, mfx_frame_info->Width,
-                       mfx_frame_info->Height, &surface->va_surface_id, 1,
-                       attrib_list, LENGTH(attrib_list));
-  if (va_status != VA_STATUS_SUCCESS) {
-    LOG("Failed to create vaapi surface (%s)", VaStatusString(va_status));
-    goto rollback_surface;
-  }
-
-  VADRMPRIMESurfaceDescriptor prime;
-  va_status = vaExportSurfaceHandle(
-      va_display, surface->va_surface_id,
-      VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
-      VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS, &prime);
-  if (va_status != VA_STATUS_SUCCESS) {
-    LOG("Failed to export vaapi surface (%s)", VaStatusString(va_status));
-    goto rollback_va_surface_id;
-  }
-
-  out_frame->width = prime.width;
-  out_frame->height = prime.height;
-  out_frame->fourcc = prime.fourcc;
-  out_frame->nplanes = prime.layers[0].num_planes;
-  for (uint32_t i = 0; i < prime.layers[0].num_planes; i++) {
-    surface->dmabuf_fds[i] = prime.objects[prime.layers[0].object_index[i]].fd;
-    out_frame->planes[i] = (struct FramePlane){
-        .dmabuf_fd = surface->dmabuf_fds[i],
-        .pitch = prime.layers[0].pitch[i],
-        .offset = prime.layers[0].offset[i],
-        .modifier =
-            prime.objects[prime.layers[0].object_index[i]].drm_format_modifier,
-    };
-  }
-  return surface;
-
-rollback_va_surface_id:
-  vaDestroySurfaces(va_display, &surface->va_surface_id, 1);
-rollback_surface:
-  free(surface);
-  return NULL;
-}
-
-static void SurfaceDestroy(struct Surface* surface, VADisplay va_display) {
-  for (size_t i = LENGTH(surface->dmabuf_fds); i; i--) {
-    if (surface->dmabuf_fds[i - 1] != -1) close(surface->dmabuf_fds[i - 1]);
-  }
-  vaDestroySurfaces(va_display, &surface->va_surface_id, 1);
-  free(surface);
-}
-
-static mfxStatus OnAllocatorAlloc(mfxHDL pthis, mfxFrameAllocRequest* request,
-                                  mfxFrameAllocResponse* response) {
-  LOG("%s(AllocId=%u, NumFrameSuggested=%u)", __func__, request->AllocId,
-      request->NumFrameSuggested);
-  if (request->Info.FourCC != MFX_FOURCC_NV12) {
-    LOG("Allocation of %.4s surfaces is not supported",
-        (const char*)&request->Info.FourCC);
-    return MFX_ERR_UNSUPPORTED;
-  }
-  if (request->Info.ChromaFormat != MFX_CHROMAFORMAT_YUV420) {
-    LOG("Chroma format %u is not supported", request->Info.ChromaFormat);
-    return MFX_ERR_UNSUPPORTED;
-  }
-
-  struct DecodeContext* decode_context = pthis;
-  decode_context->surfaces =
-      calloc(request->NumFrameSuggested + 1, sizeof(struct Surface*));
-  if (!decode_context->surfaces) {
-    LOG("Failed to allocate surfaces storage (%s)", strerror(errno));
-    return MFX_ERR_MEMORY_ALLOC;
-  }
-
-  struct Frame frames[request->NumFrameSuggested];
-  for (size_t i = 0; i < request->NumFrameSuggested; i++) {
-    decode_context->surfaces[i] =
-        SurfaceCreate(&request->Info, decode_context->va_display, &frames[i]);
-    if (!decode_context->surfaces[i]) {
-      LOG("Failed to create surface");
-      goto rollback_surfaces;
-    }
-  }
-
-  if (!WindowAssignFrames(decode_context->window, request->NumFrameSuggested,
-                          frames)) {
-    LOG("Failed to assign frames to window");
-    goto rollback_surfaces;
+bool DecodeDetectCodec(const void* buffer, size_t size,
+                       enum DecodeCodec* codec) {
+  // mburakov: Both of the codecs streamer may produce are easy to tell apart
+  // by the very first bytes. HEVC access units start with a start code, and
+  // AV1 temporal units are low overhead bitstreams starting with a temporal
+  // delimiter OBU.
+  const uint8_t* data = buffer;
+  if (size >= 3 && !data[0] && !data[1] &&
+      (data[2] == 1 || (size >= 4 && !data[2] && data[3] == 1))) {
+    *codec = DECODE_CODEC_HEVC;
+    return true;
   }
-
-  *response = (mfxFrameAllocResponse){
-      .AllocId = request->AllocId,
-      .mids = (void**)decode_context->surfaces,
-      .NumFrameActual = request->NumFrameSuggested,
-  };
-  return MFX_ERR_NONE;
-
-rollback_surfaces:
-  for (size_t i = request->NumFrameSuggested; i; i--) {
-    if (decode_context->surfaces[i - 1])
-      SurfaceDestroy(decode_context->surfaces[i - 1],
-                     decode_context->va_display);
+  if (size >= 2 && data[0] == 0x12 && data[1] == 0) {
+    *codec = DECODE_CODEC_AV1;
+    return true;
   }
-  free(decode_context->surfaces);
-  return MFX_ERR_MEMORY_ALLOC;
-}
-
-static mfxStatus OnAllocatorGetHDL(mfxHDL pthis, mfxMemId mid, mfxHDL* handle) {
-  (void)pthis;
-  struct Surface* surface = mid;
-  *handle = &surface->va_surface_id;
-  return MFX_ERR_NONE;
+  return false;
 }
 
-static mfxStatus OnAllocatorFree(mfxHDL pthis,
-                                 mfxFrameAllocResponse* response) {
-  LOG("%s(AllocId=%u)", __func__, response->AllocId);
-  struct DecodeContext* decode_context = pthis;
-  for (size_t i = response->NumFrameActual; i; i--)
-    SurfaceDestroy(decode_context->surfaces[i - 1], decode_context->va_display);
-  free(decode_context->surfaces);
-  return MFX_ERR_NONE;
+static uint64_t CpuMicrosNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
 }
 
-static const char* MfxStatusString(mfxStatus status) {
-  static const char* mfx_status_strings[] = {
-      "MFX_ERR_REALLOC_SURFACE",
-      "MFX_ERR_GPU_HANG",
-      "MFX_ERR_INVALID_AUDIO_PARAM",
-      "MFX_ERR_INCOMPATIBLE_AUDIO_PARAM",
-      "MFX_ERR_MORE_BITSTREAM",
-      "MFX_ERR_DEVICE_FAILED",
-      "MFX_ERR_UNDEFINED_BEHAVIOR",
-      "MFX_ERR_INVALID_VIDEO_PARAM",
-      "MFX_ERR_INCOMPATIBLE_VIDEO_PARAM",
-      "MFX_ERR_DEVICE_LOST",
-      "MFX_ERR_ABORTED",
-      "MFX_ERR_MORE_SURFACE",
-      "MFX_ERR_MORE_DATA",
-      "MFX_ERR_NOT_FOUND",
-      "MFX_ERR_NOT_INITIALIZED",
-      "MFX_ERR_LOCK_MEMORY",
-      "MFX_ERR_INVALID_HANDLE",
-      "MFX_ERR_NOT_ENOUGH_BUFFER",
-      "MFX_ERR_MEMORY_ALLOC",
-      "MFX_ERR_UNSUPPORTED",
-      "MFX_ERR_NULL_PTR",
-      "MFX_ERR_UNKNOWN",
-      "MFX_ERR_NONE",
-      "MFX_WRN_IN_EXECUTION",
-      "MFX_WRN_DEVICE_BUSY",
-      "MFX_WRN_VIDEO_PARAM_CHANGED",
-      "MFX_WRN_PARTIAL_ACCELERATION",
-      "MFX_WRN_INCOMPATIBLE_VIDEO_PARAM",
-      "MFX_WRN_VALUE_NOT_CHANGED",
-      "MFX_WRN_OUT_OF_RANGE",
-      "MFX_TASK_WORKING",
-      "MFX_TASK_BUSY",
-      "MFX_WRN_FILTER_SKIPPED",
-      "MFX_WRN_INCOMPATIBLE_AUDIO_PARAM",
-      "MFX_ERR_NONE_PARTIAL_OUTPUT",
-  };
-  return (MFX_ERR_REALLOC_SURFACE <= status &&
-          status <= MFX_ERR_NONE_PARTIAL_OUTPUT)
-             ? mfx_status_strings[status - MFX_ERR_REALLOC_SURFACE]
-             : "???";
+static void DropCandidate(struct DecodeContext* decode_context) {
+  decode_context->candidate_backend->Destroy(decode_context->candidate);
+  decode_context->candidate_backend = NULL;
+  decode_context->candidate = NULL;
 }
 
 struct DecodeContext* DecodeContextCreate(struct Window* window,
-                                          const char* dump_fname) {
+                                          const char* render_node,
+                                          const char* dump_fname,
+                                          enum DecodeBackend backend) {
   struct DecodeContext* decode_context = malloc(sizeof(struct DecodeContext));
   if (!decode_context) {
     LOG("Failed to allocate decode context (%s)", strerror(errno));
@@ -295,13 +92,31 @@ struct DecodeContext* DecodeContextCreate(struct Window* window,
   }
   *decode_context = (struct DecodeContext){
       .window = window,
-      .allocator.pthis = decode_context,
-      .allocator.Alloc = OnAllocatorAlloc,
-      .allocator.GetHDL = OnAllocatorGetHDL,
-      .allocator.Free = OnAllocatorFree,
       .dump_fd = -1,
+      .backend = &g_vaapi_decode_impl,
   };
 
+  switch (backend) {
+    case DECODE_BACKEND_MFX:
+#ifdef USE_LIBMFX
+      decode_context->backend = &g_libmfx_decode_impl;
+      break;
+#else   // USE_LIBMFX
+      LOG("Libmfx backend is not built in");
+      goto rollback_decode_context;
+#endif  // USE_LIBMFX
+    case DECODE_BACKEND_AUTO:
+#ifdef USE_LIBMFX
+      decode_context->candidate_backend = &g_libmfx_decode_impl;
+#endif  // USE_LIBMFX
+      break;
+    case DECODE_BACKEND_VAAPI:
+      break;
+    case DECODE_BACKEND_STUB:
+      decode_context->backend = &g_stub_decode_impl;
+      break;
+  }
+
   if (dump_fname) {
     decode_context->dump_fd =
         open(dump_fname, O_CREAT | O_TRUNC | O_WRONLY, 0644);
@@ -311,52 +126,34 @@ struct DecodeContext* DecodeContextCreate(struct Window* window,
     }
   }
 
-  decode_context->drm_fd = open("/dev/dri/renderD128", O_RDWR);
-  if (decode_context->drm_fd == -1) {
-    LOG("Failed to open render node (%s)", strerror(errno));
-    goto rollback_dump_fd;
+  decode_context->impl = decode_context->backend->Create(window, render_node);
+  if (!decode_context->impl) {
+#ifdef USE_LIBAVCODEC
+    // mburakov: Backend most likely failed because there is no usable VA
+    // driver, and none of the other backends would work either.
+    LOG("Falling back to software decoding");
+    decode_context->backend = &g_software_decode_impl;
+    decode_context->candidate_backend = NULL;
+    decode_context->impl = decode_context->backend->Create(window, NULL);
+#endif  // USE_LIBAVCODEC
   }
-
-  decode_context->va_display = vaGetDisplayDRM(decode_context->drm_fd);
-  if (!decode_context->va_display) {
-    LOG("Failed to get vaapi display (%s)", strerror(errno));
-    goto rollback_drm_fd;
-  }
-  int major, minor;
-  VAStatus va_status = vaInitialize(decode_context->va_display, &major, &minor);
-  if (va_status != VA_STATUS_SUCCESS) {
-    LOG("Failed to init vaapi (%s)", VaStatusString(va_status));
-    goto rollback_display;
-  }
-
-  LOG("Initialized vaapi %d.%d", major, minor);
-  mfxStatus mfx_status =
-      MFXInit(MFX_IMPL_HARDWARE, NULL, &decode_context->mfx_session);
-  if (mfx_status != MFX_ERR_NONE) {
-    LOG("Failed to init mfx session (%s)", MfxStatusString(mfx_status));
-    goto rollback_display;
-  }
-  mfx_status =
-      MFXVideoCORE_SetHandle(decode_context->mfx_session, MFX_HANDLE_VA_DISPLAY,
-                             decode_context->va_display);
-  if (mfx_status != MFX_ERR_NONE) {
-    LOG("Failed to set mfx session display (%s)", MfxStatusString(mfx_status));
-    goto rollback_session;
+  if (!decode_context->impl) {
+    LOG("Failed to create %s decode context", decode_context->backend->name);
+    goto rollback_dump_fd;
   }
-  mfx_status = MFXVideoCORE_SetFrameAllocator(decode_context->mfx_session,
-                                              &decode_context->allocator);
-  if (mfx_status != MFX_ERR_NONE) {
-    LOG("Failed to set frame allocator (%s)", MfxStatusString(mfx_status));
-    goto rollback_session;
+  if (decode_context->candidate_backend) {
+    decode_context->candidate =
+        decode_context->candidate_backend->Create(NULL, render_node);
+    if (!decode_context->candidate) {
+      // mburakov: This is not fatal, there is just nothing to compare with.
+      LOG("Failed to create %s decode context",
+          decode_context->candidate_backend->name);
+      decode_context->candidate_backend = NULL;
+    }
   }
+  LOG("Decoding with %s backend", decode_context->backend->name);
   return decode_context;
 
-rollback_session:
-  MFXClose(decode_context->mfx_session);
-rollback_display:
-  vaTerminate(decode_context->va_display);
-rollback_drm_fd:
-  close(decode_context->drm_fd);
 rollback_dump_fd:
   if (decode_context->dump_fd != -1) close(decode_context->dump_fd);
 rollback_decode_context:
@@ -364,59 +161,100 @@ rollback_decode_context:
   return NULL;
 }
 
-static bool InitializeDecoder(struct DecodeContext* decode_context,
-                              mfxBitstream* bitstream) {
-  mfxVideoParam video_param = {
-      .mfx.CodecId = MFX_CODEC_HEVC,
-  };
-  mfxStatus mfx_status = MFXVideoDECODE_DecodeHeader(
-      decode_context->mfx_session, bitstream, &video_param);
-  switch (mfx_status) {
-    case MFX_ERR_NONE:
-      break;
-    case MFX_ERR_MORE_DATA:
-      return true;
-    default:
-      LOG("Failed to decode header (%s)", MfxStatusString(mfx_status));
-      return false;
+bool DecodeContextPrewarm(struct DecodeContext* decode_context,
+                          enum DecodeCodec codec, uint16_t width,
+                          uint16_t height) {
+  if (decode_context->candidate &&
+      !decode_context->candidate_backend->Prewarm(decode_context->candidate,
+                                                  codec, width, height)) {
+    LOG("Failed to prewarm %s decode context",
+        decode_context->candidate_backend->name);
+    DropCandidate(decode_context);
   }
+  return decode_context->backend->Prewarm(decode_context->impl, codec, width,
+                                          height);
+}
 
-  video_param.AsyncDepth = 1;
-  video_param.mfx.DecodedOrder = 1;
-  video_param.IOPattern = MFX_IOPATTERN_OUT_VIDEO_MEMORY;
-  mfx_status = MFXVideoDECODE_Query(decode_context->mfx_session, &video_param,
-                                    &video_param);
-  if (mfx_status != MFX_ERR_NONE) {
-    LOG("Failed to query decode (%s)", MfxStatusString(mfx_status));
-    return false;
+bool DecodeContextUpscale(struct DecodeContext* decode_context, uint16_t width,
+                          uint16_t height) {
+  // mburakov: Benchmark would not be fair if only one of the backends was
+  // scaling its frames.
+  if (decode_context->candidate &&
+      !decode_context->candidate_backend->Upscale(decode_context->candidate,
+                                                  width, height)) {
+    LOG("Failed to upscale with %s decode context",
+        decode_context->candidate_backend->name);
+    DropCandidate(decode_context);
   }
+  return decode_context->backend->Upscale(decode_context->impl, width,
+                                          height);
+}
 
-  mfx_status = MFXVideoDECODE_Init(decode_context->mfx_session, &video_param);
-  if (mfx_status != MFX_ERR_NONE) {
-    LOG("Failed to init decode (%s)", MfxStatusString(mfx_status));
-    return false;
-  }
-  return true;
+void* DecodeContextLockBuffer(struct DecodeContext* decode_context,
+                              size_t size) {
+  // mburakov: Both backends have to read the same frame, but it is gone from
+  // the locked buffer once the first one decoded it.
+  if (decode_context->candidate) return NULL;
+  // mburakov: Dump needs the whole frame, that is not to be read back from
+  // the locked buffer.
+  if (decode_context->dump_fd != -1) return NULL;
+  return decode_context->backend->LockBuffer(decode_context->impl, size);
 }
 
-static struct Surface* GetFreeSurface(struct DecodeContext* decode_context) {
-  struct Surface** psurface = decode_context->surfaces;
-  for (; *psurface && (*psurface)->locked; psurface++);
-  (*psurface)->locked = true;
-  return *psurface;
+static bool FinishBenchmark(struct DecodeContext* decode_context) {
+  uint64_t backend_time =
+      decode_context->backend_time / decode_context->benchmark_frames;
+  uint64_t candidate_time =
+      decode_context->candidate_time / decode_context->benchmark_frames;
+  uint64_t backend_cpu_time =
+      decode_context->backend_cpu_time / decode_context->benchmark_frames;
+  uint64_t candidate_cpu_time =
+      decode_context->candidate_cpu_time / decode_context->benchmark_frames;
+  LOG("Backend %s decodes in %zu.%03zu ms (cpu %zu.%03zu ms), "
+      "and %s in %zu.%03zu ms (cpu %zu.%03zu ms)",
+      decode_context->backend->name, backend_time / 1000, backend_time % 1000,
+      backend_cpu_time / 1000, backend_cpu_time % 1000,
+      decode_context->candidate_backend->name, candidate_time / 1000,
+      candidate_time % 1000, candidate_cpu_time / 1000,
+      candidate_cpu_time % 1000);
+  if (candidate_time >= backend_time) {
+    DropCandidate(decode_context);
+    return true;
+  }
+
+  if (!decode_context->candidate_backend->AttachWindow(
+          decode_context->candidate, decode_context->window)) {
+    LOG("Failed to attach window to %s decode context",
+        decode_context->candidate_backend->name);
+    // mburakov: Current backend is still there to decode with.
+    DropCandidate(decode_context);
+    return true;
+  }
+  decode_context->backend->Destroy(decode_context->impl);
+  decode_context->backend = decode_context->candidate_backend;
+  decode_context->impl = decode_context->candidate;
+  decode_context->candidate_backend = NULL;
+  decode_context->candidate = NULL;
+  LOG("Switched to %s backend", decode_context->backend->name);
+  return true;
 }
 
-static size_t UnlockAllSurfaces(struct DecodeContext* decode_context,
-                                const struct Surface* keep_locked) {
-  size_t result = 0;
-  for (size_t i = 0; decode_context->surfaces[i]; i++) {
-    if (decode_context->surfaces[i] != keep_locked) {
-      decode_context->surfaces[i]->locked = false;
-    } else {
-      result = i;
-    }
+static bool DecodeCandidate(struct DecodeContext* decode_context,
+                            const void* buffer, size_t size, bool* decoded) {
+  const struct DecodeImpl* backend = decode_context->candidate_backend;
+  struct DecodeImplContext* candidate = decode_context->candidate;
+  // mburakov: Nobody polls events of the candidate, but frames it parked on
+  // a busy device are long due by the time the next frame arrives.
+  struct pollfd pfd = {.fd = backend->GetEventsFd(candidate), .events = POLLIN};
+  if (poll(&pfd, 1, 0) == 1 && !backend->ProcessEvents(candidate)) {
+    LOG("Failed to process %s decode context events", backend->name);
+    return false;
+  }
+  if (!backend->Decode(candidate, buffer, size, decoded)) {
+    LOG("Failed to decode with %s decode context", backend->name);
+    return false;
   }
-  return result;
+  return true;
 }
 
 bool DecodeContextDecode(struct DecodeContext* decode_context,
@@ -428,75 +266,89 @@ bool DecodeContextDecode(struct DecodeContext* decode_context,
     }
   }
 
-  mfxBitstream bitstream = {
-      .DecodeTimeStamp = MFX_TIMESTAMP_UNKNOWN,
-      .TimeStamp = (mfxU64)MFX_TIMESTAMP_UNKNOWN,
-      .Data = (void*)(ptrdiff_t)buffer,
-      .DataLength = (mfxU32)size,
-      .MaxLength = (mfxU32)size,
-      .DataFlag = MFX_BITSTREAM_COMPLETE_FRAME,
-  };
+  // mburakov: This is the time spent by the receiver itself, as opposed to
+  // the decode time reported by the backend, that mostly waits for device.
+  uint64_t started = CpuMicrosNow();
+  bool decoded;
+  if (!decode_context->backend->Decode(decode_context->impl, buffer, size,
+                                       &decoded)) {
+    return false;
+  }
+  decode_context->cpu_time = CpuMicrosNow() - started;
+  if (!decode_context->candidate) return true;
 
-  if (!decode_context->surfaces) {
-    if (!InitializeDecoder(decode_context, &bitstream)) {
-      LOG("Failed to initialize decoder");
-      return false;
-    }
-    if (!decode_context->surfaces) {
-      // mburakov: Initialization might be postponed.
-      return true;
-    }
+  started = CpuMicrosNow();
+  bool candidate_decoded;
+  if (!DecodeCandidate(decode_context, buffer, size, &candidate_decoded)) {
+    DropCandidate(decode_context);
+    return true;
   }
+  // mburakov: Decode time is stale unless both backends produced a picture,
+  // i.e. one of them postponed initialization or parked the frame.
+  if (!decoded || !candidate_decoded) return true;
+  decode_context->candidate_cpu_time += CpuMicrosNow() - started;
+  decode_context->backend_cpu_time += decode_context->cpu_time;
+  decode_context->backend_time +=
+      decode_context->backend->GetDecodeTime(decode_context->impl);
+  decode_context->candidate_time +=
+      decode_context->candidate_backend->GetDecodeTime(
+          decode_context->candidate);
+  if (++decode_context->benchmark_frames < DECODE_BENCHMARK_FRAMES)
+    return true;
+  return FinishBenchmark(decode_context);
+}
 
-  for (;;) {
-    struct Surface* surface = GetFreeSurface(decode_context);
-    mfxFrameSurface1 surface_work = {
-        .Info = surface->mfx_frame_info,
-        .Data.MemId = surface,
-    };
-    mfxFrameSurface1* surface_out = NULL;
-    mfxSyncPoint sync = NULL;
-    mfxStatus mfx_status =
-        MFXVideoDECODE_DecodeFrameAsync(decode_context->mfx_session, &bitstream,
-                                        &surface_work, &surface_out, &sync);
-    switch (mfx_status) {
-      case MFX_ERR_MORE_SURFACE:
-        continue;
-      case MFX_ERR_NONE:
-        break;
-      case MFX_WRN_DEVICE_BUSY:
-        usleep(500);
-        __attribute__((fallthrough));
-      case MFX_WRN_VIDEO_PARAM_CHANGED:
-        continue;
-      default:
-        LOG("Failed to decode frame (%s)", MfxStatusString(mfx_status));
-        return false;
-    }
+int DecodeContextGetEventsFd(const struct DecodeContext* decode_context) {
+  return decode_context->backend->GetEventsFd(decode_context->impl);
+}
 
-    mfx_status = MFXVideoCORE_SyncOperation(decode_context->mfx_session, sync,
-                                            MFX_INFINITE);
-    if (mfx_status != MFX_ERR_NONE) {
-      LOG("Failed to sync operation (%s)", MfxStatusString(mfx_status));
-      return false;
-    }
+bool DecodeContextProcessEvents(struct DecodeContext* decode_context) {
+  return decode_context->backend->ProcessEvents(decode_context->impl);
+}
 
-    size_t locked = UnlockAllSurfaces(decode_context, surface_out->Data.MemId);
-    if (!WindowShowFrame(decode_context->window, locked,
-                         surface_out->Info.CropX, surface_out->Info.CropY,
-                         surface_out->Info.CropW, surface_out->Info.CropH)) {
-      LOG("Failed to show frame");
-      return false;
-    }
+bool DecodeContextIsSyncPoint(const struct DecodeContext* decode_context) {
+  return decode_context->backend->IsSyncPoint(decode_context->impl);
+}
 
-    return true;
+bool DecodeContextTakeKeyframeRequest(struct DecodeContext* decode_context) {
+  return decode_context->backend->TakeKeyframeRequest(decode_context->impl);
+}
+
+uint64_t DecodeContextGetDecodeTime(
+    const struct DecodeContext* decode_context) {
+  return decode_context->backend->GetDecodeTime(decode_context->impl);
+}
+
+uint64_t DecodeContextGetCpuTime(const struct DecodeContext* decode_context) {
+  return decode_context->cpu_time;
+}
+
+size_t DecodeContextGetBusyRetries(const struct DecodeContext* decode_context) {
+  return decode_context->backend->GetBusyRetries(decode_context->impl);
+}
+
+uint64_t DecodeContextGetBusyTime(const struct DecodeContext* decode_context) {
+  return decode_context->backend->GetBusyTime(decode_context->impl);
+}
+
+bool DecodeContextGetStats(const struct DecodeContext* decode_context,
+                           struct DecodeStats* stats) {
+  return decode_context->backend->GetStats(decode_context->impl, stats);
+}
+
+bool DecodeContextReset(struct DecodeContext* decode_context) {
+  if (decode_context->candidate &&
+      !decode_context->candidate_backend->Reset(decode_context->candidate)) {
+    LOG("Failed to reset %s decode context",
+        decode_context->candidate_backend->name);
+    DropCandidate(decode_context);
   }
+  return decode_context->backend->Reset(decode_context->impl);
 }
 
 void DecodeContextDestroy(struct DecodeContext* decode_context) {
-  MFXClose(decode_context->mfx_session);
-  vaTerminate(decode_context->va_display);
-  close(decode_context->drm_fd);
+  if (decode_context->candidate) DropCandidate(decode_context);
+  decode_context->backend->Destroy(decode_context->impl);
   if (decode_context->dump_fd != -1) close(decode_context->dump_fd);
   free(decode_context);
 }
@@ -20,14 +20,72 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// mburakov: Beginning of a frame that is long enough to hold all of its
+// headers, i.e. parameter sets and the slice segment header.
+#define DECODE_HEADER_SIZE 2048
 
 struct DecodeContext;
 struct Window;
 
+enum DecodeBackend {
+  DECODE_BACKEND_AUTO,
+  DECODE_BACKEND_MFX,
+  DECODE_BACKEND_VAAPI,
+  DECODE_BACKEND_STUB,
+};
+
+enum DecodeCodec {
+  DECODE_CODEC_HEVC,
+  DECODE_CODEC_AV1,
+};
+
+// mburakov: Bitstream analytics of the last decoded frame. These are only
+// available from the decoders built on top of the stub, that parses the
+// bitstream anyway. Emulation prevention bytes of frames received directly
+// are only counted in the header part, and epb_partial is set for these.
+struct DecodeStats {
+  char frame_type;
+  int quantizer;
+  size_t payload_size;
+  size_t epb_count;
+  bool epb_partial;
+};
+
 struct DecodeContext* DecodeContextCreate(struct Window* window,
-                                          const char* dump_fname);
+                                          const char* render_node,
+                                          const char* dump_fname,
+                                          enum DecodeBackend backend);
+bool DecodeContextPrewarm(struct DecodeContext* decode_context,
+                          enum DecodeCodec codec, uint16_t width,
+                          uint16_t height);
+// mburakov: Frames smaller than the given size are scaled up to it before
+// being shown. This is only possible with the vaapi decoder, and only if the
+// driver supports video processing. Otherwise it is left to the compositor.
+bool DecodeContextUpscale(struct DecodeContext* decode_context, uint16_t width,
+                          uint16_t height);
+// mburakov: Locked buffer is uncached and write-only. Once the next frame is
+// written there, only a copy of its beginning, that is at least
+// DECODE_HEADER_SIZE bytes long, is passed for decoding.
+void* DecodeContextLockBuffer(struct DecodeContext* decode_context,
+                              size_t size);
 bool DecodeContextDecode(struct DecodeContext* decode_context,
                          const void* buffer, size_t size);
+int DecodeContextGetEventsFd(const struct DecodeContext* decode_context);
+bool DecodeContextProcessEvents(struct DecodeContext* decode_context);
+bool DecodeContextIsSyncPoint(const struct DecodeContext* decode_context);
+// mburakov: Decoder might need a keyframe without anything being wrong with
+// decoding, i.e. to reallocate its surfaces. This is reported only once.
+bool DecodeContextTakeKeyframeRequest(struct DecodeContext* decode_context);
+uint64_t DecodeContextGetDecodeTime(
+    const struct DecodeContext* decode_context);
+uint64_t DecodeContextGetCpuTime(const struct DecodeContext* decode_context);
+size_t DecodeContextGetBusyRetries(const struct DecodeContext* decode_context);
+uint64_t DecodeContextGetBusyTime(const struct DecodeContext* decode_context);
+bool DecodeContextGetStats(const struct DecodeContext* decode_context,
+                           struct DecodeStats* stats);
+bool DecodeContextReset(struct DecodeContext* decode_context);
 void DecodeContextDestroy(struct DecodeContext* decode_context);
 
 #endif  // RECEIVER_DECODE_H_
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECEIVER_DECODEIMPL_H_
+#define RECEIVER_DECODEIMPL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <va/va.h>
+
+#include "decode.h"
+
+struct DecodeImplContext;
+struct Window;
+
+// mburakov: Each of the decoders defines its own context, and only exports
+// its functions through one of these. Decoding with MFX is built twice,
+// against the stub and against libmfx, and types of these two are not
+// compatible, so not even the names of the functions are shared.
+struct DecodeImpl {
+  const char* name;
+  struct DecodeImplContext* (*Create)(struct Window* window,
+                                      const char* render_node);
+  bool (*AttachWindow)(struct DecodeImplContext* decode_context,
+                       struct Window* window);
+  bool (*Prewarm)(struct DecodeImplContext* decode_context,
+                  enum DecodeCodec codec, uint16_t width, uint16_t height);
+  bool (*Upscale)(struct DecodeImplContext* decode_context, uint16_t width,
+                  uint16_t height);
+  void* (*LockBuffer)(struct DecodeImplContext* decode_context, size_t size);
+  // mburakov: Decoded is only set when the call produced a picture, so that
+  // the decode time reported afterwards is the one of that picture.
+  bool (*Decode)(struct DecodeImplContext* decode_context, const void* buffer,
+                 size_t size, bool* decoded);
+  int (*GetEventsFd)(const struct DecodeImplContext* decode_context);
+  bool (*ProcessEvents)(struct DecodeImplContext* decode_context);
+  bool (*IsSyncPoint)(const struct DecodeImplContext* decode_context);
+  bool (*TakeKeyframeRequest)(struct DecodeImplContext* decode_context);
+  uint64_t (*GetDecodeTime)(const struct DecodeImplContext* decode_context);
+  size_t (*GetBusyRetries)(const struct DecodeImplContext* decode_context);
+  uint64_t (*GetBusyTime)(const struct DecodeImplContext* decode_context);
+  bool (*GetStats)(const struct DecodeImplContext* decode_context,
+                   struct DecodeStats* stats);
+  bool (*Reset)(struct DecodeImplContext* decode_context);
+  void (*Destroy)(struct DecodeImplContext* decode_context);
+};
+
+extern const struct DecodeImpl g_vaapi_decode_impl;
+extern const struct DecodeImpl g_stub_decode_impl;
+#ifdef USE_LIBMFX
+extern const struct DecodeImpl g_libmfx_decode_impl;
+#endif  // USE_LIBMFX
+#ifdef USE_LIBAVCODEC
+extern const struct DecodeImpl g_software_decode_impl;
+#endif  // USE_LIBAVCODEC
+
+// mburakov: Streamer does not announce the codec, so every decoder detects it
+// from the very first frame.
+bool DecodeDetectCodec(const void* buffer, size_t size,
+                       enum DecodeCodec* codec);
+const char* VaStatusString(VAStatus status);
+
+// mburakov: Every decoder in the process shares the same render node and VA
+// display, i.e. when decoding several streams at once. Display is terminated
+// once the last decoder released it. Render node is only opened by the first
+// decoder, and it defaults to the first render node when not given.
+VADisplay VaDisplayAcquire(const char* render_node);
+void VaDisplayRelease(void);
+
+#endif  // RECEIVER_DECODEIMPL_H_
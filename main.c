@@ -17,6 +17,7 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -41,19 +42,66 @@
 #include "toolbox/utils.h"
 #include "window.h"
 
+// mburakov: This is a couple of seconds of video, enough to tell whether a
+// latency spike was caused by an oversized frame.
+#define FRAME_STATS_COUNT 128
+
+// mburakov: Streams are tiled in a single window, and there is not much to
+// see in a tile once there are more of these.
+#define MAX_STREAMS 16
+
+// mburakov: Delay before reconnecting is doubled after every failed attempt,
+// but streamer is expected to be back within a few seconds at most.
+#define RECONNECT_DELAY_MIN 100000
+#define RECONNECT_DELAY_MAX 3200000
+
 static volatile sig_atomic_t g_signal;
 static void OnSignal(int status) { g_signal = status; }
 
+static volatile sig_atomic_t g_switch;
+static void OnSwitchSignal(int status) {
+  (void)status;
+  g_switch = 1;
+}
+
+struct FrameStats {
+  uint32_t size;
+  uint32_t epb_count;
+  int16_t quantizer;
+  char frame_type;
+  bool epb_partial;
+};
+
 struct Context {
+  const char* address;
+  bool no_input;
+  int sock;
   size_t audio_buffer_size;
   struct InputStream* input_stream;
+  // mburakov: Only the first context owns the window. With several streams,
+  // every context shows its frames in its own tile of that window.
   struct Window* window;
+  struct Window* view;
+  // mburakov: Window belongs to the first context, but input goes to the
+  // context that is currently shown. This is the first context itself,
+  // unless receiving in standby mode.
+  struct Context* active;
   size_t overlay_width;
   size_t overlay_height;
   struct Overlay* overlay;
+  struct Cursor* cursor;
   struct DecodeContext* decode_context;
   struct AudioContext* audio_context;
   struct Buffer buffer;
+  uint8_t* video_data;
+  size_t video_received;
+
+  // mburakov: Damage received ahead of the frame it belongs to.
+  bool damage_pending;
+  uint16_t damage_rects[PROTO_DAMAGE_RECTS_MAX][4];
+  size_t damage_rects_count;
+  int damage_width;
+  int damage_height;
 
   size_t video_bitstream;
   size_t audio_bitstream;
@@ -64,6 +112,40 @@ struct Context {
   uint64_t video_latency_count;
   uint64_t audio_latency_sum;
   uint64_t audio_latency_count;
+  uint64_t decode_time_sum;
+  uint64_t cpu_time_sum;
+  uint64_t decode_time_count;
+  size_t frames_presented;
+  size_t frames_zero_copy;
+  struct FrameStats frame_stats[FRAME_STATS_COUNT];
+  size_t frame_stats_count;
+  bool decode_stats;
+  uint32_t keyframe_size;
+
+  // mburakov: Set when connection was started, and cleared once the first
+  // frame was shown.
+  uint64_t connect_started;
+
+  // mburakov: Set when decoding failed, and cleared once a keyframe requested
+  // from the streamer was decoded successfully.
+  uint64_t resync_started;
+  uint64_t recovery_time;
+
+  // mburakov: Set when connection was lost, and cleared once a keyframe from
+  // the new connection was decoded successfully. Everything but the socket
+  // and input stream is kept meanwhile, so resuming is way faster than
+  // starting from scratch.
+  uint64_t reconnect_started;
+  uint64_t resume_time;
+  int reconnect_fd;
+  uint64_t reconnect_delay;
+  size_t reconnect_attempts;
+  bool connecting;
+
+  // mburakov: Input callbacks might run in the middle of handling a packet,
+  // i.e. from the roundtrip when a frame is shown, so these only flag the
+  // connection as lost, and it is dropped from the main loop afterwards.
+  bool disconnect_pending;
 };
 
 static int ConnectSocket(const char* arg) {
@@ -74,7 +156,7 @@ static int ConnectSocket(const char* arg) {
     return -1;
   }
 
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sock == -1) {
     LOG("Failed to create socket (%s)", strerror(errno));
     return -1;
@@ -90,7 +172,10 @@ static int ConnectSocket(const char* arg) {
       .sin_port = htons(port),
       .sin_addr.s_addr = inet_addr(ip),
   };
-  if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr))) {
+  // mburakov: Connection is finished by FinishConnect, everything else is
+  // being initialized meanwhile.
+  if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) &&
+      errno != EINPROGRESS) {
     LOG("Failed to connect socket (%s)", strerror(errno));
     goto rollback_sock;
   }
@@ -101,57 +186,175 @@ rollback_sock:
   return -1;
 }
 
+static bool ArmReconnect(struct Context* context) {
+  const struct itimerspec spec = {
+      .it_value.tv_sec = (time_t)(context->reconnect_delay / 1000000),
+      .it_value.tv_nsec = (long)(context->reconnect_delay % 1000000 * 1000),
+  };
+  if (timerfd_settime(context->reconnect_fd, 0, &spec, NULL)) {
+    LOG("Failed to arm reconnect timer (%s)", strerror(errno));
+    return false;
+  }
+  LOG("Reconnecting in %zu ms", context->reconnect_delay / 1000);
+  context->reconnect_delay =
+      MIN(context->reconnect_delay * 2, (uint64_t)RECONNECT_DELAY_MAX);
+  return true;
+}
+
+static bool Disconnect(struct Context* context) {
+  context->disconnect_pending = false;
+  if (context->input_stream) {
+    InputStreamDestroy(context->input_stream);
+    context->input_stream = NULL;
+  }
+  close(context->sock);
+  context->sock = -1;
+  context->connecting = false;
+  BufferDiscard(&context->buffer, context->buffer.size);
+  context->video_data = NULL;
+  if (!context->reconnect_started) context->reconnect_started = MicrosNow();
+
+  // mburakov: New connection starts with a keyframe, and none of the frames
+  // decoded so far could be referenced by it.
+  if (!DecodeContextReset(context->decode_context)) {
+    LOG("Failed to reset decode context");
+    return false;
+  }
+  return ArmReconnect(context);
+}
+
 static void OnWindowClose(void* user) {
   (void)user;
   g_signal = SIGINT;
 }
 
 static void OnWindowFocus(void* user, bool focused) {
-  if (focused) return;
-  if (!InputStreamHandsoff(user)) {
+  struct Context* context = ((struct Context*)user)->active;
+  // mburakov: Window might lose focus while it is still being created, and
+  // input stream is created only once the socket is connected.
+  if (focused || !context->input_stream || context->disconnect_pending)
+    return;
+  if (!InputStreamHandsoff(context->input_stream)) {
     LOG("Failed to handle window focus");
-    g_signal = SIGABRT;
+    context->disconnect_pending = true;
   }
 }
 
 static void OnWindowKey(void* user, unsigned key, bool pressed) {
-  if (!InputStreamKeyPress(user, key, pressed)) {
+  struct Context* context = ((struct Context*)user)->active;
+  if (!context->input_stream || context->disconnect_pending) return;
+  if (!InputStreamKeyPress(context->input_stream, key, pressed)) {
     LOG("Failed to handle key press");
-    g_signal = SIGABRT;
+    context->disconnect_pending = true;
   }
 }
 
 static void OnWindowMove(void* user, int dx, int dy) {
-  if (!InputStreamMouseMove(user, dx, dy)) {
+  struct Context* context = ((struct Context*)user)->active;
+  if (!context->input_stream || context->disconnect_pending) return;
+  // mburakov: Streamer is going to move its cursor anyway, and the local one
+  // is corrected once the actual position is received.
+  if (context->cursor) CursorMove(context->cursor, dx, dy);
+  if (!InputStreamMouseMove(context->input_stream, dx, dy)) {
     LOG("Failed to handle mouse move");
-    g_signal = SIGABRT;
+    context->disconnect_pending = true;
   }
 }
 
 static void OnWindowButton(void* user, unsigned button, bool pressed) {
-  if (!InputStreamMouseButton(user, button, pressed)) {
+  struct Context* context = ((struct Context*)user)->active;
+  if (!context->input_stream || context->disconnect_pending) return;
+  if (!InputStreamMouseButton(context->input_stream, button, pressed)) {
     LOG("Failed to handle mouse button");
-    g_signal = SIGABRT;
+    context->disconnect_pending = true;
   }
 }
 
 static void OnWindowWheel(void* user, int delta) {
-  if (!InputStreamMouseWheel(user, delta)) {
+  struct Context* context = ((struct Context*)user)->active;
+  if (!context->input_stream || context->disconnect_pending) return;
+  if (!InputStreamMouseWheel(context->input_stream, delta)) {
     LOG("Failed to handle mouse wheel");
-    g_signal = SIGABRT;
+    context->disconnect_pending = true;
   }
 }
 
 static void GetMaxOverlaySize(size_t* width, size_t* height) {
   char str[64];
   snprintf(str, sizeof(str), "Video bitstream: %zu.000 Mbps", SIZE_MAX / 1000);
-  *width = 4 + PuiStringWidth(str) + 4;
-  *height = 4 + 12 * 5 + 4;
+  size_t max_width = PuiStringWidth(str);
+  snprintf(str, sizeof(str), "Frames p50/p95/max: %u/%u/%u KiB",
+           UINT32_MAX >> 10, UINT32_MAX >> 10, UINT32_MAX >> 10);
+  max_width = MAX(max_width, PuiStringWidth(str));
+  *width = 4 + max_width + 4;
+  *height = 4 + 12 * 15 + 4;
 }
 
-static struct Context* ContextCreate(int sock, bool no_input, bool stats,
+static bool CheckConnect(int sock) {
+  int error;
+  socklen_t error_size = sizeof(error);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_size)) {
+    LOG("Failed to get socket error (%s)", strerror(errno));
+    return false;
+  }
+  if (error) {
+    LOG("Failed to connect socket (%s)", strerror(error));
+    return false;
+  }
+  int flags = fcntl(sock, F_GETFL);
+  if (flags == -1 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK)) {
+    LOG("Failed to make socket blocking (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool FinishConnect(int sock) {
+  struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+  for (;;) {
+    int result = poll(&pfd, 1, -1);
+    if (result == 1) break;
+    if (result == -1 && errno != EINTR) {
+      LOG("Failed to poll socket (%s)", strerror(errno));
+      return false;
+    }
+  }
+  return CheckConnect(sock);
+}
+
+static bool ParseResolution(const char* resolution, uint16_t* width,
+                            uint16_t* height) {
+  char trailer;
+  return sscanf(resolution, "%hux%hu%c", width, height, &trailer) == 2 &&
+         *width && *height;
+}
+
+static bool ParseExpect(const char* expect, enum DecodeCodec* codec,
+                        uint16_t* width, uint16_t* height) {
+  *codec = DECODE_CODEC_HEVC;
+  if (!strncmp(expect, "av1:", 4)) {
+    *codec = DECODE_CODEC_AV1;
+    expect += 4;
+  } else if (!strncmp(expect, "hevc:", 5)) {
+    expect += 5;
+  }
+  if (!ParseResolution(expect, width, height)) {
+    LOG("Invalid expected resolution");
+    return false;
+  }
+  return true;
+}
+
+static struct Context* ContextCreate(const char* address, int sock,
+                                     struct Window* parent, size_t index,
+                                     size_t count, bool no_input, bool stats,
                                      const char* audio_buffer,
-                                     const char* dump_fname) {
+                                     const char* dump_fname,
+                                     const char* expect,
+                                     const char* upscale,
+                                     const char* render_node,
+                                     bool local_cursor,
+                                     enum DecodeBackend decoder) {
   int audio_buffer_size = 0;
   if (audio_buffer) {
     audio_buffer_size = atoi(audio_buffer);
@@ -161,67 +364,155 @@ static struct Context* ContextCreate(int sock, bool no_input, bool stats,
     }
   }
 
+  enum DecodeCodec expect_codec;
+  uint16_t expect_width, expect_height;
+  if (expect &&
+      !ParseExpect(expect, &expect_codec, &expect_width, &expect_height)) {
+    LOG("Failed to parse expected stream");
+    return NULL;
+  }
+
+  uint16_t upscale_width, upscale_height;
+  if (upscale && !ParseResolution(upscale, &upscale_width, &upscale_height)) {
+    LOG("Invalid upscale resolution");
+    return NULL;
+  }
+
   struct Context* context = calloc(1, sizeof(struct Context));
   if (!context) {
     LOG("Failed to allocate context (%s)", strerror(errno));
     return NULL;
   }
 
+  context->address = address;
+  context->no_input = no_input;
+  context->sock = sock;
+  context->active = context;
+  context->reconnect_delay = RECONNECT_DELAY_MIN;
+  context->reconnect_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (context->reconnect_fd == -1) {
+    LOG("Failed to create reconnect timer (%s)", strerror(errno));
+    goto rollback_context;
+  }
+
   context->audio_buffer_size = (size_t)audio_buffer_size;
-  const struct WindowEventHandlers* maybe_window_event_handlers = NULL;
-  if (!no_input) {
-    context->input_stream = InputStreamCreate(sock);
-    if (!context->input_stream) {
-      LOG("Failed to create input stream");
-      goto rollback_context;
+  static const struct WindowEventHandlers window_event_handlers = {
+      .OnClose = OnWindowClose,
+      .OnFocus = OnWindowFocus,
+      .OnKey = OnWindowKey,
+      .OnMove = OnWindowMove,
+      .OnButton = OnWindowButton,
+      .OnWheel = OnWindowWheel,
+  };
+  struct Window* window = parent;
+  if (!window) {
+    context->window =
+        WindowCreate(no_input ? NULL : &window_event_handlers, context);
+    if (!context->window) {
+      LOG("Failed to create window");
+      goto rollback_reconnect_fd;
     }
-    static const struct WindowEventHandlers window_event_handlers = {
-        .OnClose = OnWindowClose,
-        .OnFocus = OnWindowFocus,
-        .OnKey = OnWindowKey,
-        .OnMove = OnWindowMove,
-        .OnButton = OnWindowButton,
-        .OnWheel = OnWindowWheel,
-    };
-    maybe_window_event_handlers = &window_event_handlers;
+    window = context->window;
   }
-
-  context->window =
-      WindowCreate(maybe_window_event_handlers, context->input_stream);
-  if (!context->window) {
-    LOG("Failed to create window");
-    goto rollback_input_stream;
+  context->view = window;
+  if (count) {
+    context->view = WindowCreateTile(window, index, count);
+    if (!context->view) {
+      LOG("Failed to create window tile");
+      goto rollback_window;
+    }
   }
 
   if (stats) {
     GetMaxOverlaySize(&context->overlay_width, &context->overlay_height);
     context->overlay =
-        OverlayCreate(context->window, 4, 4, (int)context->overlay_width,
+        OverlayCreate(context->view, 4, 4, (int)context->overlay_width,
                       (int)context->overlay_height);
     if (!context->overlay) {
       LOG("Failed to create stats overlay");
-      goto rollback_window;
+      goto rollback_view;
+    }
+  }
+
+  if (local_cursor && !no_input) {
+    context->cursor = CursorCreate(context->view);
+    if (!context->cursor) {
+      LOG("Failed to create cursor");
+      goto rollback_overlay;
     }
   }
 
-  context->decode_context = DecodeContextCreate(context->window, dump_fname);
+  // mburakov: Unless overridden, decoder opens the same device compositor is
+  // using, so that it could scan out the frames without copying these across
+  // devices, i.e. on laptops with hybrid graphics.
+  char render_node_path[64];
+  if (!render_node && WindowGetRenderNode(context->view, render_node_path,
+                                          sizeof(render_node_path))) {
+    render_node = render_node_path;
+  }
+  context->decode_context =
+      DecodeContextCreate(context->view, render_node, dump_fname, decoder);
   if (!context->decode_context) {
     LOG("Failed to create decode context");
-    goto rollback_overlay;
+    goto rollback_cursor;
+  }
+  if (upscale && !DecodeContextUpscale(context->decode_context,
+                                       upscale_width, upscale_height)) {
+    // mburakov: This is not fatal, compositor would scale frames instead.
+    LOG("Failed to upscale with decode context, leaving it to compositor");
+  }
+  if (expect && !DecodeContextPrewarm(context->decode_context, expect_codec,
+                                      expect_width, expect_height)) {
+    // mburakov: This is not fatal, decoder would be initialized as usual.
+    LOG("Failed to prewarm decode context");
+  }
+
+  // mburakov: All of the above was done while the socket was connecting,
+  // but input stream starts writing to the socket right away.
+  if (!FinishConnect(sock)) {
+    LOG("Failed to finish socket connection");
+    goto rollback_decode_context;
+  }
+  if (!no_input) {
+    context->input_stream = InputStreamCreate(sock);
+    if (!context->input_stream) {
+      LOG("Failed to create input stream");
+      goto rollback_decode_context;
+    }
+  }
+  uint32_t request = PROTO_REQUEST_CURSOR;
+  if (context->cursor &&
+      write(sock, &request, sizeof(request)) != sizeof(request)) {
+    LOG("Failed to write cursor request (%s)", strerror(errno));
+    goto rollback_input_stream;
   }
   return context;
 
+rollback_input_stream:
+  if (context->input_stream) InputStreamDestroy(context->input_stream);
+rollback_decode_context:
+  DecodeContextDestroy(context->decode_context);
+rollback_cursor:
+  if (context->cursor) CursorDestroy(context->cursor);
 rollback_overlay:
   if (context->overlay) OverlayDestroy(context->overlay);
+rollback_view:
+  if (context->view != context->window) WindowDestroy(context->view);
 rollback_window:
-  WindowDestroy(context->window);
-rollback_input_stream:
-  if (context->input_stream) InputStreamDestroy(context->input_stream);
+  if (context->window) WindowDestroy(context->window);
+rollback_reconnect_fd:
+  close(context->reconnect_fd);
 rollback_context:
   free(context);
   return NULL;
 }
 
+static int CompareSizes(const void* a, const void* b) {
+  uint32_t lhs = *(const uint32_t*)a;
+  uint32_t rhs = *(const uint32_t*)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
 static bool RenderOverlay(struct Context* context, uint64_t timestamp) {
   uint32_t* buffer = OverlayLock(context->overlay);
   if (!buffer) {
@@ -290,13 +581,126 @@ static bool RenderOverlay(struct Context* context, uint64_t timestamp) {
              audio_latency % 1000);
   }
 
-  char* lines[5] = {NULL};
+  char decode_time_str[64];
+  uint64_t decode_time = 0;
+  uint64_t cpu_time = 0;
+  if (context->decode_time_count) {
+    decode_time = context->decode_time_sum / context->decode_time_count;
+    cpu_time = context->cpu_time_sum / context->decode_time_count;
+  }
+  snprintf(decode_time_str, sizeof(decode_time_str),
+           "Decode time: %zu.%03zu ms (cpu %zu.%03zu ms)", decode_time / 1000,
+           decode_time % 1000, cpu_time / 1000, cpu_time % 1000);
+
+  char recovery_time_str[64];
+  snprintf(recovery_time_str, sizeof(recovery_time_str),
+           "Last recovery: %zu.%03zu ms", context->recovery_time / 1000,
+           context->recovery_time % 1000);
+
+  char reconnect_str[64];
+  snprintf(reconnect_str, sizeof(reconnect_str), "Reconnecting: attempt %zu",
+           context->reconnect_attempts);
+
+  char resume_time_str[64];
+  snprintf(resume_time_str, sizeof(resume_time_str),
+           "Last resume: %zu.%03zu ms", context->resume_time / 1000,
+           context->resume_time % 1000);
+
+  char busy_str[64];
+  size_t busy_retries = DecodeContextGetBusyRetries(context->decode_context);
+  uint64_t busy_time = DecodeContextGetBusyTime(context->decode_context);
+  snprintf(busy_str, sizeof(busy_str), "Busy retries: %zu (%zu.%03zu ms)",
+           busy_retries, busy_time / 1000, busy_time % 1000);
+
+  // mburakov: Zero-copy frames were scanned out without any composition,
+  // which is never the case while the overlay is shown on top of these.
+  char zero_copy_str[64];
+  size_t frames_zero_copy;
+  size_t frames_presented =
+      WindowGetFramesPresented(context->view, &frames_zero_copy) -
+      context->frames_presented;
+  frames_zero_copy -= context->frames_zero_copy;
+  snprintf(zero_copy_str, sizeof(zero_copy_str), "Zero-copy: %zu/%zu frames",
+           frames_zero_copy, frames_presented);
+
+  char keyframe_str[64];
+  snprintf(keyframe_str, sizeof(keyframe_str), "Keyframe size: %u KiB",
+           context->keyframe_size >> 10);
+
+  // mburakov: Frames are recorded in a ring, so once it wrapped around, the
+  // oldest frame is the one that would be overwritten next. Keyframes are way
+  // larger than the rest, and would only skew the size distribution.
+  size_t frame_stats_count =
+      MIN(context->frame_stats_count, (size_t)FRAME_STATS_COUNT);
+  size_t frame_stats_first = context->frame_stats_count - frame_stats_count;
+  uint32_t sizes[FRAME_STATS_COUNT];
+  size_t sizes_count = 0;
+  size_t total_size = 0;
+  size_t total_epb = 0;
+  bool epb_partial = false;
+  int quantizer_sum[2] = {0};
+  int quantizer_min = INT_MAX;
+  int quantizer_max = INT_MIN;
+  for (size_t i = 0; i < frame_stats_count; i++) {
+    const struct FrameStats* frame_stats =
+        &context->frame_stats[(frame_stats_first + i) % FRAME_STATS_COUNT];
+    if (frame_stats->frame_type != 'I')
+      sizes[sizes_count++] = frame_stats->size;
+    total_size += frame_stats->size;
+    total_epb += frame_stats->epb_count;
+    epb_partial |= frame_stats->epb_partial;
+    quantizer_sum[i >= frame_stats_count / 2] += frame_stats->quantizer;
+    quantizer_min = MIN(quantizer_min, frame_stats->quantizer);
+    quantizer_max = MAX(quantizer_max, frame_stats->quantizer);
+  }
+
+  char sizes_str[64];
+  if (sizes_count) {
+    qsort(sizes, sizes_count, sizeof(*sizes), CompareSizes);
+    snprintf(sizes_str, sizeof(sizes_str), "Frames p50/p95/max: %u/%u/%u KiB",
+             sizes[sizes_count / 2] >> 10, sizes[sizes_count * 95 / 100] >> 10,
+             sizes[sizes_count - 1] >> 10);
+  }
+
+  // mburakov: Trend of the quantizer is the average of the older half of the
+  // frames followed by the average of the newer half.
+  char quantizer_str[64];
+  char epb_str[64];
+  if (frame_stats_count && context->decode_stats) {
+    size_t older_count = frame_stats_count / 2;
+    int quantizer_new =
+        quantizer_sum[1] / (int)(frame_stats_count - older_count);
+    int quantizer_old =
+        older_count ? quantizer_sum[0] / (int)older_count : quantizer_new;
+    snprintf(quantizer_str, sizeof(quantizer_str),
+             "Quantizer: %d -> %d (%d..%d)", quantizer_old, quantizer_new,
+             quantizer_min, quantizer_max);
+    // mburakov: Hundredths of a percent, i.e. 100% is 10000.
+    size_t epb_overhead = total_epb * 10000 / MAX(total_size, (size_t)1);
+    snprintf(epb_str, sizeof(epb_str), "EPB overhead: %zu.%02zu%%",
+             epb_overhead / 100, epb_overhead % 100);
+  }
+
+  char* lines[15] = {NULL};
   char** plines = lines;
+  if (context->reconnect_started) *plines++ = reconnect_str;
   *plines++ = ping_str;
   *plines++ = video_bitrate_str;
   if (context->audio_context) *plines++ = audio_bitrate_str;
   *plines++ = video_latency_str;
+  *plines++ = decode_time_str;
   if (context->audio_context) *plines++ = audio_latency_str;
+  if (context->recovery_time) *plines++ = recovery_time_str;
+  if (context->resume_time) *plines++ = resume_time_str;
+  if (busy_retries) *plines++ = busy_str;
+  if (frames_presented) *plines++ = zero_copy_str;
+  if (context->keyframe_size) *plines++ = keyframe_str;
+  if (sizes_count) *plines++ = sizes_str;
+  if (frame_stats_count && context->decode_stats) {
+    *plines++ = quantizer_str;
+    // mburakov: Overhead would be understated for frames received directly.
+    if (!epb_partial) *plines++ = epb_str;
+  }
   size_t nlines = (size_t)(plines - lines);
 
   size_t overlay_width = 0;
@@ -320,14 +724,100 @@ static bool RenderOverlay(struct Context* context, uint64_t timestamp) {
   return true;
 }
 
-static bool HandleVideoStream(struct Context* context) {
-  const struct Proto* proto = context->buffer.data;
-  if (!DecodeContextDecode(context->decode_context, proto->data, proto->size)) {
+static bool WriteKeyframeRequest(struct Context* context) {
+  // mburakov: Keyframe is requested anyway once reconnected.
+  if (context->sock == -1 || context->connecting) return true;
+  uint32_t request = PROTO_REQUEST_KEYFRAME;
+  if (write(context->sock, &request, sizeof(request)) != sizeof(request)) {
+    LOG("Failed to write keyframe request (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool RequestKeyframe(struct Context* context) {
+  if (!DecodeContextReset(context->decode_context)) {
+    LOG("Failed to reset decode context");
+    return false;
+  }
+  if (!WriteKeyframeRequest(context)) return false;
+  if (context->sock != -1 && !context->connecting && !context->resync_started)
+    context->resync_started = MicrosNow();
+  return true;
+}
+
+// mburakov: Size is what is there to decode in the buffer, that is less than
+// the size of the frame if the rest of it went straight to the decoder.
+static bool HandleVideoStream(struct Context* context,
+                              const struct Proto* proto, size_t size) {
+  // mburakov: Once decoding failed, frames are still decoded, so that decoder
+  // could recover on its own at a random access or recovery point, but none
+  // of them is shown until either that or a keyframe is reached.
+  bool keyframe = proto->flags & PROTO_FLAG_KEYFRAME;
+  bool resyncing = context->resync_started || context->reconnect_started;
+  if (resyncing) WindowHoldFrames(context->view, true);
+  // mburakov: Keyframe might follow a frame that was not decoded correctly,
+  // so it is damaged completely, whatever the damage says.
+  bool damage = context->damage_pending && !keyframe;
+  context->damage_pending = false;
+  WindowSetDamage(context->view, damage ? context->damage_rects : NULL,
+                  context->damage_rects_count, context->damage_width,
+                  context->damage_height);
+  if (!DecodeContextDecode(context->decode_context, proto->data, size)) {
     LOG("Failed to decode incoming video data");
+    return RequestKeyframe(context);
+  }
+  if (DecodeContextTakeKeyframeRequest(context->decode_context) &&
+      !WriteKeyframeRequest(context)) {
     return false;
   }
+  if (resyncing) {
+    if (!keyframe && !DecodeContextIsSyncPoint(context->decode_context))
+      return true;
+    if (!WindowHoldFrames(context->view, false)) {
+      LOG("Failed to release held frames");
+      return false;
+    }
+  }
+  if (context->connect_started && WindowGetFramesShown(context->view)) {
+    uint64_t first_frame = MicrosNow() - context->connect_started;
+    context->connect_started = 0;
+    LOG("First frame shown in %zu.%03zu ms after connect", first_frame / 1000,
+        first_frame % 1000);
+  }
+  if (context->resync_started) {
+    context->recovery_time = MicrosNow() - context->resync_started;
+    context->resync_started = 0;
+    LOG("Recovered from decode error in %zu.%03zu ms",
+        context->recovery_time / 1000, context->recovery_time % 1000);
+  }
+  if (context->reconnect_started) {
+    context->resume_time = MicrosNow() - context->reconnect_started;
+    context->reconnect_started = 0;
+    context->reconnect_attempts = 0;
+    LOG("Resumed in %zu.%03zu ms after connection loss",
+        context->resume_time / 1000, context->resume_time % 1000);
+  }
 
   if (!context->overlay) return true;
+  struct DecodeStats decode_stats;
+  context->decode_stats =
+      DecodeContextGetStats(context->decode_context, &decode_stats);
+  if (!context->decode_stats) {
+    decode_stats = (struct DecodeStats){
+        .frame_type = (proto->flags & PROTO_FLAG_KEYFRAME) ? 'I' : 'P',
+    };
+  }
+  context->frame_stats[context->frame_stats_count++ % FRAME_STATS_COUNT] =
+      (struct FrameStats){
+          .size = proto->size,
+          .epb_count = (uint32_t)decode_stats.epb_count,
+          .quantizer = (int16_t)decode_stats.quantizer,
+          .frame_type = decode_stats.frame_type,
+          .epb_partial = decode_stats.epb_partial,
+      };
+  if (decode_stats.frame_type == 'I') context->keyframe_size = proto->size;
+
   if (!context->timestamp) {
     context->timestamp = MicrosNow();
     return true;
@@ -336,8 +826,17 @@ static bool HandleVideoStream(struct Context* context) {
   context->video_bitstream += proto->size;
   context->video_latency_sum += proto->latency;
   context->video_latency_count++;
+  context->decode_time_sum +=
+      DecodeContextGetDecodeTime(context->decode_context);
+  context->cpu_time_sum += DecodeContextGetCpuTime(context->decode_context);
+  context->decode_time_count++;
 
-  if (!(proto->flags & PROTO_FLAG_KEYFRAME)) return true;
+  // mburakov: With gradual decoding refresh there might be no keyframes at
+  // all, so the end of each refresh period is treated as a keyframe instead.
+  if (!(proto->flags & PROTO_FLAG_KEYFRAME) &&
+      !DecodeContextIsSyncPoint(context->decode_context)) {
+    return true;
+  }
 
   uint64_t timestamp = MicrosNow();
   if (!RenderOverlay(context, timestamp)) LOG("Failed to render overlay");
@@ -350,6 +849,19 @@ static bool HandleVideoStream(struct Context* context) {
   context->video_latency_count = 0;
   context->audio_latency_sum = 0;
   context->audio_latency_count = 0;
+  context->decode_time_sum = 0;
+  context->cpu_time_sum = 0;
+  context->decode_time_count = 0;
+  context->frames_presented = WindowGetFramesPresented(
+      context->view, &context->frames_zero_copy);
+  return true;
+}
+
+static bool HandleDecodeEvents(struct Context* context) {
+  if (!DecodeContextProcessEvents(context->decode_context)) {
+    LOG("Failed to decode parked video data");
+    return RequestKeyframe(context);
+  }
   return true;
 }
 
@@ -383,14 +895,106 @@ static bool HandleAudioStream(struct Context* context) {
   return true;
 }
 
-static bool DemuxProtoStream(int sock, struct Context* context) {
-  switch (BufferAppendFrom(&context->buffer, sock)) {
+static bool HandleCursorStream(struct Context* context) {
+  const struct Proto* proto = context->buffer.data;
+  if (!context->cursor) return true;
+  if (proto->size < sizeof(struct ProtoCursor)) {
+    LOG("Invalid cursor message size %u", proto->size);
+    return false;
+  }
+
+  const struct ProtoCursor* cursor = (const void*)proto->data;
+  if (proto->flags & PROTO_FLAG_CURSOR_IMAGE) {
+    size_t image_size = (size_t)cursor->width * cursor->height * 4;
+    if (proto->size != sizeof(struct ProtoCursor) + image_size) {
+      LOG("Invalid cursor image size %u", proto->size);
+      return false;
+    }
+    // mburakov: This is not fatal, streamed cursor is just not shown then.
+    if (!CursorSetImage(context->cursor, cursor->width, cursor->height,
+                        cursor->hotspot_x, cursor->hotspot_y, cursor->data))
+      LOG("Failed to set cursor image");
+  }
+  CursorSetPosition(context->cursor, cursor->x, cursor->y,
+                    cursor->screen_width, cursor->screen_height);
+  return true;
+}
+
+static bool HandleDamageStream(struct Context* context) {
+  const struct Proto* proto = context->buffer.data;
+  if (proto->size < sizeof(struct ProtoDamage)) {
+    LOG("Invalid damage message size %u", proto->size);
+    return false;
+  }
+  size_t rects_size = proto->size - sizeof(struct ProtoDamage);
+  if (rects_size % sizeof(context->damage_rects[0]) ||
+      rects_size > sizeof(context->damage_rects)) {
+    LOG("Invalid damage message size %u", proto->size);
+    return false;
+  }
+
+  const struct ProtoDamage* damage = (const void*)proto->data;
+  memcpy(context->damage_rects, damage->rects, rects_size);
+  context->damage_rects_count = rects_size / sizeof(context->damage_rects[0]);
+  context->damage_width = damage->width;
+  context->damage_height = damage->height;
+  context->damage_pending = true;
+  return true;
+}
+
+static bool ReceiveVideoData(struct Context* context) {
+  const struct Proto* proto = context->buffer.data;
+  ssize_t result =
+      read(context->sock, context->video_data + context->video_received,
+           proto->size - context->video_received);
+  switch (result) {
+    case -1:
+      LOG("Failed to read video data (%s)", strerror(errno));
+      return Disconnect(context);
+    case 0:
+      LOG("Server closed connection");
+      return Disconnect(context);
+    default:
+      break;
+  }
+
+  context->video_received += (size_t)result;
+  if (context->video_received < proto->size) return true;
+  context->video_data = NULL;
+  bool handled = HandleVideoStream(
+      context, proto, context->buffer.size - sizeof(struct Proto));
+  BufferDiscard(&context->buffer, context->buffer.size);
+  if (!handled) LOG("Failed to handle video stream");
+  return handled;
+}
+
+static void MaybeReceiveVideoDirectly(struct Context* context) {
+  const struct Proto* proto = context->buffer.data;
+  if (proto->type != PROTO_TYPE_VIDEO) return;
+
+  // mburakov: Whatever is in the buffer belongs to this incomplete packet, so
+  // copy it over and receive the rest straight into the decoder buffer. The
+  // buffer keeps the beginning of the packet, so that the decoder would not
+  // read its headers back from the uncached decoder buffer.
+  size_t received = context->buffer.size - sizeof(struct Proto);
+  if (received < DECODE_HEADER_SIZE) return;
+  uint8_t* video_data =
+      DecodeContextLockBuffer(context->decode_context, proto->size);
+  if (!video_data) return;
+  memcpy(video_data, proto->data, received);
+  context->video_data = video_data;
+  context->video_received = received;
+}
+
+static bool DemuxProtoStream(struct Context* context) {
+  if (context->video_data) return ReceiveVideoData(context);
+  switch (BufferAppendFrom(&context->buffer, context->sock)) {
     case -1:
       LOG("Failed to append packet data to buffer (%s)", strerror(errno));
-      return false;
+      return Disconnect(context);
     case 0:
       LOG("Server closed connection");
-      return false;
+      return Disconnect(context);
     default:
       break;
   }
@@ -398,7 +1002,10 @@ static bool DemuxProtoStream(int sock, struct Context* context) {
 again:
   if (context->buffer.size < sizeof(struct Proto)) return true;
   const struct Proto* proto = context->buffer.data;
-  if (context->buffer.size < sizeof(struct Proto) + proto->size) return true;
+  if (context->buffer.size < sizeof(struct Proto) + proto->size) {
+    MaybeReceiveVideoDirectly(context);
+    return true;
+  }
 
   switch (proto->type) {
     case PROTO_TYPE_MISC:
@@ -407,7 +1014,7 @@ again:
       context->ping_count++;
       break;
     case PROTO_TYPE_VIDEO:
-      if (!HandleVideoStream(context)) {
+      if (!HandleVideoStream(context, proto, proto->size)) {
         LOG("Failed to handle video stream");
         return false;
       }
@@ -417,13 +1024,27 @@ again:
         LOG("Failed to handle audio stream");
         return false;
       }
+      break;
+    case PROTO_TYPE_CURSOR:
+      if (!HandleCursorStream(context)) {
+        LOG("Failed to handle cursor stream");
+        return false;
+      }
+      break;
+    case PROTO_TYPE_DAMAGE:
+      if (!HandleDamageStream(context)) {
+        LOG("Failed to handle damage stream");
+        return false;
+      }
+      break;
   }
 
   BufferDiscard(&context->buffer, sizeof(struct Proto) + proto->size);
   goto again;
 }
 
-static bool SendPingMessage(int sock, int timer_fd, struct Context* context) {
+static bool SendPingMessages(int timer_fd, struct Context** contexts,
+                             size_t count) {
   uint64_t expirations;
   if (read(timer_fd, &expirations, sizeof(expirations)) !=
       sizeof(expirations)) {
@@ -435,14 +1056,99 @@ static bool SendPingMessage(int sock, int timer_fd, struct Context* context) {
     uint32_t type;
     uint64_t timestamp;
   } __attribute__((packed)) ping = {
-      .type = ~0u,
+      .type = PROTO_REQUEST_PING,
       .timestamp = MicrosNow(),
   };
 
-  if (write(sock, &ping, sizeof(ping)) != sizeof(ping)) {
-    LOG("Failed to write ping message (%s)", strerror(errno));
+  for (size_t i = 0; i < count; i++) {
+    if (contexts[i]->sock == -1 || contexts[i]->connecting) continue;
+    if (write(contexts[i]->sock, &ping, sizeof(ping)) != sizeof(ping)) {
+      LOG("Failed to write ping message (%s)", strerror(errno));
+      if (!Disconnect(contexts[i])) return false;
+    }
+  }
+  return true;
+}
+
+static bool Reconnect(struct Context* context) {
+  uint64_t expirations;
+  if (read(context->reconnect_fd, &expirations, sizeof(expirations)) !=
+      sizeof(expirations)) {
+    LOG("Failed to read reconnect timer expirations (%s)", strerror(errno));
     return false;
   }
+
+  context->reconnect_attempts++;
+  if (context->overlay && !RenderOverlay(context, MicrosNow()))
+    LOG("Failed to render overlay");
+  context->sock = ConnectSocket(context->address);
+  if (context->sock == -1) {
+    LOG("Failed to reconnect socket");
+    return ArmReconnect(context);
+  }
+  context->connecting = true;
+  return true;
+}
+
+static bool FinishReconnect(struct Context* context) {
+  context->connecting = false;
+  if (!CheckConnect(context->sock)) {
+    LOG("Failed to finish socket reconnection");
+    close(context->sock);
+    context->sock = -1;
+    return ArmReconnect(context);
+  }
+
+  // mburakov: Failing any of these means the connection is broken already.
+  if (!context->no_input) {
+    context->input_stream = InputStreamCreate(context->sock);
+    if (!context->input_stream) {
+      LOG("Failed to create input stream");
+      return Disconnect(context);
+    }
+  }
+  // mburakov: Streamer might be producing no keyframes at all, i.e. with
+  // gradual decoding refresh, so one has to be requested explicitly.
+  uint32_t request = PROTO_REQUEST_KEYFRAME;
+  if (write(context->sock, &request, sizeof(request)) != sizeof(request)) {
+    LOG("Failed to write keyframe request (%s)", strerror(errno));
+    return Disconnect(context);
+  }
+  request = PROTO_REQUEST_CURSOR;
+  if (context->cursor &&
+      write(context->sock, &request, sizeof(request)) != sizeof(request)) {
+    LOG("Failed to write cursor request (%s)", strerror(errno));
+    return Disconnect(context);
+  }
+  LOG("Reconnected after %zu attempts", context->reconnect_attempts);
+  context->reconnect_delay = RECONNECT_DELAY_MIN;
+  return true;
+}
+
+static bool SwitchStream(struct Context** contexts, size_t count) {
+  size_t current = 0;
+  while (contexts[current] != contexts[0]->active) current++;
+  size_t next = (current + 1) % count;
+
+  // mburakov: Standby context kept decoding all the time, so its last frame
+  // is shown right away, and only then the current one is hidden. It keeps
+  // decoding as well, so that it could be switched back just as fast.
+  if (!WindowSetTileVisible(contexts[next]->view, true)) {
+    LOG("Failed to show standby stream");
+    return false;
+  }
+  if (!WindowSetTileVisible(contexts[current]->view, false)) {
+    LOG("Failed to hide current stream");
+    return false;
+  }
+  // mburakov: Whatever was pressed would otherwise stay pressed forever.
+  if (contexts[current]->input_stream &&
+      !InputStreamHandsoff(contexts[current]->input_stream)) {
+    LOG("Failed to handsoff input stream");
+    return false;
+  }
+  contexts[0]->active = contexts[next];
+  LOG("Switched to stream %zu", next);
   return true;
 }
 
@@ -450,34 +1156,49 @@ static void ContextDestroy(struct Context* context) {
   BufferDestroy(&context->buffer);
   if (context->audio_context) AudioContextDestroy(context->audio_context);
   DecodeContextDestroy(context->decode_context);
+  if (context->cursor) CursorDestroy(context->cursor);
   if (context->overlay) OverlayDestroy(context->overlay);
-  WindowDestroy(context->window);
+  if (context->view != context->window) WindowDestroy(context->view);
+  if (context->window) WindowDestroy(context->window);
   if (context->input_stream) InputStreamDestroy(context->input_stream);
+  close(context->reconnect_fd);
+  if (context->sock != -1) close(context->sock);
+  free(context);
 }
 
 int main(int argc, char* argv[]) {
   if (argc < 2) {
-    LOG("Usage: %s <ip>:<port> [--no-input] [--stats] "
-        "[--audio <buffer_size>] [--dump-video <file_name>]",
+    LOG("Usage: %s <ip>:<port> [<ip>:<port>...] [--standby] [--no-input] "
+        "[--stats] [--audio <buffer_size>] [--dump-video <file_name>] "
+        "[--expect [hevc:|av1:]<width>x<height>] "
+        "[--upscale <width>x<height>] [--render-node <path>] "
+        "[--local-cursor] "
+        "[--decoder mfx|vaapi|stub|auto]",
         argv[0]);
     return EXIT_FAILURE;
   }
 
-  int sock = ConnectSocket(argv[1]);
-  if (sock == -1) {
-    LOG("Failed to connect socket");
-    return EXIT_FAILURE;
-  }
-
+  const char* addresses[MAX_STREAMS];
+  size_t streams_count = 0;
+  bool standby = false;
   bool no_input = false;
   bool stats = false;
   const char* audio_buffer = NULL;
   const char* dump_fname = NULL;
-  for (int i = 2; i < argc; i++) {
-    if (!strcmp(argv[i], "--no-input")) {
+  const char* expect = NULL;
+  const char* upscale = NULL;
+  const char* render_node = NULL;
+  bool local_cursor = false;
+  enum DecodeBackend decoder = DECODE_BACKEND_AUTO;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--standby")) {
+      standby = true;
+    } else if (!strcmp(argv[i], "--no-input")) {
       no_input = true;
     } else if (!strcmp(argv[i], "--stats")) {
       stats = true;
+    } else if (!strcmp(argv[i], "--local-cursor")) {
+      local_cursor = true;
     } else if (!strcmp(argv[i], "--audio")) {
       audio_buffer = argv[++i];
       if (i == argc) {
@@ -490,25 +1211,106 @@ int main(int argc, char* argv[]) {
         LOG("Dump video argument requires a value");
         return EXIT_FAILURE;
       }
+    } else if (!strcmp(argv[i], "--expect")) {
+      expect = argv[++i];
+      if (i == argc) {
+        LOG("Expect argument requires a value");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--upscale")) {
+      upscale = argv[++i];
+      if (i == argc) {
+        LOG("Upscale argument requires a value");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--render-node")) {
+      render_node = argv[++i];
+      if (i == argc) {
+        LOG("Render node argument requires a value");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--decoder")) {
+      const char* value = argv[++i];
+      if (i == argc) {
+        LOG("Decoder argument requires a value");
+        return EXIT_FAILURE;
+      }
+      if (!strcmp(value, "mfx")) {
+        decoder = DECODE_BACKEND_MFX;
+      } else if (!strcmp(value, "vaapi")) {
+        decoder = DECODE_BACKEND_VAAPI;
+      } else if (!strcmp(value, "stub")) {
+        decoder = DECODE_BACKEND_STUB;
+      } else if (strcmp(value, "auto")) {
+        LOG("Invalid decoder argument");
+        return EXIT_FAILURE;
+      }
+    } else if (streams_count < MAX_STREAMS) {
+      addresses[streams_count++] = argv[i];
+    } else {
+      LOG("Too many streams, at most %d are supported", MAX_STREAMS);
+      return EXIT_FAILURE;
     }
   }
+  if (!streams_count) {
+    LOG("No streams to receive");
+    return EXIT_FAILURE;
+  }
 
-  struct Context* context =
-      ContextCreate(sock, no_input, stats, audio_buffer, dump_fname);
-  if (!context) {
-    LOG("Failed to create context");
-    goto rollback_socket;
+  // mburakov: All of the streams are connecting at the same time, and each
+  // of the contexts finishes its own connection once it was created. Then
+  // the context owns its socket, and replaces it when reconnecting.
+  uint64_t connect_started = MicrosNow();
+  int socks[MAX_STREAMS];
+  size_t socks_count = 0;
+  size_t contexts_count = 0;
+  for (; socks_count < streams_count; socks_count++) {
+    socks[socks_count] = ConnectSocket(addresses[socks_count]);
+    if (socks[socks_count] == -1) {
+      LOG("Failed to connect socket");
+      goto rollback_socks;
+    }
   }
 
-  int events_fd = WindowGetEventsFd(context->window);
+  // mburakov: Only the first stream plays audio and gets dumped, because
+  // there is just one of each of these. Same stands for input events, unless
+  // receiving in standby mode, where input goes to the stream that is shown.
+  // Standby streams are stacked rather than tiled, and only one is visible.
+  standby = standby && streams_count > 1;
+  struct Context* contexts[MAX_STREAMS];
+  for (; contexts_count < streams_count; contexts_count++) {
+    bool first = !contexts_count;
+    size_t tile_index = standby ? 0 : contexts_count;
+    size_t tile_count = standby ? 1 : streams_count;
+    if (streams_count == 1) tile_count = 0;
+    struct Context* context = ContextCreate(
+        addresses[contexts_count], socks[contexts_count],
+        first ? NULL : contexts[0]->window, tile_index, tile_count,
+        no_input || (!first && !standby), stats, first ? audio_buffer : NULL,
+        first ? dump_fname : NULL, expect, upscale, render_node, local_cursor,
+        decoder);
+    if (!context) {
+      LOG("Failed to create context");
+      goto rollback_contexts;
+    }
+    context->connect_started = connect_started;
+    contexts[contexts_count] = context;
+    if (standby && !first && !WindowSetTileVisible(context->view, false)) {
+      LOG("Failed to hide standby stream");
+      contexts_count++;
+      goto rollback_contexts;
+    }
+  }
+
+  int events_fd = WindowGetEventsFd(contexts[0]->window);
   if (events_fd == -1) {
     LOG("Failed to get events fd");
-    goto rollback_context;
+    goto rollback_contexts;
   }
   int timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
   if (timer_fd == -1) {
     LOG("Failed to create timer (%s)", strerror(errno));
-    goto rollback_context;
+    goto rollback_contexts;
   }
 
   static const unsigned ping_period_ns = 1000 * 1000 * 1000 / 3;
@@ -520,19 +1322,52 @@ int main(int argc, char* argv[]) {
     LOG("Failed to arm timer (%s)", strerror(errno));
     goto rollback_timer_fd;
   }
+  // mburakov: Writing to a socket of a lost connection must not kill the
+  // receiver, it is going to reconnect instead.
   if (signal(SIGINT, OnSignal) == SIG_ERR ||
-      signal(SIGTERM, OnSignal) == SIG_ERR) {
+      signal(SIGTERM, OnSignal) == SIG_ERR ||
+      signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
     LOG("Failed to set signal handlers (%s)", strerror(errno));
     goto rollback_timer_fd;
   }
+  if (standby && signal(SIGUSR1, OnSwitchSignal) == SIG_ERR) {
+    LOG("Failed to set switch signal handler (%s)", strerror(errno));
+    goto rollback_timer_fd;
+  }
 
+  // mburakov: Streams are serviced one after another from this very loop.
+  // Decoding itself is asynchronous, so the loop is mostly parsing headers
+  // and submitting these to the device, which does not justify threads.
   while (!g_signal) {
-    struct pollfd pfds[] = {
-        {.fd = sock, .events = POLLIN},
+    if (g_switch) {
+      g_switch = 0;
+      if (!SwitchStream(contexts, streams_count)) {
+        LOG("Failed to switch stream");
+        goto rollback_timer_fd;
+      }
+    }
+    struct pollfd pfds[2 + 3 * MAX_STREAMS] = {
         {.fd = events_fd, .events = POLLIN},
         {.fd = timer_fd, .events = POLLIN},
     };
-    switch (poll(pfds, LENGTH(pfds), -1)) {
+    for (size_t i = 0; i < streams_count; i++) {
+      // mburakov: Socket is negative and ignored while waiting to reconnect.
+      struct pollfd* stream_pfds = &pfds[2 + 3 * i];
+      stream_pfds[0] = (struct pollfd){
+          .fd = contexts[i]->sock,
+          .events = contexts[i]->connecting ? POLLOUT : POLLIN,
+      };
+      // mburakov: Decode context might switch its backend.
+      stream_pfds[1] = (struct pollfd){
+          .fd = DecodeContextGetEventsFd(contexts[i]->decode_context),
+          .events = POLLIN,
+      };
+      stream_pfds[2] = (struct pollfd){
+          .fd = contexts[i]->reconnect_fd,
+          .events = POLLIN,
+      };
+    }
+    switch (poll(pfds, 2 + 3 * streams_count, -1)) {
       case -1:
         if (errno != EINTR) {
           LOG("Failed to poll (%s)", strerror(errno));
@@ -544,26 +1379,51 @@ int main(int argc, char* argv[]) {
       default:
         break;
     }
-    if (pfds[0].revents && !DemuxProtoStream(sock, context)) {
-      LOG("Failed to demux proto stream");
-      goto rollback_timer_fd;
-    }
-    if (pfds[1].revents && !WindowProcessEvents(context->window)) {
+    if (pfds[0].revents && !WindowProcessEvents(contexts[0]->window)) {
       LOG("Failed to process window events");
       goto rollback_timer_fd;
     }
-    if (pfds[2].revents && !SendPingMessage(sock, timer_fd, context)) {
-      LOG("Failed to send ping message");
+    if (pfds[1].revents &&
+        !SendPingMessages(timer_fd, contexts, streams_count)) {
+      LOG("Failed to send ping messages");
       goto rollback_timer_fd;
     }
+    for (size_t i = 0; i < streams_count; i++) {
+      const struct pollfd* stream_pfds = &pfds[2 + 3 * i];
+      // mburakov: Connection might have been lost while sending pings.
+      if (stream_pfds[0].revents && stream_pfds[0].fd == contexts[i]->sock) {
+        bool handled = contexts[i]->connecting
+                           ? FinishReconnect(contexts[i])
+                           : DemuxProtoStream(contexts[i]);
+        if (!handled) {
+          LOG("Failed to handle proto stream");
+          goto rollback_timer_fd;
+        }
+      }
+      if (stream_pfds[1].revents && !HandleDecodeEvents(contexts[i])) {
+        LOG("Failed to handle decode events");
+        goto rollback_timer_fd;
+      }
+      if (stream_pfds[2].revents && !Reconnect(contexts[i])) {
+        LOG("Failed to reconnect");
+        goto rollback_timer_fd;
+      }
+    }
+    for (size_t i = 0; i < streams_count; i++) {
+      if (contexts[i]->disconnect_pending && !Disconnect(contexts[i])) {
+        LOG("Failed to disconnect");
+        goto rollback_timer_fd;
+      }
+    }
   }
 
 rollback_timer_fd:
   close(timer_fd);
-rollback_context:
-  ContextDestroy(context);
-rollback_socket:
-  close(sock);
+rollback_contexts:
+  for (size_t i = contexts_count; i; i--) ContextDestroy(contexts[i - 1]);
+rollback_socks:
+  for (; socks_count > contexts_count; socks_count--)
+    close(socks[socks_count - 1]);
   bool result = g_signal == SIGINT || g_signal == SIGTERM;
   return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
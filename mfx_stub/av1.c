@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "av1.h"
+
+#include <stdint.h>
+
+#include "mfxsession_impl.h"
+#include "obu.h"
+
+// 7.5 Ordering of OBUs, operating point 0 is the one that gets decoded.
+static bool IsInOperatingPoint(const struct ObuParser* parser,
+                               const struct Obu* obu) {
+  uint32_t idc = parser->seq.operating_point_idc[0];
+  if (!obu->extension || !idc) return true;
+  bool inTemporalLayer = (idc >> obu->temporal_id) & 1;
+  bool inSpatialLayer = (idc >> (obu->spatial_id + 8)) & 1;
+  return inTemporalLayer && inSpatialLayer;
+}
+
+static void MarkReferences(mfxSession session) {
+  // mburakov: Slots are referenced only from the reference frames, so the
+  // marking is rebuilt from scratch after each of their updates.
+  for (size_t i = 0; i < session->slots_count; i++)
+    session->slots[i].marking = MARKING_UNUSED;
+  for (size_t i = 0; i < OBU_NUM_REF_FRAMES; i++) {
+    const struct ObuRefFrame* ref = &session->av1.refs[i];
+    if (ref->valid) session->slots[ref->slot].marking = MARKING_SHORT_TERM;
+  }
+}
+
+static void OutputFrame(mfxSession session, size_t slot_index,
+                        const struct ObuRefFrame* frame,
+                        struct VaDecoderPicture* picture) {
+  session->output_slot = slot_index;
+  *picture = (struct VaDecoderPicture){
+      .index = slot_index,
+      .surface_id = session->slots[slot_index].surface_id,
+      .crop_rect = {0, 0, frame->render_width, frame->render_height},
+      .sync_point = session->sync_point,
+  };
+}
+
+static bool SetupSurfaces(mfxSession session) {
+  struct ObuParser* parser = &session->av1;
+  if (!VaDecoderAcquireSlot(session)) return false;
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  ppb->current_frame = session->slots[session->current_slot].surface_id;
+  ppb->current_display_picture = ppb->current_frame;
+  for (size_t i = 0; i < OBU_NUM_REF_FRAMES; i++) {
+    const struct ObuRefFrame* ref = &parser->refs[i];
+    ppb->ref_frame_map[i] =
+        ref->valid ? session->slots[ref->slot].surface_id : VA_INVALID_SURFACE;
+  }
+  return true;
+}
+
+mfxStatus Av1DecodeHeader(mfxSession session, mfxBitstream* bs,
+                          mfxVideoParam* par) {
+  const mfxU8* data = bs->Data;
+  const mfxU8* end = bs->Data + bs->DataLength;
+  for (struct Obu obu; data < end;) {
+    size_t size = ObuRead(data, (size_t)(end - data), &obu);
+    if (!size) return MFX_ERR_UNSUPPORTED;
+    data += size;
+    if (obu.type != OBU_SEQUENCE_HEADER) continue;
+    if (!ObuParseSequenceHeader(&session->av1, &obu)) {
+      return MFX_ERR_UNSUPPORTED;
+    }
+
+    // mburakov: Sequence header is left in the bitstream, DecodeFrameAsync
+    // would parse it once again together with the rest of temporal unit.
+    const struct ObuSequenceHeader* seq = &session->av1.seq;
+    par->mfx.FrameInfo = (mfxFrameInfo){
+        .FourCC = MFX_FOURCC_NV12,
+        .Width = (mfxU16)(seq->max_frame_width_minus_1 + 1),
+        .Height = (mfxU16)(seq->max_frame_height_minus_1 + 1),
+        .CropW = (mfxU16)(seq->max_frame_width_minus_1 + 1),
+        .CropH = (mfxU16)(seq->max_frame_height_minus_1 + 1),
+        .ChromaFormat = MFX_CHROMAFORMAT_YUV420,
+    };
+    par->mfx.NumRefFrame = OBU_NUM_REF_FRAMES;
+    return MFX_ERR_NONE;
+  }
+  return MFX_ERR_MORE_DATA;
+}
+
+mfxStatus Av1DecodeFrame(mfxSession session, mfxBitstream* bs,
+                         struct VaDecoderPicture* picture) {
+  struct ObuParser* parser = &session->av1;
+  const mfxU8* data = bs->Data;
+  const mfxU8* end = bs->Data + bs->DataLength;
+  for (struct Obu obu; data < end;) {
+    size_t size = ObuRead(data, (size_t)(end - data), &obu);
+    if (!size) return MFX_ERR_UNSUPPORTED;
+    data += size;
+    if (!IsInOperatingPoint(parser, &obu)) continue;
+
+    const uint8_t* tiles = obu.data;
+    size_t tiles_size = obu.size;
+    switch (obu.type) {
+      case OBU_TEMPORAL_DELIMITER:
+        // 7.5: Temporal unit always starts with a new frame header.
+        parser->seen_frame_header = false;
+        continue;
+
+      case OBU_SEQUENCE_HEADER:
+        if (!ObuParseSequenceHeader(parser, &obu) ||
+            parser->seq.max_frame_width_minus_1 >= session->context_width ||
+            parser->seq.max_frame_height_minus_1 >= session->context_height) {
+          return MFX_ERR_UNSUPPORTED;
+        }
+        continue;
+
+      case OBU_FRAME_HEADER:
+      case OBU_REDUNDANT_FRAME_HEADER:
+      case OBU_FRAME: {
+        size_t header_size;
+        if (!ObuParseFrameHeader(parser, &obu, &header_size)) {
+          return MFX_ERR_UNSUPPORTED;
+        }
+        if (parser->show_existing_frame) {
+          // 7.21: Showing an existing key frame resets the references as if
+          // the key frame was just decoded.
+          ObuUpdateReferences(parser, parser->frame.slot);
+          MarkReferences(session);
+          session->sync_point = parser->frame.frame_type == OBU_KEY_FRAME;
+          OutputFrame(session, parser->frame.slot, &parser->frame, picture);
+          continue;
+        }
+        if (obu.type != OBU_FRAME) continue;
+        tiles += header_size;
+        tiles_size -= header_size;
+        break;
+      }
+
+      case OBU_TILE_GROUP:
+        break;
+
+      default:
+        continue;
+    }
+
+    bool frame_complete;
+    if (!ObuParseTileGroup(parser, tiles, tiles_size, &frame_complete)) {
+      return MFX_ERR_UNSUPPORTED;
+    }
+    if (!frame_complete) continue;
+    if (!SetupSurfaces(session)) return MFX_ERR_UNSUPPORTED;
+    size_t current_slot = session->current_slot;
+    session->stats.frame_type =
+        parser->frame.frame_type == OBU_KEY_FRAME ||
+                parser->frame.frame_type == OBU_INTRA_ONLY_FRAME
+            ? 'I'
+            : 'P';
+    session->stats.quantizer = parser->ppb.base_qindex;
+    session->stats.payload_size +=
+        (size_t)(parser->tiles_end - parser->tiles_data);
+
+    uint32_t offset;
+    if (!VaDecoderUploadSliceData(
+            session, parser->tiles_data,
+            (size_t)(parser->tiles_end - parser->tiles_data), &offset)) {
+      return MFX_ERR_DEVICE_FAILED;
+    }
+    for (size_t i = 0; i < parser->tiles_count; i++)
+      parser->tiles[i].slice_data_offset += offset;
+    if (!VaDecoderSubmitPicture(session, &parser->ppb, sizeof(parser->ppb),
+                                parser->tiles, sizeof(parser->tiles[0]),
+                                parser->tiles_count)) {
+      return MFX_ERR_DEVICE_FAILED;
+    }
+
+    ObuUpdateReferences(parser, current_slot);
+    MarkReferences(session);
+    session->current_slot = SIZE_MAX;
+    if (parser->ppb.pic_info_fields.bits.show_frame) {
+      session->sync_point = parser->frame.frame_type == OBU_KEY_FRAME;
+      OutputFrame(session, current_slot, &parser->frame, picture);
+    }
+  }
+  return MFX_ERR_NONE;
+}
+
+void Av1DecodeReset(mfxSession session) {
+  // mburakov: Whatever was decoded before is not trusted anymore, so frames
+  // that refer to it are rejected until the next key frame.
+  struct ObuParser* parser = &session->av1;
+  parser->seen_frame_header = false;
+  for (size_t i = 0; i < OBU_NUM_REF_FRAMES; i++)
+    parser->refs[i].valid = false;
+  session->sync_point = false;
+}
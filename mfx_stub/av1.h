@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MFX_STUB_AV1_H_
+#define MFX_STUB_AV1_H_
+
+#include <mfxvideo.h>
+#include <vadecoder.h>
+
+mfxStatus Av1DecodeHeader(mfxSession session, mfxBitstream* bs,
+                          mfxVideoParam* par);
+mfxStatus Av1DecodeFrame(mfxSession session, mfxBitstream* bs,
+                         struct VaDecoderPicture* picture);
+void Av1DecodeReset(mfxSession session);
+
+#endif  // MFX_STUB_AV1_H_
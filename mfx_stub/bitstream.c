@@ -17,38 +17,209 @@
 
 #include "bitstream.h"
 
+#include <endian.h>
 #include <string.h>
 
-static uint64_t BitstreamReadBit(struct Bitstream* bitstream) {
-  size_t shift = 7 - (bitstream->offset & 0x7);
-  if (shift == 7) {
-    size_t byte;
-  repeat:
-    byte = bitstream->offset >> 3;
-    if (byte >= bitstream->size) longjmp(bitstream->trap, 1);
-    bitstream->cache = (bitstream->cache << 8) | bitstream->data[byte];
-    if (bitstream->offset >= 24 && (bitstream->cache & 0xffffff) == 3) {
-      bitstream->offset += 8;
-      bitstream->epb_count++;
-      goto repeat;
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+static const uint8_t* FindStartCodeScalar(const uint8_t* data,
+                                          const uint8_t* end,
+                                          size_t* epb_count) {
+  // mburakov: If the third byte is above one, no start code can begin at any
+  // of the three positions, so those are skipped altogether.
+  while (end - data >= 3) {
+    if (data[2] > 1) {
+      if (data[2] == 3 && !data[0] && !data[1]) ++*epb_count;
+      data += 3;
+    } else if (!data[2]) {
+      data++;
+    } else if (!data[0] && !data[1]) {
+      return data;
+    } else {
+      data += 3;
+    }
+  }
+  return end;
+}
+
+#ifdef __SSE2__
+static const uint8_t* FindStartCodeSse2(const uint8_t* data,
+                                        const uint8_t* end,
+                                        size_t* epb_count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i three = _mm_set1_epi8(3);
+  for (; end - data >= 18; data += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(const void*)data);
+    __m128i b = _mm_loadu_si128((const __m128i*)(const void*)(data + 1));
+    __m128i c = _mm_loadu_si128((const __m128i*)(const void*)(data + 2));
+    __m128i zeros =
+        _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero));
+    __m128i match = _mm_and_si128(zeros, _mm_cmpeq_epi8(c, one));
+    __m128i epb = _mm_and_si128(zeros, _mm_cmpeq_epi8(c, three));
+    unsigned mask = (unsigned)_mm_movemask_epi8(match);
+    unsigned epb_mask = (unsigned)_mm_movemask_epi8(epb);
+    if (mask) {
+      *epb_count += (size_t)__builtin_popcount(
+          epb_mask & ((1u << __builtin_ctz(mask)) - 1));
+      return data + __builtin_ctz(mask);
+    }
+    *epb_count += (size_t)__builtin_popcount(epb_mask);
+  }
+  return FindStartCodeScalar(data, end, epb_count);
+}
+
+__attribute__((target("avx2"))) static const uint8_t* FindStartCodeAvx2(
+    const uint8_t* data, const uint8_t* end, size_t* epb_count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  const __m256i three = _mm256_set1_epi8(3);
+  for (; end - data >= 34; data += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(const void*)data);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(const void*)(data + 1));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(const void*)(data + 2));
+    __m256i zeros = _mm256_and_si256(_mm256_cmpeq_epi8(a, zero),
+                                     _mm256_cmpeq_epi8(b, zero));
+    __m256i match = _mm256_and_si256(zeros, _mm256_cmpeq_epi8(c, one));
+    __m256i epb = _mm256_and_si256(zeros, _mm256_cmpeq_epi8(c, three));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(match);
+    unsigned epb_mask = (unsigned)_mm256_movemask_epi8(epb);
+    if (mask) {
+      *epb_count += (size_t)__builtin_popcount(
+          epb_mask & ((1u << __builtin_ctz(mask)) - 1));
+      return data + __builtin_ctz(mask);
+    }
+    *epb_count += (size_t)__builtin_popcount(epb_mask);
+  }
+  return FindStartCodeSse2(data, end, epb_count);
+}
+#endif  // __SSE2__
+
+static __typeof__(FindStartCodeScalar)* g_find_start_code =
+    FindStartCodeScalar;
+
+#ifdef __SSE2__
+// mburakov: Cpu features do not change while running, so the scanner is
+// picked once instead of for every start code.
+__attribute__((constructor)) static void ResolveFindStartCode(void) {
+  __builtin_cpu_init();
+  g_find_start_code = __builtin_cpu_supports("avx2") ? FindStartCodeAvx2
+                                                     : FindStartCodeSse2;
+}
+#endif  // __SSE2__
+
+size_t BitstreamIndexNalus(const uint8_t* data, size_t size,
+                           struct BitstreamNalu* nalus, size_t capacity,
+                           size_t* epb_count) {
+  size_t result = 0;
+  const uint8_t* end = data + size;
+  *epb_count = 0;
+  for (const uint8_t* next = g_find_start_code(data, end, epb_count);
+       next != end;) {
+    const uint8_t* begin = next + 3;
+    next = g_find_start_code(begin, end, epb_count);
+    // mburakov: NAL units never end with a zero byte, so any zeroes before the
+    // next start code are either trailing_zero_8bits or a zero_byte belonging
+    // to a four-byte start code.
+    const uint8_t* nalu_end = next;
+    while (nalu_end > begin && !nalu_end[-1]) nalu_end--;
+    if (nalu_end == begin) continue;
+    if (result == capacity) return SIZE_MAX;
+    nalus[result++] = (struct BitstreamNalu){
+        .data = begin,
+        .size = (size_t)(nalu_end - begin),
+    };
+  }
+  return result;
+}
+
+size_t BitstreamUnescape(const uint8_t* data, size_t size, uint8_t* rbsp,
+                         size_t rbsp_size) {
+  size_t zeros = 0;
+  size_t result = 0;
+  for (size_t i = 0; i < size && result < rbsp_size; i++) {
+    if (zeros >= 2 && data[i] == 3) {
+      zeros = 0;
+      continue;
     }
+    zeros = data[i] ? 0 : zeros + 1;
+    rbsp[result++] = data[i];
+  }
+  return result;
+}
+
+size_t BitstreamEpbCount(const uint8_t* data, size_t size, size_t rbsp_size) {
+  size_t zeros = 0;
+  size_t result = 0;
+  for (size_t i = 0; i < size && i - result < rbsp_size; i++) {
+    if (zeros >= 2 && data[i] == 3) {
+      zeros = 0;
+      result++;
+      continue;
+    }
+    zeros = data[i] ? 0 : zeros + 1;
+  }
+  return result;
+}
+
+static void BitstreamRefill(struct Bitstream* bitstream) {
+  // mburakov: Bits below cache_bits are always valid. Bits above it are
+  // either zero or hold the same data that would be loaded there next time,
+  // so or-ing the next word on top of them is safe.
+  if (bitstream->next_byte + sizeof(uint64_t) <= bitstream->size) {
+    uint64_t word;
+    memcpy(&word, bitstream->data + bitstream->next_byte, sizeof(word));
+    bitstream->cache |= be64toh(word) >> bitstream->cache_bits;
+    size_t bytes = (63 - bitstream->cache_bits) >> 3;
+    bitstream->next_byte += bytes;
+    bitstream->cache_bits += bytes << 3;
+    return;
+  }
+  for (; bitstream->cache_bits <= 56 && bitstream->next_byte < bitstream->size;
+       bitstream->next_byte++) {
+    bitstream->cache |= (uint64_t)bitstream->data[bitstream->next_byte]
+                        << (56 - bitstream->cache_bits);
+    bitstream->cache_bits += 8;
   }
-  bitstream->offset++;
-  return bitstream->cache >> shift & 0x1;
+}
+
+static void BitstreamSkip(struct Bitstream* bitstream, size_t size) {
+  bitstream->cache <<= size;
+  bitstream->cache_bits -= size;
+  bitstream->offset += size;
 }
 
 uint64_t BitstreamReadU(struct Bitstream* bitstream, size_t size) {
-  uint64_t result = 0;
-  for (; size; size--) {
-    result = (result << 1) | BitstreamReadBit(bitstream);
+  if (size > 32) {
+    uint64_t high = BitstreamReadU(bitstream, size - 32);
+    return high << 32 | BitstreamReadU(bitstream, 32);
+  }
+  if (!size) return 0;
+  if (bitstream->cache_bits < size) {
+    BitstreamRefill(bitstream);
+    if (bitstream->cache_bits < size) longjmp(bitstream->trap, 1);
   }
+  uint64_t result = bitstream->cache >> (64 - size);
+  BitstreamSkip(bitstream, size);
   return result;
 }
 
 uint64_t BitstreamReadUE(struct Bitstream* bitstream) {
-  size_t size = 0;
-  while (!BitstreamReadBit(bitstream)) size++;
-  return (BitstreamReadU(bitstream, size) | (1 << size)) - 1;
+  if (bitstream->cache_bits < 32) BitstreamRefill(bitstream);
+  size_t size = bitstream->cache
+                    ? (size_t)__builtin_clzll(bitstream->cache)
+                    : sizeof(bitstream->cache) * 8;
+  if (size > 31) longjmp(bitstream->trap, 1);
+  size_t length = size * 2 + 1;
+  if (length <= bitstream->cache_bits) {
+    uint64_t result = bitstream->cache >> (64 - length);
+    BitstreamSkip(bitstream, length);
+    return result - 1;
+  }
+  BitstreamReadU(bitstream, size + 1);
+  return (BitstreamReadU(bitstream, size) | (1ull << size)) - 1;
 }
 
 int64_t BitstreamReadSE(struct Bitstream* bitstream) {
@@ -58,32 +229,5 @@ int64_t BitstreamReadSE(struct Bitstream* bitstream) {
 }
 
 void BitstreamByteAlign(struct Bitstream* bitstream) {
-  bitstream->offset = (bitstream->offset + 7) & ~(size_t)7;
-}
-
-bool BitstreamReadNalu(struct Bitstream* bitstream, struct Bitstream* output) {
-  if (bitstream->offset & 0x7) return false;
-  size_t byte_offset = bitstream->offset >> 3;
-  static const uint8_t kStartCodePrefix[] = {0, 0, 0, 1};
-  if (bitstream->size - byte_offset < sizeof(kStartCodePrefix)) {
-    return false;
-  }
-  const uint8_t* data = bitstream->data + byte_offset;
-  if (memcmp(bitstream->data + byte_offset, kStartCodePrefix,
-             sizeof(kStartCodePrefix))) {
-    return false;
-  }
-  data += sizeof(kStartCodePrefix);
-  byte_offset += sizeof(kStartCodePrefix);
-  size_t max_size = bitstream->size - byte_offset;
-  uint8_t* next =
-      memmem(data, max_size, kStartCodePrefix, sizeof(kStartCodePrefix));
-  size_t size = next ? (size_t)(next - data) : max_size;
-  bitstream->offset = (byte_offset + size) << 3;
-  *output = BitstreamCreate(data, size);
-  return true;
-}
-
-bool BitstreamAvail(const struct Bitstream* bitstream) {
-  return bitstream->offset < (bitstream->size << 3);
+  BitstreamReadU(bitstream, -bitstream->offset & 0x7);
 }
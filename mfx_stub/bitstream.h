@@ -23,24 +23,45 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// mburakov: Streamer never produces more than a handful of NAL units per
+// access unit, so this is generous even for multi-slice pictures.
+#define BITSTREAM_MAX_NALUS 64
+
+// mburakov: Parameter sets and slice headers are unescaped into a scratch
+// buffer of this size. Anything that does not fit is reported as overrun.
+#define BITSTREAM_RBSP_SIZE 512
+
 #define BitstreamCreate(a, b) \
   (struct Bitstream) { .data = a, .size = b }
 #define BitstreamReadFailed(x) setjmp((x)->trap)
 
+struct BitstreamNalu {
+  const uint8_t* data;
+  size_t size;
+};
+
 struct Bitstream {
   const uint8_t* data;
   size_t size;
   size_t offset;
-  size_t epb_count;
-  uint32_t cache;
+  size_t next_byte;
+  uint64_t cache;
+  size_t cache_bits;
   jmp_buf trap;
 };
 
+// mburakov: Emulation prevention bytes of the whole data are counted while
+// indexing, because it's nearly free compared to another pass over it.
+size_t BitstreamIndexNalus(const uint8_t* data, size_t size,
+                           struct BitstreamNalu* nalus, size_t capacity,
+                           size_t* epb_count);
+size_t BitstreamUnescape(const uint8_t* data, size_t size, uint8_t* rbsp,
+                         size_t rbsp_size);
+size_t BitstreamEpbCount(const uint8_t* data, size_t size, size_t rbsp_size);
+
 uint64_t BitstreamReadU(struct Bitstream* bitstream, size_t size);
 uint64_t BitstreamReadUE(struct Bitstream* bitstream);
 int64_t BitstreamReadSE(struct Bitstream* bitstream);
 void BitstreamByteAlign(struct Bitstream* bitstream);
-bool BitstreamReadNalu(struct Bitstream* bitstream, struct Bitstream* output);
-bool BitstreamAvail(const struct Bitstream* bitstream);
 
 #endif  // MFX_STUB_BITSTREAM_H_
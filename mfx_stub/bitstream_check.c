@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// mburakov: This is a standalone check of the bitstream helpers, that is not
+// a part of the receiver. It includes the implementation to get to the static
+// functions, see the check target of the makefile.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitstream.c"
+
+#define BENCHMARK_SIZE (16 << 20)
+#define BENCHMARK_ROUNDS 16
+#define MAX_REPORTED_FAILURES 16
+
+struct Scanner {
+  const char* name;
+  __typeof__(FindStartCodeScalar)* fn;
+};
+
+static size_t g_failures;
+static volatile size_t g_sink;
+
+static const uint8_t* FindStartCodeReference(const uint8_t* data,
+                                             const uint8_t* end,
+                                             size_t* epb_count) {
+  for (; end - data >= 3; data++) {
+    if (data[0] || data[1] || data[2] > 3) continue;
+    if (data[2] == 1) return data;
+    if (data[2] == 3) ++*epb_count;
+  }
+  return end;
+}
+
+static size_t GetScanners(struct Scanner* scanners) {
+  size_t result = 0;
+  scanners[result++] = (struct Scanner){"scalar", FindStartCodeScalar};
+#ifdef __SSE2__
+  scanners[result++] = (struct Scanner){"sse2", FindStartCodeSse2};
+  if (__builtin_cpu_supports("avx2"))
+    scanners[result++] = (struct Scanner){"avx2", FindStartCodeAvx2};
+#endif  // __SSE2__
+  return result;
+}
+
+static void CheckScanner(const struct Scanner* scanner, const uint8_t* data,
+                         size_t size) {
+  // mburakov: Data is copied to its own allocation, so that sanitizers could
+  // spot reads past the end.
+  uint8_t* copy = malloc(size ? size : 1);
+  if (!copy) abort();
+  memcpy(copy, data, size);
+  const uint8_t* end = copy + size;
+  const uint8_t* expected = copy;
+  const uint8_t* actual = copy;
+  size_t expected_epb = 0;
+  size_t actual_epb = 0;
+  for (;;) {
+    expected = FindStartCodeReference(expected, end, &expected_epb);
+    actual = scanner->fn(actual, end, &actual_epb);
+    if (actual != expected || actual_epb != expected_epb) {
+      if (g_failures++ < MAX_REPORTED_FAILURES) {
+        fprintf(stderr,
+                "%s: size %zu: expected start code at %zd with %zu epb, "
+                "got %zd with %zu epb\n",
+                scanner->name, size, expected - copy, expected_epb,
+                actual - copy, actual_epb);
+      }
+      break;
+    }
+    if (expected == end) break;
+    expected += 3;
+    actual += 3;
+  }
+  free(copy);
+}
+
+static void CheckScanners(const struct Scanner* scanners, size_t count,
+                          const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < count; i++) CheckScanner(&scanners[i], data, size);
+}
+
+static void CheckEdgeCases(const struct Scanner* scanners, size_t count) {
+  // mburakov: Vector loops handle 16 or 32 positions while looking 2 bytes
+  // ahead, and leave tails shorter than 18 or 34 bytes to the narrower
+  // scanners. Every placement of a start code and of an emulation prevention
+  // byte in buffers a bit longer than two avx2 blocks covers all the block
+  // boundaries and tails.
+  uint8_t data[72];
+  for (size_t size = 0; size <= sizeof(data); size++) {
+    for (size_t epb = 0; epb <= size; epb++) {
+      for (size_t start = 0; start <= size; start++) {
+        memset(data, 0xaa, size);
+        if (epb + 3 <= size) memcpy(data + epb, "\x00\x00\x03", 3);
+        if (start + 3 <= size) memcpy(data + start, "\x00\x00\x01", 3);
+        CheckScanners(scanners, count, data, size);
+      }
+    }
+  }
+}
+
+static void CheckRandom(const struct Scanner* scanners, size_t count) {
+  // mburakov: Bytes are mostly zeroes, ones and threes, so that start codes
+  // and emulation prevention bytes appear often and next to each other.
+  uint8_t data[256];
+  for (size_t round = 0; round < 100000; round++) {
+    size_t size = (size_t)rand() % (sizeof(data) + 1);
+    for (size_t i = 0; i < size; i++) {
+      static const uint8_t kBytes[] = {0, 0, 0, 1, 3, 0xaa};
+      data[i] = kBytes[(size_t)rand() % sizeof(kBytes)];
+    }
+    CheckScanners(scanners, count, data, size);
+  }
+}
+
+struct Reference {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+};
+
+static bool ReferenceReadU(struct Reference* reference, size_t size,
+                           uint64_t* value) {
+  if (reference->offset + size > reference->size * 8) return false;
+  for (*value = 0; size; size--, reference->offset++) {
+    uint8_t byte = reference->data[reference->offset >> 3];
+    *value = *value << 1 | ((byte >> (7 - (reference->offset & 7))) & 1);
+  }
+  return true;
+}
+
+static bool ReferenceReadUE(struct Reference* reference, uint64_t* value) {
+  size_t size = 0;
+  for (;;) {
+    uint64_t bit;
+    if (!ReferenceReadU(reference, 1, &bit)) return false;
+    if (bit) break;
+    if (++size > 31) return false;
+  }
+  if (!ReferenceReadU(reference, size, value)) return false;
+  *value = (*value | (UINT64_C(1) << size)) - 1;
+  return true;
+}
+
+enum BitReaderOp {
+  kReadU,
+  kReadUE,
+  kReadSE,
+  kByteAlign,
+};
+
+static bool RunReference(struct Reference* reference, enum BitReaderOp op,
+                         size_t size, uint64_t* value) {
+  switch (op) {
+    case kReadU:
+      return ReferenceReadU(reference, size, value);
+    case kReadUE:
+      return ReferenceReadUE(reference, value);
+    case kReadSE:
+      if (!ReferenceReadUE(reference, value)) return false;
+      *value = *value & 1 ? (*value + 1) / 2 : -(*value / 2);
+      return true;
+    case kByteAlign:
+      if (!ReferenceReadU(reference, -reference->offset & 0x7, value))
+        return false;
+      *value = 0;
+      return true;
+  }
+  abort();
+}
+
+static bool RunBitstream(struct Bitstream* bitstream, enum BitReaderOp op,
+                         size_t size, uint64_t* value) {
+  if (BitstreamReadFailed(bitstream)) return false;
+  switch (op) {
+    case kReadU:
+      *value = BitstreamReadU(bitstream, size);
+      return true;
+    case kReadUE:
+      *value = BitstreamReadUE(bitstream);
+      return true;
+    case kReadSE:
+      *value = (uint64_t)BitstreamReadSE(bitstream);
+      return true;
+    case kByteAlign:
+      BitstreamByteAlign(bitstream);
+      *value = 0;
+      return true;
+  }
+  abort();
+}
+
+static void CheckBitReader(const uint8_t* data, size_t size) {
+  static const char* const kOpNames[] = {
+      [kReadU] = "u",
+      [kReadUE] = "ue",
+      [kReadSE] = "se",
+      [kByteAlign] = "align",
+  };
+  uint8_t* copy = malloc(size ? size : 1);
+  if (!copy) abort();
+  memcpy(copy, data, size);
+  struct Bitstream bitstream = BitstreamCreate(copy, size);
+  struct Reference reference = {.data = copy, .size = size};
+  for (;;) {
+    enum BitReaderOp op = (enum BitReaderOp)(rand() % 4);
+    size_t op_size = (size_t)rand() % 65;
+    uint64_t expected = 0;
+    uint64_t actual = 0;
+    bool expected_ok = RunReference(&reference, op, op_size, &expected);
+    bool actual_ok = RunBitstream(&bitstream, op, op_size, &actual);
+    if (expected_ok != actual_ok ||
+        (expected_ok &&
+         (expected != actual || reference.offset != bitstream.offset))) {
+      if (g_failures++ < MAX_REPORTED_FAILURES) {
+        fprintf(stderr,
+                "%s(%zu) at bit %zu of %zu bytes: expected %s %#" PRIx64
+                ", got %s %#" PRIx64 " at bit %zu\n",
+                kOpNames[op], op_size, reference.offset, size,
+                expected_ok ? "ok" : "failure", expected,
+                actual_ok ? "ok" : "failure", actual, bitstream.offset);
+      }
+      break;
+    }
+    // mburakov: Reader state is not defined after a failure.
+    if (!expected_ok) break;
+  }
+  free(copy);
+}
+
+static void CheckBitReaders(void) {
+  // mburakov: Cache is refilled a word at a time until less than a word is
+  // left, and a byte at a time after that. Short buffers and long sequences
+  // of reads make sure both and the switch between these are exercised.
+  // Sparse bits make for longer exp-golomb codes.
+  uint8_t data[40];
+  for (size_t round = 0; round < 1000000; round++) {
+    size_t size = (size_t)rand() % (sizeof(data) + 1);
+    int density = rand() % 4;
+    for (size_t i = 0; i < size; i++) {
+      int byte = rand();
+      for (int j = 0; j < density; j++) byte &= rand();
+      data[i] = (uint8_t)byte;
+    }
+    CheckBitReader(data, size);
+  }
+}
+
+static double Benchmark(const struct Scanner* scanner, const uint8_t* data,
+                        size_t size) {
+  struct timespec before, after;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  size_t epb_count = 0;
+  for (size_t round = 0; round < BENCHMARK_ROUNDS; round++) {
+    const uint8_t* end = data + size;
+    for (const uint8_t* it = scanner->fn(data, end, &epb_count); it != end;)
+      it = scanner->fn(it + 3, end, &epb_count);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  // mburakov: Result is used, so that the loop is not optimized out.
+  g_sink += epb_count;
+  return (double)(after.tv_sec - before.tv_sec) +
+         (double)(after.tv_nsec - before.tv_nsec) / 1e9;
+}
+
+static void BenchmarkScanners(const struct Scanner* scanners, size_t count) {
+  // mburakov: Random bytes with a start code every few kilobytes look like
+  // slice data from the decoder point of view.
+  uint8_t* data = malloc(BENCHMARK_SIZE);
+  if (!data) abort();
+  for (size_t i = 0; i < BENCHMARK_SIZE; i++) data[i] = (uint8_t)rand();
+  for (size_t i = 0; i + 3 <= BENCHMARK_SIZE; i += 4096 + (size_t)rand() % 64)
+    memcpy(data + i, "\x00\x00\x01", 3);
+  double scalar_time = 0;
+  for (size_t i = 0; i < count; i++) {
+    double time = Benchmark(&scanners[i], data, BENCHMARK_SIZE);
+    if (!i) scalar_time = time;
+    printf("%s: %.0f MiB/s, %.2fx scalar\n", scanners[i].name,
+           BENCHMARK_SIZE * BENCHMARK_ROUNDS / time / (1 << 20),
+           scalar_time / time);
+  }
+  free(data);
+}
+
+int main(void) {
+  struct Scanner scanners[3];
+  size_t count = GetScanners(scanners);
+  CheckEdgeCases(scanners, count);
+  CheckRandom(scanners, count);
+  CheckBitReaders();
+  BenchmarkScanners(scanners, count);
+  if (g_failures) {
+    fprintf(stderr, "%zu checks failed\n", g_failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1665 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hevc.h"
+
+#include <setjmp.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "mfxsession_impl.h"
+
+#define LENGTH(x) (sizeof(x) / sizeof *(x))
+
+// mburakov: Features the stub can not decode, i.e. scaling lists or more
+// than one slice per picture, are reported the same way as malformed data,
+// so that the caller could drop it and wait for the next keyframe.
+#define EXPECT(x)                     \
+  do {                                \
+    if (!(x)) longjmp(nalu->trap, 1); \
+  } while (0)
+
+// Table 7-1 – NAL unit type codes and NAL unit type classes
+enum NalUnitType {
+  TRAIL_N = 0,
+  TRAIL_R = 1,
+  RADL_N = 6,
+  RADL_R = 7,
+  RASL_N = 8,
+  RASL_R = 9,
+  BLA_W_LP = 16,
+  BLA_W_RADL = 17,
+  BLA_N_LP = 18,
+  IDR_W_RADL = 19,
+  IDR_N_LP = 20,
+  CRA_NUT = 21,
+  RSV_IRAP_VCL23 = 23,
+  VPS_NUT = 32,
+  SPS_NUT = 33,
+  PPS_NUT = 34,
+  AUD_NUT = 35,
+  PREFIX_SEI_NUT = 39,
+};
+
+// D.2.1 General SEI message syntax
+enum PayloadType {
+  RECOVERY_POINT = 6,
+};
+
+// Table 7-7
+enum SliceType {
+  B = 0,
+  P = 1,
+  I = 2,
+};
+
+static bool IsIrap(enum NalUnitType nal_unit_type) {
+  return BLA_W_LP <= nal_unit_type && nal_unit_type <= RSV_IRAP_VCL23;
+}
+
+static uint64_t CeilLog2(uint64_t x) {
+  return (uint64_t)(32 - __builtin_clz((uint32_t)(x - 1)));
+}
+
+// 7.3.1.2 NAL unit header syntax
+static uint8_t ParseNaluHeader(struct Bitstream* nalu) {
+  EXPECT(BitstreamReadU(nalu, 1) == 0);  // forbidden_zero_bit
+  uint64_t nal_unit_type = BitstreamReadU(nalu, 6);
+  EXPECT(BitstreamReadU(nalu, 6) == 0);  // nuh_layer_id
+  EXPECT(BitstreamReadU(nalu, 3) == 1);  // nuh_temporal_id_plus1
+  return (uint8_t)nal_unit_type;
+}
+
+// 7.3.3 Profile, tier and level syntax
+static void ParseProfileTierLevel(struct Bitstream* nalu,
+                                  uint64_t sps_max_sub_layers_minus1) {
+  // mburakov: Profile itself is irrelevant, decoding capabilities are
+  // checked against the actual chroma format and bit depth instead.
+  EXPECT(BitstreamReadU(nalu, 2) == 0);  // general_profile_space
+  BitstreamReadU(nalu, 1);               // general_tier_flag
+  BitstreamReadU(nalu, 5);               // general_profile_idc
+  BitstreamReadU(nalu, 32);  // general_profile_compatibility_flag
+  BitstreamReadU(nalu, 4);   // general_progressive_source_flag and others
+  BitstreamReadU(nalu, 44);  // general_reserved_zero_43bits and others
+  BitstreamReadU(nalu, 8);   // general_level_idc
+
+  bool sub_layer_profile_present_flag[8];
+  bool sub_layer_level_present_flag[8];
+  for (size_t i = 0; i < sps_max_sub_layers_minus1; i++) {
+    sub_layer_profile_present_flag[i] = !!BitstreamReadU(nalu, 1);
+    sub_layer_level_present_flag[i] = !!BitstreamReadU(nalu, 1);
+  }
+  if (sps_max_sub_layers_minus1 > 0) {
+    for (size_t i = sps_max_sub_layers_minus1; i < 8; i++) {
+      BitstreamReadU(nalu, 2);  // reserved_zero_2bits
+    }
+  }
+  for (size_t i = 0; i < sps_max_sub_layers_minus1; i++) {
+    if (sub_layer_profile_present_flag[i]) {
+      BitstreamReadU(nalu, 8);   // sub_layer_profile_space and others
+      BitstreamReadU(nalu, 32);  // sub_layer_profile_compatibility_flag
+      BitstreamReadU(nalu, 48);  // sub_layer_progressive_source_flag and others
+    }
+    if (sub_layer_level_present_flag[i]) {
+      BitstreamReadU(nalu, 8);  // sub_layer_level_idc
+    }
+  }
+}
+
+// 7.3.7 Short-term reference picture set syntax
+static void ParseStRefPicSet(struct Bitstream* nalu, const struct StRps* sets,
+                             uint64_t num_short_term_ref_pic_sets,
+                             uint64_t stRpsIdx, struct StRps* rps) {
+  bool inter_ref_pic_set_prediction_flag = false;
+  if (stRpsIdx != 0) {
+    inter_ref_pic_set_prediction_flag = !!BitstreamReadU(nalu, 1);
+  }
+  *rps = (struct StRps){0};
+  if (!inter_ref_pic_set_prediction_flag) {
+    uint64_t num_negative_pics = BitstreamReadUE(nalu);
+    uint64_t num_positive_pics = BitstreamReadUE(nalu);
+    if (num_negative_pics > LENGTH(rps->delta_poc_s0) ||
+        num_positive_pics > LENGTH(rps->delta_poc_s1) ||
+        num_negative_pics + num_positive_pics > LENGTH(rps->delta_poc_s0)) {
+      longjmp(nalu->trap, 1);
+    }
+    rps->num_negative_pics = (uint8_t)num_negative_pics;
+    rps->num_positive_pics = (uint8_t)num_positive_pics;
+
+    // (7-63) and (7-65)
+    int32_t delta_poc = 0;
+    for (size_t i = 0; i < num_negative_pics; i++) {
+      uint64_t delta_poc_s0_minus1 = BitstreamReadUE(nalu);
+      delta_poc -= (int32_t)delta_poc_s0_minus1 + 1;
+      rps->delta_poc_s0[i] = (int16_t)delta_poc;
+      rps->used_by_curr_pic_s0[i] = !!BitstreamReadU(nalu, 1);
+    }
+    // (7-64) and (7-66)
+    delta_poc = 0;
+    for (size_t i = 0; i < num_positive_pics; i++) {
+      uint64_t delta_poc_s1_minus1 = BitstreamReadUE(nalu);
+      delta_poc += (int32_t)delta_poc_s1_minus1 + 1;
+      rps->delta_poc_s1[i] = (int16_t)delta_poc;
+      rps->used_by_curr_pic_s1[i] = !!BitstreamReadU(nalu, 1);
+    }
+    return;
+  }
+
+  uint64_t delta_idx_minus1 = 0;
+  if (stRpsIdx == num_short_term_ref_pic_sets) {
+    delta_idx_minus1 = BitstreamReadUE(nalu);
+    if (delta_idx_minus1 >= stRpsIdx) longjmp(nalu->trap, 1);
+  }
+  bool delta_rps_sign = !!BitstreamReadU(nalu, 1);
+  uint64_t abs_delta_rps_minus1 = BitstreamReadUE(nalu);
+  if (abs_delta_rps_minus1 > 0x7fff) longjmp(nalu->trap, 1);
+
+  // (7-59) and (7-60)
+  const struct StRps* ref = &sets[stRpsIdx - (delta_idx_minus1 + 1)];
+  int32_t deltaRps =
+      (1 - 2 * delta_rps_sign) * (int32_t)(abs_delta_rps_minus1 + 1);
+  size_t num_delta_pocs = ref->num_negative_pics + ref->num_positive_pics;
+  bool used_by_curr_pic_flag[LENGTH(ref->delta_poc_s0) + 1];
+  bool use_delta_flag[LENGTH(ref->delta_poc_s0) + 1];
+  for (size_t j = 0; j <= num_delta_pocs; j++) {
+    used_by_curr_pic_flag[j] = !!BitstreamReadU(nalu, 1);
+    use_delta_flag[j] = true;
+    if (!used_by_curr_pic_flag[j])
+      use_delta_flag[j] = !!BitstreamReadU(nalu, 1);
+  }
+
+  // (7-61)
+  size_t i = 0;
+  for (size_t j = ref->num_positive_pics; j; j--) {
+    int32_t dPoc = ref->delta_poc_s1[j - 1] + deltaRps;
+    size_t k = ref->num_negative_pics + j - 1;
+    if (dPoc < 0 && use_delta_flag[k]) {
+      if (i == LENGTH(rps->delta_poc_s0)) longjmp(nalu->trap, 1);
+      rps->delta_poc_s0[i] = (int16_t)dPoc;
+      rps->used_by_curr_pic_s0[i++] = used_by_curr_pic_flag[k];
+    }
+  }
+  if (deltaRps < 0 && use_delta_flag[num_delta_pocs]) {
+    if (i == LENGTH(rps->delta_poc_s0)) longjmp(nalu->trap, 1);
+    rps->delta_poc_s0[i] = (int16_t)deltaRps;
+    rps->used_by_curr_pic_s0[i++] = used_by_curr_pic_flag[num_delta_pocs];
+  }
+  for (size_t j = 0; j < ref->num_negative_pics; j++) {
+    int32_t dPoc = ref->delta_poc_s0[j] + deltaRps;
+    if (dPoc < 0 && use_delta_flag[j]) {
+      if (i == LENGTH(rps->delta_poc_s0)) longjmp(nalu->trap, 1);
+      rps->delta_poc_s0[i] = (int16_t)dPoc;
+      rps->used_by_curr_pic_s0[i++] = used_by_curr_pic_flag[j];
+    }
+  }
+  rps->num_negative_pics = (uint8_t)i;
+
+  // (7-62)
+  i = 0;
+  for (size_t j = ref->num_negative_pics; j; j--) {
+    int32_t dPoc = ref->delta_poc_s0[j - 1] + deltaRps;
+    if (dPoc > 0 && use_delta_flag[j - 1]) {
+      if (i == LENGTH(rps->delta_poc_s1)) longjmp(nalu->trap, 1);
+      rps->delta_poc_s1[i] = (int16_t)dPoc;
+      rps->used_by_curr_pic_s1[i++] = used_by_curr_pic_flag[j - 1];
+    }
+  }
+  if (deltaRps > 0 && use_delta_flag[num_delta_pocs]) {
+    if (i == LENGTH(rps->delta_poc_s1)) longjmp(nalu->trap, 1);
+    rps->delta_poc_s1[i] = (int16_t)deltaRps;
+    rps->used_by_curr_pic_s1[i++] = used_by_curr_pic_flag[num_delta_pocs];
+  }
+  for (size_t j = 0; j < ref->num_positive_pics; j++) {
+    int32_t dPoc = ref->delta_poc_s1[j] + deltaRps;
+    size_t k = ref->num_negative_pics + j;
+    if (dPoc > 0 && use_delta_flag[k]) {
+      if (i == LENGTH(rps->delta_poc_s1)) longjmp(nalu->trap, 1);
+      rps->delta_poc_s1[i] = (int16_t)dPoc;
+      rps->used_by_curr_pic_s1[i++] = used_by_curr_pic_flag[k];
+    }
+  }
+  rps->num_positive_pics = (uint8_t)i;
+  if (rps->num_negative_pics + rps->num_positive_pics >
+      LENGTH(rps->delta_poc_s0)) {
+    longjmp(nalu->trap, 1);
+  }
+}
+
+// E.2.3 Sub-layer HRD parameters syntax
+static void ParseSubLayerHrdParameters(struct Bitstream* nalu,
+                                       uint64_t cpb_cnt_minus1,
+                                       bool sub_pic_hrd_params_present_flag) {
+  for (size_t i = 0; i <= cpb_cnt_minus1; i++) {
+    BitstreamReadUE(nalu);  // bit_rate_value_minus1
+    BitstreamReadUE(nalu);  // cpb_size_value_minus1
+    if (sub_pic_hrd_params_present_flag) {
+      BitstreamReadUE(nalu);  // cpb_size_du_value_minus1
+      BitstreamReadUE(nalu);  // bit_rate_du_value_minus1
+    }
+    BitstreamReadU(nalu, 1);  // cbr_flag
+  }
+}
+
+// E.2.2 HRD parameters syntax
+static void ParseHrdParameters(struct Bitstream* nalu,
+                               uint64_t maxNumSubLayersMinus1) {
+  bool nal_hrd_parameters_present_flag = !!BitstreamReadU(nalu, 1);
+  bool vcl_hrd_parameters_present_flag = !!BitstreamReadU(nalu, 1);
+  bool sub_pic_hrd_params_present_flag = false;
+  if (nal_hrd_parameters_present_flag || vcl_hrd_parameters_present_flag) {
+    sub_pic_hrd_params_present_flag = !!BitstreamReadU(nalu, 1);
+    if (sub_pic_hrd_params_present_flag) {
+      BitstreamReadU(nalu, 8);  // tick_divisor_minus2
+      BitstreamReadU(nalu, 5);  // du_cpb_removal_delay_increment_length_minus1
+      BitstreamReadU(nalu, 1);  // sub_pic_cpb_params_in_pic_timing_sei_flag
+      BitstreamReadU(nalu, 5);  // dpb_output_delay_du_length_minus1
+    }
+    BitstreamReadU(nalu, 4);  // bit_rate_scale
+    BitstreamReadU(nalu, 4);  // cpb_size_scale
+    if (sub_pic_hrd_params_present_flag) {
+      BitstreamReadU(nalu, 4);  // cpb_size_du_scale
+    }
+    BitstreamReadU(nalu, 5);  // initial_cpb_removal_delay_length_minus1
+    BitstreamReadU(nalu, 5);  // au_cpb_removal_delay_length_minus1
+    BitstreamReadU(nalu, 5);  // dpb_output_delay_length_minus1
+  }
+
+  for (size_t i = 0; i <= maxNumSubLayersMinus1; i++) {
+    bool fixed_pic_rate_within_cvs_flag = true;
+    bool fixed_pic_rate_general_flag = !!BitstreamReadU(nalu, 1);
+    if (!fixed_pic_rate_general_flag) {
+      fixed_pic_rate_within_cvs_flag = !!BitstreamReadU(nalu, 1);
+    }
+    bool low_delay_hrd_flag = false;
+    if (fixed_pic_rate_within_cvs_flag) {
+      BitstreamReadUE(nalu);  // elemental_duration_in_tc_minus1
+    } else {
+      low_delay_hrd_flag = !!BitstreamReadU(nalu, 1);
+    }
+    uint64_t cpb_cnt_minus1 = 0;
+    if (!low_delay_hrd_flag) {
+      cpb_cnt_minus1 = BitstreamReadUE(nalu);
+      if (cpb_cnt_minus1 > 31) longjmp(nalu->trap, 1);
+    }
+    if (nal_hrd_parameters_present_flag) {
+      ParseSubLayerHrdParameters(nalu, cpb_cnt_minus1,
+                                 sub_pic_hrd_params_present_flag);
+    }
+    if (vcl_hrd_parameters_present_flag) {
+      ParseSubLayerHrdParameters(nalu, cpb_cnt_minus1,
+                                 sub_pic_hrd_params_present_flag);
+    }
+  }
+}
+
+// E.2.1 VUI parameters syntax
+static void ParseVuiParameters(struct Bitstream* nalu,
+                               uint64_t sps_max_sub_layers_minus1) {
+  bool aspect_ratio_info_present_flag = !!BitstreamReadU(nalu, 1);
+  if (aspect_ratio_info_present_flag) {
+    // Table E.1 – Interpretation of sample aspect ratio indicator
+    uint64_t aspect_ratio_idc = BitstreamReadU(nalu, 8);
+    if (aspect_ratio_idc == 255) {
+      BitstreamReadU(nalu, 16);  // sar_width
+      BitstreamReadU(nalu, 16);  // sar_height
+    }
+  }
+  bool overscan_info_present_flag = !!BitstreamReadU(nalu, 1);
+  if (overscan_info_present_flag) {
+    BitstreamReadU(nalu, 1);  // overscan_appropriate_flag
+  }
+
+  // mburakov: Colorspace is not signaled to the compositor anyway, so the
+  // video signal type is skipped regardless of what it says.
+  bool video_signal_type_present_flag = !!BitstreamReadU(nalu, 1);
+  if (video_signal_type_present_flag) {
+    BitstreamReadU(nalu, 3);  // video_format
+    BitstreamReadU(nalu, 1);  // video_full_range_flag
+    bool colour_description_present_flag = !!BitstreamReadU(nalu, 1);
+    if (colour_description_present_flag) {
+      BitstreamReadU(nalu, 8);  // colour_primaries
+      BitstreamReadU(nalu, 8);  // transfer_characteristics
+      BitstreamReadU(nalu, 8);  // matrix_coeffs
+    }
+  }
+  bool chroma_loc_info_present_flag = !!BitstreamReadU(nalu, 1);
+  if (chroma_loc_info_present_flag) {
+    BitstreamReadUE(nalu);  // chroma_sample_loc_type_top_field
+    BitstreamReadUE(nalu);  // chroma_sample_loc_type_bottom_field
+  }
+
+  BitstreamReadU(nalu, 1);               // neutral_chroma_indication_flag
+  EXPECT(BitstreamReadU(nalu, 1) == 0);  // field_seq_flag
+  BitstreamReadU(nalu, 1);               // frame_field_info_present_flag
+
+  // mburakov: Default display window is only a suggestion on top of the
+  // conformance window, and decoders are not required to honor it, see E.3.1.
+  bool default_display_window_flag = !!BitstreamReadU(nalu, 1);
+  if (default_display_window_flag) {
+    BitstreamReadUE(nalu);  // def_disp_win_left_offset
+    BitstreamReadUE(nalu);  // def_disp_win_right_offset
+    BitstreamReadUE(nalu);  // def_disp_win_top_offset
+    BitstreamReadUE(nalu);  // def_disp_win_bottom_offset
+  }
+
+  bool vui_timing_info_present_flag = !!BitstreamReadU(nalu, 1);
+  if (vui_timing_info_present_flag) {
+    BitstreamReadU(nalu, 32);  // vui_num_units_in_tick
+    BitstreamReadU(nalu, 32);  // vui_time_scale
+    bool vui_poc_proportional_to_timing_flag = !!BitstreamReadU(nalu, 1);
+    if (vui_poc_proportional_to_timing_flag) {
+      BitstreamReadUE(nalu);  // vui_num_ticks_poc_diff_one_minus1
+    }
+    bool vui_hrd_parameters_present_flag = !!BitstreamReadU(nalu, 1);
+    if (vui_hrd_parameters_present_flag) {
+      ParseHrdParameters(nalu, sps_max_sub_layers_minus1);
+    }
+  }
+
+  bool bitstream_restriction_flag = !!BitstreamReadU(nalu, 1);
+  if (bitstream_restriction_flag) {
+    BitstreamReadU(nalu, 1);  // tiles_fixed_structure_flag
+    BitstreamReadU(nalu, 1);  // motion_vectors_over_pic_boundaries_flag
+    BitstreamReadU(nalu, 1);  // restricted_ref_pic_lists_flag
+    BitstreamReadUE(nalu);    // min_spatial_segmentation_idc
+    BitstreamReadUE(nalu);    // max_bytes_per_pic_denom
+    BitstreamReadUE(nalu);    // max_bits_per_min_cu_denom
+    BitstreamReadUE(nalu);    // log2_max_mv_length_horizontal
+    BitstreamReadUE(nalu);    // log2_max_mv_length_vertical
+  }
+}
+
+// 7.3.2.2.1 General sequence parameter set RBSP syntax
+static uint8_t ParseSps(struct Bitstream* nalu, struct Sps* sps) {
+  BitstreamReadU(nalu, 4);  // sps_video_parameter_set_id
+  uint64_t sps_max_sub_layers_minus1 = BitstreamReadU(nalu, 3);
+  if (sps_max_sub_layers_minus1 > 6) longjmp(nalu->trap, 1);
+  BitstreamReadU(nalu, 1);  // sps_temporal_id_nesting_flag
+  ParseProfileTierLevel(nalu, sps_max_sub_layers_minus1);
+  uint64_t sps_seq_parameter_set_id = BitstreamReadUE(nalu);
+  if (sps_seq_parameter_set_id >= MFX_STUB_MAX_SPS) longjmp(nalu->trap, 1);
+
+  sps->ppb.pic_fields.bits.chroma_format_idc =
+      (uint32_t)BitstreamReadUE(nalu);
+  EXPECT(sps->ppb.pic_fields.bits.chroma_format_idc == 1);
+  sps->ppb.pic_width_in_luma_samples = (uint16_t)BitstreamReadUE(nalu);
+  sps->ppb.pic_height_in_luma_samples = (uint16_t)BitstreamReadUE(nalu);
+  bool conformance_window_flag = !!BitstreamReadU(nalu, 1);
+  if (conformance_window_flag) {
+    // 7.4.3.2.1: Offsets are in units of SubWidthC and SubHeightC, that are
+    // both 2 for 4:2:0. Crop rectangle is an origin followed by a size.
+    uint64_t conf_win_left_offset = BitstreamReadUE(nalu) * 2;
+    uint64_t conf_win_right_offset = BitstreamReadUE(nalu) * 2;
+    uint64_t conf_win_top_offset = BitstreamReadUE(nalu) * 2;
+    uint64_t conf_win_bottom_offset = BitstreamReadUE(nalu) * 2;
+    if (conf_win_left_offset + conf_win_right_offset >=
+            sps->ppb.pic_width_in_luma_samples ||
+        conf_win_top_offset + conf_win_bottom_offset >=
+            sps->ppb.pic_height_in_luma_samples) {
+      longjmp(nalu->trap, 1);
+    }
+    sps->crop_rect[0] = (mfxU16)conf_win_left_offset;
+    sps->crop_rect[1] = (mfxU16)conf_win_top_offset;
+    sps->crop_rect[2] =
+        (mfxU16)(sps->ppb.pic_width_in_luma_samples - conf_win_left_offset -
+                 conf_win_right_offset);
+    sps->crop_rect[3] =
+        (mfxU16)(sps->ppb.pic_height_in_luma_samples - conf_win_top_offset -
+                 conf_win_bottom_offset);
+  } else {
+    sps->crop_rect[2] = sps->ppb.pic_width_in_luma_samples;
+    sps->crop_rect[3] = sps->ppb.pic_height_in_luma_samples;
+  }
+
+  // mburakov: Decoded surfaces are NV12, so only 8-bit 4:2:0 is supported.
+  sps->ppb.bit_depth_luma_minus8 = (uint8_t)BitstreamReadUE(nalu);
+  EXPECT(sps->ppb.bit_depth_luma_minus8 == 0);
+  sps->ppb.bit_depth_chroma_minus8 = (uint8_t)BitstreamReadUE(nalu);
+  EXPECT(sps->ppb.bit_depth_chroma_minus8 == 0);
+  sps->ppb.log2_max_pic_order_cnt_lsb_minus4 =
+      (uint8_t)BitstreamReadUE(nalu);
+  if (sps->ppb.log2_max_pic_order_cnt_lsb_minus4 > 12) longjmp(nalu->trap, 1);
+
+  // mburakov: Only the highest sub-layer is ever decoded, so the values of
+  // the lower ones are irrelevant.
+  bool sps_sub_layer_ordering_info_present_flag = !!BitstreamReadU(nalu, 1);
+  for (uint64_t i = sps_sub_layer_ordering_info_present_flag
+                        ? 0
+                        : sps_max_sub_layers_minus1;
+       i <= sps_max_sub_layers_minus1; i++) {
+    sps->ppb.sps_max_dec_pic_buffering_minus1 =
+        (uint8_t)BitstreamReadUE(nalu);
+    if (sps->ppb.sps_max_dec_pic_buffering_minus1 >=
+        LENGTH(sps->ppb.ReferenceFrames)) {
+      longjmp(nalu->trap, 1);
+    }
+    // mburakov: Pictures are output in decoding order, that is correct only
+    // as long as there is nothing to reorder.
+    EXPECT(BitstreamReadUE(nalu) == 0);  // sps_max_num_reorder_pics
+    BitstreamReadUE(nalu);               // sps_max_latency_increase_plus1
+  }
+
+  sps->ppb.log2_min_luma_coding_block_size_minus3 =
+      (uint8_t)BitstreamReadUE(nalu);
+  sps->ppb.log2_diff_max_min_luma_coding_block_size =
+      (uint8_t)BitstreamReadUE(nalu);
+  sps->ppb.log2_min_transform_block_size_minus2 =
+      (uint8_t)BitstreamReadUE(nalu);
+  sps->ppb.log2_diff_max_min_transform_block_size =
+      (uint8_t)BitstreamReadUE(nalu);
+  sps->ppb.max_transform_hierarchy_depth_inter =
+      (uint8_t)BitstreamReadUE(nalu);
+  sps->ppb.max_transform_hierarchy_depth_intra =
+      (uint8_t)BitstreamReadUE(nalu);
+  // mburakov: Scaling lists would have to be submitted in a separate
+  // inverse quantization matrix buffer, that the stub does not bother with.
+  sps->ppb.pic_fields.bits.scaling_list_enabled_flag =
+      (uint8_t)BitstreamReadU(nalu, 1);
+  EXPECT(sps->ppb.pic_fields.bits.scaling_list_enabled_flag == 0);
+
+  sps->ppb.pic_fields.bits.amp_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  sps->ppb.slice_parsing_fields.bits.sample_adaptive_offset_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  sps->ppb.pic_fields.bits.pcm_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  if (sps->ppb.pic_fields.bits.pcm_enabled_flag) {
+    sps->ppb.pcm_sample_bit_depth_luma_minus1 =
+        (uint8_t)BitstreamReadU(nalu, 4);
+    sps->ppb.pcm_sample_bit_depth_chroma_minus1 =
+        (uint8_t)BitstreamReadU(nalu, 4);
+    sps->ppb.log2_min_pcm_luma_coding_block_size_minus3 =
+        (uint8_t)BitstreamReadUE(nalu);
+    sps->ppb.log2_diff_max_min_pcm_luma_coding_block_size =
+        (uint8_t)BitstreamReadUE(nalu);
+    sps->ppb.pic_fields.bits.pcm_loop_filter_disabled_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+  } else {
+    // vvv weird vvv
+    sps->ppb.pcm_sample_bit_depth_luma_minus1 =
+        (uint8_t)((1 << (sps->ppb.bit_depth_luma_minus8 + 8)) - 1);
+    sps->ppb.pcm_sample_bit_depth_chroma_minus1 =
+        (uint8_t)((1 << (sps->ppb.bit_depth_chroma_minus8 + 8)) - 1);
+    sps->ppb.log2_min_pcm_luma_coding_block_size_minus3 = 253;
+    // ^^^ weird ^^^
+  }
+
+  uint64_t num_short_term_ref_pic_sets = BitstreamReadUE(nalu);
+  if (num_short_term_ref_pic_sets > LENGTH(sps->st_rps)) {
+    longjmp(nalu->trap, 1);
+  }
+  sps->ppb.num_short_term_ref_pic_sets = (uint8_t)num_short_term_ref_pic_sets;
+  for (uint8_t i = 0; i < sps->ppb.num_short_term_ref_pic_sets; i++) {
+    ParseStRefPicSet(nalu, sps->st_rps, num_short_term_ref_pic_sets, i,
+                     &sps->st_rps[i]);
+  }
+
+  sps->ppb.slice_parsing_fields.bits.long_term_ref_pics_present_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  if (sps->ppb.slice_parsing_fields.bits.long_term_ref_pics_present_flag) {
+    uint64_t num_long_term_ref_pics_sps = BitstreamReadUE(nalu);
+    if (num_long_term_ref_pics_sps > LENGTH(sps->lt_ref_pic_poc_lsb_sps)) {
+      longjmp(nalu->trap, 1);
+    }
+    sps->ppb.num_long_term_ref_pic_sps = (uint8_t)num_long_term_ref_pics_sps;
+    for (uint8_t i = 0; i < sps->ppb.num_long_term_ref_pic_sps; i++) {
+      sps->lt_ref_pic_poc_lsb_sps[i] = (uint16_t)BitstreamReadU(
+          nalu, sps->ppb.log2_max_pic_order_cnt_lsb_minus4 + 4u);
+      sps->used_by_curr_pic_lt_sps_flag[i] = !!BitstreamReadU(nalu, 1);
+    }
+  }
+
+  sps->ppb.slice_parsing_fields.bits.sps_temporal_mvp_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  sps->ppb.pic_fields.bits.strong_intra_smoothing_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  bool vui_parameters_present_flag = !!BitstreamReadU(nalu, 1);
+  if (vui_parameters_present_flag) {
+    ParseVuiParameters(nalu, sps_max_sub_layers_minus1);
+  }
+
+  // mburakov: Extensions change the decoding process, except for those not
+  // specified yet, which decoders shall ignore.
+  bool sps_extension_present_flag = !!BitstreamReadU(nalu, 1);
+  if (sps_extension_present_flag) {
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // sps_range_extension_flag
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // sps_multilayer_extension_flag
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // sps_3d_extension_flag
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // sps_scc_extension_flag
+    BitstreamReadU(nalu, 4);               // sps_extension_4bits
+  }
+  return (uint8_t)sps_seq_parameter_set_id;
+}
+
+// 7.3.2.3.1 General picture parameter set RBSP syntax
+static uint8_t ParsePps(struct Bitstream* nalu, struct Pps* pps) {
+  uint64_t pps_pic_parameter_set_id = BitstreamReadUE(nalu);
+  if (pps_pic_parameter_set_id >= MFX_STUB_MAX_PPS) longjmp(nalu->trap, 1);
+  uint64_t pps_seq_parameter_set_id = BitstreamReadUE(nalu);
+  if (pps_seq_parameter_set_id >= MFX_STUB_MAX_SPS) longjmp(nalu->trap, 1);
+  pps->sps_id = (uint8_t)pps_seq_parameter_set_id;
+
+  pps->ppb.slice_parsing_fields.bits.dependent_slice_segments_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.slice_parsing_fields.bits.output_flag_present_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.num_extra_slice_header_bits = (uint8_t)BitstreamReadU(nalu, 3);
+
+  pps->ppb.pic_fields.bits.sign_data_hiding_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.slice_parsing_fields.bits.cabac_init_present_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.num_ref_idx_l0_default_active_minus1 =
+      (uint8_t)BitstreamReadUE(nalu);
+  pps->ppb.num_ref_idx_l1_default_active_minus1 =
+      (uint8_t)BitstreamReadUE(nalu);
+  pps->ppb.init_qp_minus26 = (int8_t)BitstreamReadSE(nalu);
+  pps->ppb.pic_fields.bits.constrained_intra_pred_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.pic_fields.bits.transform_skip_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.pic_fields.bits.cu_qp_delta_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  if (pps->ppb.pic_fields.bits.cu_qp_delta_enabled_flag) {
+    pps->ppb.diff_cu_qp_delta_depth = (uint8_t)BitstreamReadUE(nalu);
+  }
+
+  pps->ppb.pps_cb_qp_offset = (int8_t)BitstreamReadSE(nalu);
+  pps->ppb.pps_cr_qp_offset = (int8_t)BitstreamReadSE(nalu);
+  pps->ppb.slice_parsing_fields.bits
+      .pps_slice_chroma_qp_offsets_present_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+
+  pps->ppb.pic_fields.bits.weighted_pred_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.pic_fields.bits.weighted_bipred_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+
+  pps->ppb.pic_fields.bits.transquant_bypass_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.pic_fields.bits.tiles_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.pic_fields.bits.entropy_coding_sync_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  if (pps->ppb.pic_fields.bits.tiles_enabled_flag) {
+    // mburakov: Sizes of uniformly spaced tiles depend on the picture size,
+    // so those are derived only once the sequence parameter set is known.
+    uint64_t num_tile_columns_minus1 = BitstreamReadUE(nalu);
+    uint64_t num_tile_rows_minus1 = BitstreamReadUE(nalu);
+    if (num_tile_columns_minus1 >= LENGTH(pps->ppb.column_width_minus1) ||
+        num_tile_rows_minus1 >= LENGTH(pps->ppb.row_height_minus1)) {
+      longjmp(nalu->trap, 1);
+    }
+    pps->ppb.num_tile_columns_minus1 = (uint8_t)num_tile_columns_minus1;
+    pps->ppb.num_tile_rows_minus1 = (uint8_t)num_tile_rows_minus1;
+    pps->uniform_spacing_flag = !!BitstreamReadU(nalu, 1);
+    if (!pps->uniform_spacing_flag) {
+      for (size_t i = 0; i < num_tile_columns_minus1; i++) {
+        pps->ppb.column_width_minus1[i] = (uint16_t)BitstreamReadUE(nalu);
+      }
+      for (size_t i = 0; i < num_tile_rows_minus1; i++) {
+        pps->ppb.row_height_minus1[i] = (uint16_t)BitstreamReadUE(nalu);
+      }
+    }
+    pps->ppb.pic_fields.bits.loop_filter_across_tiles_enabled_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+  } else {
+    // vvv weird vvv
+    pps->ppb.pic_fields.bits.loop_filter_across_tiles_enabled_flag = 1;
+    // ^^^ weird ^^^
+  }
+
+  pps->ppb.pic_fields.bits.pps_loop_filter_across_slices_enabled_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  bool deblocking_filter_control_present_flag = !!BitstreamReadU(nalu, 1);
+  if (deblocking_filter_control_present_flag) {
+    pps->ppb.slice_parsing_fields.bits
+        .deblocking_filter_override_enabled_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+    pps->ppb.slice_parsing_fields.bits.pps_disable_deblocking_filter_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+    if (!pps->ppb.slice_parsing_fields.bits
+             .pps_disable_deblocking_filter_flag) {
+      pps->ppb.pps_beta_offset_div2 = (int8_t)BitstreamReadSE(nalu);
+      pps->ppb.pps_tc_offset_div2 = (int8_t)BitstreamReadSE(nalu);
+    }
+  }
+
+  EXPECT(BitstreamReadU(nalu, 1) == 0);  // pps_scaling_list_data_present_flag
+  pps->ppb.slice_parsing_fields.bits.lists_modification_present_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+  pps->ppb.log2_parallel_merge_level_minus2 =
+      (uint8_t)BitstreamReadUE(nalu);
+  pps->ppb.slice_parsing_fields.bits
+      .slice_segment_header_extension_present_flag =
+      (uint32_t)BitstreamReadU(nalu, 1);
+
+  bool pps_extension_present_flag = !!BitstreamReadU(nalu, 1);
+  if (pps_extension_present_flag) {
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // pps_range_extension_flag
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // pps_multilayer_extension_flag
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // pps_3d_extension_flag
+    EXPECT(BitstreamReadU(nalu, 1) == 0);  // pps_scc_extension_flag
+    BitstreamReadU(nalu, 4);               // pps_extension_4bits
+  }
+  return (uint8_t)pps_pic_parameter_set_id;
+}
+
+static uint64_t HashNalu(const struct BitstreamNalu* nalu) {
+  // mburakov: FNV-1a is plenty to tell a repeated parameter set from a new
+  // one, and it is way cheaper than unescaping and parsing it again.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < nalu->size; i++)
+    hash = (hash ^ nalu->data[i]) * 0x100000001b3ull;
+  return hash;
+}
+
+static bool IsCached(const struct ParameterSet* set, uint64_t hash,
+                     size_t size) {
+  return set->valid && set->hash == hash && set->size == size;
+}
+
+static bool HandleParameterSet(mfxSession session,
+                               const struct BitstreamNalu* nalu,
+                               uint8_t nal_unit_type) {
+  uint64_t hash = HashNalu(nalu);
+  if (nal_unit_type == SPS_NUT) {
+    for (size_t i = 0; i < LENGTH(session->sps); i++) {
+      if (IsCached(&session->sps[i].set, hash, nalu->size)) return true;
+    }
+  } else {
+    for (size_t i = 0; i < LENGTH(session->pps); i++) {
+      if (IsCached(&session->pps[i].set, hash, nalu->size)) return true;
+    }
+  }
+
+  uint8_t rbsp[BITSTREAM_RBSP_SIZE];
+  struct Bitstream bitstream = BitstreamCreate(
+      rbsp, BitstreamUnescape(nalu->data, nalu->size, rbsp, sizeof(rbsp)));
+  if (BitstreamReadFailed(&bitstream)) {
+    return false;
+  }
+  ParseNaluHeader(&bitstream);
+  struct ParameterSet set = {.valid = true, .hash = hash, .size = nalu->size};
+  if (nal_unit_type == SPS_NUT) {
+    struct Sps sps = {.set = set};
+    uint8_t id = ParseSps(&bitstream, &sps);
+    session->sps[id] = sps;
+  } else {
+    struct Pps pps = {.set = set};
+    uint8_t id = ParsePps(&bitstream, &pps);
+    session->pps[id] = pps;
+  }
+  return true;
+}
+
+// (6-3) and (6-4)
+static bool DeriveTileSizes(bool uniform_spacing_flag, uint32_t size_in_ctbs,
+                            uint32_t count, const uint16_t* explicit_sizes,
+                            uint16_t* sizes_minus1) {
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t size;
+    if (uniform_spacing_flag) {
+      size = ((i + 1) * size_in_ctbs) / count - (i * size_in_ctbs) / count;
+    } else if (i < count - 1) {
+      size = explicit_sizes[i] + 1u;
+    } else {
+      size = total < size_in_ctbs ? size_in_ctbs - total : 0;
+    }
+    if (!size) return false;
+    sizes_minus1[i] = (uint16_t)(size - 1);
+    total += size;
+  }
+  return total == size_in_ctbs;
+}
+
+static bool ActivateParameterSets(mfxSession session, uint64_t pps_id) {
+  if (pps_id >= LENGTH(session->pps) || !session->pps[pps_id].set.valid)
+    return false;
+  const struct Pps* pps = &session->pps[pps_id];
+  const struct Sps* sps = &session->sps[pps->sps_id];
+  if (!sps->set.valid) return false;
+  if (session->context_id != VA_INVALID_ID &&
+      (sps->ppb.pic_width_in_luma_samples > session->context_width ||
+       sps->ppb.pic_height_in_luma_samples > session->context_height)) {
+    // mburakov: Surfaces and context were created for smaller pictures.
+    return false;
+  }
+  if (session->slots && sps->ppb.sps_max_dec_pic_buffering_minus1 + 3u >
+                            session->slots_count) {
+    // mburakov: Not enough surfaces for the decoded picture buffer.
+    return false;
+  }
+
+  // mburakov: Sequence and picture parameter sets fill disjoint portions of
+  // the picture parameter buffer, so merging them is trivial.
+  session->ppb = sps->ppb;
+  session->ppb.pic_fields.value |= pps->ppb.pic_fields.value;
+  session->ppb.slice_parsing_fields.value |=
+      pps->ppb.slice_parsing_fields.value;
+  session->ppb.num_extra_slice_header_bits =
+      pps->ppb.num_extra_slice_header_bits;
+  session->ppb.num_ref_idx_l0_default_active_minus1 =
+      pps->ppb.num_ref_idx_l0_default_active_minus1;
+  session->ppb.num_ref_idx_l1_default_active_minus1 =
+      pps->ppb.num_ref_idx_l1_default_active_minus1;
+  session->ppb.init_qp_minus26 = pps->ppb.init_qp_minus26;
+  session->ppb.pps_cb_qp_offset = pps->ppb.pps_cb_qp_offset;
+  session->ppb.pps_cr_qp_offset = pps->ppb.pps_cr_qp_offset;
+  session->ppb.pps_beta_offset_div2 = pps->ppb.pps_beta_offset_div2;
+  session->ppb.pps_tc_offset_div2 = pps->ppb.pps_tc_offset_div2;
+  session->ppb.log2_parallel_merge_level_minus2 =
+      pps->ppb.log2_parallel_merge_level_minus2;
+  session->ppb.diff_cu_qp_delta_depth = pps->ppb.diff_cu_qp_delta_depth;
+  if (pps->ppb.pic_fields.bits.tiles_enabled_flag) {
+    // (7-10) to (7-17)
+    uint32_t CtbLog2SizeY = sps->ppb.log2_min_luma_coding_block_size_minus3 +
+                            3u +
+                            sps->ppb.log2_diff_max_min_luma_coding_block_size;
+    uint32_t CtbSizeY = 1u << CtbLog2SizeY;
+    uint32_t PicWidthInCtbsY =
+        (sps->ppb.pic_width_in_luma_samples + CtbSizeY - 1) >> CtbLog2SizeY;
+    uint32_t PicHeightInCtbsY =
+        (sps->ppb.pic_height_in_luma_samples + CtbSizeY - 1) >> CtbLog2SizeY;
+    session->ppb.num_tile_columns_minus1 = pps->ppb.num_tile_columns_minus1;
+    session->ppb.num_tile_rows_minus1 = pps->ppb.num_tile_rows_minus1;
+    if (!DeriveTileSizes(pps->uniform_spacing_flag, PicWidthInCtbsY,
+                         pps->ppb.num_tile_columns_minus1 + 1u,
+                         pps->ppb.column_width_minus1,
+                         session->ppb.column_width_minus1) ||
+        !DeriveTileSizes(pps->uniform_spacing_flag, PicHeightInCtbsY,
+                         pps->ppb.num_tile_rows_minus1 + 1u,
+                         pps->ppb.row_height_minus1,
+                         session->ppb.row_height_minus1)) {
+      return false;
+    }
+  }
+  memcpy(session->crop_rect, sps->crop_rect, sizeof(session->crop_rect));
+  session->active_sps = sps;
+  return true;
+}
+
+// 7.3.5 Supplemental enhancement information message syntax
+static void ParseSei(struct Bitstream* nalu, mfxSession session) {
+  // mburakov: more_rbsp_data() is true while there is anything besides the
+  // rbsp_trailing_bits left.
+  while (nalu->size * 8 - nalu->offset > 8) {
+    uint64_t payloadType = 0;
+    for (uint64_t byte = 0xff; byte == 0xff; payloadType += byte)
+      byte = BitstreamReadU(nalu, 8);
+    uint64_t payloadSize = 0;
+    for (uint64_t byte = 0xff; byte == 0xff; payloadSize += byte)
+      byte = BitstreamReadU(nalu, 8);
+    size_t payload_end = nalu->offset + payloadSize * 8;
+
+    if (payloadType == RECOVERY_POINT) {
+      // D.2.8 Recovery point SEI message syntax
+      session->recovery_poc_cnt = (int32_t)BitstreamReadSE(nalu);
+      session->recovery_poc_cnt_present = true;
+      BitstreamReadU(nalu, 1);  // exact_match_flag
+      BitstreamReadU(nalu, 1);  // broken_link_flag
+    }
+    while (nalu->offset < payload_end) {
+      size_t size = payload_end - nalu->offset;
+      BitstreamReadU(nalu, size < 32 ? size : 32);
+    }
+  }
+}
+
+static void HandleSei(mfxSession session, const struct BitstreamNalu* nalu) {
+  uint8_t rbsp[BITSTREAM_RBSP_SIZE];
+  struct Bitstream bitstream = BitstreamCreate(
+      rbsp, BitstreamUnescape(nalu->data, nalu->size, rbsp, sizeof(rbsp)));
+  // mburakov: Anything unexpected in SEI is ignored, including messages that
+  // do not fit into the scratch buffer. Such messages are never the ones
+  // that matter here.
+  if (BitstreamReadFailed(&bitstream)) return;
+  ParseNaluHeader(&bitstream);
+  ParseSei(&bitstream, session);
+}
+
+static void AppendRpsEntry(struct Bitstream* nalu, mfxSession session,
+                           enum RpsList list, int32_t poc, bool lsb_only) {
+  if (session->rps_count == LENGTH(session->rps)) longjmp(nalu->trap, 1);
+  session->rps[session->rps_count++] = (struct RpsEntry){
+      .list = list,
+      .poc = poc,
+      .lsb_only = lsb_only,
+  };
+}
+
+// 8.3.1 Decoding process for picture order count
+static int32_t DerivePicOrderCnt(mfxSession session,
+                                 enum NalUnitType nal_unit_type,
+                                 int32_t slice_pic_order_cnt_lsb) {
+  if (IsIrap(nal_unit_type) && session->no_rasl_output)
+    return slice_pic_order_cnt_lsb;
+  int32_t MaxPicOrderCntLsb =
+      1 << (session->ppb.log2_max_pic_order_cnt_lsb_minus4 + 4);
+  int32_t prevPicOrderCntLsb = session->prev_tid0_poc & (MaxPicOrderCntLsb - 1);
+  int32_t prevPicOrderCntMsb = session->prev_tid0_poc - prevPicOrderCntLsb;
+  int32_t PicOrderCntMsb = prevPicOrderCntMsb;
+  if (slice_pic_order_cnt_lsb < prevPicOrderCntLsb &&
+      prevPicOrderCntLsb - slice_pic_order_cnt_lsb >= MaxPicOrderCntLsb / 2) {
+    PicOrderCntMsb = prevPicOrderCntMsb + MaxPicOrderCntLsb;
+  } else if (slice_pic_order_cnt_lsb > prevPicOrderCntLsb &&
+             slice_pic_order_cnt_lsb - prevPicOrderCntLsb >
+                 MaxPicOrderCntLsb / 2) {
+    PicOrderCntMsb = prevPicOrderCntMsb - MaxPicOrderCntLsb;
+  }
+  return PicOrderCntMsb + slice_pic_order_cnt_lsb;
+}
+
+// 7.3.6.2 Reference picture list modification syntax
+static void ParseRefPicListsModification(struct Bitstream* nalu,
+                                         mfxSession session) {
+  // (7-55)
+  uint64_t NumPicTotalCurr = 0;
+  for (size_t i = 0; i < session->rps_count; i++) {
+    if (session->rps[i].list == RPS_ST_CURR_BEFORE ||
+        session->rps[i].list == RPS_ST_CURR_AFTER ||
+        session->rps[i].list == RPS_LT_CURR) {
+      NumPicTotalCurr++;
+    }
+  }
+  if (NumPicTotalCurr <= 1) return;
+
+  uint8_t num_ref_idx_active_minus1[] = {
+      session->spb.num_ref_idx_l0_active_minus1,
+      session->spb.num_ref_idx_l1_active_minus1,
+  };
+  size_t list_entry_length = (size_t)CeilLog2(NumPicTotalCurr);
+  uint32_t slice_type = session->spb.LongSliceFlags.fields.slice_type;
+  for (size_t l = 0; l < (slice_type == B ? 2u : 1u); l++) {
+    session->ref_pic_list_modification_flag[l] = !!BitstreamReadU(nalu, 1);
+    if (!session->ref_pic_list_modification_flag[l]) continue;
+    for (size_t i = 0; i <= num_ref_idx_active_minus1[l]; i++) {
+      uint64_t list_entry = BitstreamReadU(nalu, list_entry_length);
+      if (list_entry >= NumPicTotalCurr) longjmp(nalu->trap, 1);
+      session->list_entry[l][i] = (uint8_t)list_entry;
+    }
+  }
+}
+
+static void ParsePredWeights(struct Bitstream* nalu, size_t count,
+                             int32_t ChromaLog2WeightDenom,
+                             int8_t* delta_luma_weight, int8_t* luma_offset,
+                             int8_t (*delta_chroma_weight)[2],
+                             int8_t (*ChromaOffset)[2]) {
+  bool luma_weight_flag[15];
+  bool chroma_weight_flag[15];
+  for (size_t i = 0; i < count; i++)
+    luma_weight_flag[i] = !!BitstreamReadU(nalu, 1);
+  for (size_t i = 0; i < count; i++)
+    chroma_weight_flag[i] = !!BitstreamReadU(nalu, 1);
+  for (size_t i = 0; i < count; i++) {
+    if (luma_weight_flag[i]) {
+      delta_luma_weight[i] = (int8_t)BitstreamReadSE(nalu);
+      luma_offset[i] = (int8_t)BitstreamReadSE(nalu);
+    }
+    if (!chroma_weight_flag[i]) continue;
+    for (size_t j = 0; j < 2; j++) {
+      delta_chroma_weight[i][j] = (int8_t)BitstreamReadSE(nalu);
+      int32_t delta_chroma_offset = (int32_t)BitstreamReadSE(nalu);
+
+      // (7-56), with wpOffsetHalfRangeC of 8-bit chroma
+      int32_t wpOffsetHalfRangeC = 1 << 7;
+      int32_t ChromaWeight =
+          (1 << ChromaLog2WeightDenom) + delta_chroma_weight[i][j];
+      int32_t offset =
+          wpOffsetHalfRangeC + delta_chroma_offset -
+          ((wpOffsetHalfRangeC * ChromaWeight) >> ChromaLog2WeightDenom);
+      if (offset < -wpOffsetHalfRangeC) offset = -wpOffsetHalfRangeC;
+      if (offset > wpOffsetHalfRangeC - 1) offset = wpOffsetHalfRangeC - 1;
+      ChromaOffset[i][j] = (int8_t)offset;
+    }
+  }
+}
+
+// 7.3.6.3 Weighted prediction parameters syntax
+static void ParsePredWeightTable(struct Bitstream* nalu, mfxSession session) {
+  uint64_t luma_log2_weight_denom = BitstreamReadUE(nalu);
+  if (luma_log2_weight_denom > 7) longjmp(nalu->trap, 1);
+  int64_t delta_chroma_log2_weight_denom = BitstreamReadSE(nalu);
+  int64_t ChromaLog2WeightDenom =
+      (int64_t)luma_log2_weight_denom + delta_chroma_log2_weight_denom;
+  if (ChromaLog2WeightDenom < 0 || ChromaLog2WeightDenom > 7)
+    longjmp(nalu->trap, 1);
+  session->spb.luma_log2_weight_denom = (uint8_t)luma_log2_weight_denom;
+  session->spb.delta_chroma_log2_weight_denom =
+      (int8_t)delta_chroma_log2_weight_denom;
+
+  ParsePredWeights(nalu, session->spb.num_ref_idx_l0_active_minus1 + 1u,
+                   (int32_t)ChromaLog2WeightDenom,
+                   session->spb.delta_luma_weight_l0,
+                   session->spb.luma_offset_l0,
+                   session->spb.delta_chroma_weight_l0,
+                   session->spb.ChromaOffsetL0);
+  if (session->spb.LongSliceFlags.fields.slice_type == B) {
+    ParsePredWeights(nalu, session->spb.num_ref_idx_l1_active_minus1 + 1u,
+                     (int32_t)ChromaLog2WeightDenom,
+                     session->spb.delta_luma_weight_l1,
+                     session->spb.luma_offset_l1,
+                     session->spb.delta_chroma_weight_l1,
+                     session->spb.ChromaOffsetL1);
+  }
+}
+
+// mburakov: Streamer never enables any of the slice segment header syntax
+// elements checked here, and always enables sample adaptive offset.
+static bool IsStreamerProfile(const VAPictureParameterBufferHEVC* ppb) {
+  return ppb->slice_parsing_fields.bits.sample_adaptive_offset_enabled_flag &&
+         !ppb->num_extra_slice_header_bits &&
+         !ppb->slice_parsing_fields.bits.output_flag_present_flag &&
+         !ppb->slice_parsing_fields.bits.lists_modification_present_flag &&
+         !ppb->pic_fields.bits.weighted_pred_flag &&
+         !ppb->pic_fields.bits.weighted_bipred_flag &&
+         !ppb->slice_parsing_fields.bits
+              .pps_slice_chroma_qp_offsets_present_flag &&
+         !ppb->slice_parsing_fields.bits
+              .deblocking_filter_override_enabled_flag &&
+         !ppb->pic_fields.bits.tiles_enabled_flag &&
+         !ppb->pic_fields.bits.entropy_coding_sync_enabled_flag &&
+         !ppb->slice_parsing_fields.bits
+              .slice_segment_header_extension_present_flag;
+}
+
+// 7.3.6.1 General slice segment header syntax, following the parameter set
+// id. Streamer flavor is specialized at compile time, so that every syntax
+// element it never produces costs nothing at all.
+__attribute__((always_inline)) static inline void ParseSliceSegmentHeaderTail(
+    struct Bitstream* nalu, mfxSession session, enum NalUnitType nal_unit_type,
+    bool streamer) {
+  if (!streamer) {
+    for (size_t i = 0; i < session->ppb.num_extra_slice_header_bits; i++) {
+      BitstreamReadU(nalu, 1);  // slice_reserved_flag
+    }
+  }
+  session->spb.LongSliceFlags.fields.slice_type =
+      (uint32_t)BitstreamReadUE(nalu);
+  if (session->spb.LongSliceFlags.fields.slice_type > I)
+    longjmp(nalu->trap, 1);
+  if (!streamer &&
+      session->ppb.slice_parsing_fields.bits.output_flag_present_flag) {
+    session->pic_output_flag = !!BitstreamReadU(nalu, 1);
+  }
+
+  session->poc = 0;
+  session->rps_count = 0;
+  if (nal_unit_type != IDR_W_RADL && nal_unit_type != IDR_N_LP) {
+    const struct Sps* sps = session->active_sps;
+    size_t slice_pic_order_cnt_lsb_length =
+        session->ppb.log2_max_pic_order_cnt_lsb_minus4 + 4;
+    int32_t slice_pic_order_cnt_lsb =
+        (int32_t)BitstreamReadU(nalu, slice_pic_order_cnt_lsb_length);
+    session->poc =
+        DerivePicOrderCnt(session, nal_unit_type, slice_pic_order_cnt_lsb);
+
+    const struct StRps* st_rps;
+    bool short_term_ref_pic_set_sps_flag = !!BitstreamReadU(nalu, 1);
+    if (!short_term_ref_pic_set_sps_flag) {
+      size_t offset = nalu->offset;
+      ParseStRefPicSet(nalu, sps->st_rps,
+                       session->ppb.num_short_term_ref_pic_sets,
+                       session->ppb.num_short_term_ref_pic_sets,
+                       &session->slice_st_rps);
+      session->ppb.st_rps_bits = (uint32_t)(nalu->offset - offset);
+      st_rps = &session->slice_st_rps;
+    } else {
+      uint64_t short_term_ref_pic_set_idx = 0;
+      if (session->ppb.num_short_term_ref_pic_sets > 1) {
+        uint64_t short_term_ref_pic_set_idx_length =
+            CeilLog2(session->ppb.num_short_term_ref_pic_sets);
+        short_term_ref_pic_set_idx =
+            BitstreamReadU(nalu, (size_t)short_term_ref_pic_set_idx_length);
+      }
+      if (short_term_ref_pic_set_idx >=
+          session->ppb.num_short_term_ref_pic_sets) {
+        longjmp(nalu->trap, 1);
+      }
+      st_rps = &sps->st_rps[short_term_ref_pic_set_idx];
+    }
+
+    // (8-5)
+    for (size_t i = 0; i < st_rps->num_negative_pics; i++) {
+      AppendRpsEntry(nalu, session,
+                     st_rps->used_by_curr_pic_s0[i] ? RPS_ST_CURR_BEFORE
+                                                    : RPS_ST_FOLL,
+                     session->poc + st_rps->delta_poc_s0[i], false);
+    }
+    for (size_t i = 0; i < st_rps->num_positive_pics; i++) {
+      AppendRpsEntry(nalu, session,
+                     st_rps->used_by_curr_pic_s1[i] ? RPS_ST_CURR_AFTER
+                                                    : RPS_ST_FOLL,
+                     session->poc + st_rps->delta_poc_s1[i], false);
+    }
+
+    if (session->ppb.slice_parsing_fields.bits
+            .long_term_ref_pics_present_flag) {
+      uint64_t num_long_term_sps = 0;
+      if (session->ppb.num_long_term_ref_pic_sps > 0) {
+        num_long_term_sps = BitstreamReadUE(nalu);
+      }
+      uint64_t num_long_term_pics = BitstreamReadUE(nalu);
+      if (num_long_term_sps > session->ppb.num_long_term_ref_pic_sps ||
+          num_long_term_sps + num_long_term_pics > LENGTH(session->rps)) {
+        longjmp(nalu->trap, 1);
+      }
+      int32_t DeltaPocMsbCycleLt = 0;
+      for (size_t i = 0; i < num_long_term_sps + num_long_term_pics; i++) {
+        int32_t PocLsbLt;
+        bool UsedByCurrPicLt;
+        if (i < num_long_term_sps) {
+          uint64_t lt_idx_sps = 0;
+          if (session->ppb.num_long_term_ref_pic_sps > 1) {
+            lt_idx_sps = BitstreamReadU(
+                nalu, (size_t)CeilLog2(session->ppb.num_long_term_ref_pic_sps));
+          }
+          if (lt_idx_sps >= session->ppb.num_long_term_ref_pic_sps) {
+            longjmp(nalu->trap, 1);
+          }
+          PocLsbLt = sps->lt_ref_pic_poc_lsb_sps[lt_idx_sps];
+          UsedByCurrPicLt = sps->used_by_curr_pic_lt_sps_flag[lt_idx_sps];
+        } else {
+          PocLsbLt =
+              (int32_t)BitstreamReadU(nalu, slice_pic_order_cnt_lsb_length);
+          UsedByCurrPicLt = !!BitstreamReadU(nalu, 1);
+        }
+
+        // (7-52)
+        bool delta_poc_msb_present_flag = !!BitstreamReadU(nalu, 1);
+        if (i == 0 || i == num_long_term_sps) DeltaPocMsbCycleLt = 0;
+        if (delta_poc_msb_present_flag) {
+          DeltaPocMsbCycleLt += (int32_t)BitstreamReadUE(nalu);
+        }
+
+        // (8-5)
+        int32_t pocLt = PocLsbLt;
+        if (delta_poc_msb_present_flag) {
+          pocLt += session->poc -
+                   DeltaPocMsbCycleLt * (1 << slice_pic_order_cnt_lsb_length) -
+                   slice_pic_order_cnt_lsb;
+        }
+        AppendRpsEntry(nalu, session,
+                       UsedByCurrPicLt ? RPS_LT_CURR : RPS_LT_FOLL, pocLt,
+                       !delta_poc_msb_present_flag);
+      }
+    }
+
+    if (session->ppb.slice_parsing_fields.bits.sps_temporal_mvp_enabled_flag) {
+      session->spb.LongSliceFlags.fields.slice_temporal_mvp_enabled_flag =
+          (uint32_t)BitstreamReadU(nalu, 1);
+    }
+  }
+
+  if (streamer || session->ppb.slice_parsing_fields.bits
+                      .sample_adaptive_offset_enabled_flag) {
+    session->spb.LongSliceFlags.fields.slice_sao_luma_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+    session->spb.LongSliceFlags.fields.slice_sao_chroma_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+  }
+
+  // vvv weird vvv
+  session->spb.collocated_ref_idx = 0xff;
+  session->spb.LongSliceFlags.fields.collocated_from_l0_flag = 1;
+  session->spb.num_ref_idx_l0_active_minus1 =
+      session->ppb.num_ref_idx_l0_default_active_minus1;
+  session->spb.num_ref_idx_l1_active_minus1 =
+      session->ppb.num_ref_idx_l1_default_active_minus1;
+  // ^^^ weird ^^^
+
+  if (session->spb.LongSliceFlags.fields.slice_type == P ||
+      session->spb.LongSliceFlags.fields.slice_type == B) {
+    bool num_ref_idx_active_override_flag = !!BitstreamReadU(nalu, 1);
+    if (num_ref_idx_active_override_flag) {
+      session->spb.num_ref_idx_l0_active_minus1 =
+          (uint8_t)BitstreamReadUE(nalu);
+      if (session->spb.LongSliceFlags.fields.slice_type == B) {
+        session->spb.num_ref_idx_l1_active_minus1 =
+            (uint8_t)BitstreamReadUE(nalu);
+      }
+    }
+    if (session->spb.num_ref_idx_l0_active_minus1 >=
+            LENGTH(session->spb.RefPicList[0]) ||
+        session->spb.num_ref_idx_l1_active_minus1 >=
+            LENGTH(session->spb.RefPicList[1])) {
+      longjmp(nalu->trap, 1);
+    }
+    if (!streamer &&
+        session->ppb.slice_parsing_fields.bits
+            .lists_modification_present_flag) {
+      ParseRefPicListsModification(nalu, session);
+    }
+    if (session->spb.LongSliceFlags.fields.slice_type == B) {
+      session->spb.LongSliceFlags.fields.mvd_l1_zero_flag =
+          (uint32_t)BitstreamReadU(nalu, 1);
+    }
+    if (session->ppb.slice_parsing_fields.bits.cabac_init_present_flag) {
+      session->spb.LongSliceFlags.fields.cabac_init_flag =
+          (uint32_t)BitstreamReadU(nalu, 1);
+    }
+    if (session->spb.LongSliceFlags.fields.slice_temporal_mvp_enabled_flag) {
+      if (session->spb.LongSliceFlags.fields.slice_type == B) {
+        session->spb.LongSliceFlags.fields.collocated_from_l0_flag =
+            (uint32_t)BitstreamReadU(nalu, 1);
+      }
+      if ((session->spb.LongSliceFlags.fields.collocated_from_l0_flag &&
+           session->spb.num_ref_idx_l0_active_minus1 > 0) ||
+          (!session->spb.LongSliceFlags.fields.collocated_from_l0_flag &&
+           session->spb.num_ref_idx_l1_active_minus1 > 0)) {
+        session->spb.collocated_ref_idx = (uint8_t)BitstreamReadUE(nalu);
+      }
+    }
+    if (!streamer &&
+        ((session->ppb.pic_fields.bits.weighted_pred_flag &&
+          session->spb.LongSliceFlags.fields.slice_type == P) ||
+         (session->ppb.pic_fields.bits.weighted_bipred_flag &&
+          session->spb.LongSliceFlags.fields.slice_type == B))) {
+      ParsePredWeightTable(nalu, session);
+    }
+    session->spb.five_minus_max_num_merge_cand = (uint8_t)BitstreamReadUE(nalu);
+  }
+  session->spb.slice_qp_delta = (int8_t)BitstreamReadSE(nalu);
+  if (!streamer && session->ppb.slice_parsing_fields.bits
+                       .pps_slice_chroma_qp_offsets_present_flag) {
+    session->spb.slice_cb_qp_offset = (int8_t)BitstreamReadSE(nalu);
+    session->spb.slice_cr_qp_offset = (int8_t)BitstreamReadSE(nalu);
+  }
+
+  session->spb.LongSliceFlags.fields.slice_deblocking_filter_disabled_flag =
+      session->ppb.slice_parsing_fields.bits.pps_disable_deblocking_filter_flag;
+  session->spb.slice_beta_offset_div2 = session->ppb.pps_beta_offset_div2;
+  session->spb.slice_tc_offset_div2 = session->ppb.pps_tc_offset_div2;
+  if (!streamer && session->ppb.slice_parsing_fields.bits
+                       .deblocking_filter_override_enabled_flag) {
+    bool deblocking_filter_override_flag = !!BitstreamReadU(nalu, 1);
+    if (deblocking_filter_override_flag) {
+      session->spb.LongSliceFlags.fields
+          .slice_deblocking_filter_disabled_flag =
+          (uint32_t)BitstreamReadU(nalu, 1);
+      if (!session->spb.LongSliceFlags.fields
+               .slice_deblocking_filter_disabled_flag) {
+        session->spb.slice_beta_offset_div2 = (int8_t)BitstreamReadSE(nalu);
+        session->spb.slice_tc_offset_div2 = (int8_t)BitstreamReadSE(nalu);
+      }
+    }
+  }
+
+  session->spb.LongSliceFlags.fields
+      .slice_loop_filter_across_slices_enabled_flag =
+      session->ppb.pic_fields.bits.pps_loop_filter_across_slices_enabled_flag;
+  if (session->ppb.pic_fields.bits.pps_loop_filter_across_slices_enabled_flag &&
+      (session->spb.LongSliceFlags.fields.slice_sao_luma_flag ||
+       session->spb.LongSliceFlags.fields.slice_sao_chroma_flag ||
+       !session->spb.LongSliceFlags.fields
+            .slice_deblocking_filter_disabled_flag)) {
+    session->spb.LongSliceFlags.fields
+        .slice_loop_filter_across_slices_enabled_flag =
+        (uint32_t)BitstreamReadU(nalu, 1);
+  }
+
+  if (!streamer && (session->ppb.pic_fields.bits.tiles_enabled_flag ||
+                    session->ppb.pic_fields.bits
+                        .entropy_coding_sync_enabled_flag)) {
+    // mburakov: Hardware finds entry points on its own.
+    uint64_t num_entry_point_offsets = BitstreamReadUE(nalu);
+    if (num_entry_point_offsets > UINT16_MAX) longjmp(nalu->trap, 1);
+    session->spb.num_entry_point_offsets = (uint16_t)num_entry_point_offsets;
+    if (num_entry_point_offsets > 0) {
+      uint64_t offset_len_minus1 = BitstreamReadUE(nalu);
+      if (offset_len_minus1 > 31) longjmp(nalu->trap, 1);
+      for (size_t i = 0; i < num_entry_point_offsets; i++) {
+        // entry_point_offset_minus1
+        BitstreamReadU(nalu, (size_t)offset_len_minus1 + 1);
+      }
+    }
+  }
+  if (!streamer && session->ppb.slice_parsing_fields.bits
+                       .slice_segment_header_extension_present_flag) {
+    uint64_t slice_segment_header_extension_length = BitstreamReadUE(nalu);
+    if (slice_segment_header_extension_length > 256) longjmp(nalu->trap, 1);
+    for (size_t i = 0; i < slice_segment_header_extension_length; i++) {
+      BitstreamReadU(nalu, 8);  // slice_segment_header_extension_data_byte
+    }
+  }
+
+  // 7.3.2.12 Byte alignment syntax
+  EXPECT(BitstreamReadU(nalu, 1) == 1);  // alignment_bit_equal_to_one
+  BitstreamByteAlign(nalu);
+}
+
+// 7.3.6.1 General slice segment header syntax
+static void ParseSliceSegmentHeader(struct Bitstream* nalu,
+                                    mfxSession session,
+                                    enum NalUnitType nal_unit_type) {
+  memset(&session->spb, 0, sizeof(session->spb));
+  session->pic_output_flag = true;
+  session->ref_pic_list_modification_flag[0] = false;
+  session->ref_pic_list_modification_flag[1] = false;
+
+  EXPECT(BitstreamReadU(nalu, 1) == 1);  // first_slice_segment_in_pic_flag
+  if (IsIrap(nal_unit_type)) {
+    // mburakov: Pictures are output right away, so nothing is ever left in
+    // the decoded picture buffer to be discarded.
+    BitstreamReadU(nalu, 1);  // no_output_of_prior_pics_flag
+  }
+  uint64_t slice_pic_parameter_set_id = BitstreamReadUE(nalu);
+  if (!ActivateParameterSets(session, slice_pic_parameter_set_id))
+    longjmp(nalu->trap, 1);
+  if (IsStreamerProfile(&session->ppb)) {
+    ParseSliceSegmentHeaderTail(nalu, session, nal_unit_type, true);
+  } else {
+    ParseSliceSegmentHeaderTail(nalu, session, nal_unit_type, false);
+  }
+}
+
+static bool IndexNalus(mfxSession session, const mfxBitstream* bs,
+                       const struct BitstreamNalu** nalus, size_t* count) {
+  const mfxU8* end = bs->Data + bs->DataLength;
+  if (session->nalus_end != end || !session->nalus_count ||
+      session->nalus[0].data > bs->Data) {
+    session->nalus_count =
+        BitstreamIndexNalus(bs->Data, bs->DataLength, session->nalus,
+                            LENGTH(session->nalus), &session->nalus_epb_count);
+    if (session->nalus_count == SIZE_MAX) {
+      session->nalus_count = 0;
+      return false;
+    }
+    session->nalus_end = end;
+  }
+
+  // mburakov: Index might have been built for a larger portion of the same
+  // access unit, i.e. before DecodeHeader consumed parameter sets from it.
+  size_t index = 0;
+  while (index < session->nalus_count &&
+         session->nalus[index].data < bs->Data) {
+    index++;
+  }
+  *nalus = session->nalus + index;
+  *count = session->nalus_count - index;
+  return true;
+}
+
+static void DropNalus(mfxSession session) {
+  session->nalus_end = NULL;
+  session->nalus_count = 0;
+}
+
+// 8.3.2 Decoding process for reference picture set
+static bool ApplyReferencePictureSet(mfxSession session,
+                                     enum NalUnitType nal_unit_type,
+                                     uint8_t* ref_idx) {
+  static const uint32_t kFlags[] = {
+      [RPS_ST_CURR_BEFORE] = VA_PICTURE_HEVC_RPS_ST_CURR_BEFORE,
+      [RPS_ST_CURR_AFTER] = VA_PICTURE_HEVC_RPS_ST_CURR_AFTER,
+      [RPS_ST_FOLL] = 0,
+      [RPS_LT_CURR] =
+          VA_PICTURE_HEVC_RPS_LT_CURR | VA_PICTURE_HEVC_LONG_TERM_REFERENCE,
+      [RPS_LT_FOLL] = VA_PICTURE_HEVC_LONG_TERM_REFERENCE,
+  };
+
+  if (IsIrap(nal_unit_type) && session->no_rasl_output) {
+    for (size_t i = 0; i < session->slots_count; i++)
+      session->slots[i].marking = MARKING_UNUSED;
+  }
+  for (size_t i = 0; i < LENGTH(session->ppb.ReferenceFrames); i++) {
+    session->ppb.ReferenceFrames[i] = (VAPictureHEVC){
+        .picture_id = VA_INVALID_SURFACE,
+        .flags = VA_PICTURE_HEVC_INVALID,
+    };
+  }
+
+  // mburakov: Long-term entries are resolved first, because these might
+  // refer to pictures that are still marked as short-term ones.
+  int32_t lsb_mask =
+      (1 << (session->ppb.log2_max_pic_order_cnt_lsb_minus4 + 4)) - 1;
+  bool in_rps[session->slots_count];
+  memset(in_rps, 0, sizeof(in_rps));
+  size_t refs_count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < session->rps_count; i++) {
+      const struct RpsEntry* entry = &session->rps[i];
+      bool long_term = entry->list >= RPS_LT_CURR;
+      if (long_term != (pass == 0)) continue;
+      ref_idx[i] = 0xff;
+      for (size_t j = 0; j < session->slots_count; j++) {
+        struct Slot* slot = &session->slots[j];
+        if (slot->marking == MARKING_UNUSED || in_rps[j]) continue;
+        if (!long_term && slot->marking != MARKING_SHORT_TERM) continue;
+        int32_t poc = entry->lsb_only ? slot->poc & lsb_mask : slot->poc;
+        if (poc != entry->poc) continue;
+        if (refs_count == LENGTH(session->ppb.ReferenceFrames)) return false;
+        in_rps[j] = true;
+        if (long_term) slot->marking = MARKING_LONG_TERM;
+        session->ppb.ReferenceFrames[refs_count] = (VAPictureHEVC){
+            .picture_id = slot->surface_id,
+            .pic_order_cnt = slot->poc,
+            .flags = kFlags[entry->list],
+        };
+        ref_idx[i] = (uint8_t)refs_count++;
+        break;
+      }
+    }
+  }
+
+  // mburakov: Reference pictures are missing when decoding starts from a CRA
+  // picture or a recovery point, or after a loss. Unused surfaces stand in
+  // for these, and gradual refresh eventually overwrites whatever garbage
+  // was predicted from them. Pictures that are not referenced by the current
+  // one are just left out.
+  for (size_t i = 0, j = 0; i < session->rps_count; i++) {
+    const struct RpsEntry* entry = &session->rps[i];
+    if (ref_idx[i] != 0xff || entry->list == RPS_ST_FOLL ||
+        entry->list == RPS_LT_FOLL) {
+      continue;
+    }
+    for (; j < session->slots_count; j++) {
+      if (!in_rps[j] && j != session->current_slot) break;
+    }
+    if (j == session->slots_count ||
+        refs_count == LENGTH(session->ppb.ReferenceFrames)) {
+      break;
+    }
+    in_rps[j] = true;
+    session->slots[j].marking = MARKING_UNUSED;
+    session->ppb.ReferenceFrames[refs_count] = (VAPictureHEVC){
+        .picture_id = session->slots[j].surface_id,
+        .pic_order_cnt = entry->poc,
+        .flags = kFlags[entry->list],
+    };
+    ref_idx[i] = (uint8_t)refs_count++;
+  }
+
+  for (size_t i = 0; i < session->slots_count; i++) {
+    if (!in_rps[i]) session->slots[i].marking = MARKING_UNUSED;
+  }
+  return true;
+}
+
+// 8.3.4 Decoding process for reference picture lists construction
+static bool BuildRefPicLists(mfxSession session, const uint8_t* ref_idx) {
+  for (size_t i = 0; i < LENGTH(session->spb.RefPicList); i++) {
+    for (size_t j = 0; j < LENGTH(session->spb.RefPicList[i]); j++) {
+      session->spb.RefPicList[i][j] = 0xff;
+    }
+  }
+  uint32_t slice_type = session->spb.LongSliceFlags.fields.slice_type;
+  if (slice_type != P && slice_type != B) return true;
+
+  uint8_t curr[3][LENGTH(session->ppb.ReferenceFrames)];
+  size_t curr_count[3] = {0};
+  for (size_t i = 0; i < session->rps_count; i++) {
+    if (ref_idx[i] == 0xff) continue;
+    switch (session->rps[i].list) {
+      case RPS_ST_CURR_BEFORE:
+        curr[0][curr_count[0]++] = ref_idx[i];
+        break;
+      case RPS_ST_CURR_AFTER:
+        curr[1][curr_count[1]++] = ref_idx[i];
+        break;
+      case RPS_LT_CURR:
+        curr[2][curr_count[2]++] = ref_idx[i];
+        break;
+      default:
+        break;
+    }
+  }
+  size_t NumPicTotalCurr = curr_count[0] + curr_count[1] + curr_count[2];
+  if (!NumPicTotalCurr) return false;
+
+  // (8-8) to (8-11)
+  static const size_t kOrder[2][3] = {{0, 1, 2}, {1, 0, 2}};
+  uint8_t num_ref_idx_active_minus1[] = {
+      session->spb.num_ref_idx_l0_active_minus1,
+      session->spb.num_ref_idx_l1_active_minus1,
+  };
+  for (size_t l = 0; l < (slice_type == B ? 2u : 1u); l++) {
+    size_t NumRpsCurrTempList = num_ref_idx_active_minus1[l] + 1u;
+    if (NumRpsCurrTempList < NumPicTotalCurr)
+      NumRpsCurrTempList = NumPicTotalCurr;
+    uint8_t RefPicListTemp[LENGTH(session->rps)];
+    size_t rIdx = 0;
+    while (rIdx < NumRpsCurrTempList) {
+      for (size_t k = 0; k < 3; k++) {
+        const uint8_t* refs = curr[kOrder[l][k]];
+        for (size_t i = 0;
+             i < curr_count[kOrder[l][k]] && rIdx < NumRpsCurrTempList; i++) {
+          RefPicListTemp[rIdx++] = refs[i];
+        }
+      }
+    }
+    for (rIdx = 0; rIdx <= num_ref_idx_active_minus1[l]; rIdx++) {
+      size_t entry = rIdx;
+      if (session->ref_pic_list_modification_flag[l]) {
+        // mburakov: Entries refer to pictures that might be missing.
+        entry = session->list_entry[l][rIdx];
+        if (entry >= NumPicTotalCurr) return false;
+      }
+      session->spb.RefPicList[l][rIdx] = RefPicListTemp[entry];
+    }
+  }
+  return true;
+}
+mfxStatus HevcDecodeHeader(mfxSession session, mfxBitstream* bs,
+                           mfxVideoParam* par) {
+  DropNalus(session);
+  const struct BitstreamNalu* nalus;
+  size_t nalus_count;
+  if (!IndexNalus(session, bs, &nalus, &nalus_count)) {
+    return MFX_ERR_UNSUPPORTED;
+  }
+  bool parsed = false;
+  for (size_t i = 0; i < nalus_count; i++) {
+    uint8_t nal_unit_type =
+        nalus[i].size ? (nalus[i].data[0] >> 1 & 0x3f) : 0;
+    if (nal_unit_type != SPS_NUT && nal_unit_type != PPS_NUT) continue;
+    if (!HandleParameterSet(session, &nalus[i], nal_unit_type)) {
+      return MFX_ERR_UNSUPPORTED;
+    }
+    parsed = true;
+  }
+
+  // mburakov: Cached parameter sets survive resets, and would otherwise
+  // report a header in every access unit, i.e. in the middle of a sequence.
+  if (!parsed) return MFX_ERR_MORE_DATA;
+
+  // mburakov: Parameter sets are left in the bitstream, DecodeFrameAsync
+  // would find them in the cache. Initialization only needs any complete
+  // pair of them to learn the picture size.
+  for (size_t i = 0; i < LENGTH(session->pps); i++) {
+    if (!ActivateParameterSets(session, i)) continue;
+    par->mfx.FrameInfo = (mfxFrameInfo){
+        .FourCC = MFX_FOURCC_NV12,
+        .Width = (mfxU16)session->ppb.pic_width_in_luma_samples,
+        .Height = (mfxU16)session->ppb.pic_height_in_luma_samples,
+        .CropX = session->crop_rect[0],
+        .CropY = session->crop_rect[1],
+        .CropW = session->crop_rect[2],
+        .CropH = session->crop_rect[3],
+        .ChromaFormat = MFX_CHROMAFORMAT_YUV420,
+    };
+    par->mfx.NumRefFrame =
+        (mfxU16)(session->ppb.sps_max_dec_pic_buffering_minus1 + 1);
+    return MFX_ERR_NONE;
+  }
+  return MFX_ERR_MORE_DATA;
+}
+
+mfxStatus HevcDecodeFrame(mfxSession session, mfxBitstream* bs,
+                          struct VaDecoderPicture* picture) {
+  const struct BitstreamNalu* nalus;
+  size_t nalus_count;
+  if (!IndexNalus(session, bs, &nalus, &nalus_count)) {
+    return MFX_ERR_UNSUPPORTED;
+  }
+  DropNalus(session);
+  for (size_t i = 0; i < nalus_count; i++) {
+    struct BitstreamNalu nalu = nalus[i];
+    // mburakov: Peek the type before unescaping anything. NAL unit header
+    // can not contain emulation prevention bytes, so it's safe to do on the
+    // escaped data.
+    uint8_t nal_unit_type = nalu.size ? (nalu.data[0] >> 1 & 0x3f) : 0;
+    bool slice = nal_unit_type <= RASL_R ||
+                 (BLA_W_LP <= nal_unit_type && nal_unit_type <= CRA_NUT);
+
+    // mburakov: Bitstream of a locked access unit is only a copy of its
+    // beginning, and the slice segment it ends with continues in the locked
+    // bitstream. Only the slice segment header is parsed from the copy.
+    size_t slice_data_size = nalu.size;
+    if (session->locked_data && i + 1 == nalus_count) {
+      if (!slice) return MFX_ERR_UNSUPPORTED;
+      slice_data_size = session->locked_size - (size_t)(nalu.data - bs->Data);
+    }
+
+    if (nal_unit_type == SPS_NUT || nal_unit_type == PPS_NUT) {
+      if (!HandleParameterSet(session, &nalu, nal_unit_type)) {
+        return MFX_ERR_UNSUPPORTED;
+      }
+      continue;
+    }
+    if (nal_unit_type == PREFIX_SEI_NUT) {
+      HandleSei(session, &nalu);
+      continue;
+    }
+    if (!slice) continue;
+
+    // 8.1.3: RASL pictures associated with an IRAP picture that starts the
+    // decoding refer to pictures that were never decoded.
+    bool rasl = nal_unit_type == RASL_N || nal_unit_type == RASL_R;
+    if (rasl && session->no_rasl_output) continue;
+    if (IsIrap(nal_unit_type)) {
+      session->no_rasl_output =
+          nal_unit_type != CRA_NUT || session->handle_cra_as_bla;
+      session->handle_cra_as_bla = false;
+    }
+
+    uint8_t rbsp[BITSTREAM_RBSP_SIZE];
+    struct Bitstream header = BitstreamCreate(
+        rbsp, BitstreamUnescape(nalu.data, nalu.size, rbsp, sizeof(rbsp)));
+    if (BitstreamReadFailed(&header)) {
+      return MFX_ERR_UNSUPPORTED;
+    }
+    ParseNaluHeader(&header);
+    ParseSliceSegmentHeader(&header, session, nal_unit_type);
+    size_t slice_data_byte_offset = header.offset >> 3;
+    size_t epb_count =
+        BitstreamEpbCount(nalu.data, nalu.size, slice_data_byte_offset);
+
+    // mburakov: Quantizer is SliceQpY, see 7.4.7.1.
+    static const char kFrameTypes[] = {[B] = 'B', [P] = 'P', [I] = 'I'};
+    session->stats.frame_type =
+        kFrameTypes[session->spb.LongSliceFlags.fields.slice_type];
+    session->stats.quantizer =
+        26 + session->ppb.init_qp_minus26 + session->spb.slice_qp_delta;
+    session->stats.payload_size += slice_data_size;
+    // mburakov: Emulation prevention bytes are only counted in what was
+    // indexed, that is not the whole access unit if it was locked. Reading
+    // the rest back from the mapped buffer is what locking avoids.
+    session->stats.epb_count = session->nalus_epb_count;
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    uint8_t ref_idx[LENGTH(session->rps)];
+    if (!VaDecoderAcquireSlot(session) ||
+        !ApplyReferencePictureSet(session, nal_unit_type, ref_idx) ||
+        !BuildRefPicLists(session, ref_idx)) {
+      return MFX_ERR_UNSUPPORTED;
+    }
+    struct Slot* slot = &session->slots[session->current_slot];
+
+    session->ppb.CurrPic = (VAPictureHEVC){
+        .picture_id = slot->surface_id,
+        .pic_order_cnt = session->poc,
+    };
+    session->ppb.pic_fields.bits.NoPicReorderingFlag = 1;
+    session->ppb.pic_fields.bits.NoBiPredFlag =
+        session->spb.LongSliceFlags.fields.slice_type != B;
+    session->ppb.slice_parsing_fields.bits.RapPicFlag =
+        BLA_W_LP <= nal_unit_type && nal_unit_type <= CRA_NUT;
+    session->ppb.slice_parsing_fields.bits.IdrPicFlag =
+        IDR_W_RADL <= nal_unit_type && nal_unit_type <= IDR_N_LP;
+    session->ppb.slice_parsing_fields.bits.IntraPicFlag =
+        IsIrap(nal_unit_type);
+    session->spb.slice_data_size = (uint32_t)slice_data_size;
+    session->spb.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+    session->spb.slice_data_byte_offset = (uint32_t)slice_data_byte_offset;
+    session->spb.LongSliceFlags.fields.LastSliceOfPic = 1;
+    session->spb.slice_data_num_emu_prevn_bytes = (uint16_t)epb_count;
+
+    // TODO(mburakov): Does not seem to be used anywhere...
+    (void)session->spb.entry_offset_to_subset_array;
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    if (!VaDecoderUploadSliceData(session, nalu.data, slice_data_size,
+                                  &session->spb.slice_data_offset) ||
+        !VaDecoderSubmitPicture(session, &session->ppb, sizeof(session->ppb),
+                                &session->spb, sizeof(session->spb), 1)) {
+      return MFX_ERR_DEVICE_FAILED;
+    }
+
+    // 8.3.2: Current picture is marked as short-term reference.
+    slot->marking = MARKING_SHORT_TERM;
+    slot->poc = session->poc;
+    if (session->pic_output_flag) session->output_slot = session->current_slot;
+    session->current_slot = SIZE_MAX;
+    // 8.3.1: prevTid0Pic is neither RASL, RADL nor SLNR picture.
+    if (nal_unit_type != TRAIL_N &&
+        (nal_unit_type < RADL_N || nal_unit_type > RASL_R)) {
+      session->prev_tid0_poc = session->poc;
+    }
+
+    // mburakov: Decoding is synchronized either by an IRAP picture, or by
+    // reaching the recovery point signaled in SEI, i.e. once the gradual
+    // refresh period is over.
+    session->sync_point = IsIrap(nal_unit_type);
+    if (session->recovery_poc_cnt_present) {
+      session->recovery_poc = session->poc + session->recovery_poc_cnt;
+      session->recovery_poc_cnt_present = false;
+      session->recovery_pending = !session->sync_point;
+    }
+    if (session->recovery_pending && session->poc >= session->recovery_poc) {
+      session->sync_point = true;
+      session->recovery_pending = false;
+    }
+
+    // mburakov: Picture is still decoded for reference, but never shown.
+    if (session->pic_output_flag) {
+      *picture = (struct VaDecoderPicture){
+          .index = session->output_slot,
+          .surface_id = slot->surface_id,
+          .crop_rect = {session->crop_rect[0], session->crop_rect[1],
+                        session->crop_rect[2], session->crop_rect[3]},
+          .sync_point = session->sync_point,
+      };
+    }
+  }
+  return MFX_ERR_NONE;
+}
+
+void HevcDecodeReset(mfxSession session) {
+  // mburakov: Whatever was decoded before is not trusted anymore, and
+  // decoding restarts from the next IRAP picture as if it was the first one
+  // in the bitstream, see 8.1.3.
+  DropNalus(session);
+  session->handle_cra_as_bla = true;
+  session->recovery_poc_cnt_present = false;
+  session->recovery_pending = false;
+  session->sync_point = false;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MFX_STUB_HEVC_H_
+#define MFX_STUB_HEVC_H_
+
+#include <mfxvideo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <va/va.h>
+#include <vadecoder.h>
+
+// 7.4.3.2.1 and 7.4.3.3.1 limit parameter set ids to 0..15 and 0..63.
+#define MFX_STUB_MAX_SPS 16
+#define MFX_STUB_MAX_PPS 64
+
+struct ParameterSet {
+  bool valid;
+  uint64_t hash;
+  size_t size;
+};
+
+// 7.4.8 Short-term reference picture set semantics
+struct StRps {
+  uint8_t num_negative_pics;
+  uint8_t num_positive_pics;
+  int16_t delta_poc_s0[16];
+  int16_t delta_poc_s1[16];
+  bool used_by_curr_pic_s0[16];
+  bool used_by_curr_pic_s1[16];
+};
+
+// mburakov: Sequence and picture parameter sets are parsed into their own
+// copies of picture parameter buffer, and merged once a slice refers to them.
+struct Sps {
+  struct ParameterSet set;
+  mfxU16 crop_rect[4];
+  VAPictureParameterBufferHEVC ppb;
+  struct StRps st_rps[64];
+  uint16_t lt_ref_pic_poc_lsb_sps[32];
+  bool used_by_curr_pic_lt_sps_flag[32];
+};
+
+struct Pps {
+  struct ParameterSet set;
+  uint8_t sps_id;
+  bool uniform_spacing_flag;
+  VAPictureParameterBufferHEVC ppb;
+};
+
+// 8.3.2 Decoding process for reference picture set
+enum RpsList {
+  RPS_ST_CURR_BEFORE,
+  RPS_ST_CURR_AFTER,
+  RPS_ST_FOLL,
+  RPS_LT_CURR,
+  RPS_LT_FOLL,
+};
+
+struct RpsEntry {
+  enum RpsList list;
+  int32_t poc;
+  // mburakov: Long-term entries without delta_poc_msb_present_flag are
+  // identified only by the lsb part of their picture order count.
+  bool lsb_only;
+};
+
+mfxStatus HevcDecodeHeader(mfxSession session, mfxBitstream* bs,
+                           mfxVideoParam* par);
+mfxStatus HevcDecodeFrame(mfxSession session, mfxBitstream* bs,
+                          struct VaDecoderPicture* picture);
+void HevcDecodeReset(mfxSession session);
+
+#endif  // MFX_STUB_HEVC_H_
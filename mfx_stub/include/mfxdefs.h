@@ -35,12 +35,15 @@ typedef mfxHDL mfxMemId;
 
 typedef enum {
   MFX_ERR_NONE = 0,
+  MFX_ERR_NULL_PTR = -2,
   MFX_ERR_UNSUPPORTED = -3,
   MFX_ERR_MEMORY_ALLOC = -4,
+  MFX_ERR_NOT_INITIALIZED = -8,
   MFX_ERR_MORE_DATA = -10,
   MFX_ERR_MORE_SURFACE = -11,
   MFX_ERR_DEVICE_FAILED = -17,
   MFX_ERR_REALLOC_SURFACE = -22,
+  MFX_WRN_IN_EXECUTION = 1,
   MFX_WRN_DEVICE_BUSY = 2,
   MFX_WRN_VIDEO_PARAM_CHANGED = 3,
   MFX_ERR_NONE_PARTIAL_OUTPUT = 12,
@@ -20,7 +20,8 @@
 
 #include "mfxcommon.h"
 
-typedef struct _mfxSession* mfxSession;
+// mburakov: Session of the stub is the decoder itself, see vadecoder.h.
+typedef struct VaDecoder* mfxSession;
 mfxStatus MFXInit(mfxIMPL impl, mfxVersion* ver, mfxSession* session);
 mfxStatus MFXClose(mfxSession session);
 
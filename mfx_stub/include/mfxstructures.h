@@ -53,7 +53,9 @@ typedef struct {
 typedef struct {
   mfxU16 AsyncDepth;
   struct {
+    mfxFrameInfo FrameInfo;
     mfxU32 CodecId;
+    mfxU16 NumRefFrame;
     mfxU16 DecodedOrder;
   } mfx;
   mfxU16 IOPattern;
@@ -65,6 +67,7 @@ enum {
 
 enum {
   MFX_CODEC_HEVC = MFX_MAKEFOURCC('H', 'E', 'V', 'C'),
+  MFX_CODEC_AV1 = MFX_MAKEFOURCC('A', 'V', '1', ' '),
 };
 
 enum {
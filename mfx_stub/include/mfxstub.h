@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MFX_STUB_INCLUDE_MFXSTUB_H_
+#define MFX_STUB_INCLUDE_MFXSTUB_H_
+
+#include "mfxsession.h"
+
+// mburakov: Everything below is specific to the stub and does not exist in
+// Intel Media SDK. Callers must not rely on it when built with USE_LIBMFX.
+
+typedef struct {
+  mfxU32 VaBufferCalls;
+  // mburakov: Set when the last decoded frame is an IRAP picture, or the one
+  // that completes gradual decoding refresh started by recovery point SEI.
+  mfxU16 SyncPoint;
+} mfxStubStat;
+
+mfxStatus MFXVideoDECODE_GetStubStat(mfxSession session, mfxStubStat* stat);
+
+// mburakov: Returns a pointer to a mapped VA slice data buffer that can hold
+// the next access unit. Mapped buffer is uncached, so it's only for writing.
+// Next bitstream passed to DecodeFrameAsync has to be a copy of the beginning
+// of the access unit written there, long enough to hold all of its headers,
+// and the slice data is then handed to the driver without being copied. Only
+// HEVC access units could be decoded this way.
+mfxStatus MFXVideoDECODE_LockBitstream(mfxSession session, mfxU32 size,
+                                       mfxU8** data);
+
+#endif  // MFX_STUB_INCLUDE_MFXSTUB_H_
@@ -40,6 +40,8 @@ mfxStatus MFXVideoDECODE_Query(mfxSession session, mfxVideoParam* in,
 mfxStatus MFXVideoDECODE_DecodeHeader(mfxSession session, mfxBitstream* bs,
                                       mfxVideoParam* par);
 mfxStatus MFXVideoDECODE_Init(mfxSession session, mfxVideoParam* par);
+mfxStatus MFXVideoDECODE_Reset(mfxSession session, mfxVideoParam* par);
+mfxStatus MFXVideoDECODE_Close(mfxSession session);
 mfxStatus MFXVideoDECODE_DecodeFrameAsync(mfxSession session, mfxBitstream* bs,
                                           mfxFrameSurface1* surface_work,
                                           mfxFrameSurface1** surface_out,
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MFX_STUB_INCLUDE_VADECODER_H_
+#define MFX_STUB_INCLUDE_VADECODER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <va/va.h>
+
+// mburakov: This is the decoder behind the stub, without any of the Intel
+// Media SDK indirection. It owns its surfaces and decoded picture buffer, so
+// there are no frame allocator callbacks, work surfaces or sync points to
+// juggle. Session of the stub is a thin wrapper around it.
+
+struct VaDecoder;
+
+enum VaDecoderCodec {
+  VA_DECODER_CODEC_HEVC,
+  VA_DECODER_CODEC_AV1,
+};
+
+// mburakov: Modifiers are an input of VaDecoderInit only, and are left to
+// the driver when there are none, or when it could not use any of these.
+struct VaDecoderInfo {
+  enum VaDecoderCodec codec;
+  uint16_t width;
+  uint16_t height;
+  size_t num_ref_frames;
+  const uint64_t* modifiers;
+  size_t modifiers_count;
+};
+
+struct VaDecoderPicture {
+  size_t index;
+  VASurfaceID surface_id;
+  uint16_t crop_rect[4];
+  bool sync_point;
+};
+
+// mburakov: Bitstream analytics of whatever the last VaDecoderDecode call
+// consumed. Frame type is one of 'I', 'P' or 'B', or zero when no frame was
+// decoded. Quantizer is SliceQpY for HEVC and base_q_idx for AV1. Only HEVC
+// has emulation prevention bytes, these are counted over the whole data unless
+// it was received into a locked bitstream, and epb_partial is set then. VA
+// buffer calls are creations and destructions of VA buffers, that are only
+// expected until the pool of these warms up.
+struct VaDecoderStats {
+  char frame_type;
+  int quantizer;
+  size_t payload_size;
+  size_t epb_count;
+  bool epb_partial;
+  size_t va_buffer_calls;
+};
+
+struct VaDecoder* VaDecoderCreate(VADisplay display);
+
+// mburakov: Codec of the info is an input. Found is cleared when the data
+// does not carry a sequence header, and the info is left untouched then.
+bool VaDecoderDecodeHeader(struct VaDecoder* decoder, const void* data,
+                           size_t size, struct VaDecoderInfo* info,
+                           bool* found);
+bool VaDecoderInit(struct VaDecoder* decoder, const struct VaDecoderInfo* info);
+
+// mburakov: Surfaces are created for decoding and exporting, and are indexed
+// the same way as the pictures returned from VaDecoderDecode.
+const VASurfaceID* VaDecoderGetSurfaces(const struct VaDecoder* decoder,
+                                        size_t* count);
+
+// mburakov: Same as MFXVideoDECODE_LockBitstream, see mfxstub.h.
+void* VaDecoderLockBitstream(struct VaDecoder* decoder, size_t size);
+
+// mburakov: Surface of the picture is VA_INVALID_SURFACE when the data did
+// not produce anything to show, i.e. AV1 frame that is shown later.
+bool VaDecoderDecode(struct VaDecoder* decoder, const void* data, size_t size,
+                     struct VaDecoderPicture* picture);
+const struct VaDecoderStats* VaDecoderGetStats(
+    const struct VaDecoder* decoder);
+
+// mburakov: Timeout is in milliseconds, same as the wait argument of
+// MFXVideoCORE_SyncOperation. Picture that is not ready by then is a failure.
+bool VaDecoderSync(struct VaDecoder* decoder,
+                   const struct VaDecoderPicture* picture, uint32_t timeout);
+bool VaDecoderReset(struct VaDecoder* decoder);
+void VaDecoderClose(struct VaDecoder* decoder);
+void VaDecoderDestroy(struct VaDecoder* decoder);
+
+#endif  // MFX_STUB_INCLUDE_VADECODER_H_
@@ -18,25 +18,125 @@
 #ifndef MFX_STUB_MFXSESSION_IMPL_H_
 #define MFX_STUB_MFXSESSION_IMPL_H_
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <va/va.h>
 
+#include "bitstream.h"
+#include "hevc.h"
 #include "mfxvideo.h"
+#include "obu.h"
+#include "vadecoder.h"
 
-struct _mfxSession {
+enum Marking {
+  MARKING_UNUSED,
+  MARKING_SHORT_TERM,
+  MARKING_LONG_TERM,
+};
+
+struct VaBuffers {
+  VABufferID ppb_id;
+  VABufferID spb_id;
+  size_t spb_count;
+  VABufferID sdb_id;
+  size_t sdb_size;
+};
+
+// mburakov: Slot is a surface allocated either from the frame allocator or
+// by the decoder itself, together with the state of the picture decoded into
+// it, and the VA buffers that were used to decode it.
+struct Slot {
+  mfxMemId mid;
+  VASurfaceID surface_id;
+  enum Marking marking;
+  int32_t poc;
+  size_t last_decoded;
+  struct VaBuffers buffers;
+};
+
+struct VaDecoder {
   mfxFrameAllocator allocator;
   VADisplay display;
 
+  mfxU32 codec_id;
   VAConfigID config_id;
   VAContextID context_id;
+  mfxU16 context_width;
+  mfxU16 context_height;
   mfxMemId* mids;
-  size_t mids_count;
+  VASurfaceID* surface_ids;
+  size_t slots_count;
+  struct Slot* slots;
+  size_t current_slot;
+  size_t output_slot;
+  size_t va_buffer_calls;
+  size_t last_va_buffer_calls;
+  struct VaDecoderStats stats;
+  const mfxU8* locked_data;
+  size_t locked_size;
+  // mburakov: Bitstream being decoded, that is a copy of the beginning of the
+  // locked one, see MFXVideoDECODE_LockBitstream.
+  const mfxU8* locked_copy;
 
+  struct Sps sps[MFX_STUB_MAX_SPS];
+  struct Pps pps[MFX_STUB_MAX_PPS];
+  const struct Sps* active_sps;
   mfxU16 crop_rect[4];
   VAPictureParameterBufferHEVC ppb;
   VASliceParameterBufferHEVC spb;
   size_t global_frame_counter;
-  size_t local_frame_counter;
+
+  // mburakov: Picture order count and reference picture set of the picture
+  // currently being decoded, as derived from its slice segment header.
+  int32_t poc;
+  int32_t prev_tid0_poc;
+  struct StRps slice_st_rps;
+  struct RpsEntry rps[32];
+  size_t rps_count;
+  bool pic_output_flag;
+  bool ref_pic_list_modification_flag[2];
+  uint8_t list_entry[2][15];
+
+  // mburakov: State of random access, see 8.1.3, and of gradual decoding
+  // refresh signaled with recovery point SEI, see D.3.8.
+  bool handle_cra_as_bla;
+  bool no_rasl_output;
+  bool recovery_poc_cnt_present;
+  int32_t recovery_poc_cnt;
+  bool recovery_pending;
+  int32_t recovery_poc;
+  bool sync_point;
+
+  // mburakov: NAL units index of the access unit currently being decoded.
+  // It is built by whichever of DecodeHeader and DecodeFrameAsync sees the
+  // access unit first, and dropped once the access unit was decoded.
+  const mfxU8* nalus_end;
+  struct BitstreamNalu nalus[BITSTREAM_MAX_NALUS];
+  size_t nalus_count;
+  size_t nalus_epb_count;
+
+  // mburakov: Everything above starting from parameter sets is HEVC state,
+  // while AV1 keeps its state behind the parser of its bitstream.
+  struct ObuParser av1;
 };
 
+bool VaDecoderAcquireSlot(mfxSession session);
+bool VaDecoderUploadSliceData(mfxSession session, const mfxU8* data,
+                              size_t size, uint32_t* offset);
+bool VaDecoderSubmitPicture(mfxSession session, const void* ppb,
+                            size_t ppb_size, const void* spb, size_t spb_size,
+                            size_t spb_count);
+bool VaDecoderUnlockBitstream(mfxSession session);
+void VaDecoderDestroySlots(mfxSession session);
+
+// mburakov: Session functions are thin wrappers around the decoder, and
+// these are the parts of it that are not exposed in vadecoder.h.
+size_t VaDecoderGetSurfacesCount(const mfxVideoParam* par);
+mfxStatus VaDecoderInitSession(mfxSession session, const mfxVideoParam* par,
+                               const VASurfaceID* surface_ids,
+                               const mfxMemId* mids, size_t count);
+mfxStatus VaDecoderDecodeFrame(mfxSession session, mfxBitstream* bs,
+                               struct VaDecoderPicture* picture);
+
 #endif  // MFX_STUB_MFXSESSION_IMPL_H_
@@ -0,0 +1,1242 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "obu.h"
+
+#include <string.h>
+
+#include "bitstream.h"
+
+#define LENGTH(x) (sizeof(x) / sizeof *(x))
+
+// 3. Symbols and abbreviated terms
+enum {
+  SELECT_SCREEN_CONTENT_TOOLS = 2,
+  SELECT_INTEGER_MV = 2,
+  SUPERRES_NUM = 8,
+  SUPERRES_DENOM_MIN = 9,
+  MAX_TILE_WIDTH = 4096,
+  MAX_TILE_AREA = 4096 * 2304,
+  MAX_TILE_ROWS = 64,
+  MAX_TILE_COLS = 64,
+  MAX_LOOP_FILTER = 63,
+  WARPEDMODEL_PREC_BITS = 16,
+  GM_ABS_TRANS_BITS = 12,
+  GM_ABS_TRANS_ONLY_BITS = 9,
+  GM_ABS_ALPHA_BITS = 12,
+  GM_ALPHA_PREC_BITS = 15,
+  GM_TRANS_PREC_BITS = 6,
+  GM_TRANS_ONLY_PREC_BITS = 3,
+};
+
+// 6.10.24 Global motion params semantics
+enum GmType {
+  IDENTITY = 0,
+  TRANSLATION = 1,
+  ROTZOOM = 2,
+  AFFINE = 3,
+};
+
+// mburakov: These are reference frame names and restoration types, as they
+// are defined throughout the semantics sections.
+enum {
+  LAST_FRAME = 1,
+  ALTREF_FRAME = 7,
+  RESTORE_NONE = 0,
+  RESTORE_WIENER = 1,
+  RESTORE_SGRPROJ = 2,
+  RESTORE_SWITCHABLE = 3,
+};
+
+static int32_t Min(int32_t a, int32_t b) { return a < b ? a : b; }
+static int32_t Max(int32_t a, int32_t b) { return a > b ? a : b; }
+
+static int32_t Clip3(int32_t x, int32_t y, int32_t z) {
+  return z < x ? x : z > y ? y : z;
+}
+
+static uint32_t FloorLog2(uint32_t x) {
+  return (uint32_t)(31 - __builtin_clz(x));
+}
+
+// 5.9.16 Tile size calculation function
+static uint32_t TileLog2(uint32_t blkSize, uint32_t target) {
+  uint32_t k = 0;
+  for (; (blkSize << k) < target; k++);
+  return k;
+}
+
+// 4.10.3 uvlc()
+static uint32_t ReadUvlc(struct Bitstream* bitstream) {
+  size_t leadingZeros = 0;
+  while (!BitstreamReadU(bitstream, 1)) leadingZeros++;
+  if (leadingZeros >= 32) return UINT32_MAX;
+  return (uint32_t)BitstreamReadU(bitstream, leadingZeros) +
+         (1u << leadingZeros) - 1;
+}
+
+// 4.10.6 su(n)
+static int32_t ReadSu(struct Bitstream* bitstream, size_t n) {
+  int32_t value = (int32_t)BitstreamReadU(bitstream, n);
+  int32_t signMask = 1 << (n - 1);
+  return value & signMask ? value - 2 * signMask : value;
+}
+
+// 4.10.7 ns(n)
+static uint32_t ReadNs(struct Bitstream* bitstream, uint32_t n) {
+  uint32_t w = FloorLog2(n) + 1;
+  uint32_t m = (1u << w) - n;
+  uint32_t v = (uint32_t)BitstreamReadU(bitstream, w - 1);
+  if (v < m) return v;
+  uint32_t extra_bit = (uint32_t)BitstreamReadU(bitstream, 1);
+  return (v << 1) - m + extra_bit;
+}
+
+// 4.10.5 leb128()
+static bool ReadLeb128(const uint8_t** data, const uint8_t* end,
+                       uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < 8; i++) {
+    if (*data == end) return false;
+    uint8_t leb128_byte = *(*data)++;
+    *value |= (uint64_t)(leb128_byte & 0x7f) << (i * 7);
+    if (!(leb128_byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// 5.9.2 Uncompressed header syntax, get_relative_dist()
+static int32_t GetRelativeDist(const struct ObuSequenceHeader* seq, int32_t a,
+                               int32_t b) {
+  if (!seq->OrderHintBits) return 0;
+  int32_t diff = a - b;
+  int32_t m = 1 << (seq->OrderHintBits - 1);
+  return (diff & (m - 1)) - (diff & m);
+}
+
+size_t ObuRead(const uint8_t* data, size_t size, struct Obu* obu) {
+  // 5.3.1 General OBU syntax
+  const uint8_t* ptr = data;
+  const uint8_t* end = data + size;
+  if (ptr == end) return 0;
+  uint8_t obu_header = *ptr++;
+  if (obu_header & 0x80) return 0;  // obu_forbidden_bit
+  *obu = (struct Obu){
+      .type = obu_header >> 3 & 0xf,
+      .extension = !!(obu_header & 0x04),
+  };
+  if (obu->extension) {
+    if (ptr == end) return 0;
+    obu->temporal_id = *ptr >> 5;
+    obu->spatial_id = *ptr >> 3 & 0x3;
+    ptr++;
+  }
+  uint64_t obu_size = (uint64_t)(end - ptr);
+  if (obu_header & 0x02 && !ReadLeb128(&ptr, end, &obu_size)) return 0;
+  if (obu_size > (uint64_t)(end - ptr)) return 0;
+  obu->data = ptr;
+  obu->size = (size_t)obu_size;
+  return (size_t)(ptr - data) + obu->size;
+}
+
+// 5.5.2 Color config syntax
+static void ParseColorConfig(struct Bitstream* obu,
+                             struct ObuSequenceHeader* seq) {
+  // mburakov: Surfaces are allocated as NV12, so only 8-bit 4:2:0 content of
+  // the main profile can be decoded into them.
+  if (BitstreamReadU(obu, 1)) longjmp(obu->trap, 1);  // high_bitdepth
+  if (BitstreamReadU(obu, 1)) longjmp(obu->trap, 1);  // mono_chrome
+  seq->ppb.bit_depth_idx = 0;
+  uint64_t color_primaries = 2;           // CP_UNSPECIFIED
+  uint64_t transfer_characteristics = 2;  // TC_UNSPECIFIED
+  uint64_t matrix_coefficients = 2;       // MC_UNSPECIFIED
+  if (BitstreamReadU(obu, 1)) {           // color_description_present_flag
+    color_primaries = BitstreamReadU(obu, 8);
+    transfer_characteristics = BitstreamReadU(obu, 8);
+    matrix_coefficients = BitstreamReadU(obu, 8);
+  }
+  seq->ppb.matrix_coefficients = (uint8_t)matrix_coefficients;
+  if (color_primaries == 1 && transfer_characteristics == 13 &&
+      matrix_coefficients == 0) {
+    // mburakov: This is sRGB, which is 4:4:4 and is not allowed in the main
+    // profile.
+    longjmp(obu->trap, 1);
+  }
+  seq->ppb.seq_info_fields.fields.color_range =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.subsampling_x = 1;
+  seq->ppb.seq_info_fields.fields.subsampling_y = 1;
+  BitstreamReadU(obu, 2);  // chroma_sample_position
+  seq->separate_uv_delta_q = !!BitstreamReadU(obu, 1);
+}
+
+// 5.5.1 General sequence header OBU syntax
+static void ParseSequenceHeader(struct Bitstream* obu,
+                                struct ObuSequenceHeader* seq) {
+  uint64_t seq_profile = BitstreamReadU(obu, 3);
+  if (seq_profile != 0) longjmp(obu->trap, 1);
+  seq->ppb.profile = (uint8_t)seq_profile;
+  seq->ppb.seq_info_fields.fields.still_picture =
+      (uint32_t)BitstreamReadU(obu, 1);
+  // mburakov: Still pictures are never streamed, so reduced header is not
+  // supported, and neither is any field it would have inferred.
+  if (BitstreamReadU(obu, 1)) longjmp(obu->trap, 1);
+
+  uint64_t buffer_delay_length_minus_1 = 0;
+  if (BitstreamReadU(obu, 1)) {  // timing_info_present_flag
+    // 5.5.3 Timing info syntax
+    BitstreamReadU(obu, 32);  // num_units_in_display_tick
+    BitstreamReadU(obu, 32);  // time_scale
+    seq->equal_picture_interval = !!BitstreamReadU(obu, 1);
+    if (seq->equal_picture_interval)
+      ReadUvlc(obu);  // num_ticks_per_picture_minus_1
+    seq->decoder_model_info_present_flag = !!BitstreamReadU(obu, 1);
+    if (seq->decoder_model_info_present_flag) {
+      // 5.5.4 Decoder model info syntax
+      buffer_delay_length_minus_1 = BitstreamReadU(obu, 5);
+      BitstreamReadU(obu, 32);  // num_units_in_decoding_tick
+      seq->buffer_removal_time_length_minus_1 =
+          (uint8_t)BitstreamReadU(obu, 5);
+      seq->frame_presentation_time_length_minus_1 =
+          (uint8_t)BitstreamReadU(obu, 5);
+    }
+  }
+  bool initial_display_delay_present_flag = !!BitstreamReadU(obu, 1);
+  seq->operating_points_cnt_minus_1 = (uint8_t)BitstreamReadU(obu, 5);
+  for (size_t i = 0; i <= seq->operating_points_cnt_minus_1; i++) {
+    seq->operating_point_idc[i] = (uint16_t)BitstreamReadU(obu, 12);
+    uint64_t seq_level_idx = BitstreamReadU(obu, 5);
+    if (seq_level_idx > 7) BitstreamReadU(obu, 1);  // seq_tier
+    if (seq->decoder_model_info_present_flag) {
+      seq->decoder_model_present_for_this_op[i] = !!BitstreamReadU(obu, 1);
+      if (seq->decoder_model_present_for_this_op[i]) {
+        // 5.5.5 Operating parameters info syntax
+        size_t n = buffer_delay_length_minus_1 + 1;
+        BitstreamReadU(obu, n);  // decoder_buffer_delay
+        BitstreamReadU(obu, n);  // encoder_buffer_delay
+        BitstreamReadU(obu, 1);  // low_delay_mode_flag
+      }
+    }
+    if (initial_display_delay_present_flag) {
+      // initial_display_delay_present_for_this_op
+      if (BitstreamReadU(obu, 1))
+        BitstreamReadU(obu, 4);  // initial_display_delay_minus_1
+    }
+  }
+
+  seq->frame_width_bits_minus_1 = (uint8_t)BitstreamReadU(obu, 4);
+  seq->frame_height_bits_minus_1 = (uint8_t)BitstreamReadU(obu, 4);
+  seq->max_frame_width_minus_1 =
+      (uint16_t)BitstreamReadU(obu, seq->frame_width_bits_minus_1 + 1u);
+  seq->max_frame_height_minus_1 =
+      (uint16_t)BitstreamReadU(obu, seq->frame_height_bits_minus_1 + 1u);
+  seq->frame_id_numbers_present_flag = !!BitstreamReadU(obu, 1);
+  if (seq->frame_id_numbers_present_flag) {
+    seq->delta_frame_id_length_minus_2 = (uint8_t)BitstreamReadU(obu, 4);
+    seq->additional_frame_id_length_minus_1 = (uint8_t)BitstreamReadU(obu, 3);
+  }
+  seq->ppb.seq_info_fields.fields.use_128x128_superblock =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_filter_intra =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_intra_edge_filter =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_interintra_compound =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_masked_compound =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->enable_warped_motion = !!BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_dual_filter =
+      (uint32_t)BitstreamReadU(obu, 1);
+  bool enable_order_hint = !!BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_order_hint = enable_order_hint;
+  if (enable_order_hint) {
+    seq->ppb.seq_info_fields.fields.enable_jnt_comp =
+        (uint32_t)BitstreamReadU(obu, 1);
+    seq->enable_ref_frame_mvs = !!BitstreamReadU(obu, 1);
+  }
+  seq->seq_force_screen_content_tools = SELECT_SCREEN_CONTENT_TOOLS;
+  if (!BitstreamReadU(obu, 1)) {  // seq_choose_screen_content_tools
+    seq->seq_force_screen_content_tools = (uint8_t)BitstreamReadU(obu, 1);
+  }
+  seq->seq_force_integer_mv = SELECT_INTEGER_MV;
+  if (seq->seq_force_screen_content_tools > 0 &&
+      !BitstreamReadU(obu, 1)) {  // seq_choose_integer_mv
+    seq->seq_force_integer_mv = (uint8_t)BitstreamReadU(obu, 1);
+  }
+  if (enable_order_hint) {
+    uint64_t order_hint_bits_minus_1 = BitstreamReadU(obu, 3);
+    seq->ppb.order_hint_bits_minus_1 = (uint8_t)order_hint_bits_minus_1;
+    seq->OrderHintBits = (uint8_t)(order_hint_bits_minus_1 + 1);
+  }
+  seq->enable_superres = !!BitstreamReadU(obu, 1);
+  seq->ppb.seq_info_fields.fields.enable_cdef =
+      (uint32_t)BitstreamReadU(obu, 1);
+  seq->enable_restoration = !!BitstreamReadU(obu, 1);
+  ParseColorConfig(obu, seq);
+  seq->ppb.seq_info_fields.fields.film_grain_params_present =
+      (uint32_t)BitstreamReadU(obu, 1);
+}
+
+bool ObuParseSequenceHeader(struct ObuParser* parser, const struct Obu* obu) {
+  struct Bitstream bitstream = BitstreamCreate(obu->data, obu->size);
+  if (BitstreamReadFailed(&bitstream)) {
+    return false;
+  }
+  struct ObuSequenceHeader seq = {.valid = true};
+  ParseSequenceHeader(&bitstream, &seq);
+  parser->seq = seq;
+  return true;
+}
+
+// 5.9.8 Superres params syntax
+static void ParseSuperresParams(struct Bitstream* obu,
+                                struct ObuParser* parser) {
+  bool use_superres = false;
+  if (parser->seq.enable_superres) use_superres = !!BitstreamReadU(obu, 1);
+  uint32_t SuperresDenom = SUPERRES_NUM;
+  if (use_superres) {
+    uint64_t coded_denom = BitstreamReadU(obu, 3);
+    SuperresDenom = (uint32_t)coded_denom + SUPERRES_DENOM_MIN;
+  }
+  parser->ppb.pic_info_fields.bits.use_superres = use_superres;
+  parser->ppb.superres_scale_denominator = (uint8_t)SuperresDenom;
+  struct ObuRefFrame* frame = &parser->frame;
+  frame->upscaled_width = frame->frame_width;
+  frame->frame_width = (uint16_t)(
+      (frame->upscaled_width * SUPERRES_NUM + (SuperresDenom / 2)) /
+      SuperresDenom);
+}
+
+// 5.9.9 Compute image size function
+static void ComputeImageSize(struct ObuParser* parser) {
+  parser->mi_cols = (uint16_t)(2 * ((parser->frame.frame_width + 7) >> 3));
+  parser->mi_rows = (uint16_t)(2 * ((parser->frame.frame_height + 7) >> 3));
+}
+
+// 5.9.5 Frame size syntax
+static void ParseFrameSize(struct Bitstream* obu, struct ObuParser* parser,
+                           bool frame_size_override_flag) {
+  const struct ObuSequenceHeader* seq = &parser->seq;
+  struct ObuRefFrame* frame = &parser->frame;
+  if (frame_size_override_flag) {
+    frame->frame_width =
+        (uint16_t)(BitstreamReadU(obu, seq->frame_width_bits_minus_1 + 1u) +
+                   1);
+    frame->frame_height =
+        (uint16_t)(BitstreamReadU(obu, seq->frame_height_bits_minus_1 + 1u) +
+                   1);
+  } else {
+    frame->frame_width = (uint16_t)(seq->max_frame_width_minus_1 + 1);
+    frame->frame_height = (uint16_t)(seq->max_frame_height_minus_1 + 1);
+  }
+  ParseSuperresParams(obu, parser);
+  ComputeImageSize(parser);
+}
+
+// 5.9.6 Render size syntax
+static void ParseRenderSize(struct Bitstream* obu, struct ObuParser* parser) {
+  struct ObuRefFrame* frame = &parser->frame;
+  frame->render_width = frame->upscaled_width;
+  frame->render_height = frame->frame_height;
+  if (BitstreamReadU(obu, 1)) {  // render_and_frame_size_different
+    frame->render_width = (uint16_t)(BitstreamReadU(obu, 16) + 1);
+    frame->render_height = (uint16_t)(BitstreamReadU(obu, 16) + 1);
+  }
+}
+
+// 5.9.7 Frame size with refs syntax
+static void ParseFrameSizeWithRefs(struct Bitstream* obu,
+                                   struct ObuParser* parser,
+                                   bool frame_size_override_flag) {
+  struct ObuRefFrame* frame = &parser->frame;
+  for (size_t i = 0; i < OBU_REFS_PER_FRAME; i++) {
+    if (!BitstreamReadU(obu, 1)) continue;  // found_ref
+    const struct ObuRefFrame* ref =
+        &parser->refs[parser->ppb.ref_frame_idx[i]];
+    frame->upscaled_width = ref->upscaled_width;
+    frame->frame_width = frame->upscaled_width;
+    frame->frame_height = ref->frame_height;
+    frame->render_width = ref->render_width;
+    frame->render_height = ref->render_height;
+    ParseSuperresParams(obu, parser);
+    ComputeImageSize(parser);
+    return;
+  }
+  ParseFrameSize(obu, parser, frame_size_override_flag);
+  ParseRenderSize(obu, parser);
+}
+
+// 7.20 Reference frame update process, setup_past_independence()
+static void SetupPastIndependence(struct ObuParser* parser) {
+  static const int8_t kLoopFilterRefDeltas[] = {1, 0, 0, 0, -1, 0, -1, -1};
+  struct ObuRefFrame* frame = &parser->frame;
+  memset(frame->feature_mask, 0, sizeof(frame->feature_mask));
+  memset(frame->feature_data, 0, sizeof(frame->feature_data));
+  for (size_t ref = LAST_FRAME; ref <= ALTREF_FRAME; ref++) {
+    for (size_t i = 0; i < 6; i++) {
+      parser->prev_gm_params[ref][i] =
+          (i % 3 == 2) ? 1 << WARPEDMODEL_PREC_BITS : 0;
+    }
+  }
+  memcpy(frame->loop_filter_ref_deltas, kLoopFilterRefDeltas,
+         sizeof(kLoopFilterRefDeltas));
+  memset(frame->loop_filter_mode_deltas, 0,
+         sizeof(frame->loop_filter_mode_deltas));
+}
+
+// 7.21 Reference frame loading process, load_previous()
+static void LoadPrevious(struct ObuParser* parser) {
+  uint8_t prevFrame = parser->ppb.ref_frame_idx[parser->ppb.primary_ref_frame];
+  const struct ObuRefFrame* ref = &parser->refs[prevFrame];
+  struct ObuRefFrame* frame = &parser->frame;
+  memcpy(parser->prev_gm_params, ref->gm_params,
+         sizeof(parser->prev_gm_params));
+  memcpy(frame->loop_filter_ref_deltas, ref->loop_filter_ref_deltas,
+         sizeof(frame->loop_filter_ref_deltas));
+  memcpy(frame->loop_filter_mode_deltas, ref->loop_filter_mode_deltas,
+         sizeof(frame->loop_filter_mode_deltas));
+  memcpy(frame->feature_mask, ref->feature_mask, sizeof(frame->feature_mask));
+  memcpy(frame->feature_data, ref->feature_data, sizeof(frame->feature_data));
+}
+
+// 5.9.15 Tile info syntax
+static void ParseTileInfo(struct Bitstream* obu, struct ObuParser* parser) {
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  bool use_128x128_superblock =
+      ppb->seq_info_fields.fields.use_128x128_superblock;
+  uint32_t sbCols = use_128x128_superblock ? ((parser->mi_cols + 31u) >> 5)
+                                           : ((parser->mi_cols + 15u) >> 4);
+  uint32_t sbRows = use_128x128_superblock ? ((parser->mi_rows + 31u) >> 5)
+                                           : ((parser->mi_rows + 15u) >> 4);
+  uint32_t sbShift = use_128x128_superblock ? 5 : 4;
+  uint32_t sbSize = sbShift + 2;
+  uint32_t maxTileWidthSb = MAX_TILE_WIDTH >> sbSize;
+  uint32_t maxTileAreaSb = MAX_TILE_AREA >> (2 * sbSize);
+  uint32_t minLog2TileCols = TileLog2(maxTileWidthSb, sbCols);
+  uint32_t maxLog2TileCols =
+      TileLog2(1, (uint32_t)Min((int32_t)sbCols, MAX_TILE_COLS));
+  uint32_t maxLog2TileRows =
+      TileLog2(1, (uint32_t)Min((int32_t)sbRows, MAX_TILE_ROWS));
+  uint32_t minLog2Tiles =
+      (uint32_t)Max((int32_t)minLog2TileCols,
+                    (int32_t)TileLog2(maxTileAreaSb, sbRows * sbCols));
+
+  // mburakov: Sizes of tiles are stored right into the picture parameter
+  // buffer, which has no room for the last column and row. These are
+  // implied by the size of the frame anyway.
+  uint32_t TileCols = 0;
+  uint32_t TileRows = 0;
+  uint32_t TileColsLog2;
+  uint32_t TileRowsLog2;
+  bool uniform_tile_spacing_flag = !!BitstreamReadU(obu, 1);
+  if (uniform_tile_spacing_flag) {
+    TileColsLog2 = minLog2TileCols;
+    while (TileColsLog2 < maxLog2TileCols) {
+      if (!BitstreamReadU(obu, 1)) break;  // increment_tile_cols_log2
+      TileColsLog2++;
+    }
+    uint32_t tileWidthSb = (sbCols + (1u << TileColsLog2) - 1) >> TileColsLog2;
+    for (uint32_t startSb = 0; startSb < sbCols; startSb += tileWidthSb) {
+      if (TileCols < LENGTH(ppb->width_in_sbs_minus_1)) {
+        ppb->width_in_sbs_minus_1[TileCols] =
+            (uint16_t)(Min((int32_t)tileWidthSb, (int32_t)(sbCols - startSb)) -
+                       1);
+      }
+      TileCols++;
+    }
+    uint32_t minLog2TileRows =
+        (uint32_t)Max((int32_t)minLog2Tiles - (int32_t)TileColsLog2, 0);
+    TileRowsLog2 = minLog2TileRows;
+    while (TileRowsLog2 < maxLog2TileRows) {
+      if (!BitstreamReadU(obu, 1)) break;  // increment_tile_rows_log2
+      TileRowsLog2++;
+    }
+    uint32_t tileHeightSb =
+        (sbRows + (1u << TileRowsLog2) - 1) >> TileRowsLog2;
+    for (uint32_t startSb = 0; startSb < sbRows; startSb += tileHeightSb) {
+      if (TileRows < LENGTH(ppb->height_in_sbs_minus_1)) {
+        ppb->height_in_sbs_minus_1[TileRows] = (uint16_t)(
+            Min((int32_t)tileHeightSb, (int32_t)(sbRows - startSb)) - 1);
+      }
+      TileRows++;
+    }
+  } else {
+    uint32_t widestTileSb = 0;
+    for (uint32_t startSb = 0; startSb < sbCols; TileCols++) {
+      if (TileCols == MAX_TILE_COLS) longjmp(obu->trap, 1);
+      uint32_t maxWidth =
+          (uint32_t)Min((int32_t)(sbCols - startSb), (int32_t)maxTileWidthSb);
+      uint32_t width_in_sbs_minus_1 = ReadNs(obu, maxWidth);
+      if (TileCols < LENGTH(ppb->width_in_sbs_minus_1))
+        ppb->width_in_sbs_minus_1[TileCols] = (uint16_t)width_in_sbs_minus_1;
+      uint32_t sizeSb = width_in_sbs_minus_1 + 1;
+      widestTileSb = (uint32_t)Max((int32_t)sizeSb, (int32_t)widestTileSb);
+      startSb += sizeSb;
+    }
+    TileColsLog2 = TileLog2(1, TileCols);
+
+    if (minLog2Tiles > 0) {
+      maxTileAreaSb = (sbRows * sbCols) >> (minLog2Tiles + 1);
+    } else {
+      maxTileAreaSb = sbRows * sbCols;
+    }
+    uint32_t maxTileHeightSb =
+        (uint32_t)Max((int32_t)(maxTileAreaSb / widestTileSb), 1);
+    for (uint32_t startSb = 0; startSb < sbRows; TileRows++) {
+      if (TileRows == MAX_TILE_ROWS) longjmp(obu->trap, 1);
+      uint32_t maxHeight =
+          (uint32_t)Min((int32_t)(sbRows - startSb), (int32_t)maxTileHeightSb);
+      uint32_t height_in_sbs_minus_1 = ReadNs(obu, maxHeight);
+      if (TileRows < LENGTH(ppb->height_in_sbs_minus_1)) {
+        ppb->height_in_sbs_minus_1[TileRows] =
+            (uint16_t)height_in_sbs_minus_1;
+      }
+      startSb += height_in_sbs_minus_1 + 1;
+    }
+    TileRowsLog2 = TileLog2(1, TileRows);
+  }
+  if (TileCols * TileRows > OBU_MAX_TILES) longjmp(obu->trap, 1);
+
+  ppb->pic_info_fields.bits.uniform_tile_spacing_flag =
+      uniform_tile_spacing_flag;
+  ppb->tile_cols = (uint8_t)TileCols;
+  ppb->tile_rows = (uint8_t)TileRows;
+  ppb->tile_count_minus_1 = (uint16_t)(TileCols * TileRows - 1);
+  ppb->context_update_tile_id = 0;
+  parser->tile_cols_log2 = (uint8_t)TileColsLog2;
+  parser->tile_rows_log2 = (uint8_t)TileRowsLog2;
+  parser->tile_size_bytes = 4;
+  if (TileColsLog2 > 0 || TileRowsLog2 > 0) {
+    ppb->context_update_tile_id =
+        (uint16_t)BitstreamReadU(obu, TileRowsLog2 + TileColsLog2);
+    parser->tile_size_bytes = (uint8_t)(BitstreamReadU(obu, 2) + 1);
+  }
+}
+
+// 5.9.13 Delta quantizer syntax
+static int8_t ReadDeltaQ(struct Bitstream* obu) {
+  if (!BitstreamReadU(obu, 1)) return 0;  // delta_coded
+  return (int8_t)ReadSu(obu, 1 + 6);
+}
+
+// 5.9.12 Quantization params syntax
+static void ParseQuantizationParams(struct Bitstream* obu,
+                                    struct ObuParser* parser) {
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  ppb->base_qindex = (uint8_t)BitstreamReadU(obu, 8);
+  ppb->y_dc_delta_q = ReadDeltaQ(obu);
+  bool diff_uv_delta = false;
+  if (parser->seq.separate_uv_delta_q) diff_uv_delta = !!BitstreamReadU(obu, 1);
+  ppb->u_dc_delta_q = ReadDeltaQ(obu);
+  ppb->u_ac_delta_q = ReadDeltaQ(obu);
+  if (diff_uv_delta) {
+    ppb->v_dc_delta_q = ReadDeltaQ(obu);
+    ppb->v_ac_delta_q = ReadDeltaQ(obu);
+  } else {
+    ppb->v_dc_delta_q = ppb->u_dc_delta_q;
+    ppb->v_ac_delta_q = ppb->u_ac_delta_q;
+  }
+  ppb->qmatrix_fields.bits.using_qmatrix = (uint16_t)BitstreamReadU(obu, 1);
+  if (ppb->qmatrix_fields.bits.using_qmatrix) {
+    ppb->qmatrix_fields.bits.qm_y = (uint16_t)BitstreamReadU(obu, 4);
+    ppb->qmatrix_fields.bits.qm_u = (uint16_t)BitstreamReadU(obu, 4);
+    if (!parser->seq.separate_uv_delta_q) {
+      ppb->qmatrix_fields.bits.qm_v = ppb->qmatrix_fields.bits.qm_u;
+    } else {
+      ppb->qmatrix_fields.bits.qm_v = (uint16_t)BitstreamReadU(obu, 4);
+    }
+  }
+}
+
+// 5.9.14 Segmentation params syntax
+static void ParseSegmentationParams(struct Bitstream* obu,
+                                    struct ObuParser* parser) {
+  static const uint8_t kSegmentationFeatureBits[OBU_SEG_LVL_MAX] = {
+      8, 6, 6, 6, 6, 3, 0, 0};
+  static const bool kSegmentationFeatureSigned[OBU_SEG_LVL_MAX] = {
+      1, 1, 1, 1, 1, 0, 0, 0};
+  static const int16_t kSegmentationFeatureMax[OBU_SEG_LVL_MAX] = {
+      255, MAX_LOOP_FILTER, MAX_LOOP_FILTER, MAX_LOOP_FILTER,
+      MAX_LOOP_FILTER, 7, 0, 0};
+
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  struct ObuRefFrame* frame = &parser->frame;
+  bool segmentation_enabled = !!BitstreamReadU(obu, 1);
+  ppb->seg_info.segment_info_fields.bits.enabled = segmentation_enabled;
+  if (!segmentation_enabled) {
+    memset(frame->feature_mask, 0, sizeof(frame->feature_mask));
+    memset(frame->feature_data, 0, sizeof(frame->feature_data));
+    return;
+  }
+
+  bool segmentation_update_map = true;
+  bool segmentation_temporal_update = false;
+  bool segmentation_update_data = true;
+  if (ppb->primary_ref_frame != OBU_PRIMARY_REF_NONE) {
+    segmentation_update_map = !!BitstreamReadU(obu, 1);
+    if (segmentation_update_map)
+      segmentation_temporal_update = !!BitstreamReadU(obu, 1);
+    segmentation_update_data = !!BitstreamReadU(obu, 1);
+  }
+  ppb->seg_info.segment_info_fields.bits.update_map = segmentation_update_map;
+  ppb->seg_info.segment_info_fields.bits.temporal_update =
+      segmentation_temporal_update;
+  ppb->seg_info.segment_info_fields.bits.update_data =
+      segmentation_update_data;
+  if (!segmentation_update_data) return;
+
+  for (size_t i = 0; i < OBU_MAX_SEGMENTS; i++) {
+    frame->feature_mask[i] = 0;
+    for (size_t j = 0; j < OBU_SEG_LVL_MAX; j++) {
+      int32_t clippedValue = 0;
+      if (BitstreamReadU(obu, 1)) {  // feature_enabled
+        frame->feature_mask[i] |= (uint8_t)(1 << j);
+        size_t bitsToRead = kSegmentationFeatureBits[j];
+        int32_t limit = kSegmentationFeatureMax[j];
+        if (kSegmentationFeatureSigned[j]) {
+          int32_t feature_value = ReadSu(obu, 1 + bitsToRead);
+          clippedValue = Clip3(-limit, limit, feature_value);
+        } else {
+          int32_t feature_value = (int32_t)BitstreamReadU(obu, bitsToRead);
+          clippedValue = Clip3(0, limit, feature_value);
+        }
+      }
+      frame->feature_data[i][j] = (int16_t)clippedValue;
+    }
+  }
+}
+
+// 5.9.17 Quantizer index delta parameters syntax
+// 5.9.18 Loop filter delta parameters syntax
+static void ParseDeltaParams(struct Bitstream* obu, struct ObuParser* parser) {
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  if (ppb->base_qindex > 0) {
+    ppb->mode_control_fields.bits.delta_q_present_flag =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+  if (!ppb->mode_control_fields.bits.delta_q_present_flag) return;
+  ppb->mode_control_fields.bits.log2_delta_q_res =
+      (uint32_t)BitstreamReadU(obu, 2);
+  if (!ppb->pic_info_fields.bits.allow_intrabc) {
+    ppb->mode_control_fields.bits.delta_lf_present_flag =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+  if (ppb->mode_control_fields.bits.delta_lf_present_flag) {
+    ppb->mode_control_fields.bits.log2_delta_lf_res =
+        (uint32_t)BitstreamReadU(obu, 2);
+    ppb->mode_control_fields.bits.delta_lf_multi =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+}
+
+// 7.12.2 Dequantization functions, get_qindex() with ignoreDeltaQ set
+static bool IsCodedLossless(const struct ObuParser* parser) {
+  const VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  if (ppb->y_dc_delta_q || ppb->u_dc_delta_q || ppb->u_ac_delta_q ||
+      ppb->v_dc_delta_q || ppb->v_ac_delta_q) {
+    return false;
+  }
+  for (size_t segmentId = 0; segmentId < OBU_MAX_SEGMENTS; segmentId++) {
+    int32_t qindex = ppb->base_qindex;
+    if (ppb->seg_info.segment_info_fields.bits.enabled &&
+        parser->frame.feature_mask[segmentId] & 1) {  // SEG_LVL_ALT_Q
+      qindex = Clip3(0, 255,
+                     qindex + parser->frame.feature_data[segmentId][0]);
+    }
+    if (qindex) return false;
+  }
+  return true;
+}
+
+// 5.9.11 Loop filter params syntax
+static void ParseLoopFilterParams(struct Bitstream* obu,
+                                  struct ObuParser* parser,
+                                  bool CodedLossless) {
+  static const int8_t kLoopFilterRefDeltas[] = {1, 0, 0, 0, -1, 0, -1, -1};
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  struct ObuRefFrame* frame = &parser->frame;
+  if (CodedLossless || ppb->pic_info_fields.bits.allow_intrabc) {
+    memcpy(frame->loop_filter_ref_deltas, kLoopFilterRefDeltas,
+           sizeof(kLoopFilterRefDeltas));
+    memset(frame->loop_filter_mode_deltas, 0,
+           sizeof(frame->loop_filter_mode_deltas));
+    return;
+  }
+  ppb->filter_level[0] = (uint8_t)BitstreamReadU(obu, 6);
+  ppb->filter_level[1] = (uint8_t)BitstreamReadU(obu, 6);
+  if (ppb->filter_level[0] || ppb->filter_level[1]) {
+    ppb->filter_level_u = (uint8_t)BitstreamReadU(obu, 6);
+    ppb->filter_level_v = (uint8_t)BitstreamReadU(obu, 6);
+  }
+  ppb->loop_filter_info_fields.bits.sharpness_level =
+      (uint8_t)BitstreamReadU(obu, 3);
+  ppb->loop_filter_info_fields.bits.mode_ref_delta_enabled =
+      (uint8_t)BitstreamReadU(obu, 1);
+  if (!ppb->loop_filter_info_fields.bits.mode_ref_delta_enabled) return;
+  ppb->loop_filter_info_fields.bits.mode_ref_delta_update =
+      (uint8_t)BitstreamReadU(obu, 1);
+  if (!ppb->loop_filter_info_fields.bits.mode_ref_delta_update) return;
+  for (size_t i = 0; i < OBU_TOTAL_REFS_PER_FRAME; i++) {
+    if (BitstreamReadU(obu, 1))  // update_ref_delta
+      frame->loop_filter_ref_deltas[i] = (int8_t)ReadSu(obu, 1 + 6);
+  }
+  for (size_t i = 0; i < 2; i++) {
+    if (BitstreamReadU(obu, 1))  // update_mode_delta
+      frame->loop_filter_mode_deltas[i] = (int8_t)ReadSu(obu, 1 + 6);
+  }
+}
+
+// 5.9.19 CDEF params syntax
+static void ParseCdefParams(struct Bitstream* obu, struct ObuParser* parser,
+                            bool CodedLossless) {
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  if (CodedLossless || ppb->pic_info_fields.bits.allow_intrabc ||
+      !ppb->seq_info_fields.fields.enable_cdef) {
+    return;
+  }
+  ppb->cdef_damping_minus_3 = (uint8_t)BitstreamReadU(obu, 2);
+  ppb->cdef_bits = (uint8_t)BitstreamReadU(obu, 2);
+  for (size_t i = 0; i < (1u << ppb->cdef_bits); i++) {
+    // mburakov: VA wants primary and secondary strengths packed together,
+    // and secondary ones not adjusted yet.
+    ppb->cdef_y_strengths[i] = (uint8_t)BitstreamReadU(obu, 4 + 2);
+    ppb->cdef_uv_strengths[i] = (uint8_t)BitstreamReadU(obu, 4 + 2);
+  }
+}
+
+// 5.9.20 Loop restoration params syntax
+static void ParseLrParams(struct Bitstream* obu, struct ObuParser* parser,
+                          bool AllLossless) {
+  static const uint16_t kRemapLrType[] = {
+      RESTORE_NONE, RESTORE_SWITCHABLE, RESTORE_WIENER, RESTORE_SGRPROJ};
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  if (AllLossless || ppb->pic_info_fields.bits.allow_intrabc ||
+      !parser->seq.enable_restoration) {
+    return;
+  }
+  uint16_t FrameRestorationType[3];
+  bool UsesLr = false;
+  bool usesChromaLr = false;
+  for (size_t i = 0; i < LENGTH(FrameRestorationType); i++) {
+    FrameRestorationType[i] = kRemapLrType[BitstreamReadU(obu, 2)];
+    if (FrameRestorationType[i] != RESTORE_NONE) {
+      UsesLr = true;
+      if (i > 0) usesChromaLr = true;
+    }
+  }
+  ppb->loop_restoration_fields.bits.yframe_restoration_type =
+      FrameRestorationType[0];
+  ppb->loop_restoration_fields.bits.cbframe_restoration_type =
+      FrameRestorationType[1];
+  ppb->loop_restoration_fields.bits.crframe_restoration_type =
+      FrameRestorationType[2];
+  if (!UsesLr) return;
+
+  uint16_t lr_unit_shift = (uint16_t)BitstreamReadU(obu, 1);
+  if (ppb->seq_info_fields.fields.use_128x128_superblock) {
+    lr_unit_shift++;
+  } else if (lr_unit_shift) {
+    lr_unit_shift += (uint16_t)BitstreamReadU(obu, 1);  // lr_unit_extra_shift
+  }
+  ppb->loop_restoration_fields.bits.lr_unit_shift = lr_unit_shift;
+  // mburakov: Chroma is always subsampled in both directions here.
+  if (usesChromaLr) {
+    ppb->loop_restoration_fields.bits.lr_uv_shift =
+        (uint16_t)BitstreamReadU(obu, 1);
+  }
+}
+
+// 5.9.22 Skip mode params syntax
+static bool IsSkipModeAllowed(const struct ObuParser* parser) {
+  const struct ObuSequenceHeader* seq = &parser->seq;
+  const VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  int32_t forwardIdx = -1;
+  int32_t backwardIdx = -1;
+  int32_t forwardHint = 0;
+  int32_t backwardHint = 0;
+  for (int32_t i = 0; i < OBU_REFS_PER_FRAME; i++) {
+    int32_t refHint = parser->refs[ppb->ref_frame_idx[i]].order_hint;
+    if (GetRelativeDist(seq, refHint, ppb->order_hint) < 0) {
+      if (forwardIdx < 0 || GetRelativeDist(seq, refHint, forwardHint) > 0) {
+        forwardIdx = i;
+        forwardHint = refHint;
+      }
+    } else if (GetRelativeDist(seq, refHint, ppb->order_hint) > 0) {
+      if (backwardIdx < 0 ||
+          GetRelativeDist(seq, refHint, backwardHint) < 0) {
+        backwardIdx = i;
+        backwardHint = refHint;
+      }
+    }
+  }
+  if (forwardIdx < 0) return false;
+  if (backwardIdx >= 0) return true;
+
+  int32_t secondForwardIdx = -1;
+  int32_t secondForwardHint = 0;
+  for (int32_t i = 0; i < OBU_REFS_PER_FRAME; i++) {
+    int32_t refHint = parser->refs[ppb->ref_frame_idx[i]].order_hint;
+    if (GetRelativeDist(seq, refHint, forwardHint) < 0) {
+      if (secondForwardIdx < 0 ||
+          GetRelativeDist(seq, refHint, secondForwardHint) > 0) {
+        secondForwardIdx = i;
+        secondForwardHint = refHint;
+      }
+    }
+  }
+  return secondForwardIdx >= 0;
+}
+
+// 5.9.28 Decode subexp syntax
+static int32_t DecodeSubexp(struct Bitstream* obu, int32_t numSyms) {
+  int32_t i = 0;
+  int32_t mk = 0;
+  int32_t k = 3;
+  for (;;) {
+    int32_t b2 = i ? k + i - 1 : k;
+    int32_t a = 1 << b2;
+    if (numSyms <= mk + 3 * a) {
+      int32_t subexp_final_bits =
+          (int32_t)ReadNs(obu, (uint32_t)(numSyms - mk));
+      return subexp_final_bits + mk;
+    }
+    if (!BitstreamReadU(obu, 1)) {  // subexp_more_bits
+      int32_t subexp_bits = (int32_t)BitstreamReadU(obu, (size_t)b2);
+      return subexp_bits + mk;
+    }
+    i++;
+    mk += a;
+  }
+}
+
+// 5.9.27 Inverse recenter function
+static int32_t InverseRecenter(int32_t r, int32_t v) {
+  if (v > 2 * r) return v;
+  if (v & 1) return r - ((v + 1) >> 1);
+  return r + (v >> 1);
+}
+
+// 5.9.26 Decode unsigned subexp with ref syntax
+static int32_t DecodeUnsignedSubexpWithRef(struct Bitstream* obu, int32_t mx,
+                                           int32_t r) {
+  int32_t v = DecodeSubexp(obu, mx);
+  if ((r << 1) <= mx) return InverseRecenter(r, v);
+  return mx - 1 - InverseRecenter(mx - 1 - r, v);
+}
+
+// 5.9.25 Decode signed subexp with ref syntax
+static int32_t DecodeSignedSubexpWithRef(struct Bitstream* obu, int32_t low,
+                                         int32_t high, int32_t r) {
+  int32_t x = DecodeUnsignedSubexpWithRef(obu, high - low, r - low);
+  return x + low;
+}
+
+// 5.9.24 Global param syntax
+static void ParseGlobalParam(struct Bitstream* obu, struct ObuParser* parser,
+                             enum GmType type, size_t ref, size_t idx) {
+  int32_t absBits = GM_ABS_ALPHA_BITS;
+  int32_t precBits = GM_ALPHA_PREC_BITS;
+  if (idx < 2) {
+    if (type == TRANSLATION) {
+      int32_t allow_high_precision_mv =
+          parser->ppb.pic_info_fields.bits.allow_high_precision_mv;
+      absBits = GM_ABS_TRANS_ONLY_BITS - !allow_high_precision_mv;
+      precBits = GM_TRANS_ONLY_PREC_BITS - !allow_high_precision_mv;
+    } else {
+      absBits = GM_ABS_TRANS_BITS;
+      precBits = GM_TRANS_PREC_BITS;
+    }
+  }
+  int32_t precDiff = WARPEDMODEL_PREC_BITS - precBits;
+  int32_t round = (idx % 3) == 2 ? (1 << WARPEDMODEL_PREC_BITS) : 0;
+  int32_t sub = (idx % 3) == 2 ? (1 << precBits) : 0;
+  int32_t mx = (1 << absBits);
+  int32_t r = (parser->prev_gm_params[ref][idx] >> precDiff) - sub;
+  parser->frame.gm_params[ref][idx] =
+      DecodeSignedSubexpWithRef(obu, -mx, mx + 1, r) * (1 << precDiff) + round;
+}
+
+// 5.9.23 Global motion params syntax
+static void ParseGlobalMotionParams(struct Bitstream* obu,
+                                    struct ObuParser* parser,
+                                    bool FrameIsIntra) {
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  int32_t(*gm_params)[6] = parser->frame.gm_params;
+  for (size_t ref = LAST_FRAME; ref <= ALTREF_FRAME; ref++) {
+    ppb->wm[ref - LAST_FRAME].wmtype = VAAV1TransformationIdentity;
+    for (size_t i = 0; i < 6; i++) {
+      gm_params[ref][i] = (i % 3 == 2) ? 1 << WARPEDMODEL_PREC_BITS : 0;
+    }
+  }
+  if (FrameIsIntra) return;
+
+  for (size_t ref = LAST_FRAME; ref <= ALTREF_FRAME; ref++) {
+    enum GmType type = IDENTITY;
+    if (BitstreamReadU(obu, 1)) {    // is_global
+      if (BitstreamReadU(obu, 1)) {  // is_rot_zoom
+        type = ROTZOOM;
+      } else {
+        type = BitstreamReadU(obu, 1) ? TRANSLATION : AFFINE;
+      }
+    }
+    ppb->wm[ref - LAST_FRAME].wmtype = (VAAV1TransformationType)type;
+    if (type >= ROTZOOM) {
+      ParseGlobalParam(obu, parser, type, ref, 2);
+      ParseGlobalParam(obu, parser, type, ref, 3);
+      if (type == AFFINE) {
+        ParseGlobalParam(obu, parser, type, ref, 4);
+        ParseGlobalParam(obu, parser, type, ref, 5);
+      } else {
+        gm_params[ref][4] = -gm_params[ref][3];
+        gm_params[ref][5] = gm_params[ref][2];
+      }
+    }
+    if (type >= TRANSLATION) {
+      ParseGlobalParam(obu, parser, type, ref, 0);
+      ParseGlobalParam(obu, parser, type, ref, 1);
+    }
+  }
+}
+
+// 5.9.2 Uncompressed header syntax
+static void ParseUncompressedHeader(struct Bitstream* obu,
+                                    struct ObuParser* parser,
+                                    const struct Obu* header) {
+  const struct ObuSequenceHeader* seq = &parser->seq;
+  struct ObuRefFrame* frame = &parser->frame;
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  *frame = (struct ObuRefFrame){.valid = true};
+  *ppb = seq->ppb;
+
+  size_t idLen = 0;
+  if (seq->frame_id_numbers_present_flag) {
+    idLen = seq->additional_frame_id_length_minus_1 +
+            seq->delta_frame_id_length_minus_2 + 3u;
+  }
+  const uint8_t allFrames = (1 << OBU_NUM_REF_FRAMES) - 1;
+  bool temporal_point_info = seq->decoder_model_info_present_flag &&
+                             !seq->equal_picture_interval;
+  parser->show_existing_frame = !!BitstreamReadU(obu, 1);
+  if (parser->show_existing_frame) {
+    parser->frame_to_show_map_idx = (uint8_t)BitstreamReadU(obu, 3);
+    if (temporal_point_info) {
+      // frame_presentation_time
+      BitstreamReadU(obu, seq->frame_presentation_time_length_minus_1 + 1u);
+    }
+    if (seq->frame_id_numbers_present_flag)
+      BitstreamReadU(obu, idLen);  // display_frame_id
+    const struct ObuRefFrame* ref =
+        &parser->refs[parser->frame_to_show_map_idx];
+    if (!ref->valid) longjmp(obu->trap, 1);
+    *frame = *ref;
+    parser->refresh_frame_flags =
+        frame->frame_type == OBU_KEY_FRAME ? allFrames : 0;
+    return;
+  }
+
+  frame->frame_type = (uint8_t)BitstreamReadU(obu, 2);
+  bool FrameIsIntra = frame->frame_type == OBU_INTRA_ONLY_FRAME ||
+                      frame->frame_type == OBU_KEY_FRAME;
+  bool show_frame = !!BitstreamReadU(obu, 1);
+  if (show_frame && temporal_point_info) {
+    // frame_presentation_time
+    BitstreamReadU(obu, seq->frame_presentation_time_length_minus_1 + 1u);
+  }
+  bool showable_frame = frame->frame_type != OBU_KEY_FRAME;
+  if (!show_frame) showable_frame = !!BitstreamReadU(obu, 1);
+  bool error_resilient_mode = true;
+  if (frame->frame_type != OBU_SWITCH_FRAME &&
+      (frame->frame_type != OBU_KEY_FRAME || !show_frame)) {
+    error_resilient_mode = !!BitstreamReadU(obu, 1);
+  }
+  ppb->pic_info_fields.bits.frame_type = frame->frame_type;
+  ppb->pic_info_fields.bits.show_frame = show_frame;
+  ppb->pic_info_fields.bits.showable_frame = showable_frame;
+  ppb->pic_info_fields.bits.error_resilient_mode = error_resilient_mode;
+  if (frame->frame_type == OBU_KEY_FRAME && show_frame) {
+    for (size_t i = 0; i < OBU_NUM_REF_FRAMES; i++) {
+      parser->refs[i].valid = false;
+      parser->refs[i].order_hint = 0;
+    }
+  }
+
+  bool disable_cdf_update = !!BitstreamReadU(obu, 1);
+  ppb->pic_info_fields.bits.disable_cdf_update = disable_cdf_update;
+  bool allow_screen_content_tools = seq->seq_force_screen_content_tools;
+  if (seq->seq_force_screen_content_tools == SELECT_SCREEN_CONTENT_TOOLS)
+    allow_screen_content_tools = !!BitstreamReadU(obu, 1);
+  ppb->pic_info_fields.bits.allow_screen_content_tools =
+      allow_screen_content_tools;
+  bool force_integer_mv = false;
+  if (allow_screen_content_tools) {
+    force_integer_mv = seq->seq_force_integer_mv;
+    if (seq->seq_force_integer_mv == SELECT_INTEGER_MV)
+      force_integer_mv = !!BitstreamReadU(obu, 1);
+  }
+  if (FrameIsIntra) force_integer_mv = true;
+  ppb->pic_info_fields.bits.force_integer_mv = force_integer_mv;
+  if (seq->frame_id_numbers_present_flag)
+    BitstreamReadU(obu, idLen);  // current_frame_id
+  bool frame_size_override_flag = true;
+  if (frame->frame_type != OBU_SWITCH_FRAME)
+    frame_size_override_flag = !!BitstreamReadU(obu, 1);
+  frame->order_hint = (uint8_t)BitstreamReadU(obu, seq->OrderHintBits);
+  ppb->order_hint = frame->order_hint;
+  ppb->primary_ref_frame = OBU_PRIMARY_REF_NONE;
+  if (!FrameIsIntra && !error_resilient_mode)
+    ppb->primary_ref_frame = (uint8_t)BitstreamReadU(obu, 3);
+
+  if (seq->decoder_model_info_present_flag &&
+      BitstreamReadU(obu, 1)) {  // buffer_removal_time_present_flag
+    for (size_t opNum = 0; opNum <= seq->operating_points_cnt_minus_1;
+         opNum++) {
+      if (!seq->decoder_model_present_for_this_op[opNum]) continue;
+      uint32_t opPtIdc = seq->operating_point_idc[opNum];
+      bool inTemporalLayer = (opPtIdc >> header->temporal_id) & 1;
+      bool inSpatialLayer = (opPtIdc >> (header->spatial_id + 8)) & 1;
+      if (opPtIdc == 0 || (inTemporalLayer && inSpatialLayer)) {
+        // buffer_removal_time
+        BitstreamReadU(obu, seq->buffer_removal_time_length_minus_1 + 1u);
+      }
+    }
+  }
+
+  parser->refresh_frame_flags = allFrames;
+  if (frame->frame_type != OBU_SWITCH_FRAME &&
+      (frame->frame_type != OBU_KEY_FRAME || !show_frame)) {
+    parser->refresh_frame_flags = (uint8_t)BitstreamReadU(obu, 8);
+  }
+  if ((!FrameIsIntra || parser->refresh_frame_flags != allFrames) &&
+      error_resilient_mode && seq->OrderHintBits) {
+    for (size_t i = 0; i < OBU_NUM_REF_FRAMES; i++) {
+      uint8_t ref_order_hint = (uint8_t)BitstreamReadU(obu, seq->OrderHintBits);
+      // mburakov: Frames missing from the decoder are not generated, so
+      // whatever refers to them would fail to be decoded.
+      if (ref_order_hint != parser->refs[i].order_hint) {
+        parser->refs[i].valid = false;
+        parser->refs[i].order_hint = ref_order_hint;
+      }
+    }
+  }
+
+  if (FrameIsIntra) {
+    ParseFrameSize(obu, parser, frame_size_override_flag);
+    ParseRenderSize(obu, parser);
+    if (allow_screen_content_tools &&
+        frame->upscaled_width == frame->frame_width) {
+      ppb->pic_info_fields.bits.allow_intrabc =
+          (uint32_t)BitstreamReadU(obu, 1);
+    }
+  } else {
+    // mburakov: Short signaling requires guessing the rest of references,
+    // and streamer always signals them explicitly.
+    if (seq->OrderHintBits && BitstreamReadU(obu, 1))
+      longjmp(obu->trap, 1);  // frame_refs_short_signaling
+    for (size_t i = 0; i < OBU_REFS_PER_FRAME; i++) {
+      ppb->ref_frame_idx[i] = (uint8_t)BitstreamReadU(obu, 3);
+      if (!parser->refs[ppb->ref_frame_idx[i]].valid) longjmp(obu->trap, 1);
+      if (seq->frame_id_numbers_present_flag) {
+        // delta_frame_id_minus_1
+        BitstreamReadU(obu, seq->delta_frame_id_length_minus_2 + 2u);
+      }
+    }
+    if (frame_size_override_flag && !error_resilient_mode) {
+      ParseFrameSizeWithRefs(obu, parser, frame_size_override_flag);
+    } else {
+      ParseFrameSize(obu, parser, frame_size_override_flag);
+      ParseRenderSize(obu, parser);
+    }
+    if (!force_integer_mv) {
+      ppb->pic_info_fields.bits.allow_high_precision_mv =
+          (uint32_t)BitstreamReadU(obu, 1);
+    }
+    // 5.9.10 Interpolation filter syntax
+    ppb->interp_filter = 4;  // SWITCHABLE
+    if (!BitstreamReadU(obu, 1))  // is_filter_switchable
+      ppb->interp_filter = (uint8_t)BitstreamReadU(obu, 2);
+    ppb->pic_info_fields.bits.is_motion_mode_switchable =
+        (uint32_t)BitstreamReadU(obu, 1);
+    if (!error_resilient_mode && seq->enable_ref_frame_mvs) {
+      ppb->pic_info_fields.bits.use_ref_frame_mvs =
+          (uint32_t)BitstreamReadU(obu, 1);
+    }
+  }
+
+  ppb->pic_info_fields.bits.disable_frame_end_update_cdf = 1;
+  if (!disable_cdf_update) {
+    ppb->pic_info_fields.bits.disable_frame_end_update_cdf =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+  if (ppb->primary_ref_frame == OBU_PRIMARY_REF_NONE) {
+    SetupPastIndependence(parser);
+  } else {
+    LoadPrevious(parser);
+  }
+
+  ParseTileInfo(obu, parser);
+  ParseQuantizationParams(obu, parser);
+  ParseSegmentationParams(obu, parser);
+  ParseDeltaParams(obu, parser);
+  bool CodedLossless = IsCodedLossless(parser);
+  bool AllLossless =
+      CodedLossless && frame->frame_width == frame->upscaled_width;
+  ParseLoopFilterParams(obu, parser, CodedLossless);
+  ParseCdefParams(obu, parser, CodedLossless);
+  ParseLrParams(obu, parser, AllLossless);
+
+  // 5.9.21 TX mode syntax
+  ppb->mode_control_fields.bits.tx_mode = 0;  // ONLY_4X4
+  if (!CodedLossless) {
+    // tx_mode_select ? TX_MODE_SELECT : TX_MODE_LARGEST
+    ppb->mode_control_fields.bits.tx_mode = BitstreamReadU(obu, 1) ? 2 : 1;
+  }
+  // 5.9.23 Frame reference mode syntax
+  if (!FrameIsIntra) {
+    ppb->mode_control_fields.bits.reference_select =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+  if (!FrameIsIntra && ppb->mode_control_fields.bits.reference_select &&
+      seq->OrderHintBits && IsSkipModeAllowed(parser)) {
+    ppb->mode_control_fields.bits.skip_mode_present =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+  if (!FrameIsIntra && !error_resilient_mode && seq->enable_warped_motion) {
+    ppb->pic_info_fields.bits.allow_warped_motion =
+        (uint32_t)BitstreamReadU(obu, 1);
+  }
+  ppb->mode_control_fields.bits.reduced_tx_set =
+      (uint32_t)BitstreamReadU(obu, 1);
+  ParseGlobalMotionParams(obu, parser, FrameIsIntra);
+
+  // 5.9.30 Film grain params syntax
+  if (ppb->seq_info_fields.fields.film_grain_params_present &&
+      (show_frame || showable_frame)) {
+    // mburakov: Grain is synthesized by the decoder, which is pointless for
+    // screen content, so streamer never asks for it.
+    if (BitstreamReadU(obu, 1)) longjmp(obu->trap, 1);  // apply_grain
+  }
+}
+
+static void FinishPictureParameters(struct ObuParser* parser) {
+  const struct ObuRefFrame* frame = &parser->frame;
+  VADecPictureParameterBufferAV1* ppb = &parser->ppb;
+  ppb->frame_width_minus1 = (uint16_t)(frame->upscaled_width - 1);
+  ppb->frame_height_minus1 = (uint16_t)(frame->frame_height - 1);
+  for (size_t i = 0; i < OBU_MAX_SEGMENTS; i++) {
+    ppb->seg_info.feature_mask[i] = frame->feature_mask[i];
+    for (size_t j = 0; j < OBU_SEG_LVL_MAX; j++)
+      ppb->seg_info.feature_data[i][j] = frame->feature_data[i][j];
+  }
+  memcpy(ppb->ref_deltas, frame->loop_filter_ref_deltas,
+         sizeof(ppb->ref_deltas));
+  memcpy(ppb->mode_deltas, frame->loop_filter_mode_deltas,
+         sizeof(ppb->mode_deltas));
+  for (size_t i = 0; i < OBU_REFS_PER_FRAME; i++) {
+    for (size_t j = 0; j < 6; j++)
+      ppb->wm[i].wmmat[j] = frame->gm_params[LAST_FRAME + i][j];
+  }
+}
+
+bool ObuParseFrameHeader(struct ObuParser* parser, const struct Obu* obu,
+                         size_t* header_size) {
+  // 5.9.1 General frame header OBU syntax
+  if (parser->seen_frame_header && obu->type != OBU_FRAME) {
+    // mburakov: This is a copy of the header that was already parsed.
+    *header_size = obu->size;
+    return true;
+  }
+  if (!parser->seq.valid) return false;
+  struct Bitstream bitstream = BitstreamCreate(obu->data, obu->size);
+  if (BitstreamReadFailed(&bitstream)) {
+    return false;
+  }
+  ParseUncompressedHeader(&bitstream, parser, obu);
+  if (!parser->show_existing_frame) {
+    FinishPictureParameters(parser);
+    parser->seen_frame_header = true;
+    parser->tiles_data = NULL;
+    parser->tiles_end = NULL;
+    parser->tiles_count = 0;
+  }
+  // 5.10 Frame OBU syntax
+  BitstreamByteAlign(&bitstream);
+  *header_size = bitstream.offset >> 3;
+  return true;
+}
+
+bool ObuParseTileGroup(struct ObuParser* parser, const uint8_t* data,
+                       size_t size, bool* frame_complete) {
+  // 5.11.1 General tile group OBU syntax
+  if (!parser->seen_frame_header) return false;
+  struct Bitstream bitstream = BitstreamCreate(data, size);
+  if (BitstreamReadFailed(&bitstream)) {
+    return false;
+  }
+  size_t TileCols = parser->ppb.tile_cols;
+  size_t NumTiles = TileCols * parser->ppb.tile_rows;
+  size_t tg_start = 0;
+  size_t tg_end = NumTiles - 1;
+  if (NumTiles > 1 &&
+      BitstreamReadU(&bitstream, 1)) {  // tile_start_and_end_present_flag
+    size_t tileBits = parser->tile_cols_log2 + parser->tile_rows_log2;
+    tg_start = BitstreamReadU(&bitstream, tileBits);
+    tg_end = BitstreamReadU(&bitstream, tileBits);
+  }
+  BitstreamByteAlign(&bitstream);
+  // mburakov: Tiles are expected in order, and without any gaps, so that all
+  // of them are found in the single contiguous portion of the bitstream.
+  if (tg_start != parser->tiles_count || tg_end < tg_start ||
+      tg_end >= NumTiles) {
+    return false;
+  }
+
+  const uint8_t* ptr = data + (bitstream.offset >> 3);
+  const uint8_t* end = data + size;
+  if (!parser->tiles_data) parser->tiles_data = ptr;
+  for (size_t TileNum = tg_start; TileNum <= tg_end; TileNum++) {
+    size_t tileSize = (size_t)(end - ptr);
+    if (TileNum != tg_end) {
+      if (tileSize < parser->tile_size_bytes) return false;
+      tileSize = 1;  // tile_size_minus_1 is le(TileSizeBytes)
+      for (size_t i = 0; i < parser->tile_size_bytes; i++)
+        tileSize += (size_t)*ptr++ << (i * 8);
+      if (tileSize > (size_t)(end - ptr)) return false;
+    }
+    parser->tiles[TileNum] = (VASliceParameterBufferAV1){
+        .slice_data_size = (uint32_t)tileSize,
+        .slice_data_offset = (uint32_t)(ptr - parser->tiles_data),
+        .slice_data_flag = VA_SLICE_DATA_FLAG_ALL,
+        .tile_row = (uint16_t)(TileNum / TileCols),
+        .tile_column = (uint16_t)(TileNum % TileCols),
+    };
+    ptr += tileSize;
+  }
+  parser->tiles_end = end;
+  parser->tiles_count = tg_end + 1;
+  *frame_complete = parser->tiles_count == NumTiles;
+  if (*frame_complete) parser->seen_frame_header = false;
+  return true;
+}
+
+void ObuUpdateReferences(struct ObuParser* parser, size_t slot) {
+  // 7.20 Reference frame update process
+  parser->frame.slot = slot;
+  for (size_t i = 0; i < OBU_NUM_REF_FRAMES; i++) {
+    if (parser->refresh_frame_flags & (1 << i)) parser->refs[i] = parser->frame;
+  }
+}
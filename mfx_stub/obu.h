@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MFX_STUB_OBU_H_
+#define MFX_STUB_OBU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <va/va.h>
+
+// 3. Symbols and abbreviated terms
+#define OBU_REFS_PER_FRAME 7
+#define OBU_TOTAL_REFS_PER_FRAME 8
+#define OBU_NUM_REF_FRAMES 8
+#define OBU_MAX_SEGMENTS 8
+#define OBU_SEG_LVL_MAX 8
+#define OBU_PRIMARY_REF_NONE 7
+
+// mburakov: Streamer encodes pictures as a handful of tiles at most, and VA
+// can not describe more than 64 tile columns anyway.
+#define OBU_MAX_TILES 64
+
+// 6.2.2 OBU header semantics
+enum ObuType {
+  OBU_SEQUENCE_HEADER = 1,
+  OBU_TEMPORAL_DELIMITER = 2,
+  OBU_FRAME_HEADER = 3,
+  OBU_TILE_GROUP = 4,
+  OBU_METADATA = 5,
+  OBU_FRAME = 6,
+  OBU_REDUNDANT_FRAME_HEADER = 7,
+  OBU_TILE_LIST = 8,
+  OBU_PADDING = 15,
+};
+
+// 6.8.2 Uncompressed header semantics
+enum ObuFrameType {
+  OBU_KEY_FRAME = 0,
+  OBU_INTER_FRAME = 1,
+  OBU_INTRA_ONLY_FRAME = 2,
+  OBU_SWITCH_FRAME = 3,
+};
+
+struct Obu {
+  enum ObuType type;
+  bool extension;
+  uint8_t temporal_id;
+  uint8_t spatial_id;
+  const uint8_t* data;
+  size_t size;
+};
+
+// 5.5 Sequence header OBU syntax, only the portion that frame headers depend
+// on. The rest of it is parsed into its own copy of picture parameter buffer.
+struct ObuSequenceHeader {
+  bool valid;
+  VADecPictureParameterBufferAV1 ppb;
+  bool decoder_model_info_present_flag;
+  bool equal_picture_interval;
+  uint8_t buffer_removal_time_length_minus_1;
+  uint8_t frame_presentation_time_length_minus_1;
+  uint8_t operating_points_cnt_minus_1;
+  uint16_t operating_point_idc[32];
+  bool decoder_model_present_for_this_op[32];
+  uint8_t frame_width_bits_minus_1;
+  uint8_t frame_height_bits_minus_1;
+  uint16_t max_frame_width_minus_1;
+  uint16_t max_frame_height_minus_1;
+  bool frame_id_numbers_present_flag;
+  uint8_t delta_frame_id_length_minus_2;
+  uint8_t additional_frame_id_length_minus_1;
+  bool enable_warped_motion;
+  bool enable_ref_frame_mvs;
+  uint8_t seq_force_screen_content_tools;
+  uint8_t seq_force_integer_mv;
+  uint8_t OrderHintBits;
+  bool enable_superres;
+  bool enable_restoration;
+  bool separate_uv_delta_q;
+};
+
+// 7.20 Reference frame update process, only the portion that later frame
+// headers depend on. Slot is an opaque frame store index of the caller.
+struct ObuRefFrame {
+  bool valid;
+  size_t slot;
+  uint8_t frame_type;
+  uint8_t order_hint;
+  uint16_t upscaled_width;
+  uint16_t frame_width;
+  uint16_t frame_height;
+  uint16_t render_width;
+  uint16_t render_height;
+  int32_t gm_params[OBU_TOTAL_REFS_PER_FRAME][6];
+  int8_t loop_filter_ref_deltas[OBU_TOTAL_REFS_PER_FRAME];
+  int8_t loop_filter_mode_deltas[2];
+  uint8_t feature_mask[OBU_MAX_SEGMENTS];
+  int16_t feature_data[OBU_MAX_SEGMENTS][OBU_SEG_LVL_MAX];
+};
+
+// mburakov: Parser does not touch VA at all, apart from filling its buffer
+// structures. Surface ids in the picture parameter buffer are left for the
+// caller to fill from the slots of the reference frames.
+struct ObuParser {
+  struct ObuSequenceHeader seq;
+  struct ObuRefFrame refs[OBU_NUM_REF_FRAMES];
+  bool seen_frame_header;
+
+  // mburakov: State of the frame currently being decoded. Whatever of it is
+  // saved by the reference frame update process goes to the frame member.
+  struct ObuRefFrame frame;
+  int32_t prev_gm_params[OBU_TOTAL_REFS_PER_FRAME][6];
+  bool show_existing_frame;
+  uint8_t frame_to_show_map_idx;
+  uint8_t refresh_frame_flags;
+  uint16_t mi_cols;
+  uint16_t mi_rows;
+  uint8_t tile_cols_log2;
+  uint8_t tile_rows_log2;
+  uint8_t tile_size_bytes;
+  VADecPictureParameterBufferAV1 ppb;
+
+  // mburakov: Tiles of the frame currently being decoded. Offsets are
+  // relative to tiles_data, which points to the beginning of the first one.
+  const uint8_t* tiles_data;
+  const uint8_t* tiles_end;
+  VASliceParameterBufferAV1 tiles[OBU_MAX_TILES];
+  size_t tiles_count;
+};
+
+size_t ObuRead(const uint8_t* data, size_t size, struct Obu* obu);
+bool ObuParseSequenceHeader(struct ObuParser* parser, const struct Obu* obu);
+bool ObuParseFrameHeader(struct ObuParser* parser, const struct Obu* obu,
+                         size_t* header_size);
+bool ObuParseTileGroup(struct ObuParser* parser, const uint8_t* data,
+                       size_t size, bool* frame_complete);
+void ObuUpdateReferences(struct ObuParser* parser, size_t slot);
+
+#endif  // MFX_STUB_OBU_H_
@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <mfxvideo.h>
+#include <stdlib.h>
+#include <string.h>
+#include <va/va_drmcommon.h>
+#include <vadecoder.h>
+
+#include "av1.h"
+#include "hevc.h"
+#include "mfxsession_impl.h"
+
+#define LENGTH(x) (sizeof(x) / sizeof *(x))
+
+static bool CreateVaBuffer(mfxSession session, VABufferType type, size_t size,
+                           size_t count, VABufferID* buffer_id) {
+  session->va_buffer_calls++;
+  return vaCreateBuffer(session->display, session->context_id, type,
+                        (unsigned int)size, (unsigned int)count, NULL,
+                        buffer_id) == VA_STATUS_SUCCESS;
+}
+
+static void DestroyVaBuffer(mfxSession session, VABufferID* buffer_id) {
+  if (*buffer_id == VA_INVALID_ID) return;
+  session->va_buffer_calls++;
+  // mburakov: Buffers are recreated while streaming, so destroying these
+  // must not be compiled out together with asserts.
+  VAStatus status = vaDestroyBuffer(session->display, *buffer_id);
+  assert(status == VA_STATUS_SUCCESS);
+  (void)status;
+  *buffer_id = VA_INVALID_ID;
+}
+
+static bool WriteVaBuffer(mfxSession session, VABufferID buffer_id,
+                          const void* data, size_t size) {
+  void* mapped;
+  if (vaMapBuffer(session->display, buffer_id, &mapped) != VA_STATUS_SUCCESS)
+    return false;
+  memcpy(mapped, data, size);
+  return vaUnmapBuffer(session->display, buffer_id) == VA_STATUS_SUCCESS;
+}
+
+bool VaDecoderAcquireSlot(mfxSession session) {
+  if (session->current_slot != SIZE_MAX) return true;
+  // mburakov: Pick the slot that is not referenced, and was decoded into the
+  // longest time ago, so that compositor had all the time to release it.
+  size_t result = SIZE_MAX;
+  for (size_t i = 0; i < session->slots_count; i++) {
+    const struct Slot* slot = &session->slots[i];
+    if (slot->marking != MARKING_UNUSED || i == session->output_slot) continue;
+    if (result == SIZE_MAX ||
+        slot->last_decoded < session->slots[result].last_decoded) {
+      result = i;
+    }
+  }
+  if (result == SIZE_MAX) return false;
+  session->current_slot = result;
+  return true;
+}
+
+static struct VaBuffers* GetVaBuffers(mfxSession session) {
+  // mburakov: Buffers are paired with surfaces, so the buffers of this slot
+  // were last used to decode into the very same surface. Once that surface is
+  // ready, the buffers are free to be overwritten.
+  if (!VaDecoderAcquireSlot(session)) return NULL;
+  struct Slot* slot = &session->slots[session->current_slot];
+  if (vaSyncSurface(session->display, slot->surface_id) != VA_STATUS_SUCCESS) {
+    return NULL;
+  }
+  return &slot->buffers;
+}
+
+static bool ReserveSliceDataBuffer(mfxSession session,
+                                   struct VaBuffers* buffers, size_t size) {
+  if (buffers->sdb_size >= size) return true;
+  // mburakov: Leave some headroom so that slightly bigger frames do not
+  // cause the buffer to be recreated over and over again.
+  size_t sdb_size = (size + size / 2 + 0xffff) & ~(size_t)0xffff;
+  DestroyVaBuffer(session, &buffers->sdb_id);
+  buffers->sdb_size = 0;
+  if (!CreateVaBuffer(session, VASliceDataBufferType, sdb_size, 1,
+                      &buffers->sdb_id)) {
+    return false;
+  }
+  buffers->sdb_size = sdb_size;
+  return true;
+}
+
+bool VaDecoderUploadSliceData(mfxSession session, const mfxU8* data,
+                              size_t size, uint32_t* offset) {
+  struct VaBuffers* buffers = GetVaBuffers(session);
+  if (!buffers) return false;
+  *offset = 0;
+  if (session->locked_data) {
+    // mburakov: Locked bitstream was received directly into the slice data
+    // buffer of this slot, so it only needs to be unmapped. Data itself
+    // points into the copy of its beginning the headers were parsed from.
+    const mfxU8* locked_copy = session->locked_copy;
+    bool inplace = locked_copy <= data &&
+                   data + size <= locked_copy + session->locked_size;
+    if (!VaDecoderUnlockBitstream(session)) return false;
+    if (inplace) {
+      *offset = (uint32_t)(data - locked_copy);
+      return true;
+    }
+  }
+  return ReserveSliceDataBuffer(session, buffers, size) &&
+         WriteVaBuffer(session, buffers->sdb_id, data, size);
+}
+
+bool VaDecoderSubmitPicture(mfxSession session, const void* ppb,
+                            size_t ppb_size, const void* spb, size_t spb_size,
+                            size_t spb_count) {
+  struct Slot* slot = &session->slots[session->current_slot];
+  struct VaBuffers* buffers = &slot->buffers;
+  if (buffers->ppb_id == VA_INVALID_ID &&
+      !CreateVaBuffer(session, VAPictureParameterBufferType, ppb_size, 1,
+                      &buffers->ppb_id)) {
+    return false;
+  }
+  if (buffers->spb_count != spb_count) {
+    // mburakov: Number of elements is fixed when the buffer is created, and
+    // it only changes along with the tiles layout of AV1 frames.
+    DestroyVaBuffer(session, &buffers->spb_id);
+    buffers->spb_count = 0;
+    if (!CreateVaBuffer(session, VASliceParameterBufferType, spb_size,
+                        spb_count, &buffers->spb_id)) {
+      return false;
+    }
+    buffers->spb_count = spb_count;
+  }
+  if (!WriteVaBuffer(session, buffers->ppb_id, ppb, ppb_size) ||
+      !WriteVaBuffer(session, buffers->spb_id, spb, spb_size * spb_count)) {
+    return false;
+  }
+
+  VAStatus status = vaBeginPicture(session->display, session->context_id,
+                                   slot->surface_id);
+  if (status != VA_STATUS_SUCCESS) return false;
+
+  VABufferID buffer_ids[] = {buffers->ppb_id, buffers->spb_id,
+                             buffers->sdb_id};
+  status = vaRenderPicture(session->display, session->context_id, buffer_ids,
+                           LENGTH(buffer_ids));
+  if (status != VA_STATUS_SUCCESS) return false;
+
+  status = vaEndPicture(session->display, session->context_id);
+  if (status != VA_STATUS_SUCCESS) return false;
+
+  session->last_va_buffer_calls = session->va_buffer_calls;
+  session->stats.va_buffer_calls += session->va_buffer_calls;
+  session->va_buffer_calls = 0;
+  session->global_frame_counter++;
+  slot->last_decoded = session->global_frame_counter;
+  return true;
+}
+
+bool VaDecoderUnlockBitstream(mfxSession session) {
+  // mburakov: This happens for every frame received directly, so it must not
+  // be compiled out together with asserts.
+  struct VaBuffers* buffers = &session->slots[session->current_slot].buffers;
+  VAStatus status = vaUnmapBuffer(session->display, buffers->sdb_id);
+  session->locked_data = NULL;
+  session->locked_size = 0;
+  session->locked_copy = NULL;
+  return status == VA_STATUS_SUCCESS;
+}
+
+void VaDecoderDestroySlots(mfxSession session) {
+  for (size_t i = session->slots_count; i; i--) {
+    DestroyVaBuffer(session, &session->slots[i - 1].buffers.sdb_id);
+    DestroyVaBuffer(session, &session->slots[i - 1].buffers.spb_id);
+    DestroyVaBuffer(session, &session->slots[i - 1].buffers.ppb_id);
+  }
+  free(session->slots);
+  session->slots = NULL;
+}
+
+
+size_t VaDecoderGetSurfacesCount(const mfxVideoParam* par) {
+  size_t dpb_size;
+  switch (par->mfx.CodecId) {
+    case MFX_CODEC_HEVC:
+      // mburakov: Decoder might be initialized ahead of the first parameter
+      // sets, so the size of decoded picture buffer comes from the caller.
+      if (!par->mfx.NumRefFrame) return 0;
+      dpb_size = par->mfx.NumRefFrame;
+      break;
+    case MFX_CODEC_AV1:
+      dpb_size = OBU_NUM_REF_FRAMES + 1u;
+      break;
+    default:
+      return 0;
+  }
+  // mburakov: Every picture of decoded picture buffer might still be
+  // referenced when the next picture needs a surface, and compositor might
+  // still hold the picture displayed before the last one.
+  return dpb_size + 2;
+}
+
+mfxStatus VaDecoderInitSession(mfxSession session, const mfxVideoParam* par,
+                               const VASurfaceID* surface_ids,
+                               const mfxMemId* mids, size_t count) {
+  VAProfile profile = par->mfx.CodecId == MFX_CODEC_AV1 ? VAProfileAV1Profile0
+                                                        : VAProfileHEVCMain;
+  VAConfigID config_id;
+  VAStatus status = vaCreateConfig(session->display, profile, VAEntrypointVLD,
+                                   NULL, 0, &config_id);
+  if (status != VA_STATUS_SUCCESS) {
+    return MFX_ERR_DEVICE_FAILED;
+  }
+
+  VAContextID context_id;
+  mfxStatus result = MFX_ERR_DEVICE_FAILED;
+  status = vaCreateContext(session->display, config_id,
+                           par->mfx.FrameInfo.Width, par->mfx.FrameInfo.Height,
+                           VA_PROGRESSIVE, NULL, 0, &context_id);
+  if (status != VA_STATUS_SUCCESS) {
+    goto rollback_config_id;
+  }
+
+  mfxMemId* mids_copy = NULL;
+  if (mids) {
+    mids_copy = calloc(count, sizeof(mfxMemId));
+    if (!mids_copy) {
+      result = MFX_ERR_MEMORY_ALLOC;
+      goto rollback_context_id;
+    }
+    memcpy(mids_copy, mids, count * sizeof(mfxMemId));
+  }
+
+  struct Slot* slots = calloc(count, sizeof(struct Slot));
+  if (!slots) {
+    result = MFX_ERR_MEMORY_ALLOC;
+    goto rollback_mids_copy;
+  }
+  for (size_t i = 0; i < count; i++) {
+    slots[i] = (struct Slot){
+        .mid = mids ? mids[i] : NULL,
+        .surface_id = surface_ids[i],
+        .marking = MARKING_UNUSED,
+        .buffers.ppb_id = VA_INVALID_ID,
+        .buffers.spb_id = VA_INVALID_ID,
+        .buffers.sdb_id = VA_INVALID_ID,
+    };
+  }
+
+  session->codec_id = par->mfx.CodecId;
+  session->config_id = config_id;
+  session->context_id = context_id;
+  session->context_width = par->mfx.FrameInfo.Width;
+  session->context_height = par->mfx.FrameInfo.Height;
+  session->mids = mids_copy;
+  session->slots_count = count;
+  session->slots = slots;
+  session->current_slot = SIZE_MAX;
+  session->output_slot = SIZE_MAX;
+  session->handle_cra_as_bla = true;
+  return MFX_ERR_NONE;
+
+rollback_mids_copy:
+  free(mids_copy);
+rollback_context_id:
+  assert(vaDestroyContext(session->display, context_id) == VA_STATUS_SUCCESS);
+rollback_config_id:
+  assert(vaDestroyConfig(session->display, config_id) == VA_STATUS_SUCCESS);
+  return result;
+}
+
+mfxStatus VaDecoderDecodeFrame(mfxSession session, mfxBitstream* bs,
+                               struct VaDecoderPicture* picture) {
+  picture->surface_id = VA_INVALID_SURFACE;
+  session->stats = (struct VaDecoderStats){
+      .epb_partial = session->locked_data != NULL,
+  };
+  if (session->locked_data) session->locked_copy = bs->Data;
+  mfxStatus status;
+  switch (session->codec_id) {
+    case MFX_CODEC_HEVC:
+      status = HevcDecodeFrame(session, bs, picture);
+      break;
+    case MFX_CODEC_AV1:
+      status = Av1DecodeFrame(session, bs, picture);
+      break;
+    default:
+      status = MFX_ERR_NOT_INITIALIZED;
+      break;
+  }
+  // mburakov: Locked bitstream is only good for the access unit it was
+  // locked for, even if that one was dropped without being decoded.
+  if (session->locked_data && !VaDecoderUnlockBitstream(session) &&
+      status == MFX_ERR_NONE) {
+    status = MFX_ERR_DEVICE_FAILED;
+  }
+  return status;
+}
+
+struct VaDecoder* VaDecoderCreate(VADisplay display) {
+  struct VaDecoder* decoder = calloc(1, sizeof(struct VaDecoder));
+  if (!decoder) return NULL;
+  // mburakov: Decoder is too big to be initialized with a compound literal
+  // on the stack, and calloc already zeroed the rest of it.
+  decoder->display = display;
+  decoder->config_id = VA_INVALID_ID;
+  decoder->context_id = VA_INVALID_ID;
+  return decoder;
+}
+
+bool VaDecoderDecodeHeader(struct VaDecoder* decoder, const void* data,
+                           size_t size, struct VaDecoderInfo* info,
+                           bool* found) {
+  mfxBitstream bs = {
+      .Data = (void*)(ptrdiff_t)data,
+      .DataLength = (mfxU32)size,
+      .MaxLength = (mfxU32)size,
+  };
+  mfxVideoParam par = {0};
+  mfxStatus status;
+  switch (info->codec) {
+    case VA_DECODER_CODEC_HEVC:
+      status = HevcDecodeHeader(decoder, &bs, &par);
+      break;
+    case VA_DECODER_CODEC_AV1:
+      status = Av1DecodeHeader(decoder, &bs, &par);
+      break;
+    default:
+      return false;
+  }
+  *found = status == MFX_ERR_NONE;
+  if (status == MFX_ERR_MORE_DATA) return true;
+  if (status != MFX_ERR_NONE) return false;
+  info->width = par.mfx.FrameInfo.Width;
+  info->height = par.mfx.FrameInfo.Height;
+  info->num_ref_frames = par.mfx.NumRefFrame;
+  return true;
+}
+
+bool VaDecoderInit(struct VaDecoder* decoder,
+                   const struct VaDecoderInfo* info) {
+  mfxVideoParam par = {
+      .mfx.FrameInfo.Width = info->width,
+      .mfx.FrameInfo.Height = info->height,
+      .mfx.CodecId = info->codec == VA_DECODER_CODEC_AV1 ? MFX_CODEC_AV1
+                                                         : MFX_CODEC_HEVC,
+      .mfx.NumRefFrame = (mfxU16)info->num_ref_frames,
+  };
+  size_t count = VaDecoderGetSurfacesCount(&par);
+  if (!count) return false;
+  VASurfaceID* surface_ids = calloc(count, sizeof(VASurfaceID));
+  if (!surface_ids) return false;
+
+  // mburakov: Decoded pictures are handed to compositor as they are, so the
+  // surfaces have to be exportable. Modifiers go last, so that these could be
+  // dropped if the driver does not support any of them.
+  VADRMFormatModifierList modifier_list = {
+      .num_modifiers = (uint32_t)info->modifiers_count,
+      .modifiers = (void*)(ptrdiff_t)info->modifiers,
+  };
+  VASurfaceAttrib attrib_list[] = {
+      {.type = VASurfaceAttribPixelFormat,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_FOURCC_NV12},
+      {.type = VASurfaceAttribUsageHint,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_SURFACE_ATTRIB_USAGE_HINT_DECODER |
+                        VA_SURFACE_ATTRIB_USAGE_HINT_EXPORT},
+      {.type = VASurfaceAttribDRMFormatModifiers,
+       .flags = VA_SURFACE_ATTRIB_SETTABLE,
+       .value.type = VAGenericValueTypePointer,
+       .value.value.p = &modifier_list},
+  };
+  unsigned int num_attribs = LENGTH(attrib_list);
+  if (!info->modifiers_count) num_attribs--;
+  VAStatus status = vaCreateSurfaces(
+      decoder->display, VA_RT_FORMAT_YUV420, info->width, info->height,
+      surface_ids, (unsigned int)count, attrib_list, num_attribs);
+  if (status != VA_STATUS_SUCCESS && info->modifiers_count) {
+    status = vaCreateSurfaces(
+        decoder->display, VA_RT_FORMAT_YUV420, info->width, info->height,
+        surface_ids, (unsigned int)count, attrib_list, num_attribs - 1);
+  }
+  if (status != VA_STATUS_SUCCESS) {
+    goto rollback_surface_ids;
+  }
+  if (VaDecoderInitSession(decoder, &par, surface_ids, NULL, count) !=
+      MFX_ERR_NONE) {
+    goto rollback_surfaces;
+  }
+  decoder->surface_ids = surface_ids;
+  return true;
+
+rollback_surfaces:
+  vaDestroySurfaces(decoder->display, surface_ids, (int)count);
+rollback_surface_ids:
+  free(surface_ids);
+  return false;
+}
+
+const VASurfaceID* VaDecoderGetSurfaces(const struct VaDecoder* decoder,
+                                        size_t* count) {
+  *count = decoder->surface_ids ? decoder->slots_count : 0;
+  return decoder->surface_ids;
+}
+
+void* VaDecoderLockBitstream(struct VaDecoder* decoder, size_t size) {
+  // mburakov: Tile sizes are spread all over AV1 tile groups, so these would
+  // have to be read back from the uncached buffer.
+  if (!decoder->slots || decoder->codec_id != MFX_CODEC_HEVC) return NULL;
+  if (decoder->locked_data && !VaDecoderUnlockBitstream(decoder)) return NULL;
+  struct VaBuffers* buffers = GetVaBuffers(decoder);
+  if (!buffers || !ReserveSliceDataBuffer(decoder, buffers, size)) {
+    return NULL;
+  }
+  void* mapped;
+  if (vaMapBuffer(decoder->display, buffers->sdb_id, &mapped) !=
+      VA_STATUS_SUCCESS) {
+    return NULL;
+  }
+  decoder->locked_data = mapped;
+  decoder->locked_size = size;
+  return mapped;
+}
+
+bool VaDecoderDecode(struct VaDecoder* decoder, const void* data, size_t size,
+                     struct VaDecoderPicture* picture) {
+  mfxBitstream bs = {
+      .Data = (void*)(ptrdiff_t)data,
+      .DataLength = (mfxU32)size,
+      .MaxLength = (mfxU32)size,
+  };
+  return VaDecoderDecodeFrame(decoder, &bs, picture) == MFX_ERR_NONE;
+}
+
+const struct VaDecoderStats* VaDecoderGetStats(
+    const struct VaDecoder* decoder) {
+  return &decoder->stats;
+}
+
+bool VaDecoderSync(struct VaDecoder* decoder,
+                   const struct VaDecoderPicture* picture, uint32_t timeout) {
+  return vaSyncSurface2(decoder->display, picture->surface_id,
+                        timeout * UINT64_C(1000000)) == VA_STATUS_SUCCESS;
+}
+
+bool VaDecoderReset(struct VaDecoder* decoder) {
+  if (!decoder->slots) return false;
+  if (decoder->locked_data && !VaDecoderUnlockBitstream(decoder)) return false;
+  // mburakov: Surfaces are kept, and so is the one that is displayed now.
+  for (size_t i = 0; i < decoder->slots_count; i++)
+    decoder->slots[i].marking = MARKING_UNUSED;
+  decoder->current_slot = SIZE_MAX;
+  switch (decoder->codec_id) {
+    case MFX_CODEC_HEVC:
+      HevcDecodeReset(decoder);
+      return true;
+    case MFX_CODEC_AV1:
+      Av1DecodeReset(decoder);
+      return true;
+    default:
+      return false;
+  }
+}
+
+void VaDecoderClose(struct VaDecoder* decoder) {
+  if (decoder->locked_data) VaDecoderUnlockBitstream(decoder);
+  if (decoder->slots) VaDecoderDestroySlots(decoder);
+  if (decoder->mids) {
+    mfxFrameAllocResponse response = {
+        .mids = decoder->mids,
+        .NumFrameActual = (mfxU16)decoder->slots_count,
+    };
+    assert(decoder->allocator.Free(decoder->allocator.pthis, &response) ==
+           MFX_ERR_NONE);
+    free(decoder->mids);
+    decoder->mids = NULL;
+  }
+  if (decoder->surface_ids) {
+    vaDestroySurfaces(decoder->display, decoder->surface_ids,
+                      (int)decoder->slots_count);
+    free(decoder->surface_ids);
+    decoder->surface_ids = NULL;
+  }
+  decoder->slots_count = 0;
+  if (decoder->context_id != VA_INVALID_ID) {
+    assert(vaDestroyContext(decoder->display, decoder->context_id) ==
+           VA_STATUS_SUCCESS);
+    decoder->context_id = VA_INVALID_ID;
+  }
+  if (decoder->config_id != VA_INVALID_ID) {
+    assert(vaDestroyConfig(decoder->display, decoder->config_id) ==
+           VA_STATUS_SUCCESS);
+    decoder->config_id = VA_INVALID_ID;
+  }
+  switch (decoder->codec_id) {
+    case MFX_CODEC_HEVC:
+      HevcDecodeReset(decoder);
+      break;
+    case MFX_CODEC_AV1:
+      Av1DecodeReset(decoder);
+      break;
+  }
+  decoder->codec_id = 0;
+}
+
+void VaDecoderDestroy(struct VaDecoder* decoder) {
+  VaDecoderClose(decoder);
+  free(decoder);
+}
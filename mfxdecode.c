@@ -0,0 +1,847 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "decodeimpl.h"
+
+#ifdef LIBMFX_BACKEND
+#include <dlfcn.h>
+#endif  // LIBMFX_BACKEND
+#include <errno.h>
+#ifndef LIBMFX_BACKEND
+#include <mfxstub.h>
+#endif  // LIBMFX_BACKEND
+#include <mfxvideo.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <va/va.h>
+#include <va/va_drmcommon.h>
+#ifndef LIBMFX_BACKEND
+#include <vadecoder.h>
+#endif  // LIBMFX_BACKEND
+
+#include "frame.h"
+#include "toolbox/buffer.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+#include "window.h"
+
+#ifdef LIBMFX_BACKEND
+// mburakov: Libmfx is loaded at runtime, so that the same binary works on
+// machines without it. Calls to its functions are redirected to the loaded
+// symbols with the macros below.
+static struct {
+  void* handle;
+  __typeof__(MFXInit)* MFXInit;
+  __typeof__(MFXClose)* MFXClose;
+  __typeof__(MFXVideoCORE_SetFrameAllocator)* MFXVideoCORE_SetFrameAllocator;
+  __typeof__(MFXVideoCORE_SetHandle)* MFXVideoCORE_SetHandle;
+  __typeof__(MFXVideoCORE_SyncOperation)* MFXVideoCORE_SyncOperation;
+  __typeof__(MFXVideoDECODE_Query)* MFXVideoDECODE_Query;
+  __typeof__(MFXVideoDECODE_DecodeHeader)* MFXVideoDECODE_DecodeHeader;
+  __typeof__(MFXVideoDECODE_Init)* MFXVideoDECODE_Init;
+  __typeof__(MFXVideoDECODE_Reset)* MFXVideoDECODE_Reset;
+  __typeof__(MFXVideoDECODE_Close)* MFXVideoDECODE_Close;
+  __typeof__(MFXVideoDECODE_DecodeFrameAsync)* MFXVideoDECODE_DecodeFrameAsync;
+} g_libmfx;
+
+static bool LoadLibmfx(void) {
+  // mburakov: Library is loaded once and never unloaded, since there might be
+  // more than one context using it.
+  if (g_libmfx.handle) return true;
+  g_libmfx.handle = dlopen("libmfx.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (!g_libmfx.handle) {
+    LOG("Failed to load libmfx (%s)", dlerror());
+    return false;
+  }
+#define LOAD_SYMBOL(name)                              \
+  do {                                                 \
+    g_libmfx.name = dlsym(g_libmfx.handle, #name);     \
+    if (!g_libmfx.name) {                              \
+      LOG("Failed to load %s (%s)", #name, dlerror()); \
+      goto rollback_handle;                            \
+    }                                                  \
+  } while (0)
+  LOAD_SYMBOL(MFXInit);
+  LOAD_SYMBOL(MFXClose);
+  LOAD_SYMBOL(MFXVideoCORE_SetFrameAllocator);
+  LOAD_SYMBOL(MFXVideoCORE_SetHandle);
+  LOAD_SYMBOL(MFXVideoCORE_SyncOperation);
+  LOAD_SYMBOL(MFXVideoDECODE_Query);
+  LOAD_SYMBOL(MFXVideoDECODE_DecodeHeader);
+  LOAD_SYMBOL(MFXVideoDECODE_Init);
+  LOAD_SYMBOL(MFXVideoDECODE_Reset);
+  LOAD_SYMBOL(MFXVideoDECODE_Close);
+  LOAD_SYMBOL(MFXVideoDECODE_DecodeFrameAsync);
+#undef LOAD_SYMBOL
+  return true;
+
+rollback_handle:
+  dlclose(g_libmfx.handle);
+  g_libmfx.handle = NULL;
+  return false;
+}
+
+#define MFXInit g_libmfx.MFXInit
+#define MFXClose g_libmfx.MFXClose
+#define MFXVideoCORE_SetFrameAllocator g_libmfx.MFXVideoCORE_SetFrameAllocator
+#define MFXVideoCORE_SetHandle g_libmfx.MFXVideoCORE_SetHandle
+#define MFXVideoCORE_SyncOperation g_libmfx.MFXVideoCORE_SyncOperation
+#define MFXVideoDECODE_Query g_libmfx.MFXVideoDECODE_Query
+#define MFXVideoDECODE_DecodeHeader g_libmfx.MFXVideoDECODE_DecodeHeader
+#define MFXVideoDECODE_Init g_libmfx.MFXVideoDECODE_Init
+#define MFXVideoDECODE_Reset g_libmfx.MFXVideoDECODE_Reset
+#define MFXVideoDECODE_Close g_libmfx.MFXVideoDECODE_Close
+#define MFXVideoDECODE_DecodeFrameAsync g_libmfx.MFXVideoDECODE_DecodeFrameAsync
+#endif  // LIBMFX_BACKEND
+
+struct Surface {
+  mfxFrameInfo mfx_frame_info;
+  VASurfaceID va_surface_id;
+  int dmabuf_fds[4];
+  struct Frame frame;
+  bool locked;
+};
+
+struct DecodeImplContext {
+  struct Window* window;
+  mfxFrameAllocator allocator;
+
+  VADisplay va_display;
+  mfxSession mfx_session;
+  mfxVideoParam video_param;
+  // mburakov: Set when the decoder was initialized from a hint, and cleared
+  // once the actual stream parameters were checked against the hint.
+  bool prewarmed;
+  struct Surface** surfaces;
+  const struct Surface* shown_surface;
+  bool sync_point;
+  uint64_t decode_time;
+
+  // mburakov: Frames that could not be decoded because the device was busy,
+  // each prefixed with its size. These are retried in order on a timer.
+  int busy_timer_fd;
+  struct Buffer parked;
+  uint64_t busy_started;
+  size_t busy_retries;
+  uint64_t busy_time;
+};
+
+static struct Surface* SurfaceCreate(const mfxFrameInfo* mfx_frame_info,
+                                     VADisplay va_display) {
+  struct Surface* surface = malloc(sizeof(struct Surface));
+  if (!surface) {
+    LOG("Failed to allocate surface (%s)", strerror(errno));
+    return NULL;
+  }
+  *surface = (struct Surface){
+      .mfx_frame_info = *mfx_frame_info,
+      .dmabuf_fds = {-1, -1, -1, -1},
+  };
+
+  VASurfaceAttrib attrib_list[] = {
+      {.type = VASurfaceAttribPixelFormat,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_FOURCC_NV12},
+      {.type = VASurfaceAttribUsageHint,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_SURFACE_ATTRIB_USAGE_HINT_DECODER |
+                        VA_SURFACE_ATTRIB_USAGE_HINT_EXPORT},
+  };
+  VAStatus va_status =
+      vaCreateSurfaces(va_display, VA_RT_FORMAT_YUV420, mfx_frame_info->Width,
+                       mfx_frame_info->Height, &surface->va_surface_id, 1,
+                       attrib_list, LENGTH(attrib_list));
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create vaapi surface (%s)", VaStatusString(va_status));
+    goto rollback_surface;
+  }
+
+  VADRMPRIMESurfaceDescriptor prime;
+  va_status = vaExportSurfaceHandle(
+      va_display, surface->va_surface_id,
+      VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+      VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS, &prime);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to export vaapi surface (%s)", VaStatusString(va_status));
+    goto rollback_va_surface_id;
+  }
+
+  surface->frame.width = prime.width;
+  surface->frame.height = prime.height;
+  surface->frame.fourcc = prime.fourcc;
+  surface->frame.nplanes = prime.layers[0].num_planes;
+  for (uint32_t i = 0; i < prime.layers[0].num_planes; i++) {
+    surface->dmabuf_fds[i] = prime.objects[prime.layers[0].object_index[i]].fd;
+    surface->frame.planes[i] = (struct FramePlane){
+        .dmabuf_fd = surface->dmabuf_fds[i],
+        .pitch = prime.layers[0].pitch[i],
+        .offset = prime.layers[0].offset[i],
+        .modifier =
+            prime.objects[prime.layers[0].object_index[i]].drm_format_modifier,
+    };
+  }
+  return surface;
+
+rollback_va_surface_id:
+  vaDestroySurfaces(va_display, &surface->va_surface_id, 1);
+rollback_surface:
+  free(surface);
+  return NULL;
+}
+
+static void SurfaceDestroy(struct Surface* surface, VADisplay va_display) {
+  for (size_t i = LENGTH(surface->dmabuf_fds); i; i--) {
+    if (surface->dmabuf_fds[i - 1] != -1) close(surface->dmabuf_fds[i - 1]);
+  }
+  vaDestroySurfaces(va_display, &surface->va_surface_id, 1);
+  free(surface);
+}
+
+static bool AssignFrames(struct DecodeImplContext* decode_context) {
+  size_t nframes = 0;
+  while (decode_context->surfaces[nframes]) nframes++;
+  struct Frame frames[nframes];
+  for (size_t i = 0; i < nframes; i++)
+    frames[i] = decode_context->surfaces[i]->frame;
+  return WindowAssignFrames(decode_context->window, nframes, frames);
+}
+
+static mfxStatus OnAllocatorAlloc(mfxHDL pthis, mfxFrameAllocRequest* request,
+                                  mfxFrameAllocResponse* response) {
+  LOG("%s(AllocId=%u, NumFrameSuggested=%u)", __func__, request->AllocId,
+      request->NumFrameSuggested);
+  if (request->Info.FourCC != MFX_FOURCC_NV12) {
+    LOG("Allocation of %.4s surfaces is not supported",
+        (const char*)&request->Info.FourCC);
+    return MFX_ERR_UNSUPPORTED;
+  }
+  if (request->Info.ChromaFormat != MFX_CHROMAFORMAT_YUV420) {
+    LOG("Chroma format %u is not supported", request->Info.ChromaFormat);
+    return MFX_ERR_UNSUPPORTED;
+  }
+
+  struct DecodeImplContext* decode_context = pthis;
+  decode_context->surfaces =
+      calloc(request->NumFrameSuggested + 1, sizeof(struct Surface*));
+  if (!decode_context->surfaces) {
+    LOG("Failed to allocate surfaces storage (%s)", strerror(errno));
+    return MFX_ERR_MEMORY_ALLOC;
+  }
+
+  for (size_t i = 0; i < request->NumFrameSuggested; i++) {
+    decode_context->surfaces[i] =
+        SurfaceCreate(&request->Info, decode_context->va_display);
+    if (!decode_context->surfaces[i]) {
+      LOG("Failed to create surface");
+      goto rollback_surfaces;
+    }
+  }
+
+  if (decode_context->window && !AssignFrames(decode_context)) {
+    LOG("Failed to assign frames to window");
+    goto rollback_surfaces;
+  }
+
+  *response = (mfxFrameAllocResponse){
+      .AllocId = request->AllocId,
+      .mids = (void**)decode_context->surfaces,
+      .NumFrameActual = request->NumFrameSuggested,
+  };
+  return MFX_ERR_NONE;
+
+rollback_surfaces:
+  for (size_t i = request->NumFrameSuggested; i; i--) {
+    if (decode_context->surfaces[i - 1])
+      SurfaceDestroy(decode_context->surfaces[i - 1],
+                     decode_context->va_display);
+  }
+  free(decode_context->surfaces);
+  return MFX_ERR_MEMORY_ALLOC;
+}
+
+static mfxStatus OnAllocatorGetHDL(mfxHDL pthis, mfxMemId mid, mfxHDL* handle) {
+  (void)pthis;
+  struct Surface* surface = mid;
+  *handle = &surface->va_surface_id;
+  return MFX_ERR_NONE;
+}
+
+static mfxStatus OnAllocatorFree(mfxHDL pthis,
+                                 mfxFrameAllocResponse* response) {
+  LOG("%s(AllocId=%u)", __func__, response->AllocId);
+  struct DecodeImplContext* decode_context = pthis;
+  for (size_t i = response->NumFrameActual; i; i--)
+    SurfaceDestroy(decode_context->surfaces[i - 1], decode_context->va_display);
+  free(decode_context->surfaces);
+  decode_context->surfaces = NULL;
+  decode_context->shown_surface = NULL;
+  return MFX_ERR_NONE;
+}
+
+static const char* MfxStatusString(mfxStatus status) {
+  static const char* mfx_status_strings[] = {
+      "MFX_ERR_REALLOC_SURFACE",
+      "MFX_ERR_GPU_HANG",
+      "MFX_ERR_INVALID_AUDIO_PARAM",
+      "MFX_ERR_INCOMPATIBLE_AUDIO_PARAM",
+      "MFX_ERR_MORE_BITSTREAM",
+      "MFX_ERR_DEVICE_FAILED",
+      "MFX_ERR_UNDEFINED_BEHAVIOR",
+      "MFX_ERR_INVALID_VIDEO_PARAM",
+      "MFX_ERR_INCOMPATIBLE_VIDEO_PARAM",
+      "MFX_ERR_DEVICE_LOST",
+      "MFX_ERR_ABORTED",
+      "MFX_ERR_MORE_SURFACE",
+      "MFX_ERR_MORE_DATA",
+      "MFX_ERR_NOT_FOUND",
+      "MFX_ERR_NOT_INITIALIZED",
+      "MFX_ERR_LOCK_MEMORY",
+      "MFX_ERR_INVALID_HANDLE",
+      "MFX_ERR_NOT_ENOUGH_BUFFER",
+      "MFX_ERR_MEMORY_ALLOC",
+      "MFX_ERR_UNSUPPORTED",
+      "MFX_ERR_NULL_PTR",
+      "MFX_ERR_UNKNOWN",
+      "MFX_ERR_NONE",
+      "MFX_WRN_IN_EXECUTION",
+      "MFX_WRN_DEVICE_BUSY",
+      "MFX_WRN_VIDEO_PARAM_CHANGED",
+      "MFX_WRN_PARTIAL_ACCELERATION",
+      "MFX_WRN_INCOMPATIBLE_VIDEO_PARAM",
+      "MFX_WRN_VALUE_NOT_CHANGED",
+      "MFX_WRN_OUT_OF_RANGE",
+      "MFX_TASK_WORKING",
+      "MFX_TASK_BUSY",
+      "MFX_WRN_FILTER_SKIPPED",
+      "MFX_WRN_INCOMPATIBLE_AUDIO_PARAM",
+      "MFX_ERR_NONE_PARTIAL_OUTPUT",
+  };
+  return (MFX_ERR_REALLOC_SURFACE <= status &&
+          status <= MFX_ERR_NONE_PARTIAL_OUTPUT)
+             ? mfx_status_strings[status - MFX_ERR_REALLOC_SURFACE]
+             : "???";
+}
+
+static bool InitializeHardware(struct DecodeImplContext* decode_context,
+                               const char* render_node) {
+#ifdef LIBMFX_BACKEND
+  if (!LoadLibmfx()) {
+    LOG("Failed to load libmfx");
+    return false;
+  }
+#endif  // LIBMFX_BACKEND
+  decode_context->va_display = VaDisplayAcquire(render_node);
+  if (!decode_context->va_display) {
+    LOG("Failed to acquire vaapi display");
+    return false;
+  }
+
+  mfxStatus mfx_status =
+      MFXInit(MFX_IMPL_HARDWARE, NULL, &decode_context->mfx_session);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to init mfx session (%s)", MfxStatusString(mfx_status));
+    goto rollback_display;
+  }
+  mfx_status =
+      MFXVideoCORE_SetHandle(decode_context->mfx_session, MFX_HANDLE_VA_DISPLAY,
+                             decode_context->va_display);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to set mfx session display (%s)", MfxStatusString(mfx_status));
+    goto rollback_session;
+  }
+  mfx_status = MFXVideoCORE_SetFrameAllocator(decode_context->mfx_session,
+                                              &decode_context->allocator);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to set frame allocator (%s)", MfxStatusString(mfx_status));
+    goto rollback_session;
+  }
+  return true;
+
+rollback_session:
+  MFXClose(decode_context->mfx_session);
+rollback_display:
+  VaDisplayRelease();
+  return false;
+}
+
+static struct DecodeImplContext* MfxDecodeContextCreate(
+    struct Window* window, const char* render_node) {
+  struct DecodeImplContext* decode_context =
+      malloc(sizeof(struct DecodeImplContext));
+  if (!decode_context) {
+    LOG("Failed to allocate decode context (%s)", strerror(errno));
+    return NULL;
+  }
+  *decode_context = (struct DecodeImplContext){
+      .window = window,
+      .allocator.pthis = decode_context,
+      .allocator.Alloc = OnAllocatorAlloc,
+      .allocator.GetHDL = OnAllocatorGetHDL,
+      .allocator.Free = OnAllocatorFree,
+  };
+
+  decode_context->busy_timer_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (decode_context->busy_timer_fd == -1) {
+    LOG("Failed to create busy timer (%s)", strerror(errno));
+    goto rollback_decode_context;
+  }
+
+  if (!InitializeHardware(decode_context, render_node)) {
+    LOG("Failed to initialize hardware decoding");
+    goto rollback_busy_timer_fd;
+  }
+  return decode_context;
+
+rollback_busy_timer_fd:
+  close(decode_context->busy_timer_fd);
+rollback_decode_context:
+  free(decode_context);
+  return NULL;
+}
+
+static bool StartDecoder(struct DecodeImplContext* decode_context,
+                         mfxVideoParam* video_param) {
+  video_param->AsyncDepth = 1;
+  video_param->mfx.DecodedOrder = 1;
+  video_param->IOPattern = MFX_IOPATTERN_OUT_VIDEO_MEMORY;
+  mfxStatus mfx_status = MFXVideoDECODE_Query(decode_context->mfx_session,
+                                              video_param, video_param);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to query decode (%s)", MfxStatusString(mfx_status));
+    return false;
+  }
+
+  mfx_status = MFXVideoDECODE_Init(decode_context->mfx_session, video_param);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to init decode (%s)", MfxStatusString(mfx_status));
+    return false;
+  }
+  decode_context->video_param = *video_param;
+  return true;
+}
+
+static bool InitializeDecoder(struct DecodeImplContext* decode_context,
+                              mfxBitstream* bitstream) {
+  enum DecodeCodec codec;
+  if (!DecodeDetectCodec(bitstream->Data, bitstream->DataLength, &codec)) {
+    LOG("Failed to detect codec");
+    return false;
+  }
+  mfxVideoParam video_param = {
+      .mfx.CodecId = codec == DECODE_CODEC_AV1 ? MFX_CODEC_AV1 : MFX_CODEC_HEVC,
+  };
+  mfxStatus mfx_status = MFXVideoDECODE_DecodeHeader(
+      decode_context->mfx_session, bitstream, &video_param);
+  switch (mfx_status) {
+    case MFX_ERR_NONE:
+      break;
+    case MFX_ERR_MORE_DATA:
+      return true;
+    default:
+      LOG("Failed to decode header (%s)", MfxStatusString(mfx_status));
+      return false;
+  }
+
+  if (decode_context->prewarmed) {
+    decode_context->prewarmed = false;
+    const mfxVideoParam* expected = &decode_context->video_param;
+    if (video_param.mfx.CodecId == expected->mfx.CodecId &&
+        video_param.mfx.FrameInfo.Width <= expected->mfx.FrameInfo.Width &&
+        video_param.mfx.FrameInfo.Height <= expected->mfx.FrameInfo.Height &&
+        video_param.mfx.NumRefFrame <= expected->mfx.NumRefFrame) {
+      LOG("Adopted prewarmed decoder");
+      return true;
+    }
+    LOG("Stream does not match prewarmed decoder");
+    mfx_status = MFXVideoDECODE_Close(decode_context->mfx_session);
+    if (mfx_status != MFX_ERR_NONE) {
+      LOG("Failed to close decode (%s)", MfxStatusString(mfx_status));
+      return false;
+    }
+  }
+  return StartDecoder(decode_context, &video_param);
+}
+
+static bool MfxDecodeContextPrewarm(
+    struct DecodeImplContext* decode_context, enum DecodeCodec codec,
+    uint16_t width, uint16_t height) {
+  mfxVideoParam video_param = {
+      .mfx.FrameInfo.FourCC = MFX_FOURCC_NV12,
+      .mfx.FrameInfo.Width = (mfxU16)((width + 15) & ~15),
+      .mfx.FrameInfo.Height = (mfxU16)((height + 15) & ~15),
+      .mfx.FrameInfo.CropW = width,
+      .mfx.FrameInfo.CropH = height,
+      .mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420,
+      .mfx.CodecId = codec == DECODE_CODEC_AV1 ? MFX_CODEC_AV1 : MFX_CODEC_HEVC,
+      // mburakov: This is a guess that covers a few reference pictures. The
+      // decoder is initialized once again if the stream needs more of them.
+      .mfx.NumRefFrame = codec == DECODE_CODEC_AV1 ? 8 : 4,
+  };
+  if (!StartDecoder(decode_context, &video_param)) {
+    LOG("Failed to start decoder");
+    return false;
+  }
+  decode_context->prewarmed = true;
+  return true;
+}
+
+static bool MfxDecodeContextUpscale(struct DecodeImplContext* decode_context,
+                                    uint16_t width, uint16_t height) {
+  // mburakov: Libmfx could do this with its own video processing, and the
+  // stub could share the pipeline of the vaapi decoder, but neither of these
+  // is worth it when the vaapi decoder is there.
+  (void)decode_context;
+  (void)width;
+  (void)height;
+  return false;
+}
+
+static struct Surface* GetFreeSurface(
+    struct DecodeImplContext* decode_context) {
+  struct Surface** psurface = decode_context->surfaces;
+  for (; *psurface && (*psurface)->locked; psurface++);
+  (*psurface)->locked = true;
+  return *psurface;
+}
+
+static size_t UnlockAllSurfaces(struct DecodeImplContext* decode_context,
+                                const struct Surface* keep_locked) {
+  size_t result = 0;
+  for (size_t i = 0; decode_context->surfaces[i]; i++) {
+    if (decode_context->surfaces[i] != keep_locked) {
+      decode_context->surfaces[i]->locked = false;
+    } else {
+      result = i;
+    }
+  }
+  return result;
+}
+
+static void* MfxDecodeContextLockBuffer(
+    struct DecodeImplContext* decode_context, size_t size) {
+#ifndef LIBMFX_BACKEND
+  // mburakov: Decoder buffers only exist once the decoder is initialized, and
+  // parked frames have to be decoded before anything is put in there. Buffers
+  // of a prewarmed decoder might go away once the stream is checked.
+  if (!decode_context->surfaces || decode_context->prewarmed ||
+      decode_context->parked.size) {
+    return NULL;
+  }
+  mfxU8* data;
+  mfxStatus mfx_status = MFXVideoDECODE_LockBitstream(
+      decode_context->mfx_session, (mfxU32)size, &data);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to lock bitstream (%s)", MfxStatusString(mfx_status));
+    return NULL;
+  }
+  return data;
+#else   // LIBMFX_BACKEND
+  (void)decode_context;
+  (void)size;
+  return NULL;
+#endif  // LIBMFX_BACKEND
+}
+
+static bool MfxDecodeContextIsSyncPoint(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->sync_point;
+}
+
+static bool MfxDecodeContextTakeKeyframeRequest(
+    struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return false;
+}
+
+static bool DecodeBitstream(struct DecodeImplContext* decode_context,
+                            const void* buffer, size_t size, bool* busy,
+                            bool* decoded) {
+  mfxBitstream bitstream = {
+      .DecodeTimeStamp = MFX_TIMESTAMP_UNKNOWN,
+      .TimeStamp = (mfxU64)MFX_TIMESTAMP_UNKNOWN,
+      .Data = (void*)(ptrdiff_t)buffer,
+      .DataLength = (mfxU32)size,
+      .MaxLength = (mfxU32)size,
+      .DataFlag = MFX_BITSTREAM_COMPLETE_FRAME,
+  };
+
+  if (!decode_context->surfaces || decode_context->prewarmed) {
+    if (!InitializeDecoder(decode_context, &bitstream)) {
+      LOG("Failed to initialize decoder");
+      return false;
+    }
+    if (!decode_context->surfaces || decode_context->prewarmed) {
+      // mburakov: Initialization might be postponed.
+      return true;
+    }
+  }
+
+  for (;;) {
+    struct Surface* surface = GetFreeSurface(decode_context);
+    mfxFrameSurface1 surface_work = {
+        .Info = surface->mfx_frame_info,
+        .Data.MemId = surface,
+    };
+    mfxFrameSurface1* surface_out = NULL;
+    mfxSyncPoint sync = NULL;
+    mfxStatus mfx_status =
+        MFXVideoDECODE_DecodeFrameAsync(decode_context->mfx_session, &bitstream,
+                                        &surface_work, &surface_out, &sync);
+    switch (mfx_status) {
+      case MFX_ERR_MORE_SURFACE:
+        continue;
+      case MFX_ERR_NONE:
+        break;
+      case MFX_ERR_MORE_DATA:
+        // mburakov: Nothing to show, i.e. AV1 frame that is shown later.
+        surface->locked = false;
+        return true;
+      case MFX_WRN_DEVICE_BUSY:
+        surface->locked = false;
+        *busy = true;
+        return true;
+      case MFX_WRN_VIDEO_PARAM_CHANGED:
+        continue;
+      default:
+        LOG("Failed to decode frame (%s)", MfxStatusString(mfx_status));
+        return false;
+    }
+
+#ifndef LIBMFX_BACKEND
+    mfxStubStat stub_stat;
+    mfx_status =
+        MFXVideoDECODE_GetStubStat(decode_context->mfx_session, &stub_stat);
+    if (mfx_status == MFX_ERR_NONE && stub_stat.VaBufferCalls) {
+      // mburakov: This is expected only until the buffers pool warms up.
+      LOG("Frame required %u va buffer create/destroy calls",
+          stub_stat.VaBufferCalls);
+    }
+    decode_context->sync_point =
+        mfx_status == MFX_ERR_NONE && stub_stat.SyncPoint;
+#endif  // LIBMFX_BACKEND
+
+    // mburakov: This is the time from the decode being submitted and until
+    // the decoded picture is ready, not counting the submission itself.
+    uint64_t submitted = MicrosNow();
+    mfx_status = MFXVideoCORE_SyncOperation(decode_context->mfx_session, sync,
+                                            MFX_INFINITE);
+    if (mfx_status != MFX_ERR_NONE) {
+      LOG("Failed to sync operation (%s)", MfxStatusString(mfx_status));
+      return false;
+    }
+    decode_context->decode_time = MicrosNow() - submitted;
+    *decoded = true;
+
+    decode_context->shown_surface = surface_out->Data.MemId;
+    size_t locked =
+        UnlockAllSurfaces(decode_context, decode_context->shown_surface);
+    if (decode_context->window &&
+        !WindowShowFrame(decode_context->window, locked,
+                         surface_out->Info.CropX, surface_out->Info.CropY,
+                         surface_out->Info.CropW, surface_out->Info.CropH)) {
+      LOG("Failed to show frame");
+      return false;
+    }
+
+    return true;
+  }
+}
+
+static bool ParkFrame(struct DecodeImplContext* decode_context,
+                      const void* buffer, size_t size) {
+  if (!BufferAppend(&decode_context->parked, &size, sizeof(size)) ||
+      !BufferAppend(&decode_context->parked, buffer, size)) {
+    LOG("Failed to park frame (%s)", strerror(errno));
+    return false;
+  }
+  decode_context->sync_point = false;
+  return true;
+}
+
+static bool ArmBusyTimer(struct DecodeImplContext* decode_context) {
+  static const struct itimerspec spec = {.it_value.tv_nsec = 500 * 1000};
+  if (timerfd_settime(decode_context->busy_timer_fd, 0, &spec, NULL)) {
+    LOG("Failed to arm busy timer (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool MfxDecodeContextDecode(struct DecodeImplContext* decode_context,
+                                   const void* buffer, size_t size,
+                                   bool* decoded) {
+  *decoded = false;
+  // mburakov: Frames have to be decoded in order, so nothing is decoded
+  // until all of the parked ones are.
+  if (decode_context->parked.size)
+    return ParkFrame(decode_context, buffer, size);
+  bool busy = false;
+  if (!DecodeBitstream(decode_context, buffer, size, &busy, decoded))
+    return false;
+  if (!busy) return true;
+  decode_context->busy_started = MicrosNow();
+  return ParkFrame(decode_context, buffer, size) &&
+         ArmBusyTimer(decode_context);
+}
+
+static int MfxDecodeContextGetEventsFd(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->busy_timer_fd;
+}
+
+static bool MfxDecodeContextProcessEvents(
+    struct DecodeImplContext* decode_context) {
+  uint64_t expirations;
+  if (read(decode_context->busy_timer_fd, &expirations, sizeof(expirations)) !=
+      sizeof(expirations)) {
+    LOG("Failed to read busy timer expirations (%s)", strerror(errno));
+    return false;
+  }
+
+  while (decode_context->parked.size) {
+    const uint8_t* parked = decode_context->parked.data;
+    size_t size;
+    memcpy(&size, parked, sizeof(size));
+    bool busy = false;
+    bool decoded = false;
+    if (!DecodeBitstream(decode_context, parked + sizeof(size), size, &busy,
+                         &decoded)) {
+      LOG("Failed to decode parked frame");
+      return false;
+    }
+    if (busy) {
+      decode_context->busy_retries++;
+      return ArmBusyTimer(decode_context);
+    }
+    BufferDiscard(&decode_context->parked, sizeof(size) + size);
+  }
+  decode_context->busy_time += MicrosNow() - decode_context->busy_started;
+  return true;
+}
+
+static size_t MfxDecodeContextGetBusyRetries(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->busy_retries;
+}
+
+static uint64_t MfxDecodeContextGetBusyTime(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->busy_time;
+}
+
+static uint64_t MfxDecodeContextGetDecodeTime(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->decode_time;
+}
+
+static bool MfxDecodeContextGetStats(
+    const struct DecodeImplContext* decode_context,
+    struct DecodeStats* stats) {
+#ifndef LIBMFX_BACKEND
+  // mburakov: Session of the stub is its decoder, see mfxsession.h.
+  const struct VaDecoderStats* va_stats =
+      VaDecoderGetStats(decode_context->mfx_session);
+  if (!va_stats->frame_type) return false;
+  *stats = (struct DecodeStats){
+      .frame_type = va_stats->frame_type,
+      .quantizer = va_stats->quantizer,
+      .payload_size = va_stats->payload_size,
+      .epb_count = va_stats->epb_count,
+      .epb_partial = va_stats->epb_partial,
+  };
+  return true;
+#else   // LIBMFX_BACKEND
+  (void)decode_context;
+  (void)stats;
+  return false;
+#endif  // LIBMFX_BACKEND
+}
+
+static bool MfxDecodeContextReset(struct DecodeImplContext* decode_context) {
+  decode_context->sync_point = false;
+  if (decode_context->parked.size) {
+    static const struct itimerspec spec = {0};
+    if (timerfd_settime(decode_context->busy_timer_fd, 0, &spec, NULL)) {
+      LOG("Failed to disarm busy timer (%s)", strerror(errno));
+      return false;
+    }
+    BufferDiscard(&decode_context->parked, decode_context->parked.size);
+    decode_context->busy_time += MicrosNow() - decode_context->busy_started;
+  }
+  // mburakov: Decoder that was not initialized yet has nothing to forget.
+  if (!decode_context->surfaces) return true;
+  // mburakov: Surfaces handed to the decoder for the frames that failed to
+  // decode are released, but the one being shown is still owned by window.
+  UnlockAllSurfaces(decode_context, decode_context->shown_surface);
+  mfxStatus mfx_status = MFXVideoDECODE_Reset(decode_context->mfx_session,
+                                              &decode_context->video_param);
+  if (mfx_status != MFX_ERR_NONE) {
+    LOG("Failed to reset decode (%s)", MfxStatusString(mfx_status));
+    return false;
+  }
+  return true;
+}
+
+static void MfxDecodeContextDestroy(struct DecodeImplContext* decode_context) {
+  MFXClose(decode_context->mfx_session);
+  VaDisplayRelease();
+  BufferDestroy(&decode_context->parked);
+  close(decode_context->busy_timer_fd);
+  free(decode_context);
+}
+
+static bool MfxDecodeContextAttachWindow(
+    struct DecodeImplContext* decode_context, struct Window* window) {
+  decode_context->window = window;
+  if (!decode_context->surfaces) return true;
+  // mburakov: Decoder keeps all of its state, so the next picture it outputs
+  // is shown right away, without waiting for a keyframe.
+  if (!AssignFrames(decode_context)) {
+    LOG("Failed to assign frames to window");
+    return false;
+  }
+  return true;
+}
+
+#ifdef LIBMFX_BACKEND
+const struct DecodeImpl g_libmfx_decode_impl = {
+    .name = "mfx",
+#else   // LIBMFX_BACKEND
+const struct DecodeImpl g_stub_decode_impl = {
+    .name = "stub",
+#endif  // LIBMFX_BACKEND
+    .Create = MfxDecodeContextCreate,
+    .AttachWindow = MfxDecodeContextAttachWindow,
+    .Prewarm = MfxDecodeContextPrewarm,
+    .Upscale = MfxDecodeContextUpscale,
+    .LockBuffer = MfxDecodeContextLockBuffer,
+    .Decode = MfxDecodeContextDecode,
+    .GetEventsFd = MfxDecodeContextGetEventsFd,
+    .ProcessEvents = MfxDecodeContextProcessEvents,
+    .IsSyncPoint = MfxDecodeContextIsSyncPoint,
+    .TakeKeyframeRequest = MfxDecodeContextTakeKeyframeRequest,
+    .GetDecodeTime = MfxDecodeContextGetDecodeTime,
+    .GetBusyRetries = MfxDecodeContextGetBusyRetries,
+    .GetBusyTime = MfxDecodeContextGetBusyTime,
+    .GetStats = MfxDecodeContextGetStats,
+    .Reset = MfxDecodeContextReset,
+    .Destroy = MfxDecodeContextDestroy,
+};
@@ -24,8 +24,17 @@
 #define PROTO_TYPE_MISC 0
 #define PROTO_TYPE_VIDEO 1
 #define PROTO_TYPE_AUDIO 2
+#define PROTO_TYPE_CURSOR 3
+#define PROTO_TYPE_DAMAGE 4
 
 #define PROTO_FLAG_KEYFRAME 1
+#define PROTO_FLAG_CURSOR_IMAGE 2
+
+// mburakov: Messages sent upstream are mostly UHID events, and these are told
+// apart from those by the type values that UHID would never use.
+#define PROTO_REQUEST_PING (~0u)
+#define PROTO_REQUEST_KEYFRAME (~1u)
+#define PROTO_REQUEST_CURSOR (~2u)
 
 struct Proto {
   uint32_t size;
@@ -38,4 +47,41 @@ struct Proto {
 static_assert(sizeof(struct Proto) == 8 * sizeof(uint8_t),
               "Suspicious proto struct size");
 
+// mburakov: Once requested, streamer stops drawing the cursor into the video
+// stream, and sends its position in the coordinates of the streamed screen
+// of the given size instead. Image is only sent when it changes, and is
+// flagged accordingly. It is premultiplied ARGB8888 of the given size, and
+// empty one means the cursor is hidden.
+struct ProtoCursor {
+  uint16_t screen_width;
+  uint16_t screen_height;
+  int16_t x;
+  int16_t y;
+  uint16_t hotspot_x;
+  uint16_t hotspot_y;
+  uint16_t width;
+  uint16_t height;
+  uint8_t data[];
+};
+
+static_assert(sizeof(struct ProtoCursor) == 16 * sizeof(uint8_t),
+              "Suspicious proto cursor struct size");
+
+// mburakov: Damage message precedes the video message of the frame it
+// belongs to, and lists rectangles of the streamed screen of the given size
+// that changed since the previous frame. These have to cover everything that
+// changed in the decoded picture, i.e. whatever encoder refined in the static
+// areas. Frame without any rectangles did not change at all. With more than
+// PROTO_DAMAGE_RECTS_MAX rectangles, streamer just sends no damage message.
+#define PROTO_DAMAGE_RECTS_MAX 32
+
+struct ProtoDamage {
+  uint16_t width;
+  uint16_t height;
+  uint16_t rects[][4];
+};
+
+static_assert(sizeof(struct ProtoDamage) == 4 * sizeof(uint8_t),
+              "Suspicious proto damage struct size");
+
 #endif  // RECEIVER_PROTO_H_
@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "decodeimpl.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+#include "window.h"
+
+// mburakov: One buffer is being written, one is shown, and one might be
+// still held by the compositor until it gets the next one.
+#define SW_DECODE_BUFFERS_COUNT 3
+
+struct SwBuffer {
+  int memfd;
+  int dmabuf_fd;
+  void* data;
+  size_t size;
+};
+
+struct SwDecodeContext {
+  struct Window* window;
+  int udmabuf_fd;
+  AVCodecContext* codec_context;
+  AVPacket* packet;
+  AVFrame* frame;
+
+  int width;
+  int height;
+  size_t pitch;
+  struct SwBuffer buffers[SW_DECODE_BUFFERS_COUNT];
+  size_t buffers_count;
+  size_t current_buffer;
+};
+
+static bool SwBufferCreate(struct SwBuffer* buffer, int udmabuf_fd,
+                           size_t size) {
+  *buffer = (struct SwBuffer){.memfd = -1, .dmabuf_fd = -1};
+  buffer->memfd = memfd_create("swdecode", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (buffer->memfd == -1) {
+    LOG("Failed to create memfd (%s)", strerror(errno));
+    return false;
+  }
+  if (ftruncate(buffer->memfd, (off_t)size) == -1) {
+    LOG("Failed to truncate memfd (%s)", strerror(errno));
+    goto rollback_memfd;
+  }
+  // mburakov: udmabuf refuses memfds that could be shrunk under its feet.
+  if (fcntl(buffer->memfd, F_ADD_SEALS, F_SEAL_SHRINK) == -1) {
+    LOG("Failed to seal memfd (%s)", strerror(errno));
+    goto rollback_memfd;
+  }
+
+  struct udmabuf_create udmabuf_create = {
+      .memfd = (uint32_t)buffer->memfd,
+      .flags = UDMABUF_FLAGS_CLOEXEC,
+      .offset = 0,
+      .size = size,
+  };
+  buffer->dmabuf_fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &udmabuf_create);
+  if (buffer->dmabuf_fd == -1) {
+    LOG("Failed to create udmabuf (%s)", strerror(errno));
+    goto rollback_memfd;
+  }
+  buffer->data =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->memfd, 0);
+  if (buffer->data == MAP_FAILED) {
+    LOG("Failed to map memfd (%s)", strerror(errno));
+    goto rollback_dmabuf_fd;
+  }
+  buffer->size = size;
+  return true;
+
+rollback_dmabuf_fd:
+  close(buffer->dmabuf_fd);
+rollback_memfd:
+  close(buffer->memfd);
+  return false;
+}
+
+static void SwBufferDestroy(struct SwBuffer* buffer) {
+  munmap(buffer->data, buffer->size);
+  close(buffer->dmabuf_fd);
+  close(buffer->memfd);
+}
+
+static void DestroyBuffers(struct SwDecodeContext* sw_decode_context) {
+  for (size_t i = sw_decode_context->buffers_count; i; i--)
+    SwBufferDestroy(&sw_decode_context->buffers[i - 1]);
+  sw_decode_context->buffers_count = 0;
+}
+
+static bool CreateBuffers(struct SwDecodeContext* sw_decode_context,
+                          int width, int height) {
+  DestroyBuffers(sw_decode_context);
+  // mburakov: Pitch alignment is what most of GPUs are happy to import
+  // linear buffers with, and udmabuf wants whole pages.
+  size_t pitch = ((size_t)width + 255) & ~(size_t)255;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = pitch * (size_t)height * 3 / 2;
+  size = (size + page_size - 1) & ~(page_size - 1);
+
+  struct Frame frames[SW_DECODE_BUFFERS_COUNT];
+  for (size_t i = 0; i < SW_DECODE_BUFFERS_COUNT; i++) {
+    struct SwBuffer* buffer = &sw_decode_context->buffers[i];
+    if (!SwBufferCreate(buffer, sw_decode_context->udmabuf_fd, size)) {
+      LOG("Failed to create buffer");
+      goto rollback_buffers;
+    }
+    sw_decode_context->buffers_count++;
+    frames[i] = (struct Frame){
+        .width = (uint32_t)width,
+        .height = (uint32_t)height,
+        .fourcc = DRM_FORMAT_NV12,
+        .nplanes = 2,
+        .planes[0] =
+            {
+                .dmabuf_fd = buffer->dmabuf_fd,
+                .pitch = (uint32_t)pitch,
+                .offset = 0,
+                .modifier = DRM_FORMAT_MOD_LINEAR,
+            },
+        .planes[1] =
+            {
+                .dmabuf_fd = buffer->dmabuf_fd,
+                .pitch = (uint32_t)pitch,
+                .offset = (uint32_t)(pitch * (size_t)height),
+                .modifier = DRM_FORMAT_MOD_LINEAR,
+            },
+    };
+  }
+
+  if (!WindowAssignFrames(sw_decode_context->window, SW_DECODE_BUFFERS_COUNT,
+                          frames)) {
+    LOG("Failed to assign frames to window");
+    goto rollback_buffers;
+  }
+  sw_decode_context->width = width;
+  sw_decode_context->height = height;
+  sw_decode_context->pitch = pitch;
+  sw_decode_context->current_buffer = 0;
+  return true;
+
+rollback_buffers:
+  DestroyBuffers(sw_decode_context);
+  return false;
+}
+
+static bool SyncBuffer(const struct SwBuffer* buffer, uint64_t flags) {
+  struct dma_buf_sync dma_buf_sync = {.flags = flags | DMA_BUF_SYNC_WRITE};
+  if (ioctl(buffer->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &dma_buf_sync) == -1) {
+    LOG("Failed to sync dmabuf (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool CopyFrame(const AVFrame* frame, uint8_t* luma, uint8_t* chroma,
+                      size_t pitch) {
+  for (int y = 0; y < frame->height; y++) {
+    memcpy(luma + pitch * (size_t)y, frame->data[0] + frame->linesize[0] * y,
+           (size_t)frame->width);
+  }
+  int chroma_width = (frame->width + 1) / 2;
+  int chroma_height = (frame->height + 1) / 2;
+  switch (frame->format) {
+    case AV_PIX_FMT_NV12:
+      for (int y = 0; y < chroma_height; y++) {
+        memcpy(chroma + pitch * (size_t)y,
+               frame->data[1] + frame->linesize[1] * y,
+               (size_t)chroma_width * 2);
+      }
+      return true;
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+      // mburakov: Compiler vectorizes this just fine, so there's no point in
+      // doing anything smarter here.
+      for (int y = 0; y < chroma_height; y++) {
+        const uint8_t* u = frame->data[1] + frame->linesize[1] * y;
+        const uint8_t* v = frame->data[2] + frame->linesize[2] * y;
+        uint8_t* uv = chroma + pitch * (size_t)y;
+        for (int x = 0; x < chroma_width; x++) {
+          uv[x * 2 + 0] = u[x];
+          uv[x * 2 + 1] = v[x];
+        }
+      }
+      return true;
+    default:
+      LOG("Pixel format %d is not supported", frame->format);
+      return false;
+  }
+}
+
+static bool ShowFrame(struct SwDecodeContext* sw_decode_context,
+                      const AVFrame* frame) {
+  if (frame->width != sw_decode_context->width ||
+      frame->height != sw_decode_context->height) {
+    if (!CreateBuffers(sw_decode_context, frame->width, frame->height)) {
+      LOG("Failed to create buffers");
+      return false;
+    }
+  }
+
+  size_t index = sw_decode_context->current_buffer;
+  struct SwBuffer* buffer = &sw_decode_context->buffers[index];
+  uint8_t* luma = buffer->data;
+  uint8_t* chroma = luma + sw_decode_context->pitch * (size_t)frame->height;
+  if (!SyncBuffer(buffer, DMA_BUF_SYNC_START)) return false;
+  bool result = CopyFrame(frame, luma, chroma, sw_decode_context->pitch);
+  if (!SyncBuffer(buffer, DMA_BUF_SYNC_END) || !result) return false;
+
+  sw_decode_context->current_buffer = (index + 1) % SW_DECODE_BUFFERS_COUNT;
+  if (!WindowShowFrame(sw_decode_context->window, index, 0, 0, frame->width,
+                       frame->height)) {
+    LOG("Failed to show frame");
+    return false;
+  }
+  return true;
+}
+
+static struct SwDecodeContext* SwDecodeContextCreate(struct Window* window,
+                                                     enum DecodeCodec codec) {
+  struct SwDecodeContext* sw_decode_context =
+      malloc(sizeof(struct SwDecodeContext));
+  if (!sw_decode_context) {
+    LOG("Failed to allocate sw decode context (%s)", strerror(errno));
+    return NULL;
+  }
+  *sw_decode_context = (struct SwDecodeContext){
+      .window = window,
+  };
+
+  sw_decode_context->udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if (sw_decode_context->udmabuf_fd == -1) {
+    LOG("Failed to open udmabuf device (%s)", strerror(errno));
+    goto rollback_sw_decode_context;
+  }
+
+  const AVCodec* codec_impl = avcodec_find_decoder(
+      codec == DECODE_CODEC_AV1 ? AV_CODEC_ID_AV1 : AV_CODEC_ID_HEVC);
+  if (!codec_impl) {
+    LOG("Failed to find decoder");
+    goto rollback_udmabuf_fd;
+  }
+  sw_decode_context->codec_context = avcodec_alloc_context3(codec_impl);
+  if (!sw_decode_context->codec_context) {
+    LOG("Failed to allocate codec context");
+    goto rollback_udmabuf_fd;
+  }
+
+  // mburakov: Frame threads delay the output by a frame per thread, which
+  // is exactly what a streaming client can not afford. Slice threads are
+  // also what decodes HEVC wavefronts in parallel.
+  sw_decode_context->codec_context->thread_count = 0;
+  sw_decode_context->codec_context->thread_type = FF_THREAD_SLICE;
+  sw_decode_context->codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+  int err = avcodec_open2(sw_decode_context->codec_context, codec_impl, NULL);
+  if (err < 0) {
+    LOG("Failed to open codec (%s)", av_err2str(err));
+    goto rollback_codec_context;
+  }
+  // mburakov: Thread count is resolved from the cpu affinity of the process
+  // when the codec is opened.
+  LOG("Initialized %s software decoder with %d threads", codec_impl->name,
+      sw_decode_context->codec_context->thread_count);
+
+  sw_decode_context->packet = av_packet_alloc();
+  if (!sw_decode_context->packet) {
+    LOG("Failed to allocate packet");
+    goto rollback_codec_context;
+  }
+  sw_decode_context->frame = av_frame_alloc();
+  if (!sw_decode_context->frame) {
+    LOG("Failed to allocate frame");
+    goto rollback_packet;
+  }
+  return sw_decode_context;
+
+rollback_packet:
+  av_packet_free(&sw_decode_context->packet);
+rollback_codec_context:
+  avcodec_free_context(&sw_decode_context->codec_context);
+rollback_udmabuf_fd:
+  close(sw_decode_context->udmabuf_fd);
+rollback_sw_decode_context:
+  free(sw_decode_context);
+  return NULL;
+}
+
+static bool SwDecodeContextDecode(struct SwDecodeContext* sw_decode_context,
+                                  const void* buffer, size_t size,
+                                  bool* sync_point, bool* decoded) {
+  AVPacket* packet = sw_decode_context->packet;
+  packet->data = (uint8_t*)(uintptr_t)buffer;
+  packet->size = (int)size;
+  int err = avcodec_send_packet(sw_decode_context->codec_context, packet);
+  if (err < 0) {
+    LOG("Failed to send packet (%s)", av_err2str(err));
+    return false;
+  }
+
+  *sync_point = false;
+  for (;;) {
+    AVFrame* frame = sw_decode_context->frame;
+    err = avcodec_receive_frame(sw_decode_context->codec_context, frame);
+    if (err == AVERROR(EAGAIN)) return true;
+    if (err < 0) {
+      LOG("Failed to receive frame (%s)", av_err2str(err));
+      return false;
+    }
+    *sync_point = !!(frame->flags & AV_FRAME_FLAG_KEY);
+    *decoded = true;
+    bool result = ShowFrame(sw_decode_context, frame);
+    av_frame_unref(frame);
+    if (!result) return false;
+  }
+}
+
+static void SwDecodeContextReset(struct SwDecodeContext* sw_decode_context) {
+  avcodec_flush_buffers(sw_decode_context->codec_context);
+}
+
+static void SwDecodeContextDestroy(struct SwDecodeContext* sw_decode_context) {
+  DestroyBuffers(sw_decode_context);
+  av_frame_free(&sw_decode_context->frame);
+  av_packet_free(&sw_decode_context->packet);
+  avcodec_free_context(&sw_decode_context->codec_context);
+  close(sw_decode_context->udmabuf_fd);
+  free(sw_decode_context);
+}
+
+// mburakov: Software decoder is what the receiver falls back to when there is
+// no usable VA driver. Its codec is only known once the first frame arrives.
+struct DecodeImplContext {
+  struct Window* window;
+  struct SwDecodeContext* sw_decode_context;
+  bool sync_point;
+  uint64_t decode_time;
+};
+
+static struct DecodeImplContext* SoftwareCreate(struct Window* window,
+                                                const char* render_node) {
+  // mburakov: Software decoder does not need a device at all.
+  (void)render_node;
+  struct DecodeImplContext* decode_context =
+      malloc(sizeof(struct DecodeImplContext));
+  if (!decode_context) {
+    LOG("Failed to allocate decode context (%s)", strerror(errno));
+    return NULL;
+  }
+  *decode_context = (struct DecodeImplContext){
+      .window = window,
+  };
+  return decode_context;
+}
+
+static bool SoftwareAttachWindow(struct DecodeImplContext* decode_context,
+                                 struct Window* window) {
+  decode_context->window = window;
+  if (decode_context->sw_decode_context)
+    decode_context->sw_decode_context->window = window;
+  return true;
+}
+
+static bool SoftwarePrewarm(struct DecodeImplContext* decode_context,
+                            enum DecodeCodec codec, uint16_t width,
+                            uint16_t height) {
+  // mburakov: Software decoder allocates its buffers cheaply on demand.
+  (void)decode_context;
+  (void)codec;
+  (void)width;
+  (void)height;
+  return true;
+}
+
+static bool SoftwareUpscale(struct DecodeImplContext* decode_context,
+                            uint16_t width, uint16_t height) {
+  // mburakov: Frames are never on the device, so there is nothing to scale
+  // them with.
+  (void)decode_context;
+  (void)width;
+  (void)height;
+  return false;
+}
+
+static void* SoftwareLockBuffer(struct DecodeImplContext* decode_context,
+                                size_t size) {
+  (void)decode_context;
+  (void)size;
+  return NULL;
+}
+
+static bool SoftwareDecode(struct DecodeImplContext* decode_context,
+                           const void* buffer, size_t size, bool* decoded) {
+  *decoded = false;
+  if (!decode_context->sw_decode_context) {
+    enum DecodeCodec codec;
+    if (!DecodeDetectCodec(buffer, size, &codec)) {
+      LOG("Failed to detect codec");
+      return false;
+    }
+    decode_context->sw_decode_context =
+        SwDecodeContextCreate(decode_context->window, codec);
+    if (!decode_context->sw_decode_context) {
+      LOG("Failed to create sw decode context");
+      return false;
+    }
+  }
+  uint64_t submitted = MicrosNow();
+  if (!SwDecodeContextDecode(decode_context->sw_decode_context, buffer, size,
+                             &decode_context->sync_point, decoded)) {
+    return false;
+  }
+  decode_context->decode_time = MicrosNow() - submitted;
+  return true;
+}
+
+static int SoftwareGetEventsFd(const struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return -1;
+}
+
+static bool SoftwareProcessEvents(struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return true;
+}
+
+static bool SoftwareIsSyncPoint(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->sync_point;
+}
+
+static bool SoftwareTakeKeyframeRequest(
+    struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return false;
+}
+
+static uint64_t SoftwareGetDecodeTime(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->decode_time;
+}
+
+static size_t SoftwareGetBusyRetries(
+    const struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return 0;
+}
+
+static uint64_t SoftwareGetBusyTime(
+    const struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return 0;
+}
+
+static bool SoftwareGetStats(const struct DecodeImplContext* decode_context,
+                             struct DecodeStats* stats) {
+  (void)decode_context;
+  (void)stats;
+  return false;
+}
+
+static bool SoftwareReset(struct DecodeImplContext* decode_context) {
+  decode_context->sync_point = false;
+  if (decode_context->sw_decode_context)
+    SwDecodeContextReset(decode_context->sw_decode_context);
+  return true;
+}
+
+static void SoftwareDestroy(struct DecodeImplContext* decode_context) {
+  if (decode_context->sw_decode_context)
+    SwDecodeContextDestroy(decode_context->sw_decode_context);
+  free(decode_context);
+}
+
+const struct DecodeImpl g_software_decode_impl = {
+    .name = "software",
+    .Create = SoftwareCreate,
+    .AttachWindow = SoftwareAttachWindow,
+    .Prewarm = SoftwarePrewarm,
+    .Upscale = SoftwareUpscale,
+    .LockBuffer = SoftwareLockBuffer,
+    .Decode = SoftwareDecode,
+    .GetEventsFd = SoftwareGetEventsFd,
+    .ProcessEvents = SoftwareProcessEvents,
+    .IsSyncPoint = SoftwareIsSyncPoint,
+    .TakeKeyframeRequest = SoftwareTakeKeyframeRequest,
+    .GetDecodeTime = SoftwareGetDecodeTime,
+    .GetBusyRetries = SoftwareGetBusyRetries,
+    .GetBusyTime = SoftwareGetBusyTime,
+    .GetStats = SoftwareGetStats,
+    .Reset = SoftwareReset,
+    .Destroy = SoftwareDestroy,
+};
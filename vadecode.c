@@ -0,0 +1,670 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "decodeimpl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+#include <vadecoder.h>
+
+#include "frame.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+#include "vpp.h"
+#include "window.h"
+
+#define SCANOUT_MODIFIERS_MAX 16
+
+// mburakov: Decoding a single frame takes milliseconds, so a picture that is
+// not ready after a second is coming from a hung device.
+#define SYNC_TIMEOUT_MS 1000
+
+struct ExportedSurface {
+  int dmabuf_fds[4];
+  struct Frame frame;
+  size_t size;
+};
+
+// mburakov: This is the decoder that talks to the stub directly. There is no
+// frame allocator or work surfaces to manage, since the decoder owns all of
+// its surfaces, and the ones handed to the window are just exports of those.
+struct DecodeImplContext {
+  struct Window* window;
+  VADisplay va_display;
+  struct VaDecoder* va_decoder;
+  struct VaDecoderInfo info;
+  // mburakov: Set when the decoder was initialized from a hint, and cleared
+  // once the actual stream parameters were checked against the hint.
+  bool prewarmed;
+  struct ExportedSurface* surfaces;
+  size_t surfaces_count;
+  bool sync_point;
+  uint64_t decode_time;
+
+  // mburakov: Frames scaled by the video processing pipeline are assigned to
+  // the window after the ones produced by the decoder.
+  struct Vpp* vpp;
+  struct ExportedSurface* vpp_surfaces;
+  size_t vpp_surfaces_count;
+  uint16_t upscale_width;
+  uint16_t upscale_height;
+
+  // mburakov: Modifiers compositor could scan out when the surfaces were
+  // allocated. Once these change, surfaces are allocated again at the next
+  // sequence header, and bitstream is not locked until then.
+  uint64_t scanout_modifiers[SCANOUT_MODIFIERS_MAX];
+  size_t scanout_modifiers_count;
+  bool scanout_changed;
+  bool keyframe_request;
+};
+
+const char* VaStatusString(VAStatus status) {
+  static const char* va_status_strings[] = {
+      "VA_STATUS_SUCCESS",
+      "VA_STATUS_ERROR_OPERATION_FAILED",
+      "VA_STATUS_ERROR_ALLOCATION_FAILED",
+      "VA_STATUS_ERROR_INVALID_DISPLAY",
+      "VA_STATUS_ERROR_INVALID_CONFIG",
+      "VA_STATUS_ERROR_INVALID_CONTEXT",
+      "VA_STATUS_ERROR_INVALID_SURFACE",
+      "VA_STATUS_ERROR_INVALID_BUFFER",
+      "VA_STATUS_ERROR_INVALID_IMAGE",
+      "VA_STATUS_ERROR_INVALID_SUBPICTURE",
+      "VA_STATUS_ERROR_ATTR_NOT_SUPPORTED",
+      "VA_STATUS_ERROR_MAX_NUM_EXCEEDED",
+      "VA_STATUS_ERROR_UNSUPPORTED_PROFILE",
+      "VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT",
+      "VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT",
+      "VA_STATUS_ERROR_UNSUPPORTED_BUFFERTYPE",
+      "VA_STATUS_ERROR_SURFACE_BUSY",
+      "VA_STATUS_ERROR_FLAG_NOT_SUPPORTED",
+      "VA_STATUS_ERROR_INVALID_PARAMETER",
+      "VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED",
+      "VA_STATUS_ERROR_UNIMPLEMENTED",
+      "VA_STATUS_ERROR_SURFACE_IN_DISPLAYING",
+      "VA_STATUS_ERROR_INVALID_IMAGE_FORMAT",
+      "VA_STATUS_ERROR_DECODING_ERROR",
+      "VA_STATUS_ERROR_ENCODING_ERROR",
+      "VA_STATUS_ERROR_INVALID_VALUE",
+      "???",
+      "???",
+      "???",
+      "???",
+      "???",
+      "???",
+      "VA_STATUS_ERROR_UNSUPPORTED_FILTER",
+      "VA_STATUS_ERROR_INVALID_FILTER_CHAIN",
+      "VA_STATUS_ERROR_HW_BUSY",
+      "???",
+      "VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE",
+      "VA_STATUS_ERROR_NOT_ENOUGH_BUFFER",
+      "VA_STATUS_ERROR_TIMEDOUT",
+  };
+  return (VA_STATUS_SUCCESS <= status && status <= VA_STATUS_ERROR_TIMEDOUT)
+             ? va_status_strings[status - VA_STATUS_SUCCESS]
+             : "???";
+}
+
+static struct {
+  int drm_fd;
+  VADisplay va_display;
+  size_t refcount;
+} g_va_display;
+
+VADisplay VaDisplayAcquire(const char* render_node) {
+  if (g_va_display.refcount) {
+    g_va_display.refcount++;
+    return g_va_display.va_display;
+  }
+
+  if (!render_node) render_node = "/dev/dri/renderD128";
+  g_va_display.drm_fd = open(render_node, O_RDWR);
+  if (g_va_display.drm_fd == -1) {
+    LOG("Failed to open render node %s (%s)", render_node, strerror(errno));
+    return NULL;
+  }
+  LOG("Opened render node %s", render_node);
+
+  g_va_display.va_display = vaGetDisplayDRM(g_va_display.drm_fd);
+  if (!g_va_display.va_display) {
+    LOG("Failed to get vaapi display (%s)", strerror(errno));
+    goto rollback_drm_fd;
+  }
+  int major, minor;
+  VAStatus va_status = vaInitialize(g_va_display.va_display, &major, &minor);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to init vaapi (%s)", VaStatusString(va_status));
+    goto rollback_display;
+  }
+
+  LOG("Initialized vaapi %d.%d", major, minor);
+  g_va_display.refcount = 1;
+  return g_va_display.va_display;
+
+rollback_display:
+  vaTerminate(g_va_display.va_display);
+rollback_drm_fd:
+  close(g_va_display.drm_fd);
+  return NULL;
+}
+
+void VaDisplayRelease(void) {
+  if (--g_va_display.refcount) return;
+  vaTerminate(g_va_display.va_display);
+  close(g_va_display.drm_fd);
+}
+
+static bool ExportSurface(VADisplay va_display, VASurfaceID surface_id,
+                          struct ExportedSurface* surface) {
+  VADRMPRIMESurfaceDescriptor prime;
+  VAStatus va_status = vaExportSurfaceHandle(
+      va_display, surface_id, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+      VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS, &prime);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to export vaapi surface (%s)", VaStatusString(va_status));
+    return false;
+  }
+
+  *surface = (struct ExportedSurface){
+      .dmabuf_fds = {-1, -1, -1, -1},
+      .frame.width = prime.width,
+      .frame.height = prime.height,
+      .frame.fourcc = prime.fourcc,
+      .frame.nplanes = prime.layers[0].num_planes,
+  };
+  for (uint32_t i = 0; i < prime.num_objects; i++)
+    surface->size += prime.objects[i].size;
+  for (uint32_t i = 0; i < prime.layers[0].num_planes; i++) {
+    surface->dmabuf_fds[i] = prime.objects[prime.layers[0].object_index[i]].fd;
+    surface->frame.planes[i] = (struct FramePlane){
+        .dmabuf_fd = surface->dmabuf_fds[i],
+        .pitch = prime.layers[0].pitch[i],
+        .offset = prime.layers[0].offset[i],
+        .modifier =
+            prime.objects[prime.layers[0].object_index[i]].drm_format_modifier,
+    };
+  }
+  return true;
+}
+
+// mburakov: This is the video memory taken by a set of surfaces, as reported
+// by the driver, i.e. to tell how much every additional stream costs.
+static size_t GetSurfacesSize(const struct ExportedSurface* surfaces,
+                              size_t count) {
+  size_t result = 0;
+  for (size_t i = 0; i < count; i++) result += surfaces[i].size;
+  return result;
+}
+
+static void ReleaseSurface(struct ExportedSurface* surface) {
+  for (size_t i = LENGTH(surface->dmabuf_fds); i; i--) {
+    if (surface->dmabuf_fds[i - 1] != -1) close(surface->dmabuf_fds[i - 1]);
+  }
+}
+
+static bool AssignFrames(struct DecodeImplContext* decode_context) {
+  size_t nframes =
+      decode_context->surfaces_count + decode_context->vpp_surfaces_count;
+  struct Frame frames[nframes];
+  for (size_t i = 0; i < decode_context->surfaces_count; i++)
+    frames[i] = decode_context->surfaces[i].frame;
+  for (size_t i = 0; i < decode_context->vpp_surfaces_count; i++) {
+    frames[decode_context->surfaces_count + i] =
+        decode_context->vpp_surfaces[i].frame;
+  }
+  return WindowAssignFrames(decode_context->window, nframes, frames);
+}
+
+static void StopDecoder(struct DecodeImplContext* decode_context) {
+  for (size_t i = decode_context->surfaces_count; i; i--)
+    ReleaseSurface(&decode_context->surfaces[i - 1]);
+  free(decode_context->surfaces);
+  decode_context->surfaces = NULL;
+  decode_context->surfaces_count = 0;
+  VaDecoderClose(decode_context->va_decoder);
+}
+
+static void QueryScanoutModifiers(struct DecodeImplContext* decode_context) {
+  decode_context->scanout_modifiers_count = 0;
+  if (!decode_context->window) return;
+  decode_context->scanout_modifiers_count = WindowGetScanoutModifiers(
+      decode_context->window, VA_FOURCC_NV12, decode_context->scanout_modifiers,
+      LENGTH(decode_context->scanout_modifiers));
+}
+
+static bool StartDecoder(struct DecodeImplContext* decode_context,
+                         const struct VaDecoderInfo* info) {
+  QueryScanoutModifiers(decode_context);
+  struct VaDecoderInfo scanout_info = *info;
+  scanout_info.modifiers = decode_context->scanout_modifiers;
+  scanout_info.modifiers_count = decode_context->scanout_modifiers_count;
+  if (!VaDecoderInit(decode_context->va_decoder, &scanout_info)) {
+    LOG("Failed to init va decoder");
+    return false;
+  }
+
+  size_t surfaces_count;
+  const VASurfaceID* surface_ids =
+      VaDecoderGetSurfaces(decode_context->va_decoder, &surfaces_count);
+  decode_context->surfaces =
+      calloc(surfaces_count, sizeof(struct ExportedSurface));
+  if (!decode_context->surfaces) {
+    LOG("Failed to allocate surfaces storage (%s)", strerror(errno));
+    goto rollback_decoder;
+  }
+  for (; decode_context->surfaces_count < surfaces_count;
+       decode_context->surfaces_count++) {
+    size_t i = decode_context->surfaces_count;
+    if (!ExportSurface(decode_context->va_display, surface_ids[i],
+                       &decode_context->surfaces[i])) {
+      LOG("Failed to export surface");
+      goto rollback_decoder;
+    }
+  }
+  LOG("Exported %zu decode surfaces taking %zu KiB", surfaces_count,
+      GetSurfacesSize(decode_context->surfaces, surfaces_count) >> 10);
+
+  if (decode_context->window && !AssignFrames(decode_context)) {
+    LOG("Failed to assign frames to window");
+    goto rollback_decoder;
+  }
+  decode_context->info = *info;
+  return true;
+
+rollback_decoder:
+  StopDecoder(decode_context);
+  return false;
+}
+
+static struct DecodeImplContext* VaDecodeContextCreate(
+    struct Window* window, const char* render_node) {
+  struct DecodeImplContext* decode_context =
+      malloc(sizeof(struct DecodeImplContext));
+  if (!decode_context) {
+    LOG("Failed to allocate decode context (%s)", strerror(errno));
+    return NULL;
+  }
+  *decode_context = (struct DecodeImplContext){
+      .window = window,
+  };
+
+  decode_context->va_display = VaDisplayAcquire(render_node);
+  if (!decode_context->va_display) {
+    LOG("Failed to acquire vaapi display");
+    goto rollback_decode_context;
+  }
+
+  decode_context->va_decoder = VaDecoderCreate(decode_context->va_display);
+  if (!decode_context->va_decoder) {
+    LOG("Failed to create va decoder");
+    goto rollback_display;
+  }
+  return decode_context;
+
+rollback_display:
+  VaDisplayRelease();
+rollback_decode_context:
+  free(decode_context);
+  return NULL;
+}
+
+static enum VaDecoderCodec GetVaDecoderCodec(enum DecodeCodec codec) {
+  return codec == DECODE_CODEC_AV1 ? VA_DECODER_CODEC_AV1
+                                   : VA_DECODER_CODEC_HEVC;
+}
+
+static bool VaDecodeContextPrewarm(struct DecodeImplContext* decode_context,
+                                   enum DecodeCodec codec, uint16_t width,
+                                   uint16_t height) {
+  // mburakov: Same guess of the number of reference pictures as with MFX.
+  struct VaDecoderInfo info = {
+      .codec = GetVaDecoderCodec(codec),
+      .width = (uint16_t)((width + 15) & ~15),
+      .height = (uint16_t)((height + 15) & ~15),
+      .num_ref_frames = codec == DECODE_CODEC_AV1 ? 8 : 4,
+  };
+  if (!StartDecoder(decode_context, &info)) {
+    LOG("Failed to start decoder");
+    return false;
+  }
+  decode_context->prewarmed = true;
+  return true;
+}
+
+static void StopVpp(struct DecodeImplContext* decode_context) {
+  for (size_t i = decode_context->vpp_surfaces_count; i; i--)
+    ReleaseSurface(&decode_context->vpp_surfaces[i - 1]);
+  free(decode_context->vpp_surfaces);
+  decode_context->vpp_surfaces = NULL;
+  decode_context->vpp_surfaces_count = 0;
+  VppDestroy(decode_context->vpp);
+  decode_context->vpp = NULL;
+}
+
+static bool VaDecodeContextUpscale(struct DecodeImplContext* decode_context,
+                                   uint16_t width, uint16_t height) {
+  QueryScanoutModifiers(decode_context);
+  decode_context->vpp =
+      VppCreate(decode_context->va_display, width, height,
+                decode_context->scanout_modifiers,
+                decode_context->scanout_modifiers_count);
+  if (!decode_context->vpp) {
+    LOG("Failed to create vpp");
+    return false;
+  }
+
+  size_t surfaces_count;
+  const VASurfaceID* surface_ids =
+      VppGetSurfaces(decode_context->vpp, &surfaces_count);
+  decode_context->vpp_surfaces =
+      calloc(surfaces_count, sizeof(struct ExportedSurface));
+  if (!decode_context->vpp_surfaces) {
+    LOG("Failed to allocate vpp surfaces storage (%s)", strerror(errno));
+    goto rollback_vpp;
+  }
+  for (; decode_context->vpp_surfaces_count < surfaces_count;
+       decode_context->vpp_surfaces_count++) {
+    size_t i = decode_context->vpp_surfaces_count;
+    if (!ExportSurface(decode_context->va_display, surface_ids[i],
+                       &decode_context->vpp_surfaces[i])) {
+      LOG("Failed to export vpp surface");
+      goto rollback_vpp;
+    }
+  }
+  LOG("Exported %zu vpp surfaces taking %zu KiB", surfaces_count,
+      GetSurfacesSize(decode_context->vpp_surfaces, surfaces_count) >> 10);
+
+  // mburakov: Prewarmed decoder has its frames assigned already.
+  if (decode_context->window && decode_context->surfaces &&
+      !AssignFrames(decode_context)) {
+    LOG("Failed to assign frames to window");
+    goto rollback_vpp;
+  }
+  decode_context->upscale_width = width;
+  decode_context->upscale_height = height;
+  return true;
+
+rollback_vpp:
+  StopVpp(decode_context);
+  return false;
+}
+
+static bool RestartVpp(struct DecodeImplContext* decode_context) {
+  uint16_t width = decode_context->upscale_width;
+  uint16_t height = decode_context->upscale_height;
+  StopVpp(decode_context);
+  return VaDecodeContextUpscale(decode_context, width, height);
+}
+
+static bool ScanoutChanged(const struct DecodeImplContext* decode_context) {
+  if (!decode_context->window) return false;
+  uint64_t modifiers[SCANOUT_MODIFIERS_MAX];
+  size_t count = WindowGetScanoutModifiers(
+      decode_context->window, VA_FOURCC_NV12, modifiers, LENGTH(modifiers));
+  // mburakov: Compositor stops offering scanout i.e. while something is shown
+  // on top of the window. Surfaces are kept then, since these would likely be
+  // scanned out again once it is gone.
+  return count && (count != decode_context->scanout_modifiers_count ||
+                   memcmp(modifiers, decode_context->scanout_modifiers,
+                          count * sizeof(uint64_t)));
+}
+
+static bool InitializeDecoder(struct DecodeImplContext* decode_context,
+                              const void* buffer, size_t size) {
+  enum DecodeCodec codec;
+  if (!DecodeDetectCodec(buffer, size, &codec)) {
+    LOG("Failed to detect codec");
+    return false;
+  }
+  struct VaDecoderInfo info = {
+      .codec = GetVaDecoderCodec(codec),
+  };
+  bool found;
+  if (!VaDecoderDecodeHeader(decode_context->va_decoder, buffer, size, &info,
+                             &found)) {
+    LOG("Failed to decode header");
+    return false;
+  }
+  if (!found) return true;
+
+  // mburakov: Parameter sets come together with a keyframe, so nothing that
+  // was decoded before would be referenced anymore. Reallocation has to wait
+  // for these, and a keyframe is requested once scanout changed.
+  if (decode_context->scanout_changed) {
+    LOG("Reallocating surfaces for scanout");
+    decode_context->scanout_changed = false;
+    decode_context->prewarmed = false;
+    StopDecoder(decode_context);
+    if (decode_context->vpp && !RestartVpp(decode_context)) {
+      // mburakov: This is not fatal, compositor would scale frames instead.
+      LOG("Failed to restart vpp, leaving scaling to compositor");
+    }
+  }
+
+  if (decode_context->prewarmed) {
+    decode_context->prewarmed = false;
+    const struct VaDecoderInfo* expected = &decode_context->info;
+    if (info.codec == expected->codec && info.width <= expected->width &&
+        info.height <= expected->height &&
+        info.num_ref_frames <= expected->num_ref_frames) {
+      LOG("Adopted prewarmed decoder");
+      return true;
+    }
+    LOG("Stream does not match prewarmed decoder");
+    StopDecoder(decode_context);
+  }
+  return StartDecoder(decode_context, &info);
+}
+
+static void* VaDecodeContextLockBuffer(struct DecodeImplContext* decode_context,
+                                       size_t size) {
+  // mburakov: Buffers of a prewarmed decoder might go away once the stream
+  // is checked, and same stands for surfaces that are allocated again.
+  if (!decode_context->surfaces || decode_context->prewarmed) return NULL;
+  if (decode_context->scanout_changed) return NULL;
+  if (ScanoutChanged(decode_context)) {
+    decode_context->scanout_changed = true;
+    decode_context->keyframe_request = true;
+    return NULL;
+  }
+  void* data = VaDecoderLockBitstream(decode_context->va_decoder, size);
+  if (!data) LOG("Failed to lock bitstream");
+  return data;
+}
+
+static bool VaDecodeContextDecode(struct DecodeImplContext* decode_context,
+                                  const void* buffer, size_t size,
+                                  bool* decoded) {
+  *decoded = false;
+  if (!decode_context->surfaces || decode_context->prewarmed ||
+      decode_context->scanout_changed) {
+    if (!InitializeDecoder(decode_context, buffer, size)) {
+      LOG("Failed to initialize decoder");
+      return false;
+    }
+    if (!decode_context->surfaces || decode_context->prewarmed) {
+      // mburakov: Initialization might be postponed.
+      return true;
+    }
+  }
+
+  struct VaDecoderPicture picture;
+  if (!VaDecoderDecode(decode_context->va_decoder, buffer, size, &picture)) {
+    LOG("Failed to decode frame");
+    return false;
+  }
+  const struct VaDecoderStats* va_stats =
+      VaDecoderGetStats(decode_context->va_decoder);
+  if (va_stats->va_buffer_calls) {
+    // mburakov: This is expected only until the buffers pool warms up.
+    LOG("Frame required %zu va buffer create/destroy calls",
+        va_stats->va_buffer_calls);
+  }
+  // mburakov: Nothing to show, i.e. AV1 frame that is shown later.
+  if (picture.surface_id == VA_INVALID_SURFACE) return true;
+  decode_context->sync_point = picture.sync_point;
+  uint64_t submitted = MicrosNow();
+  if (!VaDecoderSync(decode_context->va_decoder, &picture, SYNC_TIMEOUT_MS)) {
+    LOG("Failed to sync picture");
+    return false;
+  }
+
+  // mburakov: Scaling is a part of the decode time, so that it could be
+  // compared with the time the compositor would spend doing the same.
+  size_t index = picture.index;
+  if (decode_context->vpp &&
+      (picture.crop_rect[2] < decode_context->upscale_width ||
+       picture.crop_rect[3] < decode_context->upscale_height)) {
+    size_t vpp_index;
+    if (!VppProcess(decode_context->vpp, picture.surface_id,
+                    picture.crop_rect, &vpp_index)) {
+      LOG("Failed to upscale picture");
+      return false;
+    }
+    index = decode_context->surfaces_count + vpp_index;
+    memcpy(picture.crop_rect,
+           (uint16_t[]){0, 0, decode_context->upscale_width,
+                        decode_context->upscale_height},
+           sizeof(picture.crop_rect));
+  }
+  decode_context->decode_time = MicrosNow() - submitted;
+  *decoded = true;
+
+  if (decode_context->window &&
+      !WindowShowFrame(decode_context->window, index, picture.crop_rect[0],
+                       picture.crop_rect[1], picture.crop_rect[2],
+                       picture.crop_rect[3])) {
+    LOG("Failed to show frame");
+    return false;
+  }
+  return true;
+}
+
+static int VaDecodeContextGetEventsFd(
+    const struct DecodeImplContext* decode_context) {
+  // mburakov: Decoder waits for the device instead of reporting it busy, so
+  // there is never anything to retry.
+  (void)decode_context;
+  return -1;
+}
+
+static bool VaDecodeContextProcessEvents(
+    struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return true;
+}
+
+static bool VaDecodeContextIsSyncPoint(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->sync_point;
+}
+
+static bool VaDecodeContextTakeKeyframeRequest(
+    struct DecodeImplContext* decode_context) {
+  bool result = decode_context->keyframe_request;
+  decode_context->keyframe_request = false;
+  return result;
+}
+
+static uint64_t VaDecodeContextGetDecodeTime(
+    const struct DecodeImplContext* decode_context) {
+  return decode_context->decode_time;
+}
+
+static size_t VaDecodeContextGetBusyRetries(
+    const struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return 0;
+}
+
+static uint64_t VaDecodeContextGetBusyTime(
+    const struct DecodeImplContext* decode_context) {
+  (void)decode_context;
+  return 0;
+}
+
+static bool VaDecodeContextGetStats(
+    const struct DecodeImplContext* decode_context,
+    struct DecodeStats* stats) {
+  const struct VaDecoderStats* va_stats =
+      VaDecoderGetStats(decode_context->va_decoder);
+  if (!va_stats->frame_type) return false;
+  *stats = (struct DecodeStats){
+      .frame_type = va_stats->frame_type,
+      .quantizer = va_stats->quantizer,
+      .payload_size = va_stats->payload_size,
+      .epb_count = va_stats->epb_count,
+      .epb_partial = va_stats->epb_partial,
+  };
+  return true;
+}
+
+static bool VaDecodeContextReset(struct DecodeImplContext* decode_context) {
+  decode_context->sync_point = false;
+  // mburakov: Decoder that was not initialized yet has nothing to forget.
+  if (!decode_context->surfaces) return true;
+  if (!VaDecoderReset(decode_context->va_decoder)) {
+    LOG("Failed to reset va decoder");
+    return false;
+  }
+  return true;
+}
+
+static void VaDecodeContextDestroy(struct DecodeImplContext* decode_context) {
+  if (decode_context->vpp) StopVpp(decode_context);
+  StopDecoder(decode_context);
+  VaDecoderDestroy(decode_context->va_decoder);
+  VaDisplayRelease();
+  free(decode_context);
+}
+
+static bool VaDecodeContextAttachWindow(
+    struct DecodeImplContext* decode_context, struct Window* window) {
+  decode_context->window = window;
+  if (!decode_context->surfaces) return true;
+  if (!AssignFrames(decode_context)) {
+    LOG("Failed to assign frames to window");
+    return false;
+  }
+  return true;
+}
+
+const struct DecodeImpl g_vaapi_decode_impl = {
+    .name = "vaapi",
+    .Create = VaDecodeContextCreate,
+    .AttachWindow = VaDecodeContextAttachWindow,
+    .Prewarm = VaDecodeContextPrewarm,
+    .Upscale = VaDecodeContextUpscale,
+    .LockBuffer = VaDecodeContextLockBuffer,
+    .Decode = VaDecodeContextDecode,
+    .GetEventsFd = VaDecodeContextGetEventsFd,
+    .ProcessEvents = VaDecodeContextProcessEvents,
+    .IsSyncPoint = VaDecodeContextIsSyncPoint,
+    .TakeKeyframeRequest = VaDecodeContextTakeKeyframeRequest,
+    .GetDecodeTime = VaDecodeContextGetDecodeTime,
+    .GetBusyRetries = VaDecodeContextGetBusyRetries,
+    .GetBusyTime = VaDecodeContextGetBusyTime,
+    .GetStats = VaDecodeContextGetStats,
+    .Reset = VaDecodeContextReset,
+    .Destroy = VaDecodeContextDestroy,
+};
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vpp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <va/va_drmcommon.h>
+
+#include "decodeimpl.h"
+#include "toolbox/utils.h"
+
+// mburakov: One surface is shown, one is held by the compositor until the
+// next frame is shown, and one is being written.
+#define VPP_SURFACES_COUNT 3
+
+struct Vpp {
+  VADisplay va_display;
+  VAConfigID va_config_id;
+  VASurfaceID va_surface_ids[VPP_SURFACES_COUNT];
+  VAContextID va_context_id;
+  VABufferID sharpening_buffer_id;
+  size_t current;
+};
+
+static bool CreateSharpeningFilter(struct Vpp* vpp) {
+  VAProcFilterType filters[VAProcFilterCount];
+  unsigned int num_filters = VAProcFilterCount;
+  VAStatus va_status = vaQueryVideoProcFilters(
+      vpp->va_display, vpp->va_context_id, filters, &num_filters);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to query vpp filters (%s)", VaStatusString(va_status));
+    return false;
+  }
+  for (unsigned int i = 0; i < num_filters; i++) {
+    if (filters[i] != VAProcFilterSharpening) continue;
+    VAProcFilterCap filter_cap;
+    unsigned int num_filter_caps = 1;
+    va_status = vaQueryVideoProcFilterCaps(
+        vpp->va_display, vpp->va_context_id, VAProcFilterSharpening,
+        &filter_cap, &num_filter_caps);
+    if (va_status != VA_STATUS_SUCCESS) {
+      LOG("Failed to query vpp sharpening caps (%s)",
+          VaStatusString(va_status));
+      return false;
+    }
+    VAProcFilterParameterBuffer filter_params = {
+        .type = VAProcFilterSharpening,
+        .value = filter_cap.range.default_value,
+    };
+    va_status = vaCreateBuffer(vpp->va_display, vpp->va_context_id,
+                               VAProcFilterParameterBufferType,
+                               sizeof(filter_params), 1, &filter_params,
+                               &vpp->sharpening_buffer_id);
+    if (va_status != VA_STATUS_SUCCESS) {
+      LOG("Failed to create vpp sharpening buffer (%s)",
+          VaStatusString(va_status));
+      return false;
+    }
+    return true;
+  }
+  return true;
+}
+
+struct Vpp* VppCreate(VADisplay va_display, uint16_t width, uint16_t height,
+                      const uint64_t* modifiers, size_t modifiers_count) {
+  struct Vpp* vpp = malloc(sizeof(struct Vpp));
+  if (!vpp) {
+    LOG("Failed to allocate vpp (%s)", strerror(errno));
+    return NULL;
+  }
+  *vpp = (struct Vpp){
+      .va_display = va_display,
+      .sharpening_buffer_id = VA_INVALID_ID,
+  };
+
+  VAStatus va_status =
+      vaCreateConfig(vpp->va_display, VAProfileNone, VAEntrypointVideoProc,
+                     NULL, 0, &vpp->va_config_id);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create vpp config (%s)", VaStatusString(va_status));
+    goto rollback_vpp;
+  }
+
+  VADRMFormatModifierList modifier_list = {
+      .num_modifiers = (uint32_t)modifiers_count,
+      .modifiers = (void*)(ptrdiff_t)modifiers,
+  };
+  VASurfaceAttrib attrib_list[] = {
+      {.type = VASurfaceAttribPixelFormat,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_FOURCC_NV12},
+      {.type = VASurfaceAttribUsageHint,
+       .value.type = VAGenericValueTypeInteger,
+       .value.value.i = VA_SURFACE_ATTRIB_USAGE_HINT_VPP_WRITE |
+                        VA_SURFACE_ATTRIB_USAGE_HINT_EXPORT},
+      {.type = VASurfaceAttribDRMFormatModifiers,
+       .flags = VA_SURFACE_ATTRIB_SETTABLE,
+       .value.type = VAGenericValueTypePointer,
+       .value.value.p = &modifier_list},
+  };
+  unsigned int num_attribs = LENGTH(attrib_list);
+  if (!modifiers_count) num_attribs--;
+  va_status = vaCreateSurfaces(vpp->va_display, VA_RT_FORMAT_YUV420, width,
+                               height, vpp->va_surface_ids,
+                               VPP_SURFACES_COUNT, attrib_list, num_attribs);
+  if (va_status != VA_STATUS_SUCCESS && modifiers_count) {
+    LOG("Failed to create vpp surfaces for scanout (%s)",
+        VaStatusString(va_status));
+    va_status = vaCreateSurfaces(vpp->va_display, VA_RT_FORMAT_YUV420, width,
+                                 height, vpp->va_surface_ids,
+                                 VPP_SURFACES_COUNT, attrib_list,
+                                 num_attribs - 1);
+  }
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create vpp surfaces (%s)", VaStatusString(va_status));
+    goto rollback_va_config_id;
+  }
+
+  va_status = vaCreateContext(vpp->va_display, vpp->va_config_id, width,
+                              height, VA_PROGRESSIVE, vpp->va_surface_ids,
+                              VPP_SURFACES_COUNT, &vpp->va_context_id);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create vpp context (%s)", VaStatusString(va_status));
+    goto rollback_va_surface_ids;
+  }
+
+  // mburakov: Sharpening is nice to have, scaling works without it.
+  if (!CreateSharpeningFilter(vpp)) LOG("Failed to create sharpening filter");
+  if (vpp->sharpening_buffer_id == VA_INVALID_ID)
+    LOG("Scaling without sharpening");
+  return vpp;
+
+rollback_va_surface_ids:
+  vaDestroySurfaces(vpp->va_display, vpp->va_surface_ids, VPP_SURFACES_COUNT);
+rollback_va_config_id:
+  vaDestroyConfig(vpp->va_display, vpp->va_config_id);
+rollback_vpp:
+  free(vpp);
+  return NULL;
+}
+
+const VASurfaceID* VppGetSurfaces(const struct Vpp* vpp, size_t* count) {
+  *count = VPP_SURFACES_COUNT;
+  return vpp->va_surface_ids;
+}
+
+bool VppProcess(struct Vpp* vpp, VASurfaceID surface_id,
+                const uint16_t crop_rect[4], size_t* index) {
+  size_t next = (vpp->current + 1) % VPP_SURFACES_COUNT;
+  const VARectangle surface_region = {
+      .x = (int16_t)crop_rect[0],
+      .y = (int16_t)crop_rect[1],
+      .width = crop_rect[2],
+      .height = crop_rect[3],
+  };
+  bool sharpening = vpp->sharpening_buffer_id != VA_INVALID_ID;
+  VAProcPipelineParameterBuffer pipeline_params = {
+      .surface = surface_id,
+      .surface_region = &surface_region,
+      .filter_flags = VA_FILTER_SCALING_HQ,
+      .filters = sharpening ? &vpp->sharpening_buffer_id : NULL,
+      .num_filters = sharpening ? 1 : 0,
+  };
+  VABufferID pipeline_buffer_id;
+  VAStatus va_status = vaCreateBuffer(
+      vpp->va_display, vpp->va_context_id, VAProcPipelineParameterBufferType,
+      sizeof(pipeline_params), 1, &pipeline_params, &pipeline_buffer_id);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create vpp pipeline buffer (%s)",
+        VaStatusString(va_status));
+    return false;
+  }
+
+  bool result = false;
+  va_status = vaBeginPicture(vpp->va_display, vpp->va_context_id,
+                             vpp->va_surface_ids[next]);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to begin vpp picture (%s)", VaStatusString(va_status));
+    goto rollback_pipeline_buffer_id;
+  }
+  va_status = vaRenderPicture(vpp->va_display, vpp->va_context_id,
+                              &pipeline_buffer_id, 1);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to render vpp picture (%s)", VaStatusString(va_status));
+    // mburakov: Picture has to be ended anyway, but it is broken already.
+    vaEndPicture(vpp->va_display, vpp->va_context_id);
+    goto rollback_pipeline_buffer_id;
+  }
+  va_status = vaEndPicture(vpp->va_display, vpp->va_context_id);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to end vpp picture (%s)", VaStatusString(va_status));
+    goto rollback_pipeline_buffer_id;
+  }
+  va_status = vaSyncSurface(vpp->va_display, vpp->va_surface_ids[next]);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to sync vpp surface (%s)", VaStatusString(va_status));
+    goto rollback_pipeline_buffer_id;
+  }
+  vpp->current = next;
+  *index = next;
+  result = true;
+
+rollback_pipeline_buffer_id:
+  vaDestroyBuffer(vpp->va_display, pipeline_buffer_id);
+  return result;
+}
+
+void VppDestroy(struct Vpp* vpp) {
+  if (vpp->sharpening_buffer_id != VA_INVALID_ID)
+    vaDestroyBuffer(vpp->va_display, vpp->sharpening_buffer_id);
+  vaDestroyContext(vpp->va_display, vpp->va_context_id);
+  vaDestroySurfaces(vpp->va_display, vpp->va_surface_ids, VPP_SURFACES_COUNT);
+  vaDestroyConfig(vpp->va_display, vpp->va_config_id);
+  free(vpp);
+}
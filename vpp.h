@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of receiver.
+ *
+ * receiver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * receiver is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with receiver.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECEIVER_VPP_H_
+#define RECEIVER_VPP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <va/va.h>
+
+// mburakov: Video processing pipeline that scales decoded pictures to the
+// given size, and sharpens these if the driver supports it. Processed
+// pictures are written into a small pool of surfaces owned by the pipeline,
+// and indexed the same way as the surfaces returned from VppGetSurfaces.
+// Modifiers are handled the same way as with VaDecoderInit, see vadecoder.h.
+
+struct Vpp;
+
+struct Vpp* VppCreate(VADisplay va_display, uint16_t width, uint16_t height,
+                      const uint64_t* modifiers, size_t modifiers_count);
+const VASurfaceID* VppGetSurfaces(const struct Vpp* vpp, size_t* count);
+bool VppProcess(struct Vpp* vpp, VASurfaceID surface_id,
+                const uint16_t crop_rect[4], size_t* index);
+void VppDestroy(struct Vpp* vpp);
+
+#endif  // RECEIVER_VPP_H_
@@ -18,6 +18,7 @@
 #include "window.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
@@ -26,22 +27,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
 #include "frame.h"
 #include "linux-dmabuf-v1.h"
 #include "pointer-constraints-unstable-v1.h"
+#include "presentation-time.h"
 #include "relative-pointer-unstable-v1.h"
 #include "toolbox/utils.h"
 #include "viewporter.h"
 #include "xdg-shell.h"
 
 #define OVERLAY_BUFFERS_COUNT 2
+#define DMABUF_FORMATS_MAX 64
+#define PRESENTATION_FEEDBACKS_MAX 8
+#define DAMAGE_RECTS_MAX 32
+#define CURSOR_BUFFERS_COUNT 2
+#define CURSOR_SIZE_MAX 256
+#define CURSOR_POOL_SIZE \
+  (CURSOR_BUFFERS_COUNT * CURSOR_SIZE_MAX * CURSOR_SIZE_MAX * 4)
 
 // TODO(mburakov): This would look like shit until Wayland guys finally fix
 // https://gitlab.freedesktop.org/wayland/wayland/-/issues/160
 
+// mburakov: This is the layout of the format table entries, as defined by
+// the linux-dmabuf-v1 protocol.
+struct DmabufFormat {
+  uint32_t format;
+  uint32_t padding;
+  uint64_t modifier;
+};
+
 struct Window {
   const struct WindowEventHandlers* event_handlers;
   void* user;
@@ -54,6 +73,7 @@ struct Window {
   struct wl_seat* wl_seat;
   struct wl_subcompositor* wl_subcompositor;
   struct wp_viewporter* wp_viewporter;
+  struct wp_presentation* wp_presentation;
   struct xdg_wm_base* xdg_wm_base;
   struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf_v1;
   struct zwp_pointer_constraints_v1* zwp_pointer_constraints_v1;
@@ -71,12 +91,65 @@ struct Window {
   struct zwp_relative_pointer_v1* zwp_relative_pointer_v1;
   struct zwp_locked_pointer_v1* zwp_locked_pointer_v1;
 
+  // Wayland feedback
+  struct zwp_linux_dmabuf_feedback_v1* zwp_linux_dmabuf_feedback_v1;
+  dev_t main_device;
+  bool has_main_device;
+  struct DmabufFormat* format_table;
+  size_t format_table_count;
+  uint32_t tranche_flags;
+  struct DmabufFormat tranche_formats[DMABUF_FORMATS_MAX];
+  size_t tranche_formats_count;
+  struct DmabufFormat pending_formats[DMABUF_FORMATS_MAX];
+  size_t pending_formats_count;
+  struct DmabufFormat scanout_formats[DMABUF_FORMATS_MAX];
+  size_t scanout_formats_count;
+
   // Wayland dynamics
   size_t wl_buffers_count;
   struct wl_buffer** wl_buffers;
   int32_t window_width;
   int32_t window_height;
   bool was_closed;
+  size_t frames_shown;
+  struct wp_presentation_feedback*
+      wp_presentation_feedbacks[PRESENTATION_FEEDBACKS_MAX];
+  size_t frames_presented;
+  size_t frames_zero_copy;
+  bool zero_copy;
+
+  // mburakov: Tiles share connection and globals of the parent window, and
+  // only own a subsurface of it. Parent shows a black background then.
+  struct Window* parent;
+  struct wl_subsurface* wl_subsurface;
+  size_t tile_index;
+  size_t tile_count;
+  struct wl_buffer* wl_background;
+
+  // mburakov: Hidden tile does not show its frames, but remembers the last
+  // one, so that it could be shown right away once the tile is visible.
+  bool hidden;
+  // mburakov: Held window remembers its frames the same way, but keeps the
+  // last shown one on the screen instead of unmapping.
+  bool held;
+  bool has_frame;
+  size_t frame_index;
+  int frame_x;
+  int frame_y;
+  int frame_width;
+  int frame_height;
+  int32_t destination_width;
+  int32_t destination_height;
+
+  // mburakov: Damage of the next frame shown, in the coordinates of a frame
+  // of the given size. Whole frame is damaged unless this is set. Damage of
+  // the frames that were not shown is pending until the next one is.
+  bool damage_pending;
+  bool partial_damage;
+  uint16_t damage_rects[DAMAGE_RECTS_MAX][4];
+  size_t damage_rects_count;
+  int damage_width;
+  int damage_height;
 };
 
 struct Overlay {
@@ -91,10 +164,29 @@ struct Overlay {
   size_t wl_buffer_current;
 };
 
+struct Cursor {
+  const struct Window* window;
+  int shm_fd;
+  void* shm_buffer;
+  struct wl_surface* wl_surface;
+  struct wp_viewport* wp_viewport;
+  struct wl_subsurface* wl_subsurface;
+  struct wl_shm_pool* wl_shm_pool;
+  struct wl_buffer* wl_buffers[CURSOR_BUFFERS_COUNT];
+  size_t wl_buffer_current;
+  int width;
+  int height;
+  int hotspot_x;
+  int hotspot_y;
+  int x;
+  int y;
+  int screen_width;
+  int screen_height;
+};
+
 static void OnWlRegistryGlobal(void* data, struct wl_registry* wl_registry,
                                uint32_t name, const char* interface,
                                uint32_t version) {
-  (void)version;
 #define MAYBE_BIND(what, ver)                                                 \
   if (!strcmp(interface, what##_interface.name)) {                            \
     window->what =                                                            \
@@ -103,13 +195,14 @@ static void OnWlRegistryGlobal(void* data, struct wl_registry* wl_registry,
     return;                                                                   \
   }
   struct Window* window = data;
-  MAYBE_BIND(wl_compositor, 1)
+  MAYBE_BIND(wl_compositor, MIN(version, 4))
   MAYBE_BIND(wl_shm, 1)
   MAYBE_BIND(wl_seat, 8)
   MAYBE_BIND(wl_subcompositor, 1)
   MAYBE_BIND(wp_viewporter, 1)
+  MAYBE_BIND(wp_presentation, 1)
   MAYBE_BIND(xdg_wm_base, 1)
-  MAYBE_BIND(zwp_linux_dmabuf_v1, 2)
+  MAYBE_BIND(zwp_linux_dmabuf_v1, MIN(version, 4))
   MAYBE_BIND(zwp_pointer_constraints_v1, 1)
   MAYBE_BIND(zwp_relative_pointer_manager_v1, 1)
 #undef MAYBE_BIND
@@ -182,6 +275,7 @@ rollback_globals:
   if (window->zwp_linux_dmabuf_v1)
     zwp_linux_dmabuf_v1_destroy(window->zwp_linux_dmabuf_v1);
   if (window->xdg_wm_base) xdg_wm_base_destroy(window->xdg_wm_base);
+  if (window->wp_presentation) wp_presentation_destroy(window->wp_presentation);
   if (window->wp_viewporter) wp_viewporter_destroy(window->wp_viewporter);
   if (window->wl_subcompositor)
     wl_subcompositor_destroy(window->wl_subcompositor);
@@ -195,6 +289,172 @@ rollback_wl_display:
   return false;
 }
 
+static void OnZwpLinuxDmabufFeedbackDone(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback) {
+  (void)feedback;
+  struct Window* window = data;
+  memcpy(window->scanout_formats, window->pending_formats,
+         window->pending_formats_count * sizeof(struct DmabufFormat));
+  window->scanout_formats_count = window->pending_formats_count;
+  window->pending_formats_count = 0;
+}
+
+static void OnZwpLinuxDmabufFeedbackFormatTable(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback, int32_t fd,
+    uint32_t size) {
+  (void)feedback;
+  struct Window* window = data;
+  if (window->format_table) {
+    munmap(window->format_table,
+           window->format_table_count * sizeof(struct DmabufFormat));
+    window->format_table = NULL;
+    window->format_table_count = 0;
+  }
+  void* format_table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (format_table == MAP_FAILED) {
+    LOG("Failed to map format table (%s)", strerror(errno));
+    return;
+  }
+  window->format_table = format_table;
+  window->format_table_count = size / sizeof(struct DmabufFormat);
+}
+
+static void OnZwpLinuxDmabufFeedbackMainDevice(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback,
+    struct wl_array* device) {
+  (void)feedback;
+  struct Window* window = data;
+  if (device->size != sizeof(dev_t)) return;
+  memcpy(&window->main_device, device->data, sizeof(dev_t));
+  window->has_main_device = true;
+}
+
+static void OnZwpLinuxDmabufFeedbackTrancheDone(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback) {
+  (void)feedback;
+  struct Window* window = data;
+  if (window->tranche_flags &
+      ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT) {
+    size_t count = MIN(window->tranche_formats_count,
+                       LENGTH(window->pending_formats) -
+                           window->pending_formats_count);
+    memcpy(window->pending_formats + window->pending_formats_count,
+           window->tranche_formats, count * sizeof(struct DmabufFormat));
+    window->pending_formats_count += count;
+  }
+  window->tranche_formats_count = 0;
+  window->tranche_flags = 0;
+}
+
+static void OnZwpLinuxDmabufFeedbackTrancheTargetDevice(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback,
+    struct wl_array* device) {
+  (void)data;
+  (void)feedback;
+  (void)device;
+}
+
+static void OnZwpLinuxDmabufFeedbackTrancheFormats(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback,
+    struct wl_array* indices) {
+  (void)feedback;
+  struct Window* window = data;
+  // mburakov: Flags of the tranche are only sent after its formats, so these
+  // are kept until the tranche is done.
+  const uint16_t* index;
+  wl_array_for_each(index, indices) {
+    if (*index >= window->format_table_count ||
+        window->tranche_formats_count == LENGTH(window->tranche_formats))
+      continue;
+    window->tranche_formats[window->tranche_formats_count++] =
+        window->format_table[*index];
+  }
+}
+
+static void OnZwpLinuxDmabufFeedbackTrancheFlags(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback,
+    uint32_t flags) {
+  (void)feedback;
+  struct Window* window = data;
+  window->tranche_flags = flags;
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener
+    g_zwp_linux_dmabuf_feedback_v1_listener = {
+        .done = OnZwpLinuxDmabufFeedbackDone,
+        .format_table = OnZwpLinuxDmabufFeedbackFormatTable,
+        .main_device = OnZwpLinuxDmabufFeedbackMainDevice,
+        .tranche_done = OnZwpLinuxDmabufFeedbackTrancheDone,
+        .tranche_target_device = OnZwpLinuxDmabufFeedbackTrancheTargetDevice,
+        .tranche_formats = OnZwpLinuxDmabufFeedbackTrancheFormats,
+        .tranche_flags = OnZwpLinuxDmabufFeedbackTrancheFlags,
+};
+
+static bool InitMainDevice(struct Window* window) {
+  // mburakov: Feedback is only available since version 4 of the protocol.
+  if (zwp_linux_dmabuf_v1_get_version(window->zwp_linux_dmabuf_v1) < 4)
+    return true;
+  struct zwp_linux_dmabuf_feedback_v1* feedback =
+      zwp_linux_dmabuf_v1_get_default_feedback(window->zwp_linux_dmabuf_v1);
+  if (!feedback) {
+    LOG("Failed to get default feedback (%s)", strerror(errno));
+    return false;
+  }
+
+  bool result = false;
+  if (zwp_linux_dmabuf_feedback_v1_add_listener(
+          feedback, &g_zwp_linux_dmabuf_feedback_v1_listener, window)) {
+    LOG("Failed to add zwp_linux_dmabuf_feedback_v1 listener (%s)",
+        strerror(errno));
+    goto rollback_feedback;
+  }
+  if (wl_display_roundtrip(window->wl_display) == -1) {
+    LOG("Failed to roundtrip wl_display (%s)", strerror(errno));
+    goto rollback_feedback;
+  }
+  result = true;
+
+rollback_feedback:
+  zwp_linux_dmabuf_feedback_v1_destroy(feedback);
+  return result;
+}
+
+static bool InitScanoutFeedback(struct Window* window) {
+  // mburakov: Scanout tranches are only sent in the feedback of a surface,
+  // and only when the compositor considers the surface for direct scanout,
+  // i.e. once it is fullscreen. These change over time, hence the feedback
+  // is kept for the whole lifetime of the window.
+  if (zwp_linux_dmabuf_v1_get_version(window->zwp_linux_dmabuf_v1) < 4)
+    return true;
+  window->zwp_linux_dmabuf_feedback_v1 =
+      zwp_linux_dmabuf_v1_get_surface_feedback(window->zwp_linux_dmabuf_v1,
+                                               window->wl_surface);
+  if (!window->zwp_linux_dmabuf_feedback_v1) {
+    LOG("Failed to get surface feedback (%s)", strerror(errno));
+    return false;
+  }
+  if (zwp_linux_dmabuf_feedback_v1_add_listener(
+          window->zwp_linux_dmabuf_feedback_v1,
+          &g_zwp_linux_dmabuf_feedback_v1_listener, window)) {
+    LOG("Failed to add zwp_linux_dmabuf_feedback_v1 listener (%s)",
+        strerror(errno));
+    zwp_linux_dmabuf_feedback_v1_destroy(window->zwp_linux_dmabuf_feedback_v1);
+    window->zwp_linux_dmabuf_feedback_v1 = NULL;
+    return false;
+  }
+  return true;
+}
+
+static void DeinitFeedback(struct Window* window) {
+  if (window->zwp_linux_dmabuf_feedback_v1)
+    zwp_linux_dmabuf_feedback_v1_destroy(window->zwp_linux_dmabuf_feedback_v1);
+  if (window->format_table) {
+    munmap(window->format_table,
+           window->format_table_count * sizeof(struct DmabufFormat));
+  }
+}
+
 static void OnXdgSurfaceConfigure(void* data, struct xdg_surface* xdg_surface,
                                   uint32_t serial) {
   (void)data;
@@ -224,6 +484,21 @@ static void OnXdgToplevelClose(void* data, struct xdg_toplevel* xdg_toplevel) {
   }
 }
 
+static bool SetOpaqueRegion(struct Window* window) {
+  // mburakov: Decoded frames have no alpha channel, and telling that to the
+  // compositor lets it skip blending, or anything beneath the surface.
+  struct wl_region* wl_region =
+      wl_compositor_create_region(window->wl_compositor);
+  if (!wl_region) {
+    LOG("Failed to create wl_region (%s)", strerror(errno));
+    return false;
+  }
+  wl_region_add(wl_region, 0, 0, INT32_MAX, INT32_MAX);
+  wl_surface_set_opaque_region(window->wl_surface, wl_region);
+  wl_region_destroy(wl_region);
+  return true;
+}
+
 static bool InitWaylandToplevel(struct Window* window) {
   window->wl_surface = wl_compositor_create_surface(window->wl_compositor);
   if (!window->wl_surface) {
@@ -268,6 +543,10 @@ static bool InitWaylandToplevel(struct Window* window) {
     LOG("Failed to add xdg_toplevel listener (%s)", strerror(errno));
     goto rollback_xdg_toplevel;
   }
+  if (!SetOpaqueRegion(window)) {
+    LOG("Failed to set opaque region");
+    goto rollback_xdg_toplevel;
+  }
   return true;
 
 rollback_xdg_toplevel:
@@ -545,6 +824,7 @@ static void DeinitWaylandGlobals(struct Window* window) {
   zwp_pointer_constraints_v1_destroy(window->zwp_pointer_constraints_v1);
   zwp_linux_dmabuf_v1_destroy(window->zwp_linux_dmabuf_v1);
   xdg_wm_base_destroy(window->xdg_wm_base);
+  if (window->wp_presentation) wp_presentation_destroy(window->wp_presentation);
   wp_viewporter_destroy(window->wp_viewporter);
   wl_subcompositor_destroy(window->wl_subcompositor);
   wl_seat_destroy(window->wl_seat);
@@ -571,11 +851,19 @@ struct Window* WindowCreate(const struct WindowEventHandlers* event_handlers,
     goto rollback_window;
   }
 
+  // mburakov: This is not fatal, decoder would just open the default device.
+  if (!InitMainDevice(window)) LOG("Failed to initialize main device");
+
   if (!InitWaylandToplevel(window)) {
     LOG("Failed to initialize wayland toplevel");
     goto rollback_wayland_globals;
   }
 
+  // mburakov: This is not fatal, decoder would just allocate whatever layout
+  // the driver prefers, and the compositor might have to copy frames then.
+  if (!InitScanoutFeedback(window))
+    LOG("Failed to initialize scanout feedback");
+
   if (window->event_handlers && !InitWaylandInputs(window)) {
     LOG("Failed to initialize wayland inputs");
     goto rollback_wayland_toplevel;
@@ -596,6 +884,7 @@ rollback_wayland_inputs:
 rollback_wayland_toplevel:
   DeinitWaylandToplevel(window);
 rollback_wayland_globals:
+  DeinitFeedback(window);
   DeinitWaylandGlobals(window);
 rollback_window:
   free(window);
@@ -643,9 +932,16 @@ static struct wl_buffer* CreateBuffer(struct Window* window,
   return wl_buffer;
 }
 
+static void ResetDamage(struct Window* window) {
+  window->damage_pending = false;
+  window->partial_damage = false;
+}
+
 bool WindowAssignFrames(struct Window* window, size_t nframes,
                         const struct Frame* frames) {
   DestroyBuffers(window);
+  window->has_frame = false;
+  ResetDamage(window);
   window->wl_buffers = malloc(nframes * sizeof(struct wl_buffer*));
   if (!window->wl_buffers) {
     LOG("Failed to alloc window buffers (%s)", strerror(errno));
@@ -666,27 +962,423 @@ rollback_buffers:
   return false;
 }
 
+static void CommitBackground(struct Window* window) {
+  if (window->window_width && window->window_height) {
+    wp_viewport_set_destination(window->wp_viewport, window->window_width,
+                                window->window_height);
+  }
+  wl_surface_damage(window->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+  wl_surface_commit(window->wl_surface);
+}
+
+static void PlaceTile(const struct Window* window, int32_t* width,
+                      int32_t* height) {
+  // mburakov: Tiles are laid out row by row in a grid that is as close to a
+  // square as possible. Parent might be resized at any time, so the layout is
+  // recalculated for every frame.
+  size_t cols = 1;
+  while (cols * cols < window->tile_count) cols++;
+  size_t rows = (window->tile_count + cols - 1) / cols;
+  *width = window->parent->window_width / (int32_t)cols;
+  *height = window->parent->window_height / (int32_t)rows;
+  wl_subsurface_set_position(window->wl_subsurface,
+                             *width * (int32_t)(window->tile_index % cols),
+                             *height * (int32_t)(window->tile_index / cols));
+}
+
+static void ReleasePresentationFeedback(
+    struct Window* window, struct wp_presentation_feedback* feedback) {
+  for (size_t i = 0; i < LENGTH(window->wp_presentation_feedbacks); i++) {
+    if (window->wp_presentation_feedbacks[i] == feedback)
+      window->wp_presentation_feedbacks[i] = NULL;
+  }
+  wp_presentation_feedback_destroy(feedback);
+}
+
+static void OnWpPresentationFeedbackSyncOutput(
+    void* data, struct wp_presentation_feedback* wp_presentation_feedback,
+    struct wl_output* output) {
+  (void)data;
+  (void)wp_presentation_feedback;
+  (void)output;
+}
+
+static void OnWpPresentationFeedbackPresented(
+    void* data, struct wp_presentation_feedback* wp_presentation_feedback,
+    uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+    uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+  (void)tv_sec_hi;
+  (void)tv_sec_lo;
+  (void)tv_nsec;
+  (void)refresh;
+  (void)seq_hi;
+  (void)seq_lo;
+  struct Window* window = data;
+  ReleasePresentationFeedback(window, wp_presentation_feedback);
+  window->frames_presented++;
+  bool zero_copy = flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+  if (zero_copy) window->frames_zero_copy++;
+  if (zero_copy != window->zero_copy || window->frames_presented == 1) {
+    LOG("Frames are %s", zero_copy ? "scanned out directly" : "composited");
+  }
+  window->zero_copy = zero_copy;
+}
+
+static void OnWpPresentationFeedbackDiscarded(
+    void* data, struct wp_presentation_feedback* wp_presentation_feedback) {
+  ReleasePresentationFeedback(data, wp_presentation_feedback);
+}
+
+static void RequestPresentationFeedback(struct Window* window) {
+  // mburakov: Feedbacks are tracked so that these could be destroyed together
+  // with the window. Compositor might hold these for a while, i.e. when the
+  // window is not visible, and frames are just not counted meanwhile.
+  struct wp_presentation_feedback** slot = NULL;
+  for (size_t i = 0; i < LENGTH(window->wp_presentation_feedbacks); i++) {
+    if (!window->wp_presentation_feedbacks[i])
+      slot = &window->wp_presentation_feedbacks[i];
+  }
+  if (!slot) return;
+
+  // mburakov: This is not fatal, there would be just no presentation stats.
+  struct wp_presentation_feedback* feedback =
+      wp_presentation_feedback(window->wp_presentation, window->wl_surface);
+  if (!feedback) {
+    LOG("Failed to request presentation feedback (%s)", strerror(errno));
+    return;
+  }
+  static const struct wp_presentation_feedback_listener
+      wp_presentation_feedback_listener = {
+          .sync_output = OnWpPresentationFeedbackSyncOutput,
+          .presented = OnWpPresentationFeedbackPresented,
+          .discarded = OnWpPresentationFeedbackDiscarded,
+      };
+  if (wp_presentation_feedback_add_listener(
+          feedback, &wp_presentation_feedback_listener, window)) {
+    LOG("Failed to add wp_presentation_feedback listener (%s)",
+        strerror(errno));
+    wp_presentation_feedback_destroy(feedback);
+    return;
+  }
+  *slot = feedback;
+}
+
+static void MergeDamage(struct Window* window, const uint16_t (*rects)[4],
+                        size_t count) {
+  if (window->damage_rects_count + count <= LENGTH(window->damage_rects)) {
+    memcpy(window->damage_rects + window->damage_rects_count, rects,
+           count * sizeof(*rects));
+    window->damage_rects_count += count;
+    return;
+  }
+
+  // mburakov: Rectangles that do not fit are merged into their bounding box,
+  // that is still better than damaging the whole frame.
+  int left = window->damage_width;
+  int top = window->damage_height;
+  int right = 0;
+  int bottom = 0;
+  for (size_t i = 0; i < window->damage_rects_count + count; i++) {
+    const uint16_t* rect = i < window->damage_rects_count
+                               ? window->damage_rects[i]
+                               : rects[i - window->damage_rects_count];
+    left = MIN(left, rect[0]);
+    top = MIN(top, rect[1]);
+    right = MAX(right, rect[0] + rect[2]);
+    bottom = MAX(bottom, rect[1] + rect[3]);
+  }
+  window->damage_rects_count = 0;
+  if (left >= right || top >= bottom) return;
+  memcpy(window->damage_rects[0],
+         (uint16_t[]){(uint16_t)left, (uint16_t)top, (uint16_t)(right - left),
+                      (uint16_t)(bottom - top)},
+         sizeof(window->damage_rects[0]));
+  window->damage_rects_count = 1;
+}
+
+void WindowSetDamage(struct Window* window, const uint16_t (*rects)[4],
+                     size_t count, int width, int height) {
+  bool partial = rects && width && height;
+  if (!window->damage_pending) {
+    window->damage_pending = true;
+    window->partial_damage = partial;
+    window->damage_rects_count = 0;
+    window->damage_width = width;
+    window->damage_height = height;
+  } else if (window->partial_damage) {
+    window->partial_damage = partial && width == window->damage_width &&
+                             height == window->damage_height;
+  }
+  if (window->partial_damage) MergeDamage(window, rects, count);
+}
+
+static void DamageFrame(struct Window* window, int x, int y, int width,
+                        int height) {
+  // mburakov: Buffer damage is only available since version 4 of the
+  // compositor, and frame is damaged completely without it.
+  if (!window->partial_damage ||
+      wl_compositor_get_version(window->wl_compositor) < 4) {
+    wl_surface_damage(window->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+    return;
+  }
+
+  // mburakov: Frame might be scaled by the decoder, i.e. when upscaling, and
+  // scaler samples neighbouring pixels, hence the margin then.
+  int margin =
+      width != window->damage_width || height != window->damage_height;
+  for (size_t i = 0; i < window->damage_rects_count; i++) {
+    const uint16_t* rect = window->damage_rects[i];
+    int left = rect[0] * width / window->damage_width;
+    int top = rect[1] * height / window->damage_height;
+    int right = ((rect[0] + rect[2]) * width + window->damage_width - 1) /
+                window->damage_width;
+    int bottom = ((rect[1] + rect[3]) * height + window->damage_height - 1) /
+                 window->damage_height;
+    left = MAX(left - margin, 0);
+    top = MAX(top - margin, 0);
+    right = MIN(right + margin, width);
+    bottom = MIN(bottom + margin, height);
+    if (left >= right || top >= bottom) continue;
+    wl_surface_damage_buffer(window->wl_surface, x + left, y + top,
+                             right - left, bottom - top);
+  }
+}
+
 bool WindowShowFrame(struct Window* window, size_t index, int x, int y,
                      int width, int height) {
+  window->has_frame = true;
+  window->frame_index = index;
+  window->frame_x = x;
+  window->frame_y = y;
+  window->frame_width = width;
+  window->frame_height = height;
+  if (window->hidden || window->held) {
+    ResetDamage(window);
+    return true;
+  }
+
   wp_viewport_set_source(window->wp_viewport, wl_fixed_from_int(x),
                          wl_fixed_from_int(y), wl_fixed_from_int(width),
                          wl_fixed_from_int(height));
-  if (window->window_width && window->window_height) {
-    wp_viewport_set_destination(window->wp_viewport, window->window_width,
-                                window->window_height);
+  int32_t destination_width = window->window_width;
+  int32_t destination_height = window->window_height;
+  if (window->parent)
+    PlaceTile(window, &destination_width, &destination_height);
+  if (destination_width && destination_height) {
+    wp_viewport_set_destination(window->wp_viewport, destination_width,
+                                destination_height);
   }
+  window->destination_width = destination_width;
+  window->destination_height = destination_height;
+  // mburakov: Frame that did not change is still attached, even though there
+  // is nothing to damage. Decoder reuses the surface it decoded into the
+  // longest time ago, and that must not be the one compositor shows.
   wl_surface_attach(window->wl_surface, window->wl_buffers[index], 0, 0);
-  wl_surface_damage(window->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+  DamageFrame(window, x, y, width, height);
+  ResetDamage(window);
+  if (window->wp_presentation) RequestPresentationFeedback(window);
+  wl_surface_commit(window->wl_surface);
+  // mburakov: Position of a subsurface is a part of the parent state.
+  if (window->parent) CommitBackground(window->parent);
+  bool result = wl_display_roundtrip(window->wl_display) != -1;
+  if (!result) LOG("Failed to roundtrip wl_display (%s)", strerror(errno));
+  if (result) window->frames_shown++;
+  return result;
+}
+
+size_t WindowGetFramesShown(const struct Window* window) {
+  return window->frames_shown;
+}
+
+size_t WindowGetFramesPresented(const struct Window* window,
+                               size_t* zero_copy) {
+  *zero_copy = window->frames_zero_copy;
+  return window->frames_presented;
+}
+
+size_t WindowGetScanoutModifiers(const struct Window* window, uint32_t fourcc,
+                                 uint64_t* modifiers, size_t size) {
+  size_t count = 0;
+  for (size_t i = 0; i < window->scanout_formats_count && count < size; i++) {
+    if (window->scanout_formats[i].format == fourcc)
+      modifiers[count++] = window->scanout_formats[i].modifier;
+  }
+  return count;
+}
+
+bool WindowGetRenderNode(const struct Window* window, char* path,
+                         size_t size) {
+  if (window->parent) window = window->parent;
+  if (!window->has_main_device) return false;
+
+  // mburakov: Main device is most likely a primary node, so the render node
+  // of the same device is looked up in sysfs.
+  char sysfs_path[64];
+  snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/char/%u:%u/device/drm",
+           major(window->main_device), minor(window->main_device));
+  DIR* dir = opendir(sysfs_path);
+  if (!dir) {
+    LOG("Failed to open %s (%s)", sysfs_path, strerror(errno));
+    return false;
+  }
+  bool result = false;
+  for (struct dirent* entry; (entry = readdir(dir));) {
+    if (strncmp(entry->d_name, "renderD", 7)) continue;
+    snprintf(path, size, "/dev/dri/%s", entry->d_name);
+    result = true;
+    break;
+  }
+  closedir(dir);
+  if (!result) LOG("Main device does not have a render node");
+  return result;
+}
+
+static bool InitBackground(struct Window* window) {
+  char name[64];
+  snprintf(name, sizeof(name), "/wl_shm-%d-background", getpid());
+  int shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shm_fd == -1) {
+    LOG("Failed to open shm (%s)", strerror(errno));
+    return false;
+  }
+  shm_unlink(name);
+
+  // mburakov: Single black pixel is stretched over the whole window, and
+  // freshly truncated shm is zero-filled, which is exactly that pixel.
+  bool result = false;
+  if (ftruncate(shm_fd, 4) == -1) {
+    LOG("Failed to truncate shm (%s)", strerror(errno));
+    goto rollback_shm_fd;
+  }
+  struct wl_shm_pool* wl_shm_pool =
+      wl_shm_create_pool(window->wl_shm, shm_fd, 4);
+  if (!wl_shm_pool) {
+    LOG("Failed to create wl_shm_pool (%s)", strerror(errno));
+    goto rollback_shm_fd;
+  }
+  window->wl_background = wl_shm_pool_create_buffer(
+      wl_shm_pool, 0, 1, 1, 4, WL_SHM_FORMAT_XRGB8888);
+  if (!window->wl_background) {
+    LOG("Failed to create wl_buffer (%s)", strerror(errno));
+    goto rollback_wl_shm_pool;
+  }
+  wl_surface_attach(window->wl_surface, window->wl_background, 0, 0);
+  CommitBackground(window);
+  result = true;
+
+rollback_wl_shm_pool:
+  wl_shm_pool_destroy(wl_shm_pool);
+rollback_shm_fd:
+  close(shm_fd);
+  return result;
+}
+
+bool WindowSetTileVisible(struct Window* window, bool visible) {
+  window->hidden = !visible;
+  if (visible) {
+    if (!window->has_frame) return true;
+    return WindowShowFrame(window, window->frame_index, window->frame_x,
+                           window->frame_y, window->frame_width,
+                           window->frame_height);
+  }
+
+  // mburakov: Subsurface without a buffer is unmapped together with all of
+  // its own subsurfaces, i.e. stats overlay.
+  wl_surface_attach(window->wl_surface, NULL, 0, 0);
   wl_surface_commit(window->wl_surface);
   bool result = wl_display_roundtrip(window->wl_display) != -1;
   if (!result) LOG("Failed to roundtrip wl_display (%s)", strerror(errno));
   return result;
 }
 
+bool WindowHoldFrames(struct Window* window, bool hold) {
+  if (window->held == hold) return true;
+  window->held = hold;
+  if (hold || window->hidden || !window->has_frame) return true;
+  return WindowShowFrame(window, window->frame_index, window->frame_x,
+                         window->frame_y, window->frame_width,
+                         window->frame_height);
+}
+
+struct Window* WindowCreateTile(struct Window* parent, size_t index,
+                                size_t count) {
+  if (!parent->wl_background && !InitBackground(parent)) {
+    LOG("Failed to initialize window background");
+    return NULL;
+  }
+
+  struct Window* window = malloc(sizeof(struct Window));
+  if (!window) {
+    LOG("Failed to allocate window (%s)", strerror(errno));
+    return NULL;
+  }
+  *window = (struct Window){
+      .wl_display = parent->wl_display,
+      .wl_compositor = parent->wl_compositor,
+      .wl_shm = parent->wl_shm,
+      .wl_subcompositor = parent->wl_subcompositor,
+      .wp_viewporter = parent->wp_viewporter,
+      .wp_presentation = parent->wp_presentation,
+      .zwp_linux_dmabuf_v1 = parent->zwp_linux_dmabuf_v1,
+      .parent = parent,
+      .tile_index = index,
+      .tile_count = count,
+  };
+
+  window->wl_surface = wl_compositor_create_surface(window->wl_compositor);
+  if (!window->wl_surface) {
+    LOG("Failed to create wl_surface (%s)", strerror(errno));
+    goto rollback_window;
+  }
+
+  window->wp_viewport =
+      wp_viewporter_get_viewport(window->wp_viewporter, window->wl_surface);
+  if (!window->wp_viewport) {
+    LOG("Failed to get wp_viewport (%s)", strerror(errno));
+    goto rollback_wl_surface;
+  }
+  if (!SetOpaqueRegion(window)) {
+    LOG("Failed to set opaque region");
+    goto rollback_wp_viewport;
+  }
+
+  window->wl_subsurface = wl_subcompositor_get_subsurface(
+      window->wl_subcompositor, window->wl_surface, parent->wl_surface);
+  if (!window->wl_subsurface) {
+    LOG("Failed to create wl_subsurface (%s)", strerror(errno));
+    goto rollback_wp_viewport;
+  }
+  // mburakov: Every tile shows its frames as soon as these are decoded,
+  // without waiting for the parent or the other tiles.
+  wl_subsurface_set_desync(window->wl_subsurface);
+  return window;
+
+rollback_wp_viewport:
+  wp_viewport_destroy(window->wp_viewport);
+rollback_wl_surface:
+  wl_surface_destroy(window->wl_surface);
+rollback_window:
+  free(window);
+  return NULL;
+}
+
 void WindowDestroy(struct Window* window) {
+  for (size_t i = 0; i < LENGTH(window->wp_presentation_feedbacks); i++) {
+    if (window->wp_presentation_feedbacks[i])
+      wp_presentation_feedback_destroy(window->wp_presentation_feedbacks[i]);
+  }
   DestroyBuffers(window);
+  if (window->parent) {
+    wl_subsurface_destroy(window->wl_subsurface);
+    wp_viewport_destroy(window->wp_viewport);
+    wl_surface_destroy(window->wl_surface);
+    free(window);
+    return;
+  }
+  if (window->wl_background) wl_buffer_destroy(window->wl_background);
   if (window->event_handlers) DeinitWaylandInputs(window);
   DeinitWaylandToplevel(window);
+  DeinitFeedback(window);
   DeinitWaylandGlobals(window);
   free(window);
 }
@@ -810,3 +1502,178 @@ void OverlayDestroy(struct Overlay* overlay) {
   close(overlay->shm_fd);
   free(overlay);
 }
+
+struct Cursor* CursorCreate(const struct Window* window) {
+  struct Cursor* cursor = malloc(sizeof(struct Cursor));
+  if (!cursor) {
+    LOG("Failed to allocate cursor (%s)", strerror(errno));
+    return NULL;
+  }
+  *cursor = (struct Cursor){
+      .window = window,
+  };
+
+  char name[64];
+  static size_t counter = 0;
+  snprintf(name, sizeof(name), "/wl_shm-%d-cursor-%zu", getpid(), counter++);
+  cursor->shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (cursor->shm_fd == -1) {
+    LOG("Failed to open shm (%s)", strerror(errno));
+    goto rollback_cursor;
+  }
+  shm_unlink(name);
+
+  if (ftruncate(cursor->shm_fd, CURSOR_POOL_SIZE) == -1) {
+    LOG("Failed to truncate shm (%s)", strerror(errno));
+    goto rollback_shm_fd;
+  }
+  cursor->shm_buffer = mmap(NULL, CURSOR_POOL_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, cursor->shm_fd, 0);
+  if (cursor->shm_buffer == MAP_FAILED) {
+    LOG("Failed to mmap shm (%s)", strerror(errno));
+    goto rollback_shm_fd;
+  }
+
+  cursor->wl_surface = wl_compositor_create_surface(window->wl_compositor);
+  if (!cursor->wl_surface) {
+    LOG("Failed to create wl_surface (%s)", strerror(errno));
+    goto rollback_shm_buffer;
+  }
+
+  cursor->wp_viewport =
+      wp_viewporter_get_viewport(window->wp_viewporter, cursor->wl_surface);
+  if (!cursor->wp_viewport) {
+    LOG("Failed to get wp_viewport (%s)", strerror(errno));
+    goto rollback_wl_surface;
+  }
+
+  cursor->wl_subsurface = wl_subcompositor_get_subsurface(
+      window->wl_subcompositor, cursor->wl_surface, window->wl_surface);
+  if (!cursor->wl_subsurface) {
+    LOG("Failed to create wl_subsurface (%s)", strerror(errno));
+    goto rollback_wp_viewport;
+  }
+  wl_subsurface_place_above(cursor->wl_subsurface, window->wl_surface);
+
+  cursor->wl_shm_pool =
+      wl_shm_create_pool(window->wl_shm, cursor->shm_fd, CURSOR_POOL_SIZE);
+  if (!cursor->wl_shm_pool) {
+    LOG("Failed to create wl_shm_pool (%s)", strerror(errno));
+    goto rollback_wl_subsurface;
+  }
+  return cursor;
+
+rollback_wl_subsurface:
+  wl_subsurface_destroy(cursor->wl_subsurface);
+rollback_wp_viewport:
+  wp_viewport_destroy(cursor->wp_viewport);
+rollback_wl_surface:
+  wl_surface_destroy(cursor->wl_surface);
+rollback_shm_buffer:
+  munmap(cursor->shm_buffer, CURSOR_POOL_SIZE);
+rollback_shm_fd:
+  close(cursor->shm_fd);
+rollback_cursor:
+  free(cursor);
+  return NULL;
+}
+
+static void CommitCursor(struct Cursor* cursor) {
+  // mburakov: Cursor is placed in the coordinates of the streamed screen,
+  // that is scaled to the window, regardless of the frame being scaled by the
+  // decoder before. Nothing could be placed before the first frame was shown,
+  // so the cursor stays where it was until then.
+  const struct Window* window = cursor->window;
+  if (cursor->screen_width && cursor->screen_height &&
+      window->destination_width && window->destination_height) {
+    int32_t x = (cursor->x - cursor->hotspot_x) * window->destination_width /
+                cursor->screen_width;
+    int32_t y = (cursor->y - cursor->hotspot_y) * window->destination_height /
+                cursor->screen_height;
+    wl_subsurface_set_position(cursor->wl_subsurface, x, y);
+    if (cursor->width && cursor->height) {
+      wp_viewport_set_destination(
+          cursor->wp_viewport,
+          MAX(cursor->width * window->destination_width / cursor->screen_width,
+              1),
+          MAX(cursor->height * window->destination_height /
+                  cursor->screen_height,
+              1));
+    }
+  }
+  wl_surface_commit(cursor->wl_surface);
+  // mburakov: Position of a subsurface is a part of the parent state.
+  wl_surface_commit(window->wl_surface);
+  if (wl_display_flush(window->wl_display) == -1)
+    LOG("Failed to flush wl_display (%s)", strerror(errno));
+}
+
+bool CursorSetImage(struct Cursor* cursor, int width, int height,
+                    int hotspot_x, int hotspot_y, const void* data) {
+  if (width < 0 || width > CURSOR_SIZE_MAX || height < 0 ||
+      height > CURSOR_SIZE_MAX) {
+    LOG("Suspicious cursor size %dx%d", width, height);
+    return false;
+  }
+
+  struct wl_buffer* wl_buffer = NULL;
+  if (width && height) {
+    size_t next = (cursor->wl_buffer_current + 1) % CURSOR_BUFFERS_COUNT;
+    size_t offset = next * CURSOR_SIZE_MAX * CURSOR_SIZE_MAX * 4;
+    memcpy((uint8_t*)cursor->shm_buffer + offset, data,
+           (size_t)width * (size_t)height * 4);
+    wl_buffer = wl_shm_pool_create_buffer(cursor->wl_shm_pool, (int)offset,
+                                          width, height, width * 4,
+                                          WL_SHM_FORMAT_ARGB8888);
+    if (!wl_buffer) {
+      LOG("Failed to create wl_buffer (%s)", strerror(errno));
+      return false;
+    }
+    if (cursor->wl_buffers[next]) wl_buffer_destroy(cursor->wl_buffers[next]);
+    cursor->wl_buffers[next] = wl_buffer;
+    cursor->wl_buffer_current = next;
+  }
+
+  cursor->width = width;
+  cursor->height = height;
+  cursor->hotspot_x = hotspot_x;
+  cursor->hotspot_y = hotspot_y;
+  wl_surface_attach(cursor->wl_surface, wl_buffer, 0, 0);
+  wl_surface_damage(cursor->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+  CommitCursor(cursor);
+  return true;
+}
+
+void CursorSetPosition(struct Cursor* cursor, int x, int y, int screen_width,
+                       int screen_height) {
+  cursor->x = x;
+  cursor->y = y;
+  cursor->screen_width = screen_width;
+  cursor->screen_height = screen_height;
+  if (cursor->width && cursor->height) CommitCursor(cursor);
+}
+
+void CursorMove(struct Cursor* cursor, int dx, int dy) {
+  // mburakov: Cursor is not allowed to leave the streamed screen, same as it
+  // would not leave it on the streamer side.
+  int x = cursor->x + dx;
+  int y = cursor->y + dy;
+  if (cursor->screen_width && cursor->screen_height) {
+    x = MIN(MAX(x, 0), cursor->screen_width - 1);
+    y = MIN(MAX(y, 0), cursor->screen_height - 1);
+  }
+  CursorSetPosition(cursor, x, y, cursor->screen_width, cursor->screen_height);
+}
+
+void CursorDestroy(struct Cursor* cursor) {
+  for (size_t i = CURSOR_BUFFERS_COUNT; i; i--) {
+    if (cursor->wl_buffers[i - 1]) wl_buffer_destroy(cursor->wl_buffers[i - 1]);
+  }
+  wl_shm_pool_destroy(cursor->wl_shm_pool);
+  wl_subsurface_destroy(cursor->wl_subsurface);
+  wp_viewport_destroy(cursor->wp_viewport);
+  wl_surface_destroy(cursor->wl_surface);
+  munmap(cursor->shm_buffer, CURSOR_POOL_SIZE);
+  close(cursor->shm_fd);
+  free(cursor);
+}
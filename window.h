@@ -20,10 +20,12 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 struct Window;
 struct Frame;
 struct Overlay;
+struct Cursor;
 
 struct WindowEventHandlers {
   void (*OnClose)(void* user);
@@ -40,14 +42,54 @@ int WindowGetEventsFd(const struct Window* window);
 bool WindowProcessEvents(const struct Window* window);
 bool WindowAssignFrames(struct Window* window, size_t nframes,
                         const struct Frame* frames);
+// mburakov: Damage is given in the coordinates of a frame of the given size,
+// and applies to the next frame shown. Damage of frames that were decoded but
+// not shown yet is merged into it. Without rectangles, the whole frame is
+// damaged.
+void WindowSetDamage(struct Window* window, const uint16_t (*rects)[4],
+                     size_t count, int width, int height);
 bool WindowShowFrame(struct Window* window, size_t index, int x, int y,
                      int width, int height);
+size_t WindowGetFramesShown(const struct Window* window);
+// mburakov: Presented frames are counted once compositor reports these on
+// screen, and zero-copy ones are those it scanned out without composition.
+size_t WindowGetFramesPresented(const struct Window* window,
+                                size_t* zero_copy);
+// mburakov: Modifiers of the given format that compositor could scan out
+// directly. There are none unless the window is eligible for direct scanout.
+size_t WindowGetScanoutModifiers(const struct Window* window, uint32_t fourcc,
+                                 uint64_t* modifiers, size_t size);
+// mburakov: Render node of the device compositor is using for composition.
+// Decoding on any other device forces the compositor to copy every frame.
+bool WindowGetRenderNode(const struct Window* window, char* path,
+                         size_t size);
+// mburakov: Frames shown while the window is held are not displayed, and the
+// last one of them is shown once the window is released.
+bool WindowHoldFrames(struct Window* window, bool hold);
 void WindowDestroy(struct Window* window);
 
+// mburakov: Tile is a part of the parent window that could be used in place
+// of a window for showing frames and creating overlays. Parent must outlive
+// all of its tiles, and processes events on their behalf.
+struct Window* WindowCreateTile(struct Window* parent, size_t index,
+                                size_t count);
+bool WindowSetTileVisible(struct Window* window, bool visible);
+
 struct Overlay* OverlayCreate(const struct Window* window, int x, int y,
                               int width, int height);
 void* OverlayLock(struct Overlay* overlay);
 void OverlayUnlock(struct Overlay* overlay);
 void OverlayDestroy(struct Overlay* overlay);
 
+// mburakov: Cursor is drawn on top of the window in the coordinates of the
+// streamed screen of the given size, so that it could be moved right away on
+// local input, without waiting for the streamer. Empty image hides it.
+struct Cursor* CursorCreate(const struct Window* window);
+bool CursorSetImage(struct Cursor* cursor, int width, int height,
+                    int hotspot_x, int hotspot_y, const void* data);
+void CursorSetPosition(struct Cursor* cursor, int x, int y, int screen_width,
+                       int screen_height);
+void CursorMove(struct Cursor* cursor, int dx, int dy);
+void CursorDestroy(struct Cursor* cursor);
+
 #endif  // RECEIVER_WINDOW_H_